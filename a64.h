@@ -0,0 +1,330 @@
+#pragma once
+
+#include "encoder.h"
+#include "patterns.h"
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <string_view>
+#include <vector>
+
+/// Compile-time assembler for embedding small ARM64 snippets in C++.
+///
+///   constexpr auto code = a64::assemble<"add x1, x2, x3\n b.eq done\n done:\n">();
+///   // code is a std::array<uint32_t, 2> with the label already resolved
+///
+/// Instructions use the operand syntax of `asm --raw` (see patterns.h),
+/// one per line, with `name:` labels (alone or in front of an
+/// instruction), `;` / `//` comments, `.8byte`, which takes two words
+/// (low word first), and `.p2align` / `.align` / `.balign`, padded with
+/// nops before code and zeros before data.  Operands are plain numbers
+/// and labels: the constant expressions, sections, other data directives,
+/// macros and includes of `--raw` are run-time only.
+///
+/// Everything runs in a consteval context, so a malformed snippet --
+/// unknown instruction, undefined label, out-of-range immediate -- is
+/// reported as a compile error pointing at the failing check.
+/// tests/a64_check.cpp holds this to the encodings of tests/encoding.
+namespace a64 {
+
+/// String literal usable as a template argument.
+template <size_t N>
+struct FixedString {
+    char data[N] = {};
+    constexpr FixedString(const char (&s)[N]) {
+        for (size_t i = 0; i < N; ++i) data[i] = s[i];
+    }
+    constexpr std::string_view view() const { return {data, N - 1}; }
+};
+
+namespace detail {
+
+enum class TokKind { WORD, COMMA, LBRACK, RBRACK, EXCLAM };
+
+struct Tok {
+    TokKind kind;
+    std::string_view text;
+};
+
+struct Line {
+    std::string_view label;         // defined label, if any
+    std::vector<Tok> toks;          // instruction or directive tokens
+};
+
+constexpr bool isSpace(char c) { return c == ' ' || c == '\t' || c == '\r'; }
+constexpr bool isDigit(char c) { return '0' <= c && c <= '9'; }
+
+constexpr std::string_view stripComment(std::string_view line) {
+    auto pos = line.find(';');
+    if (pos == std::string_view::npos) pos = line.find("//");
+    return (pos == std::string_view::npos) ? line : line.substr(0, pos);
+}
+
+constexpr std::vector<Line> splitLines(std::string_view src) {
+    std::vector<Line> lines;
+    while (!src.empty()) {
+        auto nl = src.find('\n');
+        std::string_view text = stripComment(src.substr(0, nl));
+        src = (nl == std::string_view::npos) ? std::string_view{} : src.substr(nl + 1);
+
+        Line line;
+        size_t i = 0;
+        while (i < text.size()) {
+            char ch = text[i];
+            if (isSpace(ch)) { ++i; continue; }
+            if (ch == ',') { line.toks.push_back({TokKind::COMMA, ","}); ++i; continue; }
+            if (ch == '[') { line.toks.push_back({TokKind::LBRACK, "["}); ++i; continue; }
+            if (ch == ']') { line.toks.push_back({TokKind::RBRACK, "]"}); ++i; continue; }
+            if (ch == '!') { line.toks.push_back({TokKind::EXCLAM, "!"}); ++i; continue; }
+            if (ch == '#' || ch == '{' || ch == '}') { ++i; continue; }
+            size_t start = i;
+            while (i < text.size() && !isSpace(text[i]) && text[i] != ',' &&
+                   text[i] != '[' && text[i] != ']' && text[i] != '!' &&
+                   text[i] != '{' && text[i] != '}')
+                ++i;
+            std::string_view word = text.substr(start, i - start);
+            if (word.back() == ':' && line.toks.empty() && line.label.empty()) {
+                line.label = word.substr(0, word.size() - 1);
+                if (line.label.empty()) throw std::runtime_error("a64: empty label");
+                continue;
+            }
+            line.toks.push_back({TokKind::WORD, word});
+        }
+        if (!line.label.empty() || !line.toks.empty()) lines.push_back(line);
+    }
+    return lines;
+}
+
+constexpr bool isRegister(std::string_view s) {
+    if (s == "sp" || s == "xzr") return true;
+    if (s.size() < 2 || s.size() > 3 || s[0] != 'x') return false;
+    for (size_t i = 1; i < s.size(); ++i) if (!isDigit(s[i])) return false;
+    int v = 0;
+    for (size_t i = 1; i < s.size(); ++i) v = v * 10 + (s[i] - '0');
+    return v <= 30;
+}
+
+constexpr int regNumber(std::string_view s) {
+    if (!isRegister(s)) throw std::runtime_error("a64: expected register");
+    if (s == "sp" || s == "xzr") return 31;
+    int v = 0;
+    for (size_t i = 1; i < s.size(); ++i) v = v * 10 + (s[i] - '0');
+    return v;
+}
+
+constexpr bool isNumber(std::string_view s) {
+    if (!s.empty() && (s[0] == '-' || s[0] == '+')) s.remove_prefix(1);
+    return !s.empty() && isDigit(s[0]);
+}
+
+constexpr int64_t parseNumber(std::string_view s) {
+    bool neg = false;
+    if (!s.empty() && (s[0] == '-' || s[0] == '+')) { neg = s[0] == '-'; s.remove_prefix(1); }
+    uint64_t base = 10;
+    if (s.size() > 2 && s[0] == '0' && (s[1] == 'x' || s[1] == 'X')) { base = 16; s.remove_prefix(2); }
+    if (s.empty()) throw std::runtime_error("a64: malformed number");
+    uint64_t v = 0;
+    for (char ch : s) {
+        uint64_t d;
+        if (isDigit(ch))                               d = static_cast<uint64_t>(ch - '0');
+        else if (base == 16 && 'a' <= ch && ch <= 'f') d = static_cast<uint64_t>(ch - 'a' + 10);
+        else if (base == 16 && 'A' <= ch && ch <= 'F') d = static_cast<uint64_t>(ch - 'A' + 10);
+        else throw std::runtime_error("a64: malformed number");
+        v = v * base + d;
+    }
+    return neg ? -static_cast<int64_t>(v) : static_cast<int64_t>(v);
+}
+
+/// `.p2align n[, fill]` at word `pc`: words of padding and the fill word,
+/// or -1 for the default.  Alignments below a word are always met.
+struct Padding {
+    size_t words;
+    int64_t fill;
+};
+
+constexpr Padding paddingOf(const Line &line, size_t pc) {
+    const auto &t = line.toks;
+    if (t.size() != 2 && !(t.size() == 4 && t[2].kind == TokKind::COMMA))
+        throw std::runtime_error("a64: alignment takes an amount and an optional fill byte");
+    uint64_t bytes = alignmentOf(t[0].text, parseNumber(t[1].text));
+    Padding p{alignPadding(pc, bytes < 4 ? 1 : bytes / 4), -1};
+    if (t.size() == 4) {
+        int64_t fill = parseNumber(t[3].text);
+        if (fill < 0 || fill > 255) throw std::runtime_error("a64: fill value must be a byte");
+        p.fill = fill * 0x01010101;
+    }
+    return p;
+}
+
+constexpr size_t lineWords(const Line &line, size_t pc) {
+    if (line.toks.empty()) return 0;
+    if (line.toks[0].text == ".8byte") return 2;
+    if (isAlignDirective(line.toks[0].text)) return paddingOf(line, pc).words;
+    return 1;
+}
+
+struct Symbol {
+    std::string_view name;
+    int64_t address;
+};
+
+constexpr int64_t lookup(const std::vector<Symbol> &syms, std::string_view name) {
+    for (const auto &s : syms)
+        if (s.name == name) return s.address;
+    throw std::runtime_error("a64: undefined label");
+}
+
+constexpr int toImm(int64_t v) {
+    if (v < -2147483648LL || v > 2147483647LL)
+        throw std::runtime_error("a64: immediate out of range");
+    return static_cast<int>(v);
+}
+
+/// Match operands against one pattern (see patterns.h).  Returns false on
+/// a mismatch so the next form can be tried; undefined labels are fatal.
+constexpr bool matchOperands(const std::vector<Tok> &toks, size_t ti, std::string_view pattern,
+                             int *args, int ai, const std::vector<Symbol> &syms, int64_t pc) {
+    for (char p : pattern) {
+        if (ti >= toks.size()) return false;
+        const Tok &t = toks[ti++];
+        const bool word = t.kind == TokKind::WORD;
+        switch (p) {
+            case 'r':
+                if (!word || t.text == "xzr" || !isRegister(t.text)) return false;
+                args[ai++] = regNumber(t.text);
+                break;
+            case 'z':
+                if (!word || t.text == "sp" || !isRegister(t.text)) return false;
+                args[ai++] = regNumber(t.text);
+                break;
+            case 'v':
+                if (!word || findVectorReg(t.text) < 0) return false;
+                args[ai++] = findVectorReg(t.text);
+                break;
+            case 'c': if (t.kind != TokKind::COMMA)  return false; break;
+            case 'l': if (t.kind != TokKind::LBRACK) return false; break;
+            case 't': if (t.kind != TokKind::RBRACK) return false; break;
+            case 'e': if (t.kind != TokKind::EXCLAM) return false; break;
+            case 's': if (!word || t.text != "lsl")  return false; break;
+            case 'k':
+                if (!word || findCondName(t.text) < 0) return false;
+                args[ai++] = findCondName(t.text);
+                break;
+            case 'i':
+                if (!word || !isNumber(t.text)) return false;
+                args[ai++] = toImm(parseNumber(t.text));
+                break;
+            case 'j':
+                if (!word || isRegister(t.text)) return false;
+                args[ai++] = isNumber(t.text) ? toImm(parseNumber(t.text))
+                                              : toImm(lookup(syms, t.text) - pc);
+                break;
+        }
+    }
+    return ti == toks.size();
+}
+
+/// Mirrors Assembler::pass2 for a single instruction line.
+constexpr uint32_t encodeLine(const Line &line, const std::vector<Symbol> &syms, int64_t pc) {
+    const auto &toks = line.toks;
+    if (toks[0].kind != TokKind::WORD)
+        throw std::runtime_error("a64: expected instruction");
+
+    std::string_view instr = toks[0].text;
+    int args[4] = {0, 0, 0, 0};
+    int ai = 0;
+    bool bcond = false;
+
+    if (instr.size() > 2 && instr[0] == 'b' && instr[1] == '.') {
+        int cond = findCondCode(instr.substr(1));
+        if (cond < 0) throw std::runtime_error("a64: invalid condition");
+        args[ai++] = cond;
+        instr = "b";
+        bcond = true;
+    }
+
+    const InstrPattern *ip = findInstrPattern(instr);
+    if (!ip) throw std::runtime_error("a64: unknown instruction");
+    for (; ip != instrPatternsEnd() && ip->mnemonic == instr; ++ip) {
+        int formArgs[4] = {args[0], args[1], args[2], args[3]};
+        if (matchOperands(toks, 1, ip->pattern, formArgs, ai, syms, pc))
+            return Encoder::encode(bcond ? std::string_view("b.cond") : ip->form,
+                                   formArgs[0], formArgs[1], formArgs[2], formArgs[3]);
+    }
+    throw std::runtime_error("a64: invalid operands");
+}
+
+constexpr size_t wordCount(std::string_view src) {
+    size_t n = 0;
+    for (const auto &line : splitLines(src)) n += lineWords(line, n);
+    return n;
+}
+
+template <size_t N>
+constexpr std::array<uint32_t, N> assemble(std::string_view src) {
+    auto lines = splitLines(src);
+
+    // pass 1 : labels
+    std::vector<Symbol> syms;
+    int64_t pc = 0;
+    for (const auto &line : lines) {
+        if (!line.label.empty()) {
+            for (const auto &s : syms)
+                if (s.name == line.label) throw std::runtime_error("a64: duplicate label");
+            syms.push_back({line.label, pc});
+        }
+        pc += 4 * static_cast<int64_t>(lineWords(line, static_cast<size_t>(pc / 4)));
+    }
+
+    // pass 2 : encode
+    std::array<uint32_t, N> out{};
+    size_t w = 0;
+    pc = 0;
+    for (size_t li = 0; li < lines.size(); ++li) {
+        const Line &line = lines[li];
+        if (line.toks.empty()) continue;
+        if (isAlignDirective(line.toks[0].text)) {
+            // nops before code, zeros before data or at the end
+            Padding p = paddingOf(line, w);
+            if (p.fill < 0) {
+                p.fill = 0;
+                for (size_t j = li + 1; j < lines.size(); ++j) {
+                    const auto &next = lines[j].toks;
+                    if (next.empty() || isAlignDirective(next[0].text)) continue;
+                    if (next[0].text != ".8byte") p.fill = Encoder::NOP;
+                    break;
+                }
+            }
+            for (size_t k = 0; k < p.words; ++k) out[w++] = static_cast<uint32_t>(p.fill);
+            pc += 4 * static_cast<int64_t>(p.words);
+            continue;
+        }
+        if (line.toks[0].text == ".8byte") {
+            if (line.toks.size() != 2 || line.toks[1].kind != TokKind::WORD)
+                throw std::runtime_error("a64: .8byte takes one operand");
+            std::string_view v = line.toks[1].text;
+            uint64_t val = isNumber(v) ? static_cast<uint64_t>(parseNumber(v))
+                                       : static_cast<uint64_t>(lookup(syms, v));
+            out[w++] = static_cast<uint32_t>(val);
+            out[w++] = static_cast<uint32_t>(val >> 32);
+            pc += 8;
+            continue;
+        }
+        out[w++] = encodeLine(line, syms, pc);
+        pc += 4;
+    }
+    return out;
+}
+
+} // namespace detail
+
+/// Assemble `Src` at compile time.
+template <FixedString Src>
+consteval auto assemble() {
+    constexpr size_t n = detail::wordCount(Src.view());
+    return detail::assemble<n>(Src.view());
+}
+
+} // namespace a64
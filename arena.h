@@ -0,0 +1,126 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <memory_resource>
+#include <string>
+#include <vector>
+
+/// Per-assembly memory pool.
+///
+/// Every container in the pipeline (token streams, grouped lines, IR) takes a
+/// std::pmr::memory_resource.  Passing an Arena serves those allocations from
+/// size-class pools carved out of a few large chunks, without locking.  A
+/// block a container frees, such as the buffer a vector outgrew or the IR a
+/// pass replaced, goes back to its pool for the next allocation of that size;
+/// blocks too large for the pools come from the heap and go straight back to
+/// it.  Peak memory therefore follows what the pipeline holds at once, not
+/// everything it ever allocated.
+///
+/// reset() or the destructor releases everything in one shot.  In a library
+/// or daemon, keep one Arena per worker and reset() it between requests: the
+/// chunks handed back by a reset are kept and reused, so steady-state
+/// requests stop calling malloc/free for all but the largest blocks.
+///
+/// Containers built from an Arena must not outlive the next reset().
+class Arena : public std::pmr::memory_resource {
+public:
+    struct Stats {
+        uint64_t allocations = 0;       // requests served by the arena
+        uint64_t bytesRequested = 0;    // sum of requested sizes
+        uint64_t chunks = 0;            // allocations made from the upstream heap
+        uint64_t chunkBytes = 0;        // bytes obtained from the upstream heap
+        uint64_t peakBytes = 0;         // most bytes held from the heap at once
+    };
+
+    explicit Arena(std::pmr::memory_resource *upstream = std::pmr::new_delete_resource())
+        : chunks_(upstream, stats_), pool_(&chunks_) {}
+
+    Arena(const Arena &) = delete;
+    Arena &operator=(const Arena &) = delete;
+
+    /// Drop everything allocated since the last reset.  Request counters
+    /// restart; chunk counters keep accumulating.
+    void reset() {
+        chunks_.keep(true);
+        pool_.release();
+        chunks_.keep(false);
+        stats_.allocations = 0;
+        stats_.bytesRequested = 0;
+    }
+
+    const Stats &stats() const { return stats_; }
+
+    std::string summary() const {
+        return std::to_string(stats_.allocations) + " allocations, " +
+               std::to_string(stats_.bytesRequested) + " bytes requested, " +
+               std::to_string(stats_.chunks) + " heap chunks (" +
+               std::to_string(stats_.chunkBytes) + " bytes, peak " +
+               std::to_string(stats_.peakBytes) + " held)";
+    }
+
+private:
+    /// Upstream adaptor for the pool: counts what is taken from the heap and
+    /// keeps the chunks released by reset() for reuse.  After a reset the
+    /// pool asks for the same sequence of chunk sizes again, so exact-size
+    /// matching is enough.  Blocks freed outside a reset go back to the heap.
+    class ChunkCache : public std::pmr::memory_resource {
+    public:
+        ChunkCache(std::pmr::memory_resource *up, Stats &s) : up_(up), stats_(s) {}
+        ~ChunkCache() override {
+            for (auto &c : free_) up_->deallocate(c.ptr, c.bytes, c.align);
+        }
+
+        /// While set, deallocated chunks are cached instead of freed.
+        void keep(bool on) { keep_ = on; }
+
+    private:
+        struct Chunk { void *ptr; size_t bytes; size_t align; };
+        std::pmr::memory_resource *up_;
+        Stats &stats_;
+        std::vector<Chunk> free_;
+        bool keep_ = false;
+        uint64_t held_ = 0;             // bytes taken from the heap, cached ones included
+
+        void *do_allocate(size_t bytes, size_t align) override {
+            for (size_t i = 0; i < free_.size(); ++i) {
+                if (free_[i].bytes == bytes && free_[i].align == align) {
+                    void *p = free_[i].ptr;
+                    free_[i] = free_.back();
+                    free_.pop_back();
+                    return p;
+                }
+            }
+            void *p = up_->allocate(bytes, align);
+            ++stats_.chunks;
+            stats_.chunkBytes += bytes;
+            held_ += bytes;
+            stats_.peakBytes = std::max(stats_.peakBytes, held_);
+            return p;
+        }
+        void do_deallocate(void *p, size_t bytes, size_t align) override {
+            if (keep_) {
+                free_.push_back({p, bytes, align});
+                return;
+            }
+            up_->deallocate(p, bytes, align);
+            held_ -= bytes;
+        }
+        bool do_is_equal(const memory_resource &o) const noexcept override { return this == &o; }
+    };
+
+    Stats stats_;
+    ChunkCache chunks_;
+    std::pmr::unsynchronized_pool_resource pool_;
+
+    void *do_allocate(size_t bytes, size_t align) override {
+        ++stats_.allocations;
+        stats_.bytesRequested += bytes;
+        return pool_.allocate(bytes, align);
+    }
+    void do_deallocate(void *p, size_t bytes, size_t align) override {
+        pool_.deallocate(p, bytes, align);
+    }
+    bool do_is_equal(const memory_resource &o) const noexcept override { return this == &o; }
+};
@@ -3,57 +3,53 @@
 #include "token.h"
 #include "symbol_table.h"
 #include "encoder.h"
+#include "patterns.h"
+#include "image.h"
+#include "expr.h"
+#include "stats.h"
 
 #include <vector>
 #include <string>
+#include <string_view>
+#include <algorithm>
 #include <map>
+#include <unordered_map>
+#include <cctype>
 #include <cstdint>
+#include <optional>
 #include <stdexcept>
 #include <iostream>
 
 /// Two-pass assembler that works on Token vectors.
+///
+/// Output is a flat image of sections: `.text` at address 0, then every
+/// other section with contents in order of first use, then the zero-only
+/// ones (`.bss`), each starting at a multiple of its largest alignment
+/// (at least 8).  Labels are addresses in that image.
 class Assembler {
 public:
-    /// Assemble a stream of tokens. Emits binary to stdout, labels to stderr.
-    void assemble(const std::vector<Token> &tokens) {
-        auto lines = groupLines(tokens);
-        pass1(lines);
-        pass2(lines);
+    /// Assemble a stream of tokens. Emits binary to `fd` (stdout), labels
+    /// to stderr.  With `stats`, each stage is measured as a phase.
+    void assemble(const TokenList &tokens, int fd = STDOUT_FILENO, PipelineStats *stats = nullptr) {
+        PipelineStats off(false);
+        PipelineStats &st = stats ? *stats : off;
+        auto lines = st.measure("group", [&] {
+            return groupLines(tokens, tokens.get_allocator().resource());
+        });
+        st.measure("pass1", [&] { pass1(lines); });
+        st.measure("pass2", [&] { pass2(lines); });
+        st.measure("output", [&] { write(fd); });
         dumpSymbols();
     }
 
-private:
-    SymbolTable symbols_;
-
-    // ---- instruction pattern table ----
-    // r = REG or sp,  z = REG or ZREG,  i = INT/HEXINT,
-    // j = INT/HEXINT/label,  c = COMMA,  l = '[',  t = ']'
-    static const std::map<std::string, std::string> &patterns() {
-        static const std::map<std::string, std::string> p = {
-            {"add",   "rcrcz"},   {"sub",   "rcrcz"},
-            {"mul",   "rcrcz"},   {"smulh", "rcrcz"},
-            {"umulh", "rcrcz"},   {"sdiv",  "rcrcz"},
-            {"udiv",  "rcrcz"},   {"cmp",   "rcz"},
-            {"br",    "r"},       {"blr",   "r"},
-            {"ldur",  "rclrcit"}, {"stur",  "rclrcit"},
-            {"ldr",   "rcj"},     {"b",     "j"},
-        };
-        return p;
-    }
-
-    static const std::map<std::string, int> &condCodes() {
-        static const std::map<std::string, int> c = {
-            {".eq",0},{".ne",1},{".hs",2},{".lo",3},
-            {".hi",8},{".ls",9},{".ge",10},{".lt",11},
-            {".gt",12},{".le",13}
-        };
-        return c;
-    }
+    // The stages below are public so that the benchmark harness can time
+    // each of them in isolation.  assemble() is the normal entry point.
 
     // ---- group tokens into lines ----
-    static std::vector<std::vector<Token>> groupLines(const std::vector<Token> &tokens) {
-        std::vector<std::vector<Token>> lines;
-        std::vector<Token> cur;
+    static TokenLines groupLines(const TokenList &tokens,
+                                 std::pmr::memory_resource *mr = std::pmr::get_default_resource()) {
+        TokenLines lines(mr);
+        TokenList cur(mr);
         for (auto &t : tokens) {
             if (t.type == NEWLINE) {
                 if (!cur.empty()) { lines.push_back(std::move(cur)); cur.clear(); }
@@ -65,56 +61,140 @@ private:
         return lines;
     }
 
-    // ---- pass 1 : build symbol table ----
-    void pass1(const std::vector<std::vector<Token>> &lines) {
-        uint64_t pc = 0;
+    // ---- pass 1 : size the sections, build symbol table ----
+    void pass1(const TokenLines &lines) {
+        struct Pending {
+            std::string name;
+            size_t section;
+            uint64_t offset;
+        };
+        std::vector<Pending> labels;
+
+        sections_.assign(1, Section{".text"});
+        size_t cur = 0;
         for (auto &line : lines) {
+            if (line.empty()) continue;
             if (line.size() == 1 && line[0].type == LABEL) {
                 std::string name = line[0].lexeme;
                 if (name.back() == ':') name.pop_back();
-                symbols_.define(name, pc);
-            } else if (!line.empty() && line[0].type == DOTID && line[0].lexeme == ".8byte") {
-                pc += 8;
+                labels.push_back({std::move(name), cur, sections_[cur].size});
+            } else if (line[0].type == DOTID && isSectionDirective(line[0].lexeme)) {
+                cur = sectionIndex(line, true);
             } else {
-                pc += 4;
+                sections_[cur].size += lineSize(line, sections_[cur]);
             }
         }
+
+        // text first, zero-only sections last
+        std::vector<size_t> order(sections_.size());
+        for (size_t i = 0; i < order.size(); ++i) order[i] = i;
+        std::stable_partition(order.begin() + 1, order.end(),
+                              [&](size_t i) { return !sections_[i].nobits; });
+        uint64_t end = 0;
+        for (size_t i : order) {
+            Section &s = sections_[i];
+            s.base = end + alignPadding(end, std::max<uint64_t>(s.align, 8));
+            end = s.base + s.size;
+        }
+        for (auto &l : labels) symbols_.define(l.name, sections_[l.section].base + l.offset);
+
+        std::vector<Section> laidOut;
+        for (size_t i : order) laidOut.push_back(std::move(sections_[i]));
+        sections_ = std::move(laidOut);
     }
 
-    // ---- pass 2 : encode & emit ----
-    void pass2(const std::vector<std::vector<Token>> &lines) {
-        uint64_t pc = 0;
-        for (auto &line : lines) {
+    // ---- pass 2 : encode into the image ----
+    void pass2(const TokenLines &lines) {
+        image_.clear();
+        padding_ = {};
+        encoded_.clear();
+        encoding_ = {};
+        std::vector<Image> parts(sections_.size());
+        std::vector<uint64_t> pcs(sections_.size());
+        std::vector<bool> falls(sections_.size());     // can the previous line run into this one?
+        for (size_t i = 0; i < sections_.size(); ++i) pcs[i] = sections_[i].base;
+        falls[0] = true;
+
+        size_t cur = 0;
+        for (size_t li = 0; li < lines.size(); ++li) {
+            const TokenList &line = lines[li];
             if (line.empty()) continue;
 
             // skip label-only lines
             if (line.size() == 1 && line[0].type == LABEL) continue;
 
-            // .8byte directive
-            if (line[0].type == DOTID && line[0].lexeme == ".8byte") {
-                if (line.size() < 2) throw std::runtime_error("Missing operand for .8byte");
-                uint64_t val = 0;
-                if (line[1].type == ID)
-                    val = symbols_.lookup(line[1].lexeme);
-                else
-                    val = std::stoull(line[1].lexeme, nullptr, 0);
-                Encoder::emit64le(val);
-                pc += 8;
+            uint64_t &pc = pcs[cur];
+            Image &out = parts[cur];
+
+            if (line[0].type == DOTID) {
+                const std::string &d = line[0].lexeme;
+                if (isSectionDirective(d)) {
+                    cur = sectionIndex(line, false);
+                } else if (isAlignDirective(d)) {
+                    // .p2align / .align / .balign
+                    Alignment a = parseAlignment(line);
+                    uint64_t n = alignPadding(pc, a.bytes);
+                    int fill = sections_[cur].nobits ? 0 : a.fill >= 0 ? a.fill : paddingFill(lines, li);
+                    uint64_t nops = pad(out, pc, n, fill);
+                    padding_.directives++;
+                    padding_.bytes += n;
+                    padding_.nops += nops;
+                    if (falls[cur]) padding_.executedNops += nops;
+                    pc += n;
+                } else if (unsigned width = dataWidth(d)) {
+                    // .byte / .4byte / .8byte  value, ...
+                    for (Operand op : operands(line)) {
+                        uint64_t v = dataValue(line, op, width);
+                        for (unsigned k = 0; k < width; ++k)
+                            out.bytes().push_back(static_cast<uint8_t>(v >> (8 * k)));
+                        pc += width;
+                    }
+                    falls[cur] = false;
+                } else if (d == ".ascii") {
+                    for (Operand op : operands(line)) {
+                        std::string s = decodeString(line, op);
+                        out.bytes().insert(out.bytes().end(), s.begin(), s.end());
+                        pc += s.size();
+                    }
+                    falls[cur] = false;
+                } else if (d == ".zero" || d == ".space") {
+                    Fill f = parseFill(line);
+                    if (f.byte == 0) out.zeros(f.count);
+                    else out.bytes().insert(out.bytes().end(), f.count, static_cast<uint8_t>(f.byte));
+                    pc += f.count;
+                    falls[cur] = false;
+                } else {
+                    throw std::runtime_error("Unknown directive: " + d);
+                }
                 continue;
             }
 
             if (line[0].type != ID)
                 throw std::runtime_error("Expected instruction, got: " + line[0].lexeme);
 
-            std::string instr = line[0].lexeme;
-            const auto &pat = patterns();
-
-            auto it = pat.find(instr);
-            if (it == pat.end() && instr != "b")
-                throw std::runtime_error("Unknown instruction: " + instr);
+            // a line seen before skips pattern matching
+            encoding_.lines++;
+            auto hit = encoded_.find(encodingKey(line));
+            if (hit != encoded_.end()) {
+                const Encoded &e = hit->second;
+                uint32_t word = e.word;
+                if (e.label >= 0) {
+                    int args[4] = {e.args[0], e.args[1], e.args[2], e.args[3]};
+                    args[e.label] = static_cast<int>(
+                        static_cast<int64_t>(symbols_.lookup(line[e.labelToken].lexeme)) -
+                        static_cast<int64_t>(pc));
+                    word = Encoder::encode(e.form, args[0], args[1], args[2], args[3]);
+                    encoding_.relocated++;
+                }
+                Encoder::emit32le(out.bytes(), word);
+                pc += 4;
+                falls[cur] = e.falls;
+                encoding_.hits++;
+                continue;
+            }
 
-            std::string pattern = (it != pat.end()) ? it->second : "";
-            int args[3] = {0, 0, 0};
+            std::string instr = line[0].lexeme;
+            int args[4] = {0, 0, 0, 0};
             int ai = 0;
             size_t ti = 1;
 
@@ -125,65 +205,496 @@ private:
                     throw std::runtime_error("Invalid condition: " + line[1].lexeme);
                 args[ai++] = ci->second;
                 instr = "b.cond";
-                pattern = pat.at("b");   // j
                 ti = 2;
             }
 
-            if (pattern.empty())
-                throw std::runtime_error("No pattern for instruction: " + instr);
-
-            for (char p : pattern) {
-                if (ti >= line.size())
-                    throw std::runtime_error("Too few operands for " + instr);
-                Token t = line[ti++];
-                switch (p) {
-                    case 'r':
-                        if (t.type == REG || (t.type == ID && t.lexeme == "sp"))
-                            args[ai++] = Encoder::readReg(t.lexeme);
-                        else throw std::runtime_error("Expected register or sp");
-                        break;
-                    case 'z':
-                        if (t.type != REG && t.type != ZREG)
-                            throw std::runtime_error("Expected register or xzr");
-                        args[ai++] = Encoder::readReg(t.lexeme);
-                        break;
-                    case 'c':
-                        if (t.type != COMMA) throw std::runtime_error("Expected comma");
-                        break;
-                    case 'l':
-                        if (t.type != LBRACK) throw std::runtime_error("Expected '['");
-                        break;
-                    case 't':
-                        if (t.type != RBRACK) throw std::runtime_error("Expected ']'");
-                        break;
-                    case 'i':
-                        if (t.type == INT || t.type == HEXINT)
-                            args[ai++] = Encoder::readImm(t.lexeme);
-                        else throw std::runtime_error("Expected immediate");
-                        break;
-                    case 'j':
-                        if (t.type == INT || t.type == HEXINT)
-                            args[ai++] = Encoder::readImm(t.lexeme);
-                        else if (t.type == ID)
-                            args[ai++] = static_cast<int>(
-                                static_cast<int64_t>(symbols_.lookup(t.lexeme)) -
-                                static_cast<int64_t>(pc));
-                        else throw std::runtime_error("Expected immediate or label");
-                        break;
+            const auto &pat = patterns();
+            auto it = pat.find(instr == "b.cond" ? std::string("b") : instr);
+            if (it == pat.end())
+                throw std::runtime_error("Unknown instruction: " + instr);
+
+            // try each operand form in table order
+            std::string_view form;
+            std::string error;
+            LabelUse label;
+            for (const InstrPattern *ip : it->second) {
+                int formArgs[4] = {args[0], args[1], args[2], args[3]};
+                LabelUse formLabel;
+                std::string err = matchOperands(line, ti, ip->pattern, formArgs, ai, instr, pc, &formLabel);
+                if (err.empty()) {
+                    form = (instr == "b.cond") ? std::string_view("b.cond") : ip->form;
+                    std::copy(formArgs, formArgs + 4, args);
+                    label = formLabel;
+                    break;
                 }
+                if (error.empty()) error = std::move(err);
             }
+            if (form.empty())
+                throw std::runtime_error(it->second.size() == 1 ? error : "Invalid operands for " + instr);
 
-            if (ti < line.size())
-                throw std::runtime_error("Extra tokens after " + instr);
-
-            uint32_t word = Encoder::encode(instr, args[0], args[1], args[2]);
-            Encoder::emit32le(word);
+            uint32_t word = Encoder::encode(form, args[0], args[1], args[2], args[3]);
+            Encoder::emit32le(out.bytes(), word);
             pc += 4;
+            falls[cur] = !(instr == "b" || instr == "br");
+
+            if (!label.other) {
+                Encoded &e = encoded_[key_];
+                e = {form, {args[0], args[1], args[2], args[3]}, label.arg, label.token, word, falls[cur]};
+            }
+        }
+        encoding_.entries = encoded_.size();
+
+        for (size_t i = 0; i < parts.size(); ++i) {
+            image_.zeros(sections_[i].base - image_.size());
+            image_.append(std::move(parts[i]));
         }
     }
 
+    // ---- output : write the image ----
+    void write(std::ostream &out) const { image_.write(out); }
+
+    /// Write to a file descriptor; long zero runs become holes in a
+    /// regular file (see Image::write).
+    void write(int fd) const { image_.write(fd); }
+
+    const Image &image() const { return image_; }
+
+    /// A section of the image, after pass1 in layout order.
+    struct Section {
+        std::string name;
+        bool nobits = false;        // .bss-style: zeros only, written as a hole
+        uint64_t size = 0;
+        uint64_t align = 1;         // largest alignment directive in it
+        uint64_t base = 0;
+    };
+
+    const std::vector<Section> &sections() const { return sections_; }
+
+    /// Name of the section a `.text` / `.data` / `.bss` / `.section name`
+    /// line switches to.
+    static std::string sectionName(const TokenList &line) {
+        if (line[0].lexeme != ".section") return line[0].lexeme;
+        if (line.size() < 2 || (line[1].type != DOTID && line[1].type != ID))
+            throw std::runtime_error("Expected section name after .section");
+        return line[1].lexeme;
+    }
+
+    /// Cost of the alignment directives in the last pass2: padding bytes,
+    /// the nops among them, and the nops that run because the line before
+    /// the padding falls through into it (reported by --stats).
+    struct PaddingStats {
+        size_t directives = 0;
+        uint64_t bytes = 0;
+        uint64_t nops = 0;
+        uint64_t executedNops = 0;
+    };
+
+    const PaddingStats &padding() const { return padding_; }
+
+    /// Instruction lines in the last pass2, how many of them the encoding
+    /// cache answered, how many of those hits re-encoded a label offset,
+    /// and the number of distinct lines cached (reported by --stats).
+    struct EncodeStats {
+        size_t lines = 0;
+        size_t hits = 0;
+        size_t relocated = 0;
+        size_t entries = 0;
+    };
+
+    const EncodeStats &encoding() const { return encoding_; }
+
     void dumpSymbols() const {
         for (auto &name : symbols_.order())
             std::cerr << name << " " << symbols_.lookup(name) << "\n";
     }
+
+private:
+    SymbolTable symbols_;
+    std::vector<Section> sections_{Section{".text"}};
+    Image image_;
+    PaddingStats padding_;
+
+    /// An instruction line encoded earlier in this pass2.  `word` is final
+    /// unless `label` >= 0: then args[label] is the offset to the label at
+    /// token `labelToken`, recomputed against the pc of each hit.
+    struct Encoded {
+        std::string_view form;      // points into patterns.h
+        int args[4];
+        int label;
+        size_t labelToken;
+        uint32_t word;
+        bool falls;
+    };
+    std::unordered_map<std::string, Encoded> encoded_;
+    std::string key_;               // reused by encodingKey()
+    EncodeStats encoding_;
+
+    /// Cache key of an instruction line: token types and lexemes, with any
+    /// defined label replaced by a placeholder so that `cbz x1, a` and
+    /// `cbz x1, b` share an entry.  Registers, `sp`, `lsl` and condition
+    /// names are never labels here, even if a label has the same name.
+    const std::string &encodingKey(const TokenList &line) {
+        key_.clear();
+        for (size_t i = 0; i < line.size(); ++i) {
+            const Token &t = line[i];
+            key_ += static_cast<char>(t.type);
+            if (i > 0 && t.type == ID && t.lexeme != "sp" && t.lexeme != "lsl" &&
+                findCondName(t.lexeme) < 0 && symbols_.contains(t.lexeme))
+                key_ += '\1';
+            else
+                key_ += t.lexeme;
+            key_ += '\0';
+        }
+        return key_;
+    }
+
+    // ---- sections ----
+
+    /// Index of the section `line` switches to; pass1 creates it on first
+    /// use.  `.bss`, `.bss.*` and `.section name, ..., @nobits` hold only
+    /// zeros; other `.section` flags are accepted and ignored.
+    size_t sectionIndex(const TokenList &line, bool create) {
+        std::string name = sectionName(line);
+        for (size_t i = 0; i < sections_.size(); ++i)
+            if (sections_[i].name == name) return i;
+        if (!create) throw std::runtime_error("Unknown section: " + name);
+        Section s{name};
+        s.nobits = name == ".bss" || name.rfind(".bss.", 0) == 0;
+        for (auto &t : line)
+            if (t.lexeme == "@nobits" || t.lexeme == "%nobits") s.nobits = true;
+        sections_.push_back(std::move(s));
+        return sections_.size() - 1;
+    }
+
+    /// Bytes emitted by a non-label line at offset `s.size` of section `s`;
+    /// also checks that the line may appear there.
+    uint64_t lineSize(const TokenList &line, Section &s) const {
+        uint64_t pc = s.size;
+        if (line[0].type != DOTID) {
+            if (s.nobits) throw std::runtime_error("Instruction in zero-only section " + s.name);
+            if (pc % 4)
+                throw std::runtime_error("Instruction at unaligned offset " + std::to_string(pc) +
+                                         " in " + s.name);
+            return 4;
+        }
+        const std::string &d = line[0].lexeme;
+        if (isAlignDirective(d)) {
+            Alignment a = parseAlignment(line);
+            if (s.nobits && a.fill > 0) throw std::runtime_error("Non-zero fill in zero-only section " + s.name);
+            s.align = std::max(s.align, a.bytes);
+            return alignPadding(pc, a.bytes);
+        }
+        if (d == ".zero" || d == ".space") {
+            Fill f = parseFill(line);
+            if (s.nobits && f.byte) throw std::runtime_error("Non-zero fill in zero-only section " + s.name);
+            return f.count;
+        }
+        if (s.nobits) throw std::runtime_error(d + " in zero-only section " + s.name);
+        if (unsigned width = dataWidth(d)) return width * operands(line).size();
+        if (d == ".ascii") {
+            uint64_t n = 0;
+            for (Operand op : operands(line)) n += decodeString(line, op).size();
+            return n;
+        }
+        throw std::runtime_error("Unknown directive: " + d);
+    }
+
+    // ---- data directives ----
+
+    /// Tokens [begin, end) of one directive operand.
+    struct Operand {
+        size_t begin, end;
+    };
+
+    /// The comma-separated operands of a directive.
+    static std::vector<Operand> operands(const TokenList &line) {
+        std::vector<Operand> ops;
+        size_t begin = 1;
+        for (size_t i = 1; i <= line.size(); ++i) {
+            if (i < line.size() && line[i].type != COMMA) continue;
+            if (i == begin) throw std::runtime_error("Missing operand for " + line[0].lexeme);
+            ops.push_back({begin, i});
+            begin = i + 1;
+        }
+        return ops;
+    }
+
+    /// Evaluate the expression `op` (see expr.h); `lookup` resolves labels.
+    template <class Lookup>
+    static Expr::Value evaluate(const TokenList &line, Operand op, const Lookup &lookup) {
+        size_t ti = op.begin;
+        Expr::Value v;
+        std::string err = Expr::parse(line, ti, lookup, v);
+        if (err.empty() && ti != op.end)
+            err = "Unexpected '" + line[ti].lexeme + "' in " + line[0].lexeme;
+        if (!err.empty()) throw std::runtime_error(err);
+        return v;
+    }
+
+    /// A number that pass 1 needs (a size or alignment), so it may not
+    /// involve labels.
+    static int64_t constant(const TokenList &line, Operand op) {
+        auto noLabels = [&](const std::string &name) -> std::optional<uint64_t> {
+            throw std::runtime_error(line[0].lexeme + " needs a constant, got label: " + name);
+        };
+        return evaluate(line, op, noLabels).value;
+    }
+
+    /// Label addresses for expressions in pass 2.
+    auto labelLookup() const {
+        return [this](const std::string &name) -> std::optional<uint64_t> {
+            return symbols_.lookup(name);
+        };
+    }
+
+    /// A `.byte` / `.4byte` / `.8byte` value: a number (negative ones in
+    /// two's complement), a label address or an expression, which must fit
+    /// in `width` bytes.
+    uint64_t dataValue(const TokenList &line, Operand op, unsigned width) const {
+        const Token &t = line[op.begin];
+        const std::string &directive = line[0].lexeme;
+        uint64_t v;
+        bool negative = false;
+        if (op.end - op.begin > 1 || t.type == LPAREN || Expr::isOperator(t.type)) {
+            Expr::Value e = evaluate(line, op, labelLookup());
+            if (e.labels != 0 && e.labels != 1)
+                throw std::runtime_error("Expression in " + directive + " adds up several label addresses");
+            v = static_cast<uint64_t>(e.value);
+            negative = e.labels == 0 && e.value < 0;
+        } else if (t.type == ID) {
+            v = symbols_.lookup(t.lexeme);
+        } else if (t.type == INT || t.type == HEXINT) {
+            negative = t.lexeme[0] == '-';
+            v = negative ? static_cast<uint64_t>(std::stoll(t.lexeme, nullptr, 0))
+                         : std::stoull(t.lexeme, nullptr, 0);
+        } else {
+            throw std::runtime_error("Expected number or label in " + directive + ", got: " + t.lexeme);
+        }
+        uint64_t top = width == 8 ? 0 : ~uint64_t{0} << (8 * width);
+        bool fits = negative ? (v & top) == top && (width == 8 || (v >> (8 * width - 1)) & 1)
+                             : !(v & top);
+        if (!fits) throw std::runtime_error("Value out of range for " + directive + ": " + t.lexeme);
+        return v;
+    }
+
+    /// `.zero n` / `.space n[, fill]`.
+    struct Fill {
+        uint64_t count;
+        int byte;
+    };
+
+    static Fill parseFill(const TokenList &line) {
+        auto ops = operands(line);
+        if (ops.size() > (line[0].lexeme == ".space" ? 2u : 1u))
+            throw std::runtime_error("Extra tokens after " + line[0].lexeme);
+        int64_t n = constant(line, ops[0]);
+        if (n < 0) throw std::runtime_error("Expected size after " + line[0].lexeme);
+        Fill f{static_cast<uint64_t>(n), 0};
+        if (ops.size() > 1) {
+            int64_t b = constant(line, ops[1]);
+            if (b < 0 || b > 255) throw std::runtime_error("Fill value must be a byte (0..255)");
+            f.byte = static_cast<int>(b);
+        }
+        return f;
+    }
+
+    /// Bytes of a `.ascii` operand: a quoted string with the escapes
+    /// \n \t \r \0 \\ \" \' and \xHH.
+    static std::string decodeString(const TokenList &line, Operand op) {
+        const Token &t = line[op.begin];
+        if (t.type != STRING || op.end - op.begin > 1) throw std::runtime_error("Expected string after .ascii, got: " + t.lexeme);
+        const std::string &s = t.lexeme;
+        if (s.size() < 2 || s.front() != '"' || s.back() != '"')
+            throw std::runtime_error("Malformed string: " + s);
+        std::string out;
+        for (size_t i = 1; i + 1 < s.size(); ++i) {
+            if (s[i] != '\\') { out += s[i]; continue; }
+            if (++i + 1 >= s.size()) throw std::runtime_error("Malformed string: " + s);
+            switch (s[i]) {
+                case 'n': out += '\n'; break;
+                case 't': out += '\t'; break;
+                case 'r': out += '\r'; break;
+                case '0': out += '\0'; break;
+                case '\\': case '"': case '\'': out += s[i]; break;
+                case 'x': {
+                    size_t k = i + 1;
+                    while (k + 1 < s.size() && k < i + 3 && std::isxdigit(static_cast<unsigned char>(s[k]))) ++k;
+                    if (k == i + 1) throw std::runtime_error("Expected hex digits after \\x in " + s);
+                    out += static_cast<char>(std::stoi(s.substr(i + 1, k - i - 1), nullptr, 16));
+                    i = k - 1;
+                    break;
+                }
+                default: throw std::runtime_error(std::string("Unknown escape \\") + s[i] + " in " + s);
+            }
+        }
+        return out;
+    }
+
+    // ---- alignment directives ----
+
+    /// `.p2align n[, fill]`: alignment in bytes, and the fill byte or -1
+    /// for the default (nops before code, zeros before data).
+    struct Alignment {
+        uint64_t bytes;
+        int fill;
+    };
+
+    static Alignment parseAlignment(const TokenList &line) {
+        if (line.size() < 2) throw std::runtime_error("Expected number after " + line[0].lexeme);
+        auto ops = operands(line);
+        if (ops.size() > 2) throw std::runtime_error("Extra tokens after " + line[0].lexeme);
+        Alignment a{alignmentOf(line[0].lexeme, constant(line, ops[0])), -1};
+        if (ops.size() > 1) {
+            int64_t fill = constant(line, ops[1]);
+            if (fill < 0 || fill > 255) throw std::runtime_error("Fill value must be a byte (0..255)");
+            a.fill = static_cast<int>(fill);
+        }
+        return a;
+    }
+
+    /// Default fill for the padding at line `li`: nops (-1) if the next
+    /// line that emits anything is an instruction, zeros before data or at
+    /// the end of the program.
+    static int paddingFill(const TokenLines &lines, size_t li) {
+        for (size_t j = li + 1; j < lines.size(); ++j) {
+            const TokenList &l = lines[j];
+            if (l.empty() || (l.size() == 1 && l[0].type == LABEL)) continue;
+            if (l[0].type == DOTID && isAlignDirective(l[0].lexeme)) continue;
+            return l[0].type == ID ? -1 : 0;
+        }
+        return 0;
+    }
+
+    /// Append `n` bytes of padding at `pc`; fill -1 means nops, with zero
+    /// bytes up to the first word boundary.  Returns the number of nops.
+    static uint64_t pad(Image &out, uint64_t pc, uint64_t n, int fill) {
+        if (fill == 0) {
+            out.zeros(n);
+            return 0;
+        }
+        auto &code = out.bytes();
+        if (fill > 0) {
+            code.insert(code.end(), n, static_cast<uint8_t>(fill));
+            return 0;
+        }
+        uint64_t head = std::min(n, alignPadding(pc, 4));
+        code.insert(code.end(), head, 0);
+        uint64_t nops = (n - head) / 4;
+        for (uint64_t k = 0; k < nops; ++k) Encoder::emit32le(code, Encoder::NOP);
+        code.insert(code.end(), n - head - 4 * nops, 0);
+        return nops;
+    }
+
+    // ---- instruction pattern table (see patterns.h) ----
+    // mnemonic -> its operand forms, in the order they are tried
+    static const std::map<std::string, std::vector<const InstrPattern *>> &patterns() {
+        static const std::map<std::string, std::vector<const InstrPattern *>> p = [] {
+            std::map<std::string, std::vector<const InstrPattern *>> m;
+            for (const auto &ip : kInstrPatterns)
+                m[std::string(ip.mnemonic)].push_back(&ip);
+            return m;
+        }();
+        return p;
+    }
+
+    /// How a matched line depends on labels: `arg` is the args index of a
+    /// plain label operand (-1 if none) read from token `token`; `other`
+    /// is set when labels enter it some other way (an expression, or a
+    /// second label), which keeps the line out of the encoding cache.
+    struct LabelUse {
+        int arg = -1;
+        size_t token = 0;
+        bool other = false;
+    };
+
+    /// Match the operands of `line` from token `ti` on against `pattern`,
+    /// appending operand values to args[ai...].  Returns an error message,
+    /// or an empty string on success.
+    std::string matchOperands(const TokenList &line, size_t ti, std::string_view pattern,
+                              int *args, int ai, const std::string &instr, uint64_t pc,
+                              LabelUse *label) const {
+        for (char p : pattern) {
+            if (ti >= line.size())
+                return "Too few operands for " + instr;
+            const Token &t = line[ti++];
+            switch (p) {
+                case 'r':
+                    if (t.type == REG || (t.type == ID && t.lexeme == "sp"))
+                        args[ai++] = Encoder::readReg(t.lexeme);
+                    else return "Expected register or sp";
+                    break;
+                case 'z':
+                    if (t.type != REG && t.type != ZREG)
+                        return "Expected register or xzr";
+                    args[ai++] = Encoder::readReg(t.lexeme);
+                    break;
+                case 'v':
+                    if (t.type != VREG) return "Expected vector register";
+                    args[ai++] = findVectorReg(t.lexeme);
+                    break;
+                case 'c':
+                    if (t.type != COMMA) return "Expected comma";
+                    break;
+                case 'l':
+                    if (t.type != LBRACK) return "Expected '['";
+                    break;
+                case 't':
+                    if (t.type != RBRACK) return "Expected ']'";
+                    break;
+                case 'e':
+                    if (t.type != EXCLAM) return "Expected '!'";
+                    break;
+                case 's':
+                    if (t.type != ID || t.lexeme != "lsl") return "Expected lsl";
+                    break;
+                case 'k':
+                    if (t.type != ID || findCondName(t.lexeme) < 0) return "Expected condition";
+                    args[ai++] = findCondName(t.lexeme);
+                    break;
+                case 'i':
+                case 'j':
+                    if (Expr::isCompound(line, ti - 1)) {
+                        Expr::Value v;
+                        auto lookup = [&](const std::string &name) -> std::optional<uint64_t> {
+                            label->other = true;
+                            return symbols_.lookup(name);
+                        };
+                        std::string err = Expr::parse(line, --ti, lookup, v);
+                        if (!err.empty()) return err;
+                        if (p == 'j' && v.labels == 1) v.value -= static_cast<int64_t>(pc);
+                        else if (v.labels != 0) return p == 'i' ? "Expected immediate" : "Expected immediate or label";
+                        if (v.value < INT32_MIN || v.value > INT32_MAX)
+                            throw std::runtime_error("Immediate out of range: " + std::to_string(v.value));
+                        args[ai++] = static_cast<int>(v.value);
+                    } else if (p == 'i') {
+                        if (t.type == INT || t.type == HEXINT)
+                            args[ai++] = Encoder::readImm(t.lexeme);
+                        else return "Expected immediate";
+                    } else if (t.type == INT || t.type == HEXINT)
+                        args[ai++] = Encoder::readImm(t.lexeme);
+                    else if (t.type == ID) {
+                        if (label->arg >= 0) label->other = true;
+                        label->arg = ai;
+                        label->token = ti - 1;
+                        args[ai++] = static_cast<int>(
+                            static_cast<int64_t>(symbols_.lookup(t.lexeme)) -
+                            static_cast<int64_t>(pc));
+                    } else return "Expected immediate or label";
+                    break;
+            }
+        }
+        if (ti < line.size())
+            return "Extra tokens after " + instr;
+        return {};
+    }
+
+    static const std::map<std::string, int> &condCodes() {
+        static const std::map<std::string, int> c = [] {
+            std::map<std::string, int> m;
+            for (const auto &cc : kCondCodes)
+                m.emplace(cc.suffix, cc.code);
+            return m;
+        }();
+        return c;
+    }
 };
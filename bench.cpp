@@ -0,0 +1,437 @@
+#include "token.h"
+#include "arena.h"
+#include "lexer.h"
+#include "assembler.h"
+#include "ir.h"
+#include "highlevel.h"
+#include "ir_codegen.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+/// Micro-benchmark harness for the assembler pipeline.
+///
+/// Every stage (lexer, parser, ir_codegen, pass1, pass2, output) is timed
+/// over a fixed synthetic workload.  Each stage is sampled repeatedly so that
+/// runs can be compared statistically against a stored baseline:
+///
+///   bench --save baseline.json        record a baseline
+///   bench --compare baseline.json     rerun and gate on regressions
+///
+/// The comparison uses a one-sided Mann-Whitney U test over the per-sample
+/// timings and only reports a regression when the median slowed down by more
+/// than --threshold percent *and* the test is significant at --alpha.
+
+namespace {
+
+struct Options {
+    int samples = 21;
+    int lines = 20000;
+    double threshold = 5.0;     // percent
+    double alpha = 0.01;
+    std::string savePath;
+    std::string comparePath;
+};
+
+using Samples = std::map<std::string, std::vector<double>>;   // stage -> ns/line
+
+const char *const kStages[] = {"lexer", "parser", "ir_codegen", "pass1", "pass2", "output"};
+
+// ---------- synthetic workload ----------
+
+std::string makeRawProgram(int lines) {
+    static const char *const body[] = {
+        "add x1, x2, x3", "sub x4, x4, x5", "mul x6, x1, x2", "sdiv x7, x6, x3",
+        "ldur x8, [x29, -8]", "stur x8, [x29, -16]", "cmp x1, x2",
+    };
+    std::ostringstream out;
+    int n = 0;
+    for (int blk = 0; n < lines; ++blk) {
+        out << "L" << blk << ":\n";
+        for (const char *s : body) { out << "    " << s << "\n"; ++n; }
+        out << "    b.ne L" << blk << "\n";
+        out << "    ldr x9, 8 ; literal\n";
+        out << "    b 12\n";
+        out << "    .8byte L" << blk << "\n";
+        n += 5;
+    }
+    out << "    br x30\n";
+    return out.str();
+}
+
+std::string makeHighProgram(int lines) {
+    std::ostringstream out;
+    int n = 0;
+    for (int blk = 0; n < lines; ++blk) {
+        out << "label L" << blk << "\n"
+            << "x1 = x2 + x3\n"
+            << "x4 = x4 - x5\n"
+            << "x6 = x1 % x2\n"
+            << "x8 = *(x29 + -8)\n"
+            << "*(x29 + -16) = x8\n"
+            << "if x1 != x2 goto L" << blk << "\n"
+            << "x7 = x6\n";
+        n += 8;
+    }
+    out << "ret\n";
+    return out.str();
+}
+
+// ---------- timing ----------
+
+/// Discards everything written to it; used to time the output stage
+/// without touching the filesystem.
+class NullBuffer : public std::streambuf {
+protected:
+    std::streamsize xsputn(const char *, std::streamsize n) override { return n; }
+    int overflow(int c) override { return traits_type::not_eof(c); }
+};
+
+template <typename F>
+double timeOnce(F &&f) {
+    auto t0 = std::chrono::steady_clock::now();
+    f();
+    auto t1 = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::nano>(t1 - t0).count();
+}
+
+Samples runBenchmarks(const Options &opt) {
+    const std::string raw = makeRawProgram(opt.lines);
+    const std::string high = makeHighProgram(opt.lines);
+
+    TokenList tokens;
+    {
+        std::istringstream in(raw);
+        tokens = RawAsmLexer::lex(in);
+    }
+    IRProgram ir;
+    {
+        std::istringstream in(high);
+        ir = HighLevelParser::parse(in);
+    }
+    const auto lines = Assembler::groupLines(tokens);
+    // the generators round up to whole blocks, so divide by the lines they
+    // actually produced: the raw program's for the lexer and the assembler
+    // stages, the high-level program's for the parser and ir_codegen
+    const double rawLines = static_cast<double>(std::count(raw.begin(), raw.end(), '\n'));
+    const double highLines = static_cast<double>(std::count(high.begin(), high.end(), '\n'));
+
+    NullBuffer nullBuf;
+    std::ostream nullOut(&nullBuf);
+
+    // Allocating stages use a per-sample arena, as asm itself does.
+    Arena arena;
+    std::map<std::string, std::function<double()>> stages;
+    stages["lexer"] = [&] {
+        arena.reset();
+        std::istringstream in(raw);
+        return timeOnce([&] { auto t = RawAsmLexer::lex(in, &arena); });
+    };
+    stages["parser"] = [&] {
+        arena.reset();
+        std::istringstream in(high);
+        return timeOnce([&] { auto r = HighLevelParser::parse(in, &arena); });
+    };
+    stages["ir_codegen"] = [&] {
+        arena.reset();
+        return timeOnce([&] { auto t = IRCodeGen::lower(ir, &arena); });
+    };
+    stages["pass1"] = [&] {
+        Assembler a;
+        return timeOnce([&] { a.pass1(lines); });
+    };
+    stages["pass2"] = [&] {
+        Assembler a;
+        a.pass1(lines);
+        return timeOnce([&] { a.pass2(lines); });
+    };
+    stages["output"] = [&] {
+        Assembler a;
+        a.pass1(lines);
+        a.pass2(lines);
+        return timeOnce([&] { a.write(nullOut); });
+    };
+
+    const std::map<std::string, double> perLine = {
+        {"lexer", rawLines},  {"parser", highLines}, {"ir_codegen", highLines},
+        {"pass1", rawLines},  {"pass2", rawLines},   {"output", rawLines},
+    };
+
+    Samples result;
+    for (const char *name : kStages) {
+        auto &run = stages.at(name);
+        run();                                  // warm-up
+        auto &v = result[name];
+        for (int s = 0; s < opt.samples; ++s)
+            v.push_back(run() / perLine.at(name));
+    }
+    return result;
+}
+
+// ---------- statistics ----------
+
+double median(std::vector<double> v) {
+    if (v.empty()) return 0.0;
+    std::sort(v.begin(), v.end());
+    size_t n = v.size();
+    return (n % 2) ? v[n / 2] : 0.5 * (v[n / 2 - 1] + v[n / 2]);
+}
+
+/// One-sided Mann-Whitney U test (normal approximation with tie and
+/// continuity correction).  Returns the p-value for the hypothesis that
+/// samples in `cur` tend to be larger than those in `base`.
+double mannWhitneyGreater(const std::vector<double> &base, const std::vector<double> &cur) {
+    const size_t n1 = cur.size(), n2 = base.size();
+    if (n1 == 0 || n2 == 0) return 1.0;
+
+    std::vector<std::pair<double, int>> all;   // value, group (0 = cur, 1 = base)
+    for (double v : cur)  all.push_back({v, 0});
+    for (double v : base) all.push_back({v, 1});
+    std::sort(all.begin(), all.end());
+
+    const double n = static_cast<double>(all.size());
+    double rankSumCur = 0.0, tieTerm = 0.0;
+    for (size_t i = 0; i < all.size();) {
+        size_t j = i;
+        while (j < all.size() && all[j].first == all[i].first) ++j;
+        double rank = 0.5 * static_cast<double>(i + 1 + j);   // average of i+1 .. j
+        for (size_t k = i; k < j; ++k)
+            if (all[k].second == 0) rankSumCur += rank;
+        double t = static_cast<double>(j - i);
+        tieTerm += t * t * t - t;
+        i = j;
+    }
+
+    const double u = rankSumCur - static_cast<double>(n1 * (n1 + 1)) / 2.0;
+    const double mean = static_cast<double>(n1 * n2) / 2.0;
+    const double var = static_cast<double>(n1 * n2) / 12.0 *
+                       ((n + 1.0) - tieTerm / (n * (n - 1.0)));
+    if (var <= 0.0) return 1.0;
+    const double z = (u - mean - 0.5) / std::sqrt(var);
+    return 0.5 * std::erfc(z / std::sqrt(2.0));
+}
+
+// ---------- baseline file ----------
+
+void saveBaseline(const std::string &path, const Options &opt, const Samples &s) {
+    std::ofstream out(path);
+    if (!out) throw std::runtime_error("Cannot write baseline: " + path);
+    out << std::setprecision(17);
+    out << "{\n  \"version\": 1,\n  \"unit\": \"ns/line\",\n"
+        << "  \"lines\": " << opt.lines << ",\n  \"stages\": {";
+    bool firstStage = true;
+    for (const char *name : kStages) {
+        out << (firstStage ? "\n" : ",\n") << "    \"" << name << "\": [";
+        firstStage = false;
+        const auto &v = s.at(name);
+        for (size_t i = 0; i < v.size(); ++i) out << (i ? ", " : "") << v[i];
+        out << "]";
+    }
+    out << "\n  }\n}\n";
+}
+
+/// Minimal reader for the file written by saveBaseline().  Only the
+/// "lines" field and the "stages" object of number arrays are extracted;
+/// everything else is skipped.
+class BaselineReader {
+public:
+    explicit BaselineReader(std::string text) : s_(std::move(text)) {}
+
+    void read(int &lines, Samples &out) {
+        expect('{');
+        while (!peek('}')) {
+            std::string key = readString();
+            expect(':');
+            if (key == "lines")       lines = static_cast<int>(readNumber());
+            else if (key == "stages") readStages(out);
+            else                      skipValue();
+            if (!peek('}')) expect(',');
+        }
+        expect('}');
+    }
+
+private:
+    std::string s_;
+    size_t i_ = 0;
+
+    void ws() { while (i_ < s_.size() && std::isspace(static_cast<unsigned char>(s_[i_]))) ++i_; }
+    bool peek(char c) { ws(); return i_ < s_.size() && s_[i_] == c; }
+    void expect(char c) {
+        if (!peek(c)) throw std::runtime_error(std::string("Baseline parse error: expected '") + c + "'");
+        ++i_;
+    }
+
+    std::string readString() {
+        expect('"');
+        size_t start = i_;
+        while (i_ < s_.size() && s_[i_] != '"') ++i_;
+        if (i_ >= s_.size()) throw std::runtime_error("Baseline parse error: unterminated string");
+        return s_.substr(start, i_++ - start);
+    }
+
+    double readNumber() {
+        ws();
+        const char *begin = s_.c_str() + i_;
+        char *end = nullptr;
+        double v = std::strtod(begin, &end);
+        if (end == begin) throw std::runtime_error("Baseline parse error: expected number");
+        i_ += static_cast<size_t>(end - begin);
+        return v;
+    }
+
+    void readStages(Samples &out) {
+        expect('{');
+        while (!peek('}')) {
+            std::string name = readString();
+            expect(':');
+            expect('[');
+            auto &v = out[name];
+            while (!peek(']')) {
+                v.push_back(readNumber());
+                if (!peek(']')) expect(',');
+            }
+            expect(']');
+            if (!peek('}')) expect(',');
+        }
+        expect('}');
+    }
+
+    void skipValue() {
+        if (peek('"')) { readString(); return; }
+        if (peek('{') || peek('[')) {
+            int depth = 0;
+            do {
+                if (s_[i_] == '{' || s_[i_] == '[') ++depth;
+                else if (s_[i_] == '}' || s_[i_] == ']') --depth;
+                ++i_;
+            } while (depth > 0 && i_ < s_.size());
+            return;
+        }
+        readNumber();
+    }
+};
+
+// ---------- reporting ----------
+
+void printTable(const Samples &s) {
+    std::cout << std::left << std::setw(12) << "stage"
+              << std::right << std::setw(14) << "median ns/line"
+              << std::setw(12) << "min" << "\n";
+    for (const char *name : kStages) {
+        const auto &v = s.at(name);
+        std::cout << std::left << std::setw(12) << name << std::right << std::fixed
+                  << std::setprecision(2) << std::setw(14) << median(v)
+                  << std::setw(12) << *std::min_element(v.begin(), v.end()) << "\n";
+    }
+}
+
+/// Prints the per-stage delta table and returns the number of regressions.
+int compare(const Samples &base, const Samples &cur, const Options &opt) {
+    std::cout << std::left << std::setw(12) << "stage" << std::right
+              << std::setw(12) << "base" << std::setw(12) << "current"
+              << std::setw(10) << "delta" << std::setw(12) << "p-value"
+              << "  verdict\n";
+    int regressions = 0;
+    for (const char *name : kStages) {
+        auto bi = base.find(name);
+        const auto &c = cur.at(name);
+        std::cout << std::left << std::setw(12) << name << std::right << std::fixed;
+        if (bi == base.end() || bi->second.empty()) {
+            std::cout << std::setw(12) << "-" << std::setprecision(2) << std::setw(12)
+                      << median(c) << std::setw(10) << "-" << std::setw(12) << "-"
+                      << "  new\n";
+            continue;
+        }
+        double mb = median(bi->second), mc = median(c);
+        double delta = (mb > 0.0) ? 100.0 * (mc - mb) / mb : 0.0;
+        double p = mannWhitneyGreater(bi->second, c);
+        bool regressed = delta > opt.threshold && p < opt.alpha;
+        if (regressed) ++regressions;
+        std::cout << std::setprecision(2) << std::setw(12) << mb << std::setw(12) << mc
+                  << std::showpos << std::setw(9) << delta << "%" << std::noshowpos
+                  << std::setprecision(4) << std::setw(12) << p
+                  << "  " << (regressed ? "REGRESSION" : "ok") << "\n";
+    }
+    return regressions;
+}
+
+void printUsage() {
+    std::cerr << "Usage:\n"
+              << "  bench [OPTIONS]\n\n"
+              << "Options:\n"
+              << "  --save FILE        Write the samples to FILE as a baseline\n"
+              << "  --compare FILE     Compare against the baseline in FILE; exits 1 on regression\n"
+              << "  --threshold PCT    Median slowdown that counts as a regression (default 5)\n"
+              << "  --alpha P          Significance level of the Mann-Whitney test (default 0.01)\n"
+              << "  --samples N        Samples per stage (default 21)\n"
+              << "  --lines N          Size of the synthetic workload in lines (default 20000)\n";
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+    try {
+        Options opt;
+        for (int i = 1; i < argc; ++i) {
+            auto next = [&]() -> const char * {
+                if (i + 1 >= argc) throw std::runtime_error(std::string("Missing value for ") + argv[i]);
+                return argv[++i];
+            };
+            if      (std::strcmp(argv[i], "--save") == 0)      opt.savePath = next();
+            else if (std::strcmp(argv[i], "--compare") == 0)   opt.comparePath = next();
+            else if (std::strcmp(argv[i], "--threshold") == 0) opt.threshold = std::stod(next());
+            else if (std::strcmp(argv[i], "--alpha") == 0)     opt.alpha = std::stod(next());
+            else if (std::strcmp(argv[i], "--samples") == 0)   opt.samples = std::stoi(next());
+            else if (std::strcmp(argv[i], "--lines") == 0)     opt.lines = std::stoi(next());
+            else if (std::strcmp(argv[i], "--help") == 0 ||
+                     std::strcmp(argv[i], "-h") == 0) {
+                printUsage();
+                return 0;
+            }
+            else throw std::runtime_error(std::string("Unknown option: ") + argv[i]);
+        }
+        if (opt.samples < 2) throw std::runtime_error("--samples must be at least 2");
+
+        Samples base;
+        if (!opt.comparePath.empty()) {
+            std::ifstream in(opt.comparePath);
+            if (!in) throw std::runtime_error("Cannot open baseline: " + opt.comparePath);
+            std::stringstream ss;
+            ss << in.rdbuf();
+            int baseLines = opt.lines;
+            BaselineReader(ss.str()).read(baseLines, base);
+            opt.lines = baseLines;              // rerun the same workload size
+        }
+
+        Samples cur = runBenchmarks(opt);
+
+        if (!opt.savePath.empty()) saveBaseline(opt.savePath, opt, cur);
+
+        if (opt.comparePath.empty()) {
+            printTable(cur);
+            return 0;
+        }
+        int regressions = compare(base, cur, opt);
+        if (regressions) {
+            std::cout << std::defaultfloat << regressions
+                      << " stage(s) regressed by more than "
+                      << opt.threshold << "%\n";
+            return 1;
+        }
+        return 0;
+    } catch (const std::exception &e) {
+        std::cerr << "ERROR: " << e.what() << "\n";
+        return 2;
+    }
+}
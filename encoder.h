@@ -1,97 +1,189 @@
 #pragma once
 
+#include <charconv>
 #include <cstdint>
-#include <iostream>
 #include <string>
+#include <string_view>
+#include <vector>
 #include <stdexcept>
 
 /// Validates and encodes a single ARM64 instruction into a 32-bit word.
+///
+/// The encoding helpers are constexpr so that a64.h can assemble at compile
+/// time; a validation failure there surfaces as a compile error.
 class Encoder {
 public:
+    // ---- base opcodes (register fields zero) ----
+    static constexpr uint32_t ADD   = 0x8B206000;
+    static constexpr uint32_t SUB   = 0xCB206000;
+    static constexpr uint32_t MUL   = 0x9B007C00;
+    static constexpr uint32_t SMULH = 0x9B407C00;
+    static constexpr uint32_t UMULH = 0x9BC07C00;
+    static constexpr uint32_t SDIV  = 0x9AC00C00;
+    static constexpr uint32_t UDIV  = 0x9AC00800;
+    static constexpr uint32_t NOP   = 0xD503201F;
+    static constexpr uint32_t BR    = 0xD61F0000;
+    static constexpr uint32_t BLR   = 0xD63F0000;
+    static constexpr uint32_t LDUR  = 0xF8400000;
+    static constexpr uint32_t STUR  = 0xF8000000;
+    static constexpr uint32_t LDR_UOFF = 0xF9400000, STR_UOFF = 0xF9000000;
+    static constexpr uint32_t LDR_PRE  = 0xF8400C00, STR_PRE  = 0xF8000C00;
+    static constexpr uint32_t LDR_POST = 0xF8400400, STR_POST = 0xF8000400;
+    static constexpr uint32_t LDR_REG  = 0xF8606800, STR_REG  = 0xF8206800;
+    static constexpr uint32_t LDP      = 0xA9400000, STP      = 0xA9000000;
+    static constexpr uint32_t LDP_PRE  = 0xA9C00000, STP_PRE  = 0xA9800000;
+    static constexpr uint32_t LDP_POST = 0xA8C00000, STP_POST = 0xA8800000;
+    static constexpr uint32_t ADD_SHIFTED = 0x8B000000, SUB_SHIFTED = 0xCB000000;
+    static constexpr uint32_t SUBS_SHIFTED = 0xEB000000, ORR_SHIFTED = 0xAA000000;
+    static constexpr uint32_t CSEL  = 0x9A800000, CSINC = 0x9A800400, CSNEG = 0xDA800400;
+    static constexpr uint32_t CBZ   = 0xB4000000, CBNZ  = 0xB5000000;
+    static constexpr uint32_t TBZ   = 0x36000000, TBNZ  = 0x37000000;
+    static constexpr uint32_t CMP_IMM = 0xF100001F;                 // subs xzr, xn, #imm
+    static constexpr uint32_t ADD_V = 0x0E208400, SUB_V = 0x2E208400, MUL_V = 0x0E209C00;
+    static constexpr uint32_t LD1   = 0x0C407000, ST1   = 0x0C007000;
+    static constexpr uint32_t LD1_POST = 0x0CDF7000, ST1_POST = 0x0C9F7000;
+
     /// Encode an instruction. Returns the machine-code word.
-    static uint32_t encode(const std::string &instr, int a, int b, int c) {
+    /// `instr` is a mnemonic or, for instructions with several addressing
+    /// modes, one of the forms named in patterns.h (e.g. "ldr.pre").
+    static constexpr uint32_t encode(std::string_view instr, int a, int b, int c, int d = 0) {
         uint32_t w = 0;
-        if      (instr == "add")    w = encodeRRR(0x8B206000, a, b, c);
-        else if (instr == "sub")    w = encodeRRR(0xCB206000, a, b, c);
-        else if (instr == "mul")    w = encodeRRR(0x9B007C00, a, b, c);
-        else if (instr == "smulh")  w = encodeRRR(0x9B407C00, a, b, c);
-        else if (instr == "umulh")  w = encodeRRR(0x9BC07C00, a, b, c);
-        else if (instr == "sdiv")   w = encodeRRR(0x9AC00C00, a, b, c);
-        else if (instr == "udiv")   w = encodeRRR(0x9AC00800, a, b, c);
+        if      (instr == "add")    w = encodeRRR(ADD, a, b, c);
+        else if (instr == "sub")    w = encodeRRR(SUB, a, b, c);
+        else if (instr == "mul")    w = encodeRRR(MUL, a, b, c);
+        else if (instr == "smulh")  w = encodeRRR(SMULH, a, b, c);
+        else if (instr == "umulh")  w = encodeRRR(UMULH, a, b, c);
+        else if (instr == "sdiv")   w = encodeRRR(SDIV, a, b, c);
+        else if (instr == "udiv")   w = encodeRRR(UDIV, a, b, c);
         else if (instr == "cmp")    w = encodeCmp(a, b);
-        else if (instr == "br")     w = encodeBranchReg(0xD61F0000, a);
-        else if (instr == "blr")    w = encodeBranchReg(0xD63F0000, a);
-        else if (instr == "ldur")   w = encodeMem(0xF8400000, a, b, c);
-        else if (instr == "stur")   w = encodeMem(0xF8000000, a, b, c);
+        else if (instr == "cmp.imm") w = encodeCmpImm(a, b);
+        else if (instr == "neg")    w = encodeRRR(SUB_SHIFTED, a, 31, b);   // sub xd, xzr, xm
+        else if (instr == "mov")    w = encodeRRR(ORR_SHIFTED, a, 31, b);   // orr xd, xzr, xm
+        else if (instr == "nop")    w = NOP;
+        else if (instr == "br")     w = encodeBranchReg(BR, a);
+        else if (instr == "blr")    w = encodeBranchReg(BLR, a);
+        else if (instr == "ldur")   w = encodeMem(LDUR, a, b, c);
+        else if (instr == "stur")   w = encodeMem(STUR, a, b, c);
         else if (instr == "ldr")    w = encodeLdr(a, b);
+        else if (instr == "ldr.uoff") w = encodeMemUOff(LDR_UOFF, LDUR, a, b, c);
+        else if (instr == "str.uoff") w = encodeMemUOff(STR_UOFF, STUR, a, b, c);
+        else if (instr == "ldr.pre")  w = encodeMemIndexed(LDR_PRE, a, b, c);
+        else if (instr == "str.pre")  w = encodeMemIndexed(STR_PRE, a, b, c);
+        else if (instr == "ldr.post") w = encodeMemIndexed(LDR_POST, a, b, c);
+        else if (instr == "str.post") w = encodeMemIndexed(STR_POST, a, b, c);
+        else if (instr == "ldr.reg")  w = encodeMemReg(LDR_REG, a, b, c, d);
+        else if (instr == "str.reg")  w = encodeMemReg(STR_REG, a, b, c, d);
+        else if (instr == "ldp")      w = encodePair(LDP, a, b, c, d, false);
+        else if (instr == "stp")      w = encodePair(STP, a, b, c, d, false);
+        else if (instr == "ldp.pre")  w = encodePair(LDP_PRE, a, b, c, d, true);
+        else if (instr == "stp.pre")  w = encodePair(STP_PRE, a, b, c, d, true);
+        else if (instr == "ldp.post") w = encodePair(LDP_POST, a, b, c, d, true);
+        else if (instr == "stp.post") w = encodePair(STP_POST, a, b, c, d, true);
+        else if (instr == "csel")   w = encodeCondSel(CSEL, a, b, c, d);
+        else if (instr == "csinc")  w = encodeCondSel(CSINC, a, b, c, d);
+        else if (instr == "csneg")  w = encodeCondSel(CSNEG, a, b, c, d);
+        else if (instr == "cset")   w = encodeCset(a, b);
+        else if (instr == "cbz")    w = encodeCompareBranch(CBZ, a, b);
+        else if (instr == "cbnz")   w = encodeCompareBranch(CBNZ, a, b);
+        else if (instr == "tbz")    w = encodeTestBranch(TBZ, a, b, c);
+        else if (instr == "tbnz")   w = encodeTestBranch(TBNZ, a, b, c);
         else if (instr == "b")      w = encodeBranch(a);
+        else if (instr == "bl")     w = encodeBranchLink(a);
         else if (instr == "b.cond") w = encodeBCond(a, b);
-        else throw std::runtime_error("Unknown instruction: " + instr);
+        else if (instr == "add.v")  w = encodeVec3(ADD_V, a, b, c);
+        else if (instr == "sub.v")  w = encodeVec3(SUB_V, a, b, c);
+        else if (instr == "mul.v")  w = encodeVec3(MUL_V, a, b, c);
+        else if (instr == "ld1")      w = encodeVecMem(LD1, a, b);
+        else if (instr == "st1")      w = encodeVecMem(ST1, a, b);
+        else if (instr == "ld1.post") w = encodeVecMemPost(LD1_POST, a, b, c);
+        else if (instr == "st1.post") w = encodeVecMemPost(ST1_POST, a, b, c);
+        else throw std::runtime_error("Unknown instruction: " + std::string(instr));
         return w;
     }
 
     // ---- helpers ----
 
-    static bool validRegister(int r) { return 0 <= r && r <= 31; }
+    static constexpr bool validRegister(int r) { return 0 <= r && r <= 31; }
 
-    static bool validSignedImm(int v, int bits) {
+    static constexpr bool validSignedImm(int v, int bits) {
         int lo = -(1 << (bits - 1));
         int hi =  (1 << (bits - 1)) - 1;
         return lo <= v && v <= hi;
     }
 
-    static int readImm(const std::string &s) {
-        if (s.size() > 2 && s[0] == '0' && (s[1] == 'x' || s[1] == 'X'))
-            return std::stoi(s.substr(2), nullptr, 16);
-        return std::stoi(s);
+    // readImm/readReg parse in place (no substr temporaries).
+
+    static int readImm(std::string_view s) {
+        int base = 10;
+        std::string_view digits = s;
+        if (s.size() > 2 && s[0] == '0' && (s[1] == 'x' || s[1] == 'X')) {
+            base = 16;
+            digits = s.substr(2);
+        } else if (!s.empty() && s[0] == '+') {
+            digits = s.substr(1);
+        }
+        int v = 0;
+        auto [end, ec] = std::from_chars(digits.data(), digits.data() + digits.size(), v, base);
+        if (ec == std::errc::result_out_of_range)
+            throw std::runtime_error("Immediate out of range: " + std::string(s));
+        if (ec != std::errc() || end == digits.data())
+            throw std::runtime_error("Invalid immediate: " + std::string(s));
+        return v;
     }
 
-    static uint32_t readReg(const std::string &s) {
+    static uint32_t readReg(std::string_view s) {
         if (s == "xzr" || s == "sp") return 31;
-        if (s[0] != 'x')
-            throw std::runtime_error("Invalid register: " + s);
-        int v = std::stoi(s.substr(1));
-        if (v < 0 || v > 30)
-            throw std::runtime_error("Register out of range: " + s);
+        if (s.empty() || s[0] != 'x')
+            throw std::runtime_error("Invalid register: " + std::string(s));
+        int v = -1;
+        auto [end, ec] = std::from_chars(s.data() + 1, s.data() + s.size(), v);
+        if (ec != std::errc() || end != s.data() + s.size() || v < 0 || v > 30)
+            throw std::runtime_error("Register out of range: " + std::string(s));
         return static_cast<uint32_t>(v);
     }
 
     // ---- binary output ----
 
-    static void emit32le(uint32_t w) {
-        std::cout.put(static_cast<char>(w & 0xFF));
-        std::cout.put(static_cast<char>((w >>  8) & 0xFF));
-        std::cout.put(static_cast<char>((w >> 16) & 0xFF));
-        std::cout.put(static_cast<char>((w >> 24) & 0xFF));
+    static void emit32le(std::vector<uint8_t> &out, uint32_t w) {
+        out.push_back(static_cast<uint8_t>(w & 0xFF));
+        out.push_back(static_cast<uint8_t>((w >>  8) & 0xFF));
+        out.push_back(static_cast<uint8_t>((w >> 16) & 0xFF));
+        out.push_back(static_cast<uint8_t>((w >> 24) & 0xFF));
     }
 
-    static void emit64le(uint64_t w) {
+    static void emit64le(std::vector<uint8_t> &out, uint64_t w) {
         for (int i = 0; i < 8; ++i)
-            std::cout.put(static_cast<char>((w >> (8 * i)) & 0xFF));
+            out.push_back(static_cast<uint8_t>((w >> (8 * i)) & 0xFF));
     }
 
-private:
-    static void requireReg(int r) {
-        if (!validRegister(r))
-            throw std::runtime_error("Invalid register value");
-    }
+    // ---- typed encoders ----
+    // encode() dispatches to these by mnemonic; MacroAssembler calls them
+    // directly.
 
-    static uint32_t encodeRRR(uint32_t base, int rd, int rn, int rm) {
+    static constexpr uint32_t encodeRRR(uint32_t base, int rd, int rn, int rm) {
         requireReg(rd); requireReg(rn); requireReg(rm);
         return base | rd | (rn << 5) | (rm << 16);
     }
 
-    static uint32_t encodeCmp(int rn, int rm) {
+    static constexpr uint32_t encodeCmp(int rn, int rm) {
         requireReg(rn); requireReg(rm);
         return 0xEB20601F | (rn << 5) | (rm << 16);
     }
 
-    static uint32_t encodeBranchReg(uint32_t base, int rn) {
+    /// cmp xn|sp, #imm  (12-bit unsigned immediate)
+    static constexpr uint32_t encodeCmpImm(int rn, int imm) {
+        requireReg(rn);
+        if (imm < 0 || imm > 4095)
+            throw std::runtime_error("cmp immediate out of range (0..4095)");
+        return CMP_IMM | (static_cast<uint32_t>(imm) << 10) | (rn << 5);
+    }
+
+    static constexpr uint32_t encodeBranchReg(uint32_t base, int rn) {
         requireReg(rn);
         return base | (rn << 5);
     }
 
-    static uint32_t encodeMem(uint32_t base, int rt, int rn, int imm) {
+    static constexpr uint32_t encodeMem(uint32_t base, int rt, int rn, int imm) {
         requireReg(rt); requireReg(rn);
         if (!validSignedImm(imm, 9))
             throw std::runtime_error("Immediate out of range for ldur/stur");
@@ -99,7 +191,55 @@ private:
         return base | rt | (rn << 5) | (imm9 << 12);
     }
 
-    static uint32_t encodeLdr(int rd, int offset) {
+    /// Scaled 12-bit unsigned offset ([xn, #imm], imm = 0..32760, multiple
+    /// of 8).  Other offsets in the signed 9-bit range fall back to the
+    /// unscaled ldur/stur encoding, as other assemblers do.
+    static constexpr uint32_t encodeMemUOff(uint32_t base, uint32_t unscaled,
+                                            int rt, int rn, int imm) {
+        requireReg(rt); requireReg(rn);
+        if (imm >= 0 && imm % 8 == 0 && imm / 8 < 4096)
+            return base | rt | (rn << 5) | (static_cast<uint32_t>(imm / 8) << 10);
+        if (validSignedImm(imm, 9))
+            return encodeMem(unscaled, rt, rn, imm);
+        throw std::runtime_error("Immediate out of range for ldr/str");
+    }
+
+    /// Pre-/post-index writeback ([xn, #imm]! / [xn], #imm), signed 9-bit.
+    static constexpr uint32_t encodeMemIndexed(uint32_t base, int rt, int rn, int imm) {
+        requireReg(rt); requireReg(rn);
+        if (rt == rn && rn != 31)
+            throw std::runtime_error("Writeback base must differ from the transfer register");
+        if (!validSignedImm(imm, 9))
+            throw std::runtime_error("Immediate out of range for pre/post-index");
+        uint32_t imm9 = static_cast<uint32_t>(imm) & 0x1FF;
+        return base | rt | (rn << 5) | (imm9 << 12);
+    }
+
+    /// Register offset [xn, xm] or [xn, xm, lsl #3].
+    static constexpr uint32_t encodeMemReg(uint32_t base, int rt, int rn, int rm, int shift) {
+        requireReg(rt); requireReg(rn); requireReg(rm);
+        if (shift != 0 && shift != 3)
+            throw std::runtime_error("Register offset shift must be lsl #0 or lsl #3");
+        return base | rt | (rn << 5) | (rm << 16) | (shift ? (1u << 12) : 0u);
+    }
+
+    /// ldp/stp with a signed 7-bit offset scaled by 8 (-512..504).
+    static constexpr uint32_t encodePair(uint32_t base, int rt, int rt2, int rn, int imm,
+                                         bool writeback) {
+        requireReg(rt); requireReg(rt2); requireReg(rn);
+        if (imm % 8)
+            throw std::runtime_error("ldp/stp offset must be divisible by 8");
+        if (!validSignedImm(imm / 8, 7))
+            throw std::runtime_error("ldp/stp offset out of range");
+        if (writeback && rn != 31 && (rt == rn || rt2 == rn))
+            throw std::runtime_error("Writeback base must differ from the transfer registers");
+        if ((base & 0x00400000) && rt == rt2)
+            throw std::runtime_error("ldp destination registers must differ");
+        uint32_t imm7 = static_cast<uint32_t>(imm / 8) & 0x7F;
+        return base | rt | (rt2 << 10) | (rn << 5) | (imm7 << 15);
+    }
+
+    static constexpr uint32_t encodeLdr(int rd, int offset) {
         if (offset % 4)
             throw std::runtime_error("ldr offset must be divisible by 4");
         requireReg(rd);
@@ -109,7 +249,7 @@ private:
         return 0x58000000 | rd | (imm19 << 5);
     }
 
-    static uint32_t encodeBranch(int offset) {
+    static constexpr uint32_t encodeBranch(int offset) {
         if (offset % 4)
             throw std::runtime_error("b offset must be divisible by 4");
         if (!validSignedImm(offset / 4, 26))
@@ -118,7 +258,12 @@ private:
         return 0x14000000 | imm26;
     }
 
-    static uint32_t encodeBCond(int cond, int offset) {
+    /// bl label: like b, and sets x30 to the return address.
+    static constexpr uint32_t encodeBranchLink(int offset) {
+        return encodeBranch(offset) | 0x80000000;
+    }
+
+    static constexpr uint32_t encodeBCond(int cond, int offset) {
         if (offset % 4)
             throw std::runtime_error("b.cond offset must be divisible by 4");
         if (!validSignedImm(offset / 4, 19))
@@ -128,4 +273,90 @@ private:
         uint32_t imm19 = static_cast<uint32_t>(offset / 4) & 0x7FFFF;
         return 0x54000000 | (imm19 << 5) | (cond & 0x1F);
     }
+
+    /// csel / csinc / csneg xd, xn, xm, cond
+    static constexpr uint32_t encodeCondSel(uint32_t base, int rd, int rn, int rm, int cond) {
+        requireReg(rd); requireReg(rn); requireReg(rm); requireCond(cond);
+        return base | rd | (rn << 5) | (cond << 12) | (rm << 16);
+    }
+
+    /// cset xd, cond  ==  csinc xd, xzr, xzr, !cond
+    static constexpr uint32_t encodeCset(int rd, int cond) {
+        requireCond(cond);
+        return encodeCondSel(CSINC, rd, 31, 31, cond ^ 1);
+    }
+
+    /// cbz / cbnz xt, label  (19-bit word offset, like b.cond)
+    static constexpr uint32_t encodeCompareBranch(uint32_t base, int rt, int offset) {
+        requireReg(rt);
+        if (offset % 4)
+            throw std::runtime_error("cbz/cbnz offset must be divisible by 4");
+        if (!validSignedImm(offset / 4, 19))
+            throw std::runtime_error("cbz/cbnz offset out of range");
+        uint32_t imm19 = static_cast<uint32_t>(offset / 4) & 0x7FFFF;
+        return base | rt | (imm19 << 5);
+    }
+
+    /// tbz / tbnz xt, #bit, label  (14-bit word offset, +-32KB)
+    static constexpr uint32_t encodeTestBranch(uint32_t base, int rt, int bit, int offset) {
+        requireReg(rt);
+        if (bit < 0 || bit > 63)
+            throw std::runtime_error("tbz/tbnz bit number must be 0..63");
+        if (offset % 4)
+            throw std::runtime_error("tbz/tbnz offset must be divisible by 4");
+        if (!validSignedImm(offset / 4, 14))
+            throw std::runtime_error("tbz/tbnz offset out of range");
+        uint32_t imm14 = static_cast<uint32_t>(offset / 4) & 0x3FFF;
+        return base | (static_cast<uint32_t>(bit >> 5) << 31) |
+               (static_cast<uint32_t>(bit & 31) << 19) | (imm14 << 5) | rt;
+    }
+
+    // ---- NEON ----
+    // Vector operands are findVectorReg() values: register | q << 5 | size << 6.
+
+    /// add / sub / mul vd.T, vn.T, vm.T.  mul has no .2d form.
+    static constexpr uint32_t encodeVec3(uint32_t base, int vd, int vn, int vm) {
+        requireVec(vd); requireVec(vn); requireVec(vm);
+        if ((vd >> 5) != (vn >> 5) || (vd >> 5) != (vm >> 5))
+            throw std::runtime_error("Vector operands must have the same arrangement");
+        if (base == MUL_V && (vd >> 6) == 3)
+            throw std::runtime_error("mul has no .2d arrangement");
+        return base | vecBits(vd, 22) | ((vm & 31) << 16) | ((vn & 31) << 5) | (vd & 31);
+    }
+
+    /// ld1 / st1 {vt.T}, [xn]
+    static constexpr uint32_t encodeVecMem(uint32_t base, int vt, int rn) {
+        requireVec(vt); requireReg(rn);
+        return base | vecBits(vt, 10) | (rn << 5) | (vt & 31);
+    }
+
+    /// ld1 / st1 {vt.T}, [xn], #imm  -- imm must be the register size
+    static constexpr uint32_t encodeVecMemPost(uint32_t base, int vt, int rn, int imm) {
+        requireVec(vt); requireReg(rn);
+        if (imm != (((vt >> 5) & 1) ? 16 : 8))
+            throw std::runtime_error("ld1/st1 post-index must be the register size (8 or 16)");
+        return base | vecBits(vt, 10) | (rn << 5) | (vt & 31);
+    }
+
+private:
+    /// Q at bit 30 and the element size at `sizeShift`.
+    static constexpr uint32_t vecBits(int v, int sizeShift) {
+        return (static_cast<uint32_t>((v >> 5) & 1) << 30) |
+               (static_cast<uint32_t>(v >> 6) << sizeShift);
+    }
+
+    static constexpr void requireVec(int v) {
+        if (v < 0 || v >= 256)
+            throw std::runtime_error("Invalid vector register value");
+    }
+
+    static constexpr void requireCond(int cond) {
+        if (cond < 0 || cond > 13)
+            throw std::runtime_error("Invalid condition code");
+    }
+
+    static constexpr void requireReg(int r) {
+        if (!validRegister(r))
+            throw std::runtime_error("Invalid register value");
+    }
 };
@@ -0,0 +1,193 @@
+#pragma once
+
+#include "token.h"
+
+#include <cstdint>
+#include <optional>
+#include <stdexcept>
+#include <string>
+
+/// Operand expressions: integers and labels combined with
+///
+///   unary - +     *     binary + -     << >>     &     |
+///
+/// from tightest to loosest binding (as in C), and parentheses.  `>>` is
+/// an arithmetic shift; arithmetic wraps at 64 bits.
+///
+/// A value counts the label addresses in it: `end - start` is a plain
+/// number (labels 0) and `table + 8` an address (labels 1).  Only + and -
+/// may take an operand that holds a label.  The lexer folds expressions
+/// without labels into one INT token; the rest are evaluated by the
+/// Assembler in pass 2, once every label has an address.
+class Expr {
+public:
+    struct Value {
+        int64_t value = 0;
+        int labels = 0;
+    };
+
+    /// Can `t` begin an expression?
+    static bool isStart(const Token &t) {
+        return t.type == INT || t.type == HEXINT || t.type == ID || t.type == LPAREN ||
+               t.type == MINUS || t.type == PLUS;
+    }
+
+    static bool isOperator(TokenType t) {
+        return t == PLUS || t == MINUS || t == STAR || t == LSHIFT || t == RSHIFT ||
+               t == AMP || t == PIPE;
+    }
+
+    /// Is the operand at line[ti] more than a single number or label?
+    static bool isCompound(const TokenList &line, size_t ti) {
+        if (ti >= line.size()) return false;
+        if (line[ti].type == LPAREN || isOperator(line[ti].type)) return true;
+        return ti + 1 < line.size() && isOperator(line[ti + 1].type);
+    }
+
+    /// Parse the expression at line[ti], advancing `ti` past it.
+    /// `lookup(name)` gives a label's address, or nullopt if it has none.
+    /// Returns an error message, or an empty string on success.
+    template <class Lookup>
+    static std::string parse(const TokenList &line, size_t &ti, const Lookup &lookup, Value &out) {
+        Parser<Lookup> p{line, ti, lookup, {}};
+        out = p.bitOr();
+        ti = p.i;
+        return p.error;
+    }
+
+    /// Replace every label-free expression of two or more tokens in
+    /// line[begin...] with one INT token.  An expression starts right
+    /// after the mnemonic, a directive or condition, a comma or a '['.
+    static void foldConstants(TokenList &line, size_t begin) {
+        auto noLabels = [](const std::string &) -> std::optional<uint64_t> { return std::nullopt; };
+        for (size_t i = begin + 1; i < line.size(); ++i) {
+            TokenType prev = line[i - 1].type;
+            if (!(i == begin + 1 || prev == COMMA || prev == LBRACK || prev == DOTID)) continue;
+            if (!isStart(line[i]) || !isCompound(line, i)) continue;
+            size_t end = i;
+            Value v;
+            if (!parse(line, end, noLabels, v).empty()) continue;
+            line[i] = {INT, std::to_string(v.value)};
+            line.erase(line.begin() + static_cast<long>(i) + 1, line.begin() + static_cast<long>(end));
+        }
+    }
+
+private:
+    template <class Lookup>
+    struct Parser {
+        const TokenList &line;
+        size_t i;
+        const Lookup &lookup;
+        std::string error;
+
+        bool at(TokenType t) const { return error.empty() && i < line.size() && line[i].type == t; }
+
+        Value fail(std::string msg) {
+            if (error.empty()) error = std::move(msg);
+            return {};
+        }
+
+        /// Both operands of `op` must be plain numbers.
+        bool numbers(const Value &a, const Value &b, const char *op) {
+            if (a.labels == 0 && b.labels == 0) return true;
+            fail(std::string("A label address cannot be an operand of '") + op + "'");
+            return false;
+        }
+
+        static int64_t wrap(uint64_t v) { return static_cast<int64_t>(v); }
+
+        Value bitOr() {
+            Value a = bitAnd();
+            while (at(PIPE)) {
+                ++i;
+                Value b = bitAnd();
+                if (numbers(a, b, "|")) a.value |= b.value;
+            }
+            return a;
+        }
+
+        Value bitAnd() {
+            Value a = shift();
+            while (at(AMP)) {
+                ++i;
+                Value b = shift();
+                if (numbers(a, b, "&")) a.value &= b.value;
+            }
+            return a;
+        }
+
+        Value shift() {
+            Value a = sum();
+            while (at(LSHIFT) || at(RSHIFT)) {
+                bool left = line[i++].type == LSHIFT;
+                Value b = sum();
+                if (!numbers(a, b, left ? "<<" : ">>")) break;
+                if (b.value < 0 || b.value > 63) return fail("Shift amount must be 0..63");
+                a.value = left ? wrap(static_cast<uint64_t>(a.value) << b.value) : a.value >> b.value;
+            }
+            return a;
+        }
+
+        Value sum() {
+            Value a = product();
+            while (at(PLUS) || at(MINUS)) {
+                bool plus = line[i++].type == PLUS;
+                Value b = product();
+                uint64_t x = static_cast<uint64_t>(a.value), y = static_cast<uint64_t>(b.value);
+                a.value = wrap(plus ? x + y : x - y);
+                a.labels += plus ? b.labels : -b.labels;
+            }
+            return a;
+        }
+
+        Value product() {
+            Value a = unary();
+            while (at(STAR)) {
+                ++i;
+                Value b = unary();
+                if (numbers(a, b, "*"))
+                    a.value = wrap(static_cast<uint64_t>(a.value) * static_cast<uint64_t>(b.value));
+            }
+            return a;
+        }
+
+        Value unary() {
+            if (at(PLUS)) { ++i; return unary(); }
+            if (at(MINUS)) {
+                ++i;
+                Value v = unary();
+                return {wrap(0 - static_cast<uint64_t>(v.value)), -v.labels};
+            }
+            return primary();
+        }
+
+        Value primary() {
+            if (!error.empty()) return {};
+            if (i >= line.size()) return fail("Expected expression");
+            const Token &t = line[i];
+            if (t.type == LPAREN) {
+                ++i;
+                Value v = bitOr();
+                if (!at(RPAREN)) return fail("Expected ')'");
+                ++i;
+                return v;
+            }
+            if (t.type == INT || t.type == HEXINT) {
+                ++i;
+                try {
+                    if (t.lexeme[0] == '-') return {std::stoll(t.lexeme, nullptr, 0), 0};
+                    return {wrap(std::stoull(t.lexeme, nullptr, 0)), 0};
+                } catch (const std::exception &) {
+                    return fail("Number out of range: " + t.lexeme);
+                }
+            }
+            if (t.type == ID) {
+                ++i;
+                auto addr = lookup(t.lexeme);
+                if (!addr) return fail("Undefined label: " + t.lexeme);
+                return {wrap(*addr), 1};
+            }
+            return fail("Expected number, label or '(', got: " + t.lexeme);
+        }
+    };
+};
@@ -0,0 +1,115 @@
+#pragma once
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+#include <sys/stat.h>
+
+/// Included files, each lexed or parsed once per process.  An entry is
+/// keyed by the file's real path and remembers its modification time and
+/// size; while both are unchanged the cached value is reused without
+/// reading the file.  When they change the file is read again, and it is
+/// only lexed again if its contents hash differently.  `asm --batch` keeps
+/// one cache for all its programs, so a fragment they share is lexed once.
+template <class Parsed>
+class FileCache {
+public:
+    struct Stats {
+        size_t hits = 0;      // includes served from the cache
+        size_t loads = 0;     // files lexed or parsed
+    };
+
+    /// Resolve `name` the way an include in file `from` means it: relative
+    /// names are relative to the directory of `from` (or the working
+    /// directory if `from` is empty or has none).
+    static std::string resolve(std::string_view name, std::string_view from) {
+        std::string path(name);
+        size_t slash = from.rfind('/');
+        if (!name.empty() && name[0] != '/' && slash != std::string_view::npos)
+            path = std::string(from.substr(0, slash + 1)) + path;
+        char *real = ::realpath(path.c_str(), nullptr);
+        if (!real) throw std::runtime_error("Cannot open include file: " + std::string(name));
+        std::string out(real);
+        std::free(real);
+        return out;
+    }
+
+    /// The value for the file at `path` (as given by resolve()): cached if
+    /// the file is unchanged and `valid(value)` holds, else `build(text)`.
+    template <class Build, class Valid>
+    const Parsed &get(const std::string &path, Build &&build, Valid &&valid) {
+        struct stat st;
+        if (::stat(path.c_str(), &st) != 0)
+            throw std::runtime_error("Cannot open include file: " + path + ": " + std::strerror(errno));
+        Stamp stamp{mtime(st), static_cast<uint64_t>(st.st_size)};
+
+        auto it = files_.find(path);
+        if (it != files_.end() && it->second.stamp == stamp && valid(it->second.value)) {
+            ++stats_.hits;
+            return it->second.value;
+        }
+        std::ifstream in(path, std::ios::binary);
+        std::string text{std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>()};
+        if (!in && !in.eof()) throw std::runtime_error("Cannot read include file: " + path);
+        uint64_t h = hash(text);
+        if (it != files_.end() && it->second.hash == h && valid(it->second.value)) {
+            it->second.stamp = stamp;       // touched, not changed
+            ++stats_.hits;
+            return it->second.value;
+        }
+        Parsed value = build(std::string_view(text));
+        ++stats_.loads;
+        Entry &e = files_[path];
+        e = {stamp, h, std::move(value)};
+        return e.value;
+    }
+
+    template <class Build>
+    const Parsed &get(const std::string &path, Build &&build) {
+        return get(path, build, [](const Parsed &) { return true; });
+    }
+
+    const Stats &stats() const { return stats_; }
+
+    /// FNV-1a.
+    static uint64_t hash(std::string_view s) {
+        uint64_t h = 14695981039346656037ull;
+        for (unsigned char c : s) {
+            h ^= c;
+            h *= 1099511628211ull;
+        }
+        return h;
+    }
+
+private:
+    struct Stamp {
+        int64_t mtime;       // nanoseconds
+        uint64_t size;
+        bool operator==(const Stamp &) const = default;
+    };
+
+    struct Entry {
+        Stamp stamp;
+        uint64_t hash;
+        Parsed value;
+    };
+
+    std::unordered_map<std::string, Entry> files_;
+    Stats stats_;
+
+    static int64_t mtime(const struct stat &st) {
+#ifdef __APPLE__
+        return static_cast<int64_t>(st.st_mtimespec.tv_sec) * 1000000000 + st.st_mtimespec.tv_nsec;
+#else
+        return static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+#endif
+    }
+};
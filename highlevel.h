@@ -1,229 +1,923 @@
 #pragma once
 
 #include "ir.h"
+#include "file_cache.h"
 
-#include <vector>
-#include <string>
-#include <sstream>
-#include <istream>
-#include <cctype>
 #include <algorithm>
+#include <charconv>
+#include <cstdio>
+#include <cstdint>
+#include <istream>
+#include <memory_resource>
 #include <stdexcept>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
 
 /// Parses high-level pseudocode into a target-independent IR.
 ///
-/// Supported syntax (one statement per line):
+/// Statements end at a newline or `;` (newlines inside parentheses are
+/// ignored); `#` starts a comment that runs to the end of the line.
 ///
 ///   label <name>                         →  LABEL
-///   <xd> = <xn> + <xm>                  →  ADD
-///   <xd> = <xn> - <xm>                  →  SUB
-///   <xd> = <xn> * <xm>                  →  MUL
-///   <xd> = <xn> / <xm>                  →  DIV
-///   <xd> = <xn> % <xm>                  →  MOD
-///   <xd> = <xn>                          →  MOV
-///   <xd> = *<xn>                         →  LOAD (offset 0)
-///   <xd> = *(<xn> + <imm>)              →  LOAD
-///   *<xn> = <xd>                         →  STORE (offset 0)
-///   *(<xn> + <imm>) = <xd>              →  STORE
-///   if <xn> <cmp> <xm> goto <label>     →  CMP_BRANCH
 ///   goto <label>                         →  BRANCH
-///   call <xn>                            →  CALL
+///   call <expr>                          →  CALL
+///   call <name>(<expr>, ...)             →  argument moves, CALL_DIRECT
+///   <xd> = call <name>(<expr>, ...)      →  ... and MOV xd, x0
 ///   ret                                  →  RET
+///   func <name>(<reg>, ...) { ... }      →  FUNC, parameter moves, body, ENDFUNC
+///   return [<expr>]                      →  MOV x0, <expr>; RET
 ///   .8byte <val>                         →  DATA8
+///   include "<file>"                     (top level) the file's IR
+///   <xd> = <expr>                        →  ADD/SUB/MUL/DIV/MOD/MOV/LOAD/SELECT
+///   *<addr> = <expr>                     →  STORE
+///   if <cond> goto <label>               →  CMP_BRANCH
+///   if <cond> { ... } [else { ... }]     →  CMP_BRANCH (negated), BRANCH
+///   if <cond> { ... } else if ...
+///   while <cond> { ... }                 →  BRANCH to the test, CMP_BRANCH back
+///   break / continue                     (innermost while)
+///
+/// Expressions are registers combined with + - * / % (usual precedence),
+/// unary -, parentheses, loads `*xn` / `*(<addr>)` and
+/// `<cond> ? <expr> : <expr>`, which evaluates both arms and picks one with
+/// SELECT.  <cond> is `<expr> <cmp> <expr>` with <cmp> one of
+/// == != < <= > >=.  An integer literal is either 0 (read as xzr) or an
+/// address offset:
 ///
-///  Lines starting with # are comments.
+///   *(<expr> + <imm>)   *(<expr> - <imm>)   *(<expr> + <expr>)   *(<expr> + <expr> * 8)
 ///
+/// Any other address is computed into a register first.
+///
+/// Functions follow AAPCS64: arguments arrive in x0-x7 and the result is
+/// returned in x0.  Parameter k names the register the body uses for
+/// argument k: either xk itself or a register outside x0-x7, which gets a
+/// move on entry.  Calls may clobber x0-x18; IRCodeGen saves the
+/// callee-saved registers a function writes (see ir_codegen.h).
+///
+/// Intermediate values live in temporaries taken from registers the
+/// program never mentions (x9-x17, then x19-x28, then x0-x8) and are freed
+/// at the end of each statement.  Generated labels start with `__`, which
+/// is reserved.
+///
+/// An included file is parsed on its own, once (see file_cache.h), and
+/// its IR is copied in place of the `include`.  Registers named by the
+/// file count as named by the program and the other way round, so neither
+/// side's temporaries touch the other's registers; a cached parse whose
+/// temporaries the including program names is parsed again.  The file's
+/// generated labels carry a suffix derived from its path, and each copy
+/// adds the number of the `include`, so a file may be included twice.
 class HighLevelParser {
 public:
-    static std::vector<IRInstruction> parse(std::istream &in) {
-        std::vector<IRInstruction> ir;
-        std::string line;
-        while (std::getline(in, line)) {
-            line = strip(line);
-            if (line.empty() || line[0] == '#') continue;
-            parseLine(line, ir);
-        }
-        return ir;
+    /// An included file's IR and the registers it uses.
+    struct Fragment {
+        IRProgram ir;
+        uint32_t named = 0;     // named by the file and the files it includes
+        uint32_t temps = 0;     // taken as temporaries
+    };
+    using Includes = FileCache<Fragment>;
+
+    /// `includes` keeps included files across calls (without it, across
+    /// this call); relative names are relative to `path`, the file read.
+    static IRProgram parse(std::istream &in,
+                           std::pmr::memory_resource *mr = std::pmr::get_default_resource(),
+                           Includes *includes = nullptr, const std::string &path = {}) {
+        std::string src;
+        char buf[1 << 16];
+        while (in.read(buf, sizeof buf) || in.gcount() > 0)
+            src.append(buf, static_cast<size_t>(in.gcount()));
+        Includes local;
+        Parser p(src, mr, includes ? *includes : local, path);
+        return p.program();
     }
 
 private:
-    static std::string strip(const std::string &s) {
-        size_t a = 0, b = s.size();
-        while (a < b && std::isspace(static_cast<unsigned char>(s[a]))) ++a;
-        while (b > a && std::isspace(static_cast<unsigned char>(s[b - 1]))) --b;
-        return s.substr(a, b - a);
-    }
+    enum class Tok { END, NEWLINE, IDENT, NUMBER, PUNCT, STRING };
 
-    static std::vector<std::string> split(const std::string &s) {
-        std::vector<std::string> out;
-        std::istringstream ss(s);
-        std::string w;
-        while (ss >> w) out.push_back(w);
-        return out;
+    struct Token {
+        Tok kind = Tok::END;
+        std::string_view text;
+        int line = 1;
+    };
+
+    [[noreturn]] static void fail(int line, const std::string &msg) {
+        throw std::runtime_error("line " + std::to_string(line) + ": " + msg);
     }
 
-    static bool isInteger(const std::string &s) {
-        if (s.empty()) return false;
-        size_t st = (s[0] == '-' || s[0] == '+') ? 1 : 0;
-        if (st >= s.size()) return false;
-        return std::all_of(s.begin() + st, s.end(),
-                           [](unsigned char c){ return std::isdigit(c); });
+    /// x0..x30 -> 0..30, anything else -> -1.
+    static int regNumber(std::string_view s) {
+        if (s.size() < 2 || s.size() > 3 || s[0] != 'x') return -1;
+        int v = -1;
+        auto [end, ec] = std::from_chars(s.data() + 1, s.data() + s.size(), v);
+        if (ec != std::errc() || end != s.data() + s.size() || v > 30) return -1;
+        return v;
     }
 
-    static bool isReg(const std::string &s) {
-        if (s == "xzr" || s == "sp") return true;
-        return s.size() >= 2 && s[0] == 'x' && std::isdigit(static_cast<unsigned char>(s[1]));
+    static bool isReg(std::string_view s) {
+        return s == "xzr" || s == "sp" || regNumber(s) >= 0;
     }
 
-    // ---------- line dispatcher ----------
+    static std::string str(std::string_view s) { return std::string(s); }
+
+    // ---------- tokenizer ----------
+
+    /// On-demand tokenizer with one token of lookahead.  Copyable, so the
+    /// parser can peek further and rewind by keeping a copy.
+    class Scanner {
+    public:
+        explicit Scanner(std::string_view src) : src_(src) { advance(); }
 
-    static void parseLine(const std::string &line, std::vector<IRInstruction> &ir) {
-        auto words = split(line);
-        if (words.empty()) return;
+        const Token &peek() const { return tok_; }
+        Token next() {
+            Token t = tok_;
+            advance();
+            return t;
+        }
 
-        // label <name>
-        if (words[0] == "label") {
-            if (words.size() < 2) throw std::runtime_error("label requires a name");
-            ir.push_back({IRInstruction::LABEL, words[1], {}, {}, {}, {}, {}});
-            return;
+        static bool isDigit(char c) { return '0' <= c && c <= '9'; }
+        static bool identStart(char c) {
+            return ('a' <= (c | 0x20) && (c | 0x20) <= 'z') || c == '_' || c == '.' || c == '$';
         }
+        static bool identChar(char c) { return identStart(c) || isDigit(c); }
+
+    private:
+        std::string_view src_;
+        size_t pos_ = 0;
+        int line_ = 1;
+        int parens_ = 0;
+        Token tok_;
+
+        void advance() {
+            for (;;) {
+                while (pos_ < src_.size() && (src_[pos_] == ' ' || src_[pos_] == '\t' || src_[pos_] == '\r'))
+                    ++pos_;
+                if (pos_ < src_.size() && src_[pos_] == '#')
+                    while (pos_ < src_.size() && src_[pos_] != '\n') ++pos_;
+                if (pos_ >= src_.size()) {
+                    tok_ = {Tok::END, {}, line_};
+                    return;
+                }
+                if (src_[pos_] != '\n') break;
+                ++pos_;
+                ++line_;
+                if (parens_ == 0) {
+                    tok_ = {Tok::NEWLINE, "\n", line_ - 1};
+                    return;
+                }
+            }
 
-        // goto <label>
-        if (words[0] == "goto") {
-            if (words.size() < 2) throw std::runtime_error("goto requires a label");
-            ir.push_back({IRInstruction::BRANCH, {}, {}, {}, words[1], {}, {}});
-            return;
+            size_t st = pos_;
+            char c = src_[pos_++];
+            Tok kind = Tok::PUNCT;
+            if (identStart(c)) {
+                while (pos_ < src_.size() && identChar(src_[pos_])) ++pos_;
+                kind = Tok::IDENT;
+            } else if (isDigit(c)) {
+                while (pos_ < src_.size() && identChar(src_[pos_])) ++pos_;
+                kind = Tok::NUMBER;
+            } else if (c == '"') {
+                size_t end = src_.find_first_of("\"\n", pos_);
+                if (end == std::string_view::npos || src_[end] != '"') fail(line_, "Unterminated string");
+                tok_ = {Tok::STRING, src_.substr(pos_, end - pos_), line_};
+                pos_ = end + 1;
+                return;
+            } else if ((c == '=' || c == '!' || c == '<' || c == '>') &&
+                       pos_ < src_.size() && src_[pos_] == '=') {
+                ++pos_;
+            } else if (std::string_view("(){}*+-/%=<>?:;,").find(c) == std::string_view::npos) {
+                fail(line_, std::string("Unexpected character '") + c + "'");
+            } else if (c == '(') {
+                ++parens_;
+            } else if (c == ')' && parens_ > 0) {
+                --parens_;
+            }
+            tok_ = {kind, src_.substr(st, pos_ - st), line_};
+        }
+    };
+
+    // ---------- parser ----------
+
+    class Parser {
+    public:
+        Parser(std::string_view src, std::pmr::memory_resource *mr, Includes &includes,
+               const std::string &path, int depth = 0, uint32_t outerNamed = 0)
+            : sc_(src), ir_(mr), nodes_(mr), src_(src), includes_(includes), path_(path), depth_(depth) {
+            // temporaries must not alias any register the program names
+            // (a character scan that skips comments; a stray match in a
+            // label name only costs a temporary)
+            for (size_t i = 0; i < src.size(); ++i) {
+                if (src[i] == '#') {
+                    i = src.find('\n', i);
+                    if (i == std::string_view::npos) break;
+                    continue;
+                }
+                if (src[i] != 'x' || (i > 0 && Scanner::identChar(src[i - 1]))) continue;
+                size_t e = i + 1;
+                while (e < src.size() && e < i + 4 && Scanner::isDigit(src[e])) ++e;
+                int r = (e == src.size() || !Scanner::identChar(src[e]))
+                            ? regNumber(src.substr(i, e - i)) : -1;
+                if (r >= 0) own_ |= 1u << r;
+            }
+            setNamed(own_ | outerNamed);
+            if (depth > 0) {
+                char hex[16];
+                std::snprintf(hex, sizeof hex, "_%08x", static_cast<uint32_t>(Includes::hash(path)));
+                suffix_ = hex;
+            }
         }
 
-        // call <reg>
-        if (words[0] == "call") {
-            if (words.size() < 2) throw std::runtime_error("call requires a register");
-            ir.push_back({IRInstruction::CALL, {}, words[1], {}, {}, {}, {}});
-            return;
+        IRProgram program() {
+            loadIncludes();
+            for (;;) {
+                skipSeparators();
+                const Token &t = sc_.peek();
+                if (t.kind == Tok::END) break;
+                if (is(t, "}")) fail(t.line, "Unexpected '}'");
+                if (peekWord("include")) includeStatement();
+                else statement();
+            }
+            return std::move(ir_);
         }
 
-        // ret
-        if (words[0] == "ret") {
-            ir.push_back({IRInstruction::RET, {}, {}, {}, {}, {}, {}});
-            return;
+        /// Parse an included file.
+        Fragment fragment() { return {program(), own_, temps_}; }
+
+    private:
+        /// Expression tree of the current statement, cleared per statement.
+        struct Node {
+            enum Kind { REG, NUM, NEG, BIN, LOAD, CMP, SEL } kind;
+            std::string_view text;      // register name or operator
+            int64_t value = 0;          // NUM
+            int a = -1, b = -1, c = -1; // operands (LOAD: address; SEL: cmp, then, else)
+            int line = 0;
+        };
+
+        struct Address {
+            std::string_view base, index;
+            int64_t imm = 0;
+            bool scaled = false;        // index * 8
+        };
+
+        struct Loop {
+            std::string continueLabel, breakLabel;
+        };
+
+        static constexpr std::string_view kTemps[] = {
+            "x9",  "x10", "x11", "x12", "x13", "x14", "x15", "x16", "x17",
+            "x19", "x20", "x21", "x22", "x23", "x24", "x25", "x26", "x27", "x28",
+            "x0",  "x1",  "x2",  "x3",  "x4",  "x5",  "x6",  "x7",  "x8",
+        };
+        static constexpr std::string_view kArgs[] = {"x0", "x1", "x2", "x3", "x4", "x5", "x6", "x7"};
+
+        Scanner sc_;
+        IRProgram ir_;
+        std::pmr::vector<Node> nodes_;
+        std::vector<Loop> loops_;
+        std::string func_;              // enclosing function, if any
+        bool named_[31] = {};
+        bool busy_[31] = {};
+        int labelCount_ = 0;
+
+        static constexpr int kMaxIncludeDepth = 64;
+
+        std::string_view src_;
+        Includes &includes_;
+        std::string path_;              // file being parsed, for relative includes
+        int depth_;                     // 0 for the program, n for a file it includes
+        uint32_t own_ = 0;              // registers named here or in included files
+        uint32_t temps_ = 0;            // registers taken as temporaries
+        std::string suffix_;            // of generated labels
+        int copies_ = 0;                // includes copied so far
+        std::vector<std::pair<std::string_view, const Fragment *>> fragments_;
+
+        // ---- token helpers ----
+
+        static bool is(const Token &t, std::string_view punct) {
+            return t.kind == Tok::PUNCT && t.text == punct;
+        }
+        bool peekIs(std::string_view punct) const { return is(sc_.peek(), punct); }
+        bool peekWord(std::string_view w) const {
+            return sc_.peek().kind == Tok::IDENT && sc_.peek().text == w;
         }
 
-        // .8byte <val>
-        if (words[0] == ".8byte") {
-            if (words.size() < 2) throw std::runtime_error(".8byte requires a value");
-            ir.push_back({IRInstruction::DATA8, {}, {}, {}, {}, {}, words[1]});
-            return;
+        void expect(std::string_view punct) {
+            Token t = sc_.next();
+            if (!is(t, punct)) fail(t.line, "Expected '" + str(punct) + "'");
         }
 
-        // if <xn> <op> <xm> goto <label>
-        if (words[0] == "if") {
-            if (words.size() < 6 || words[4] != "goto")
-                throw std::runtime_error("Syntax: if <reg> <op> <reg> goto <label>");
-            ir.push_back({IRInstruction::CMP_BRANCH, {}, words[1], words[3], words[5], words[2], {}});
-            return;
+        std::string_view expectIdent(const char *msg) {
+            Token t = sc_.next();
+            if (t.kind != Tok::IDENT) fail(t.line, msg);
+            return t.text;
         }
 
-        // --- assignment forms ---
-        auto eqPos = std::find(words.begin(), words.end(), "=");
-        if (eqPos == words.end())
-            throw std::runtime_error("Unrecognized statement: " + line);
-        size_t eqIdx = eqPos - words.begin();
+        void skipSeparators() {
+            while (sc_.peek().kind == Tok::NEWLINE || peekIs(";")) sc_.next();
+        }
 
-        // *xn = xd  or  *(xn + imm) = xd   → STORE
-        if (words[0][0] == '*') {
-            parseStore(words, eqIdx, ir);
-            return;
+        void endStatement() {
+            const Token &t = sc_.peek();
+            if (t.kind == Tok::NEWLINE || t.kind == Tok::END || is(t, ";") || is(t, "}")) return;
+            fail(t.line, "Unexpected '" + str(t.text) + "' after statement");
         }
 
-        if (eqIdx != 1)
-            throw std::runtime_error("Expected 'register = ...': " + line);
+        // ---- IR emission ----
 
-        std::string dest = words[0];
-        auto rhs = std::vector<std::string>(words.begin() + 2, words.end());
+        void emit(IRInstruction::Op op, std::string_view dst, std::string_view s1 = {},
+                  std::string_view s2 = {}) {
+            ir_.push_back({op, str(dst), str(s1), str(s2), {}, {}, {}});
+        }
+        void emitLabel(const std::string &name) {
+            ir_.push_back({IRInstruction::LABEL, name, {}, {}, {}, {}, {}});
+        }
+        void emitBranch(const std::string &target) {
+            ir_.push_back({IRInstruction::BRANCH, {}, {}, {}, target, {}, {}});
+        }
 
-        // xd = *xn  or  xd = *(xn + imm)  → LOAD
-        if (!rhs.empty() && rhs[0][0] == '*') {
-            parseLoad(dest, rhs, ir);
-            return;
+        std::string newLabel(const char *kind, int id) const {
+            return "__" + std::string(kind) + std::to_string(id) + suffix_;
         }
 
-        // xd = xn op xm
-        if (rhs.size() == 3 && isReg(rhs[0]) && isReg(rhs[2])) {
-            IRInstruction::Op op;
-            if      (rhs[1] == "+") op = IRInstruction::ADD;
-            else if (rhs[1] == "-") op = IRInstruction::SUB;
-            else if (rhs[1] == "*") op = IRInstruction::MUL;
-            else if (rhs[1] == "/") op = IRInstruction::DIV;
-            else if (rhs[1] == "%") op = IRInstruction::MOD;
-            else throw std::runtime_error("Unknown operator: " + rhs[1]);
-            ir.push_back({op, dest, rhs[0], rhs[2], {}, {}, {}});
-            return;
+        // ---- includes ----
+
+        uint32_t namedMask() const {
+            uint32_t m = 0;
+            for (int r = 0; r < 31; ++r)
+                if (named_[r]) m |= 1u << r;
+            return m;
         }
 
-        // xd = xn  (move)
-        if (rhs.size() == 1 && isReg(rhs[0])) {
-            ir.push_back({IRInstruction::MOV, dest, rhs[0], {}, {}, {}, {}});
-            return;
+        void setNamed(uint32_t mask) {
+            for (int r = 0; r < 31; ++r) named_[r] = named_[r] || (mask >> r & 1);
         }
 
-        throw std::runtime_error("Unrecognized assignment: " + line);
-    }
+        /// Parse or fetch every file included at the top level, until the
+        /// registers named on either side no longer change.
+        void loadIncludes() {
+            if (src_.find("include") == std::string_view::npos) return;
+            Scanner sc(src_);
+            bool start = true;
+            for (Token t = sc.next(); t.kind != Tok::END; t = sc.next()) {
+                if (start && t.kind == Tok::IDENT && t.text == "include" && sc.peek().kind == Tok::STRING) {
+                    if (depth_ == kMaxIncludeDepth) fail(t.line, "Includes nested too deeply");
+                    fragments_.push_back({sc.peek().text, nullptr});
+                }
+                start = t.kind == Tok::NEWLINE || is(t, ";") || is(t, "{") || is(t, "}");
+            }
+
+            std::vector<std::string> paths;
+            for (auto &f : fragments_) paths.push_back(Includes::resolve(f.first, path_));
+            for (bool changed = true; changed;) {
+                changed = false;
+                for (size_t k = 0; k < paths.size(); ++k) {
+                    const std::string &path = paths[k];
+                    uint32_t named = namedMask();
+                    const Fragment &f = includes_.get(
+                        path,
+                        [&](std::string_view text) {
+                            try {
+                                Parser p(text, std::pmr::get_default_resource(), includes_, path,
+                                         depth_ + 1, named);
+                                return p.fragment();
+                            } catch (const std::runtime_error &e) {
+                                // name the file the error is in, once
+                                if (std::string_view(e.what()).substr(0, 5) != "line ") throw;
+                                throw std::runtime_error(path + ": " + e.what());
+                            }
+                        },
+                        [&](const Fragment &f) { return !(f.temps & named); });
+                    fragments_[k].second = &f;
+                    own_ |= f.named;
+                    changed = changed || (f.named & ~named);
+                    setNamed(f.named);
+                }
+            }
+        }
+
+        void includeStatement() {
+            int line = sc_.next().line;
+            Token name = sc_.next();
+            if (name.kind != Tok::STRING) fail(line, "include needs a file name in quotes");
+            auto it = std::find_if(fragments_.begin(), fragments_.end(),
+                                   [&](auto &f) { return f.first.data() == name.text.data(); });
+            if (it == fragments_.end()) fail(line, "include must be at the top level");
+            // number the copy's generated labels, which are all defined in it
+            std::string copy = "_" + std::to_string(copies_++);
+            for (IRInstruction inst : it->second->ir) {
+                if (inst.op == IRInstruction::LABEL && inst.dst.starts_with("__")) inst.dst += copy;
+                if (inst.label.starts_with("__")) inst.label += copy;
+                ir_.push_back(std::move(inst));
+            }
+            temps_ |= it->second->temps;
+            endStatement();
+        }
+
+        // ---- temporaries ----
+
+        std::string_view temp(int line) {
+            for (auto t : kTemps) {
+                int r = regNumber(t);
+                if (!named_[r] && !busy_[r]) {
+                    busy_[r] = true;
+                    temps_ |= 1u << r;
+                    return t;
+                }
+            }
+            fail(line, "Expression needs more temporary registers than are free");
+        }
+
+        void release(std::string_view reg) {
+            int r = regNumber(reg);
+            if (r >= 0 && !named_[r]) busy_[r] = false;
+        }
+
+        std::string_view dest(std::string_view target, int line) {
+            return target.empty() ? temp(line) : target;
+        }
 
-    // ---------- load ----------
-
-    static void parseLoad(const std::string &dest,
-                          const std::vector<std::string> &rhs,
-                          std::vector<IRInstruction> &ir) {
-        std::string first = rhs[0].substr(1); // strip '*'
-        std::string base, offset = "0";
-
-        if (first.empty() || first[0] == '(') {
-            std::string combined = first;
-            for (size_t i = 1; i < rhs.size(); ++i) combined += " " + rhs[i];
-            if (combined.front() == '(') combined = combined.substr(1);
-            if (combined.back() == ')') combined.pop_back();
-
-            auto parts = split(combined);
-            if (parts.size() == 1) {
-                base = parts[0]; offset = "0";
-            } else if (parts.size() == 3 && parts[1] == "+") {
-                base = parts[0]; offset = parts[2];
+        // ---- statements ----
+
+        void statement() {
+            nodes_.clear();
+            for (bool &b : busy_) b = false;
+
+            Token t = sc_.next();
+            if (t.kind == Tok::IDENT && !isReg(t.text)) {
+                keywordStatement(t);
+            } else if (t.kind == Tok::IDENT) {
+                expect("=");
+                if (peekWord("call")) {
+                    int line = sc_.next().line;
+                    callStatement(line);
+                    if (t.text != "x0") emit(IRInstruction::MOV, t.text, "x0");
+                } else {
+                    assign(t.text, ternary());
+                }
+            } else if (is(t, "*")) {
+                int addr = unary();
+                expect("=");
+                store(addr, ternary());
+            } else if (is(t, "{")) {
+                blockBody();
             } else {
-                throw std::runtime_error("Bad load syntax");
+                fail(t.line, "Unrecognized statement: " + str(t.text));
             }
-        } else {
-            base = first;
+            endStatement();
         }
 
-        ir.push_back({IRInstruction::LOAD, dest, base, {}, {}, {}, offset});
-    }
+        void keywordStatement(const Token &t) {
+            if (t.text == "label") {
+                std::string_view name = expectIdent("label requires a name");
+                if (name.substr(0, 2) == "__") fail(t.line, "Labels starting with __ are reserved");
+                emitLabel(str(name));
+            } else if (t.text == "goto") {
+                emitBranch(str(expectIdent("goto requires a label")));
+            } else if (t.text == "call") {
+                callStatement(t.line);
+            } else if (t.text == "ret") {
+                emit(IRInstruction::RET, {});
+            } else if (t.text == "return") {
+                if (func_.empty()) fail(t.line, "return outside of a function");
+                const Token &n = sc_.peek();
+                if (n.kind != Tok::NEWLINE && n.kind != Tok::END && !is(n, ";") && !is(n, "}")) {
+                    std::string_view v = gen(ternary());
+                    if (v != "x0") emit(IRInstruction::MOV, "x0", v);
+                }
+                emit(IRInstruction::RET, {});
+            } else if (t.text == "func") {
+                funcStatement(t.line);
+            } else if (t.text == ".8byte") {
+                Token v = sc_.next();
+                std::string val;
+                if (is(v, "-")) {
+                    val = "-";
+                    v = sc_.next();
+                }
+                if (v.kind != Tok::NUMBER && !(v.kind == Tok::IDENT && val.empty()))
+                    fail(t.line, ".8byte requires a value");
+                val += v.text;
+                ir_.push_back({IRInstruction::DATA8, {}, {}, {}, {}, {}, val});
+            } else if (t.text == "include") {
+                fail(t.line, "include must be at the top level");
+            } else if (t.text == "if") {
+                ifStatement(t.line);
+            } else if (t.text == "while") {
+                whileStatement(t.line);
+            } else if (t.text == "break" || t.text == "continue") {
+                if (loops_.empty()) fail(t.line, str(t.text) + " outside of a loop");
+                emitBranch(t.text == "break" ? loops_.back().breakLabel
+                                             : loops_.back().continueLabel);
+            } else {
+                fail(t.line, "Unrecognized statement: " + str(t.text));
+            }
+        }
 
-    // ---------- store ----------
-
-    static void parseStore(const std::vector<std::string> &words, size_t eqIdx,
-                           std::vector<IRInstruction> &ir) {
-        std::string lhs;
-        for (size_t i = 0; i < eqIdx; ++i) {
-            if (i) lhs += " ";
-            lhs += words[i];
-        }
-        if (eqIdx + 1 >= words.size())
-            throw std::runtime_error("Missing value in store");
-        std::string val = words[eqIdx + 1];
-
-        lhs = lhs.substr(1); // strip '*'
-        std::string base, offset = "0";
-        if (lhs.empty() || lhs[0] == '(') {
-            if (lhs.front() == '(') lhs = lhs.substr(1);
-            if (lhs.back() == ')') lhs.pop_back();
-            auto parts = split(lhs);
-            if (parts.size() == 1) { base = parts[0]; offset = "0"; }
-            else if (parts.size() == 3 && parts[1] == "+") { base = parts[0]; offset = parts[2]; }
-            else throw std::runtime_error("Bad store syntax");
-        } else {
-            base = lhs;
-        }
-
-        ir.push_back({IRInstruction::STORE, base, val, {}, {}, {}, offset});
-    }
+        // ---- functions ----
+
+        void funcStatement(int line) {
+            if (!func_.empty() || !loops_.empty()) fail(line, "func must be at the top level");
+            std::string_view name = expectIdent("func requires a name");
+            if (name.substr(0, 2) == "__") fail(line, "Labels starting with __ are reserved");
+
+            std::vector<std::string_view> params;
+            expect("(");
+            while (!peekIs(")")) {
+                Token p = sc_.next();
+                if (p.kind != Tok::IDENT || regNumber(p.text) < 0)
+                    fail(p.line, "Function parameters must be registers");
+                params.push_back(p.text);
+                if (!peekIs(",")) break;
+                sc_.next();
+            }
+            expect(")");
+            if (params.size() > 8) fail(line, "At most 8 parameters (x0-x7) are supported");
+
+            ir_.push_back({IRInstruction::FUNC, str(name), {}, {}, {}, {}, {}});
+            for (size_t k = 0; k < params.size(); ++k) {
+                int r = regNumber(params[k]);
+                if (r == static_cast<int>(k)) continue;
+                if (r <= 7)
+                    fail(line, "Parameter " + std::to_string(k) + " must be x" + std::to_string(k) +
+                               " or a register outside x0-x7");
+                emit(IRInstruction::MOV, params[k], kArgs[k]);
+            }
+
+            func_ = str(name);
+            block();
+            IRInstruction::Op last = ir_.back().op;
+            if (last != IRInstruction::RET && last != IRInstruction::BRANCH)
+                emit(IRInstruction::RET, {});
+            ir_.push_back({IRInstruction::ENDFUNC, {}, {}, {}, {}, {}, {}});
+            func_.clear();
+        }
+
+        /// `call <expr>` (indirect) or `call <name>(<args>)` (direct, with the
+        /// arguments moved into x0-x7).
+        void callStatement(int line) {
+            const Token &t = sc_.peek();
+            if (t.kind == Tok::IDENT && !isReg(t.text)) {
+                std::string name = str(sc_.next().text);
+                std::vector<std::string_view> args;
+                if (peekIs("(")) {
+                    sc_.next();
+                    while (!peekIs(")")) {
+                        args.push_back(gen(ternary()));
+                        if (!peekIs(",")) break;
+                        sc_.next();
+                    }
+                    expect(")");
+                }
+                if (args.size() > 8) fail(line, "At most 8 arguments (x0-x7) are supported");
+                std::vector<std::string_view> slots(kArgs, kArgs + args.size());
+                parallelMove(slots, args, line);
+                ir_.push_back({IRInstruction::CALL_DIRECT, {}, {}, {}, name, {}, {}});
+                return;
+            }
+            if (t.kind != Tok::IDENT && !is(t, "*") && !is(t, "("))
+                fail(line, "call requires a register");
+            emit(IRInstruction::CALL, {}, gen(ternary()));
+        }
+
+        /// dst[k] = src[k] for all k at once: moves whose destination is
+        /// still needed as a source wait, and a cycle is broken through a
+        /// temporary.  Sources stay reserved until the statement ends, and
+        /// destinations are reserved too, so the temporary is neither.
+        void parallelMove(const std::vector<std::string_view> &dst,
+                          std::vector<std::string_view> src, int line) {
+            for (auto d : dst) busy_[regNumber(d)] = true;
+            std::vector<size_t> pending;
+            for (size_t k = 0; k < dst.size(); ++k)
+                if (dst[k] != src[k]) pending.push_back(k);
+            while (!pending.empty()) {
+                bool progress = false;
+                for (size_t p = 0; p < pending.size(); ++p) {
+                    size_t k = pending[p];
+                    bool needed = false;
+                    for (size_t q : pending) needed |= (q != k && src[q] == dst[k]);
+                    if (needed) continue;
+                    emit(IRInstruction::MOV, dst[k], src[k]);
+                    pending.erase(pending.begin() + static_cast<std::ptrdiff_t>(p));
+                    progress = true;
+                    break;
+                }
+                if (progress) continue;
+                // every pending destination is someone's source: a cycle
+                std::string_view old = src[pending[0]], t = temp(line);
+                emit(IRInstruction::MOV, t, old);
+                for (size_t q : pending)
+                    if (src[q] == old) src[q] = t;
+            }
+        }
+
+        void assign(std::string_view target, int root) {
+            const Node &e = nodes_[root];
+            if (e.kind == Node::REG || e.kind == Node::NUM)
+                emit(IRInstruction::MOV, target, gen(root));
+            else
+                gen(root, target);
+        }
+
+        void store(int addrNode, int valueNode) {
+            std::string_view v = gen(valueNode);
+            Address a = address(addrNode);
+            ir_.push_back({IRInstruction::STORE, str(a.base), str(v), str(a.index), {}, {},
+                           offset(a)});
+        }
+
+        void ifStatement(int line) {
+            int cond = ternary();
+            if (peekWord("goto")) {
+                sc_.next();
+                condBranch(cond, str(expectIdent("goto requires a label")), false, line);
+                return;
+            }
+            int id = labelCount_++;
+            std::string elseLabel = newLabel("else", id);
+            condBranch(cond, elseLabel, true, line);
+            block();
+
+            // `else` may sit on the line after the closing brace
+            Scanner save = sc_;
+            while (sc_.peek().kind == Tok::NEWLINE) sc_.next();
+            if (!peekWord("else")) {
+                sc_ = save;
+                emitLabel(elseLabel);
+                return;
+            }
+            int elseLine = sc_.next().line;
+            std::string endLabel = newLabel("endif", id);
+            emitBranch(endLabel);
+            emitLabel(elseLabel);
+            if (peekWord("if")) {
+                sc_.next();
+                nodes_.clear();
+                ifStatement(elseLine);
+            } else {
+                block();
+            }
+            emitLabel(endLabel);
+        }
+
+        /// Rotated loop: the test sits at the bottom, so each iteration takes
+        /// one conditional branch instead of a conditional and a jump.
+        void whileStatement(int line) {
+            int id = labelCount_++;
+            std::string bodyLabel = newLabel("loop", id), testLabel = newLabel("test", id),
+                        endLabel = newLabel("break", id);
+
+            // the test is parsed first but emitted after the body
+            IRProgram test(ir_.get_allocator());
+            std::swap(ir_, test);
+            condBranch(ternary(), bodyLabel, false, line);
+            std::swap(ir_, test);
+
+            emitBranch(testLabel);
+            emitLabel(bodyLabel);
+            loops_.push_back({testLabel, endLabel});
+            block();
+            loops_.pop_back();
+            emitLabel(testLabel);
+            for (auto &i : test) ir_.push_back(std::move(i));
+            emitLabel(endLabel);
+        }
+
+        void block() {
+            expect("{");
+            blockBody();
+        }
+
+        void blockBody() {
+            for (;;) {
+                skipSeparators();
+                const Token &t = sc_.peek();
+                if (t.kind == Tok::END) fail(t.line, "Missing '}'");
+                if (is(t, "}")) break;
+                statement();
+            }
+            sc_.next();
+        }
+
+        static std::string negate(std::string_view cmp) {
+            if (cmp == "==") return "!=";
+            if (cmp == "!=") return "==";
+            if (cmp == "<")  return ">=";
+            if (cmp == ">=") return "<";
+            if (cmp == ">")  return "<=";
+            return ">";     // <=
+        }
+
+        void condBranch(int n, const std::string &target, bool negated, int line) {
+            const Node c = nodes_[n];
+            if (c.kind != Node::CMP) fail(line, "Expected a comparison");
+            std::string_view l = gen(c.a), r = gen(c.b);
+            release(l);
+            release(r);
+            ir_.push_back({IRInstruction::CMP_BRANCH, {}, str(l), str(r), target,
+                           negated ? negate(c.text) : str(c.text), {}});
+        }
+
+        // ---- expressions (precedence climbing) ----
+
+        int node(Node n) {
+            nodes_.push_back(n);
+            return static_cast<int>(nodes_.size()) - 1;
+        }
+
+        int ternary() {
+            int cond = comparison();
+            if (!peekIs("?")) return cond;
+            int line = sc_.next().line;
+            int t = ternary();
+            expect(":");
+            int f = ternary();
+            return node({Node::SEL, "?", 0, cond, t, f, line});
+        }
+
+        int comparison() {
+            int l = additive();
+            const Token &t = sc_.peek();
+            if (t.kind == Tok::PUNCT && (t.text == "==" || t.text == "!=" || t.text == "<" ||
+                                         t.text == "<=" || t.text == ">" || t.text == ">=")) {
+                Token op = sc_.next();
+                int r = additive();
+                return node({Node::CMP, op.text, 0, l, r, -1, op.line});
+            }
+            return l;
+        }
+
+        int additive() {
+            int l = term();
+            while (peekIs("+") || peekIs("-")) {
+                Token op = sc_.next();
+                int r = term();
+                l = node({Node::BIN, op.text, 0, l, r, -1, op.line});
+            }
+            return l;
+        }
+
+        int term() {
+            int l = unary();
+            while (peekIs("*") || peekIs("/") || peekIs("%")) {
+                Token op = sc_.next();
+                int r = unary();
+                l = node({Node::BIN, op.text, 0, l, r, -1, op.line});
+            }
+            return l;
+        }
+
+        int unary() {
+            Token t = sc_.peek();
+            if (is(t, "-")) {
+                sc_.next();
+                if (sc_.peek().kind == Tok::NUMBER) {
+                    Token n = sc_.next();
+                    return node({Node::NUM, n.text, -number(n), -1, -1, -1, n.line});
+                }
+                return node({Node::NEG, "-", 0, unary(), -1, -1, t.line});
+            }
+            if (is(t, "*")) {
+                sc_.next();
+                return node({Node::LOAD, "*", 0, unary(), -1, -1, t.line});
+            }
+            return primary();
+        }
+
+        int primary() {
+            Token t = sc_.next();
+            if (t.kind == Tok::IDENT && isReg(t.text))
+                return node({Node::REG, t.text, 0, -1, -1, -1, t.line});
+            if (t.kind == Tok::NUMBER)
+                return node({Node::NUM, t.text, number(t), -1, -1, -1, t.line});
+            if (is(t, "(")) {
+                int e = ternary();
+                expect(")");
+                return e;
+            }
+            fail(t.line, t.kind == Tok::IDENT ? "Expected register, got: " + str(t.text)
+                                              : "Expected expression");
+        }
+
+        static int64_t number(const Token &t) {
+            std::string_view s = t.text;
+            int base = 10;
+            if (s.size() > 2 && s[0] == '0' && (s[1] == 'x' || s[1] == 'X')) {
+                base = 16;
+                s.remove_prefix(2);
+            }
+            int64_t v = 0;
+            auto [end, ec] = std::from_chars(s.data(), s.data() + s.size(), v, base);
+            if (ec != std::errc() || end != s.data() + s.size())
+                fail(t.line, "Invalid number: " + str(t.text));
+            return v;
+        }
+
+        // ---- expression lowering ----
+
+        /// Evaluate node `n` into a register and return it.  Only the root of
+        /// an assignment passes `target`; other operators write a temporary,
+        /// and register leaves are used in place.
+        std::string_view gen(int n, std::string_view target = {}) {
+            const Node e = nodes_[n];
+            switch (e.kind) {
+                case Node::REG:
+                    return e.text;
+
+                case Node::NUM:
+                    if (e.value == 0) return "xzr";
+                    fail(e.line, "Integer literals are only allowed as 0 or as address offsets");
+
+                case Node::NEG: {
+                    std::string_view r = gen(e.a);
+                    release(r);
+                    std::string_view d = dest(target, e.line);
+                    emit(IRInstruction::SUB, d, "xzr", r);
+                    return d;
+                }
+
+                case Node::BIN: {
+                    std::string_view l = gen(e.a), r = gen(e.b);
+                    if (e.text == "%") {
+                        // MOD lowers to sdiv/mul/sub through its destination,
+                        // which therefore must differ from both operands
+                        bool clash = target == l || target == r;
+                        std::string_view d = (target.empty() || clash) ? temp(e.line) : target;
+                        emit(IRInstruction::MOD, d, l, r);
+                        release(l);
+                        release(r);
+                        if (!clash) return d;
+                        emit(IRInstruction::MOV, target, d);
+                        release(d);
+                        return target;
+                    }
+                    release(l);
+                    release(r);
+                    std::string_view d = dest(target, e.line);
+                    IRInstruction::Op op = e.text == "+" ? IRInstruction::ADD
+                                         : e.text == "-" ? IRInstruction::SUB
+                                         : e.text == "*" ? IRInstruction::MUL
+                                                         : IRInstruction::DIV;
+                    emit(op, d, l, r);
+                    return d;
+                }
+
+                case Node::LOAD: {
+                    Address a = address(e.a);
+                    release(a.base);
+                    release(a.index);
+                    std::string_view d = dest(target, e.line);
+                    ir_.push_back({IRInstruction::LOAD, str(d), str(a.base), str(a.index), {}, {},
+                                   offset(a)});
+                    return d;
+                }
+
+                case Node::SEL: {
+                    const Node c = nodes_[e.a];
+                    if (c.kind != Node::CMP) fail(e.line, "Expected a comparison before '?'");
+                    std::string_view l = gen(c.a), r = gen(c.b), t = gen(e.b), f = gen(e.c);
+                    for (auto reg : {l, r, t, f}) release(reg);
+                    std::string_view d = dest(target, e.line);
+                    ir_.push_back({IRInstruction::SELECT, str(d), str(l), str(r), {}, str(c.text), {},
+                                   str(t), str(f)});
+                    return d;
+                }
+
+                case Node::CMP:
+                    break;
+            }
+            fail(e.line, "A comparison can only be used in if/while or before '?'");
+        }
+
+        /// Fold `base + imm`, `base - imm`, `base + index` and
+        /// `base + index * 8` into the addressing mode.
+        Address address(int n) {
+            const Node e = nodes_[n];
+            Address a;
+            if (e.kind == Node::BIN && (e.text == "+" || e.text == "-")) {
+                const Node r = nodes_[e.b];
+                if (r.kind == Node::NUM) {
+                    a.base = gen(e.a);
+                    a.imm = (e.text == "+") ? r.value : -r.value;
+                    return a;
+                }
+                if (e.text == "+") {
+                    a.base = gen(e.a);
+                    if (r.kind == Node::BIN && r.text == "*" && nodes_[r.b].kind == Node::NUM &&
+                        nodes_[r.b].value == 8) {
+                        a.index = gen(r.a);
+                        a.scaled = true;
+                    } else {
+                        a.index = gen(e.b);
+                    }
+                    return a;
+                }
+            }
+            a.base = gen(n);
+            return a;
+        }
+
+        static std::string offset(const Address &a) {
+            if (!a.index.empty()) return a.scaled ? "8" : "1";
+            return std::to_string(a.imm);
+        }
+    };
 };
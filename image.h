@@ -0,0 +1,162 @@
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/// The assembled output: literal bytes, with long runs of zeros (`.zero`,
+/// `.bss`, section gaps) kept as holes.  A hole costs O(1) however large
+/// it is, and write(fd) turns it into a hole in the output file when the
+/// file allows it, so a program with a 1 GiB table produces a 1 GiB file
+/// that occupies almost no disk.
+class Image {
+public:
+    /// Zero runs at least this long become holes; shorter ones are bytes.
+    static constexpr uint64_t kHoleThreshold = 64;
+
+    /// Buffer for appending literal bytes (Encoder::emit32le etc.).
+    std::vector<uint8_t> &bytes() {
+        if (chunks_.empty()) chunks_.push_back({});
+        return chunks_.back().data;
+    }
+
+    void zeros(uint64_t n) {
+        if (n < kHoleThreshold) {
+            bytes().insert(bytes().end(), n, 0);
+        } else if (!chunks_.empty() && chunks_.back().data.empty()) {
+            chunks_.back().hole += n;
+        } else {
+            chunks_.push_back({n, {}});
+        }
+    }
+
+    /// Move `other` onto the end of this image.
+    void append(Image &&other) {
+        for (auto &c : other.chunks_) {
+            zeros(c.hole);
+            auto &b = bytes();
+            b.insert(b.end(), c.data.begin(), c.data.end());
+        }
+        other.chunks_.clear();
+    }
+
+    uint64_t size() const {
+        uint64_t n = 0;
+        for (auto &c : chunks_) n += c.hole + c.data.size();
+        return n;
+    }
+
+    uint64_t holeBytes() const {
+        uint64_t n = 0;
+        for (auto &c : chunks_) n += c.hole;
+        return n;
+    }
+
+    void clear() { chunks_.clear(); }
+
+    /// Every byte, holes included (for tests and small images).
+    std::vector<uint8_t> flatten() const {
+        std::vector<uint8_t> out;
+        for (auto &c : chunks_) {
+            out.insert(out.end(), c.hole, 0);
+            out.insert(out.end(), c.data.begin(), c.data.end());
+        }
+        return out;
+    }
+
+    /// Write to a stream; holes are written as zeros.
+    void write(std::ostream &out) const {
+        static const char zero[4096] = {};
+        for (auto &c : chunks_) {
+            for (uint64_t left = c.hole; left;) {
+                uint64_t n = std::min<uint64_t>(left, sizeof zero);
+                out.write(zero, static_cast<std::streamsize>(n));
+                left -= n;
+            }
+            out.write(reinterpret_cast<const char *>(c.data.data()),
+                      static_cast<std::streamsize>(c.data.size()));
+        }
+    }
+
+    /// Write to a file descriptor at its current offset.  On a regular
+    /// file (not opened for append) holes are skipped with lseek -- and
+    /// punched out of any old contents -- so they take no disk space; on a
+    /// pipe or terminal they are written as zeros.
+    void write(int fd) const {
+        struct stat st;
+        bool sparse = fstat(fd, &st) == 0 && S_ISREG(st.st_mode) &&
+                      !(fcntl(fd, F_GETFL) & O_APPEND);
+        off_t pos = sparse ? lseek(fd, 0, SEEK_CUR) : -1;
+        if (pos < 0) sparse = false;
+
+        for (auto &c : chunks_) {
+            if (c.hole && sparse) {
+                clearOld(fd, pos, static_cast<off_t>(c.hole), st.st_size);
+                pos += static_cast<off_t>(c.hole);
+                if (lseek(fd, pos, SEEK_SET) < 0) fail("lseek");
+            } else {
+                writeZeros(fd, c.hole);
+            }
+            writeAll(fd, c.data.data(), c.data.size());
+            pos += static_cast<off_t>(c.data.size());
+        }
+        // a trailing hole still has to reach the file size
+        if (sparse && !chunks_.empty() && chunks_.back().data.empty() &&
+            pos > st.st_size && ftruncate(fd, pos) != 0)
+            fail("ftruncate");
+    }
+
+private:
+    /// `hole` zero bytes, then `data`.
+    struct Chunk {
+        uint64_t hole = 0;
+        std::vector<uint8_t> data;
+    };
+
+    std::vector<Chunk> chunks_;
+
+    [[noreturn]] static void fail(const char *what) {
+        throw std::runtime_error(std::string("Cannot write output (") + what + "): " +
+                                 std::strerror(errno));
+    }
+
+    static void writeAll(int fd, const uint8_t *p, size_t n) {
+        while (n) {
+            ssize_t w = ::write(fd, p, n);
+            if (w < 0 && errno == EINTR) continue;
+            if (w <= 0) fail("write");
+            p += w;
+            n -= static_cast<size_t>(w);
+        }
+    }
+
+    static void writeZeros(int fd, uint64_t n) {
+        static const uint8_t zero[65536] = {};
+        while (n) {
+            size_t k = static_cast<size_t>(std::min<uint64_t>(n, sizeof zero));
+            writeAll(fd, zero, k);
+            n -= k;
+        }
+    }
+
+    /// Zero the part of [pos, pos + len) that lies inside the file's old
+    /// contents, by punching a hole where supported.
+    static void clearOld(int fd, off_t pos, off_t len, off_t oldSize) {
+        if (pos >= oldSize) return;
+        len = std::min(len, oldSize - pos);
+#if defined(__linux__) && defined(FALLOC_FL_PUNCH_HOLE)
+        if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, pos, len) == 0) return;
+#endif
+        if (lseek(fd, pos, SEEK_SET) < 0) fail("lseek");
+        writeZeros(fd, static_cast<uint64_t>(len));
+    }
+};
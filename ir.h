@@ -1,28 +1,42 @@
 #pragma once
 
+#include <cstdint>
 #include <string>
 #include <vector>
+#include <memory_resource>
 #include <iostream>
 
 /// Intermediate Representation for high-level statements.
 /// Each IRInstruction is a target-independent operation that
-/// is later lowered to ARM64 tokens by IRCodeGen.
+/// is later lowered to ARM64 tokens by IRCodeGen, or to x86-64
+/// machine code by X86CodeGen.
 struct IRInstruction {
     enum Op {
         ADD,            // dst = src1 + src2
         SUB,            // dst = src1 - src2
         MUL,            // dst = src1 * src2
         DIV,            // dst = src1 / src2
-        MOD,            // dst = src1 % src2
+        MOD,            // dst = src1 % src2 (dst is neither source, unless src1 == src2)
         MOV,            // dst = src1
-        LOAD,           // dst = *(src1 + imm)
-        STORE,          // *(dst + imm) = src1
-        CMP_BRANCH,     // if src1 <cond> src2 goto label
+        LOAD,           // dst = *(src1 + imm), or *(src1 + src2 * imm) if src2 is set
+        STORE,          // *(dst + imm) = src1, or *(dst + src2 * imm) if src2 is set
+        CMP_BRANCH,     // if src1 <cond> src2 goto label (src2 may be a literal 0..4095)
+        SELECT,         // dst = (src1 <cond> src2) ? src3 : src4
         BRANCH,         // goto label
         CALL,           // call src1
-        RET,            // return (br x30)
+        CALL_DIRECT,    // call label (bl)
+        RET,            // return (br x30; inside a function, epilogue first)
         LABEL,          // label definition
         DATA8,          // .8byte value
+        FUNC,           // start of function dst (defines the label)
+        ENDFUNC,        // end of the current function
+
+        // two 64-bit lanes in a vector register v0-v31 (emitted by the
+        // vectorizer, not the parser)
+        VLOAD,          // dst = the doublewords at src1 and src1 + 8
+        VSTORE,         // the doublewords at dst and dst + 8 = src1
+        VADD,           // dst = src1 + src2, per lane
+        VSUB,           // dst = src1 - src2, per lane
     };
 
     Op op;
@@ -31,9 +45,15 @@ struct IRInstruction {
     std::string src2;       // second source register
     std::string label;      // target label (for branches)
     std::string cond;       // condition (==, !=, <, <=, >, >=)
-    std::string imm;        // immediate value (for LOAD/STORE offset, DATA8 value)
+    std::string imm;        // immediate value (for LOAD/STORE offset or index scale, DATA8 value)
+    std::string src3 = {};  // SELECT: value if the condition holds
+    std::string src4 = {};  // SELECT: value otherwise
 };
 
+/// IR containers allocate from a caller-supplied memory resource
+/// (see arena.h); the default is the global heap.
+using IRProgram = std::pmr::vector<IRInstruction>;
+
 inline std::string irOpToString(IRInstruction::Op op) {
     switch (op) {
         case IRInstruction::ADD:        return "ADD";
@@ -45,17 +65,73 @@ inline std::string irOpToString(IRInstruction::Op op) {
         case IRInstruction::LOAD:       return "LOAD";
         case IRInstruction::STORE:      return "STORE";
         case IRInstruction::CMP_BRANCH: return "CMP_BRANCH";
+        case IRInstruction::SELECT:     return "SELECT";
         case IRInstruction::BRANCH:     return "BRANCH";
         case IRInstruction::CALL:       return "CALL";
+        case IRInstruction::CALL_DIRECT: return "CALL_DIRECT";
         case IRInstruction::RET:        return "RET";
         case IRInstruction::LABEL:      return "LABEL";
         case IRInstruction::DATA8:      return "DATA8";
+        case IRInstruction::FUNC:       return "FUNC";
+        case IRInstruction::ENDFUNC:    return "ENDFUNC";
+        case IRInstruction::VLOAD:      return "VLOAD";
+        case IRInstruction::VSTORE:     return "VSTORE";
+        case IRInstruction::VADD:       return "VADD";
+        case IRInstruction::VSUB:       return "VSUB";
     }
     return "???";
 }
 
+/// Offset part of a LOAD/STORE address: "imm", "src2" or "src2 * imm".
+inline std::string irIndex(const IRInstruction &i) {
+    if (i.src2.empty()) return i.imm;
+    return (i.imm == "1") ? i.src2 : i.src2 + " * " + i.imm;
+}
+
+/// Bit r set for each x register (x0-x30) that an operand of `ir` names.
+inline uint32_t irNamedRegisters(const IRProgram &ir) {
+    uint32_t named = 0;
+    for (auto &i : ir) {
+        if (i.op == IRInstruction::LABEL || i.op == IRInstruction::FUNC) continue;
+        for (const std::string *f : {&i.dst, &i.src1, &i.src2, &i.src3, &i.src4}) {
+            const std::string &s = *f;
+            if (s.size() < 2 || s.size() > 3 || s[0] != 'x') continue;
+            int r = 0;
+            for (size_t k = 1; k < s.size() && r >= 0; ++k)
+                r = (s[k] >= '0' && s[k] <= '9') ? r * 10 + (s[k] - '0') : -1;
+            if (r >= 0 && r <= 30) named |= 1u << r;
+        }
+    }
+    return named;
+}
+
+/// Registers the program never names, in HighLevelParser's temporary
+/// order, for passes and code generation to use as scratch.  It must be
+/// taken from the parser's output: a pass can remove the last mention of
+/// a register whose value is still live at exit, and such a register is
+/// not scratch.  Users take the entries the current IR does not name
+/// (irUnnamed), so two passes do not pick the same one.
+inline std::vector<std::string> irScratchRegisters(const IRProgram &ir) {
+    static const int order[] = {9,  10, 11, 12, 13, 14, 15, 16, 17, 19, 20, 21, 22, 23,
+                                24, 25, 26, 27, 28, 0,  1,  2,  3,  4,  5,  6,  7,  8};
+    uint32_t named = irNamedRegisters(ir);
+    std::vector<std::string> scratch;
+    for (int r : order)
+        if (!(named >> r & 1)) scratch.push_back("x" + std::to_string(r));
+    return scratch;
+}
+
+/// The registers of `scratch` that `ir` does not name.
+inline std::vector<std::string> irUnnamed(const IRProgram &ir, const std::vector<std::string> &scratch) {
+    uint32_t named = irNamedRegisters(ir);
+    std::vector<std::string> free;
+    for (const std::string &r : scratch)
+        if (!(named >> std::stoi(r.substr(1)) & 1)) free.push_back(r);
+    return free;
+}
+
 /// Dump IR to a stream in a human-readable format.
-inline void dumpIR(const std::vector<IRInstruction> &ir, std::ostream &out) {
+inline void dumpIR(const IRProgram &ir, std::ostream &out) {
     for (auto &i : ir) {
         switch (i.op) {
             case IRInstruction::LABEL:
@@ -66,6 +142,8 @@ inline void dumpIR(const std::vector<IRInstruction> &ir, std::ostream &out) {
             case IRInstruction::MUL:
             case IRInstruction::DIV:
             case IRInstruction::MOD:
+            case IRInstruction::VADD:
+            case IRInstruction::VSUB:
                 out << "  " << irOpToString(i.op) << " " << i.dst
                     << ", " << i.src1 << ", " << i.src2 << "\n";
                 break;
@@ -73,24 +151,43 @@ inline void dumpIR(const std::vector<IRInstruction> &ir, std::ostream &out) {
                 out << "  MOV " << i.dst << ", " << i.src1 << "\n";
                 break;
             case IRInstruction::LOAD:
-                out << "  LOAD " << i.dst << ", [" << i.src1 << " + " << i.imm << "]\n";
+                out << "  LOAD " << i.dst << ", [" << i.src1 << " + " << irIndex(i) << "]\n";
                 break;
             case IRInstruction::STORE:
-                out << "  STORE [" << i.dst << " + " << i.imm << "], " << i.src1 << "\n";
+                out << "  STORE [" << i.dst << " + " << irIndex(i) << "], " << i.src1 << "\n";
+                break;
+            case IRInstruction::VLOAD:
+                out << "  VLOAD " << i.dst << ", [" << i.src1 << "]\n";
+                break;
+            case IRInstruction::VSTORE:
+                out << "  VSTORE [" << i.dst << "], " << i.src1 << "\n";
                 break;
             case IRInstruction::CMP_BRANCH:
                 out << "  CMP_BRANCH " << i.src1 << " " << i.cond
                     << " " << i.src2 << ", " << i.label << "\n";
                 break;
+            case IRInstruction::SELECT:
+                out << "  SELECT " << i.dst << ", " << i.src1 << " " << i.cond << " " << i.src2
+                    << " ? " << i.src3 << " : " << i.src4 << "\n";
+                break;
             case IRInstruction::BRANCH:
                 out << "  BRANCH " << i.label << "\n";
                 break;
             case IRInstruction::CALL:
                 out << "  CALL " << i.src1 << "\n";
                 break;
+            case IRInstruction::CALL_DIRECT:
+                out << "  CALL_DIRECT " << i.label << "\n";
+                break;
             case IRInstruction::RET:
                 out << "  RET\n";
                 break;
+            case IRInstruction::FUNC:
+                out << "FUNC " << i.dst << ":\n";
+                break;
+            case IRInstruction::ENDFUNC:
+                out << "ENDFUNC\n";
+                break;
             case IRInstruction::DATA8:
                 out << "  DATA8 " << i.imm << "\n";
                 break;
@@ -7,22 +7,164 @@
 #include <string>
 #include <stdexcept>
 #include <cctype>
+#include <algorithm>
 #include <map>
+#include <set>
+#include <utility>
 
 /// Lowers target-independent IR into ARM64 Token streams.
 /// This is the "instruction selection" phase of the compiler pipeline.
+///
+/// Functions (FUNC ... ENDFUNC) also get their frame here, once the final
+/// IR is known: the prologue saves exactly the callee-saved registers
+/// (x19-x29) the body writes, plus the x29/x30 frame record if the body
+/// makes a call, in stp pairs under a single sp adjustment; each RET
+/// restores them with ldp.  A leaf function that writes no callee-saved
+/// register gets no prologue at all.
+///
+/// A call immediately followed by RET is a tail call: the epilogue runs
+/// first and the call becomes a plain branch (`b label` / `br xn`), so the
+/// callee returns straight to our caller.  Tail calls do not make a
+/// function non-leaf.
+///
+/// With `loopAlign` (bytes, a power of two; 0 = off), each loop header --
+/// a label that a later branch jumps back to -- is preceded by
+/// `.balign loopAlign`, so the loop body starts at a fetch-block boundary.
 class IRCodeGen {
 public:
-    static std::vector<Token> lower(const std::vector<IRInstruction> &ir) {
-        std::vector<Token> tokens;
-        for (auto &inst : ir) {
-            lowerOne(inst, tokens);
+    static TokenList lower(const IRProgram &ir,
+                           std::pmr::memory_resource *mr = std::pmr::get_default_resource(),
+                           unsigned loopAlign = 0) {
+        TokenList tokens(mr);
+        Frame frame;
+        std::set<std::string> headers;
+        if (loopAlign) headers = loopHeaders(ir);
+        for (size_t i = 0; i < ir.size(); ++i) {
+            if (ir[i].op == IRInstruction::FUNC) frame = computeFrame(ir, i);
+            if (ir[i].op == IRInstruction::LABEL && headers.count(ir[i].dst)) {
+                tokens.push_back({DOTID, ".balign"});
+                tokens.push_back({INT, std::to_string(loopAlign)});
+                tokens.push_back({NEWLINE, ""});
+            }
+            if (isTailCall(ir, i)) lowerTailCall(ir[i++], frame, tokens);
+            else if (i + 1 < ir.size() && lowerPair(ir[i], ir[i + 1], tokens)) ++i;
+            else lowerOne(ir[i], frame, tokens);
             tokens.push_back({NEWLINE, ""});
+            if (ir[i].op == IRInstruction::ENDFUNC) frame = Frame{};
         }
         return tokens;
     }
 
+    /// Registers saved by the enclosing function, as stp/ldp pairs; the
+    /// first pair is stored at the bottom of the save area.  Shared with
+    /// X86CodeGen, which keeps the same frame layout.
+    struct Frame {
+        std::vector<std::pair<std::string, std::string>> pairs;
+        bool record = false;    // first pair is x29/x30, and x29 = sp
+    };
+
+    static bool isTailCall(const IRProgram &ir, size_t i) {
+        return (ir[i].op == IRInstruction::CALL || ir[i].op == IRInstruction::CALL_DIRECT) &&
+               i + 1 < ir.size() && ir[i + 1].op == IRInstruction::RET;
+    }
+
+    static Frame computeFrame(const IRProgram &ir, size_t func) {
+        bool written[31] = {};
+        bool call = false;
+        for (size_t i = func + 1; i < ir.size() && ir[i].op != IRInstruction::ENDFUNC; ++i) {
+            const IRInstruction &in = ir[i];
+            switch (in.op) {
+                case IRInstruction::ADD: case IRInstruction::SUB: case IRInstruction::MUL:
+                case IRInstruction::DIV: case IRInstruction::MOD: case IRInstruction::MOV:
+                case IRInstruction::LOAD: case IRInstruction::SELECT: {
+                    int r = regNum(in.dst);
+                    if (r >= 0) written[r] = true;
+                    break;
+                }
+                case IRInstruction::CALL: case IRInstruction::CALL_DIRECT:
+                    if (!isTailCall(ir, i)) call = true;
+                    break;
+                default:
+                    break;
+            }
+        }
+
+        Frame f;
+        std::vector<std::string> regs;
+        if (call) {
+            f.record = true;
+            regs = {"x29", "x30"};
+        }
+        for (int r = 19; r <= 29; ++r)
+            if (written[r] && !(call && r == 29)) regs.push_back("x" + std::to_string(r));
+        if (regs.size() % 2) regs.push_back("xzr");
+        for (size_t k = 0; k < regs.size(); k += 2) f.pairs.push_back({regs[k], regs[k + 1]});
+        return f;
+    }
+
 private:
+    /// Back-edge targets: labels that a BRANCH or CMP_BRANCH at or after
+    /// their definition jumps to.
+    static std::set<std::string> loopHeaders(const IRProgram &ir) {
+        std::set<std::string> defined, headers;
+        for (auto &inst : ir) {
+            if (inst.op == IRInstruction::LABEL) defined.insert(inst.dst);
+            else if ((inst.op == IRInstruction::BRANCH || inst.op == IRInstruction::CMP_BRANCH) &&
+                     defined.count(inst.label))
+                headers.insert(inst.label);
+        }
+        return headers;
+    }
+
+    static int regNum(const std::string &s) {
+        if (s.size() < 2 || s[0] != 'x' || !std::isdigit(static_cast<unsigned char>(s[1]))) return -1;
+        int v = std::stoi(s.substr(1));
+        return v <= 30 ? v : -1;
+    }
+
+    enum class Index { OFFSET, PRE, POST };
+
+    /// stp/ldp a, b, [sp, off]  /  [sp, off]!  /  [sp], off
+    static void emitPairSp(const char *instr, const std::string &a, const std::string &b,
+                           int off, Index mode, TokenList &out) {
+        emit2Reg(instr, a, b, out);
+        out.push_back({COMMA, ","});
+        out.push_back({LBRACK, "["});
+        out.push_back({ID, "sp"});
+        if (mode != Index::POST) {
+            out.push_back({COMMA, ","});
+            out.push_back({INT, std::to_string(off)});
+        }
+        out.push_back({RBRACK, "]"});
+        if (mode == Index::PRE) out.push_back({EXCLAM, "!"});
+        if (mode == Index::POST) {
+            out.push_back({COMMA, ","});
+            out.push_back({INT, std::to_string(off)});
+        }
+    }
+
+    static void emitPrologue(const Frame &f, TokenList &out) {
+        int size = 16 * static_cast<int>(f.pairs.size());
+        for (size_t k = 0; k < f.pairs.size(); ++k) {
+            out.push_back({NEWLINE, ""});
+            if (k == 0) emitPairSp("stp", f.pairs[0].first, f.pairs[0].second, -size, Index::PRE, out);
+            else        emitPairSp("stp", f.pairs[k].first, f.pairs[k].second, 16 * static_cast<int>(k), Index::OFFSET, out);
+            if (k == 0 && f.record) {
+                out.push_back({NEWLINE, ""});
+                emit3Reg("add", "x29", "sp", "xzr", out);     // mov x29, sp
+            }
+        }
+    }
+
+    static void emitEpilogue(const Frame &f, TokenList &out) {
+        int size = 16 * static_cast<int>(f.pairs.size());
+        for (size_t k = f.pairs.size(); k-- > 0;) {
+            if (k == 0) emitPairSp("ldp", f.pairs[0].first, f.pairs[0].second, size, Index::POST, out);
+            else        emitPairSp("ldp", f.pairs[k].first, f.pairs[k].second, 16 * static_cast<int>(k), Index::OFFSET, out);
+            out.push_back({NEWLINE, ""});
+        }
+    }
+
     // ---------- helpers ----------
 
     static Token regToken(const std::string &s) {
@@ -33,6 +175,13 @@ private:
         throw std::runtime_error("IRCodeGen: expected register, got: " + s);
     }
 
+    /// IR vector registers hold two 64-bit lanes: v3 -> v3.2d.
+    static Token vecToken(const std::string &s) {
+        if (s.size() < 2 || s[0] != 'v' || !std::isdigit(static_cast<unsigned char>(s[1])))
+            throw std::runtime_error("IRCodeGen: expected vector register, got: " + s);
+        return {VREG, s + ".2d"};
+    }
+
     static Token immOrLabel(const std::string &s) {
         if (s.empty()) throw std::runtime_error("IRCodeGen: empty immediate/label");
         if (s[0] == '0' && s.size() > 2 && (s[1] == 'x' || s[1] == 'X'))
@@ -60,9 +209,17 @@ private:
         return it->second;
     }
 
+    static void emit2Reg(const std::string &instr, const std::string &a,
+                         const std::string &b, TokenList &out) {
+        out.push_back({ID, instr});
+        out.push_back(regToken(a));
+        out.push_back({COMMA, ","});
+        out.push_back(regToken(b));
+    }
+
     static void emit3Reg(const std::string &instr, const std::string &a,
                          const std::string &b, const std::string &c,
-                         std::vector<Token> &out) {
+                         TokenList &out) {
         out.push_back({ID, instr});
         out.push_back(regToken(a));
         out.push_back({COMMA, ","});
@@ -71,20 +228,151 @@ private:
         out.push_back(regToken(c));
     }
 
+    static bool smallInt(const std::string &s, long &v) {
+        if (immOrLabel(s).type != INT) return false;
+        v = std::stol(s);
+        return true;
+    }
+
+    /// [base, imm], [base, idx] or [base, idx, lsl 3] for a LOAD/STORE.
+    /// Immediate offsets use ldur/stur when they fit the signed 9-bit form
+    /// and the scaled unsigned-offset ldr/str otherwise.
+    static void emitMem(const char *scaled, const char *unscaled, const std::string &rt,
+                        const std::string &base, const IRInstruction &inst, TokenList &out) {
+        long off = 0;
+        bool unscaledFits = inst.src2.empty() && smallInt(inst.imm, off) &&
+                            -256 <= off && off <= 255;
+        out.push_back({ID, unscaledFits ? unscaled : scaled});
+        out.push_back(regToken(rt));
+        out.push_back({COMMA, ","});
+        out.push_back({LBRACK, "["});
+        out.push_back(regToken(base));
+        out.push_back({COMMA, ","});
+        if (inst.src2.empty()) {
+            out.push_back(immOrLabel(inst.imm));
+        } else {
+            out.push_back(regToken(inst.src2));
+            if (inst.imm == "8") {
+                out.push_back({COMMA, ","});
+                out.push_back({ID, "lsl"});
+                out.push_back({INT, "3"});
+            }
+        }
+        out.push_back({RBRACK, "]"});
+    }
+
+    /// Fuse two adjacent LOADs (or STOREs) of neighbouring doublewords off
+    /// the same base into one ldp/stp.  Loads are only paired when the first
+    /// one does not overwrite the base or the second destination.
+    static bool lowerPair(const IRInstruction &a, const IRInstruction &b, TokenList &out) {
+        if (a.op != b.op || (a.op != IRInstruction::LOAD && a.op != IRInstruction::STORE))
+            return false;
+        if (!a.src2.empty() || !b.src2.empty()) return false;
+        const bool load = a.op == IRInstruction::LOAD;
+        const std::string &base = load ? a.src1 : a.dst;
+        if ((load ? b.src1 : b.dst) != base) return false;
+        long oa, ob;
+        if (!smallInt(a.imm, oa) || !smallInt(b.imm, ob)) return false;
+        if (load && (a.dst == base || a.dst == b.dst)) return false;
+
+        const IRInstruction *lo = &a, *hi = &b;
+        if (ob + 8 == oa) std::swap(lo, hi);
+        else if (oa + 8 != ob) return false;
+        long off = std::min(oa, ob);
+        if (off % 8 || off < -512 || off > 504) return false;
+
+        out.push_back({ID, load ? "ldp" : "stp"});
+        out.push_back(regToken(load ? lo->dst : lo->src1));
+        out.push_back({COMMA, ","});
+        out.push_back(regToken(load ? hi->dst : hi->src1));
+        out.push_back({COMMA, ","});
+        out.push_back({LBRACK, "["});
+        out.push_back(regToken(base));
+        out.push_back({COMMA, ","});
+        out.push_back({INT, std::to_string(off)});
+        out.push_back({RBRACK, "]"});
+        return true;
+    }
+
+    /// `if xn == xzr` / `if xn != xzr` (either operand order) becomes a
+    /// single cbz / cbnz, which also leaves the flags alone.
+    static bool lowerZeroBranch(const IRInstruction &inst, TokenList &out) {
+        if (inst.cond != "==" && inst.cond != "!=") return false;
+        const std::string *reg;
+        if (inst.src2 == "xzr")      reg = &inst.src1;
+        else if (inst.src1 == "xzr") reg = &inst.src2;
+        else return false;
+        Token t = regToken(*reg);
+        if (t.type != REG) return false;    // sp has no cbz form; xzr == xzr stays a cmp
+        out.push_back({ID, inst.cond == "==" ? "cbz" : "cbnz"});
+        out.push_back(t);
+        out.push_back({COMMA, ","});
+        out.push_back(immOrLabel(inst.label));
+        return true;
+    }
+
+    /// `cmp src1, src2` followed by a NEWLINE.  cmp cannot take xzr as its
+    /// first operand, so `xzr <op> x` is emitted as `x <mirrored op> xzr`.
+    /// A literal src2 becomes `cmp src1, #imm`.
+    /// Returns the condition that applies to the emitted compare.
+    static std::string emitCmp(const IRInstruction &inst, TokenList &out) {
+        static const std::map<std::string, std::string> mirror = {
+            {"<", ">"}, {">", "<"}, {"<=", ">="}, {">=", "<="},
+        };
+        bool literal = !inst.src2.empty() && immOrLabel(inst.src2).type == INT;
+        bool swap = inst.src1 == "xzr" && inst.src2 != "xzr" && !literal;
+        out.push_back({ID, "cmp"});
+        out.push_back(regToken(swap ? inst.src2 : inst.src1));
+        out.push_back({COMMA, ","});
+        out.push_back(literal ? immOrLabel(inst.src2) : regToken(swap ? inst.src1 : inst.src2));
+        out.push_back({NEWLINE, ""});
+        if (!swap) return inst.cond;
+        auto it = mirror.find(inst.cond);
+        return it == mirror.end() ? inst.cond : it->second;
+    }
+
     // ---------- lowering dispatch ----------
 
-    static void lowerOne(const IRInstruction &inst, std::vector<Token> &out) {
+    /// Epilogue, then branch to the callee.  An indirect target that the
+    /// epilogue restores is first moved to x16 (IP0), which AAPCS64 leaves
+    /// free for exactly this.
+    static void lowerTailCall(const IRInstruction &call, const Frame &frame, TokenList &out) {
+        if (call.op == IRInstruction::CALL_DIRECT) {
+            emitEpilogue(frame, out);
+            out.push_back({ID, "b"});
+            out.push_back(immOrLabel(call.label));
+            return;
+        }
+        std::string target = call.src1;
+        for (auto &[a, b] : frame.pairs) {
+            if (a == target || b == target) {
+                emit2Reg("mov", "x16", target, out);
+                out.push_back({NEWLINE, ""});
+                target = "x16";
+                break;
+            }
+        }
+        emitEpilogue(frame, out);
+        out.push_back({ID, "br"});
+        out.push_back(regToken(target));
+    }
+
+    static void lowerOne(const IRInstruction &inst, const Frame &frame, TokenList &out) {
         switch (inst.op) {
             case IRInstruction::LABEL:
                 out.push_back({LABEL, inst.dst + ":"});
                 break;
 
+            // add/sub take sp, not xzr, as their first source, so a zero
+            // there is swapped away (add) or turned into neg (sub)
             case IRInstruction::ADD:
-                emit3Reg("add", inst.dst, inst.src1, inst.src2, out);
+                if (inst.src1 == "xzr") emit3Reg("add", inst.dst, inst.src2, inst.src1, out);
+                else                    emit3Reg("add", inst.dst, inst.src1, inst.src2, out);
                 break;
 
             case IRInstruction::SUB:
-                emit3Reg("sub", inst.dst, inst.src1, inst.src2, out);
+                if (inst.src1 == "xzr") emit2Reg("neg", inst.dst, inst.src2, out);
+                else                    emit3Reg("sub", inst.dst, inst.src1, inst.src2, out);
                 break;
 
             case IRInstruction::MUL:
@@ -100,6 +388,20 @@ private:
                 //   sdiv dst, src1, src2
                 //   mul  dst, dst, src2
                 //   sub  dst, src1, dst
+                // which reads both sources after writing dst, so dst must be
+                // another register.  The sub cannot take xzr either, but
+                // x % x and 0 % x are 0, and x % 0 is x as sdiv gives 0.
+                if (inst.src1 == inst.src2 || inst.src1 == "xzr") {
+                    emit2Reg("mov", inst.dst, "xzr", out);
+                    break;
+                }
+                if (inst.src2 == "xzr") {
+                    emit3Reg("add", inst.dst, inst.src1, "xzr", out);
+                    break;
+                }
+                if (inst.dst == inst.src1 || inst.dst == inst.src2)
+                    throw std::runtime_error("IRCodeGen: MOD destination must differ from its sources: " +
+                                             inst.dst);
                 emit3Reg("sdiv", inst.dst, inst.src1, inst.src2, out);
                 out.push_back({NEWLINE, ""});
                 emit3Reg("mul", inst.dst, inst.dst, inst.src2, out);
@@ -108,45 +410,42 @@ private:
                 break;
 
             case IRInstruction::MOV:
-                // add dst, src1, xzr
-                emit3Reg("add", inst.dst, inst.src1, "xzr", out);
+                // add dst, src1, xzr  (mov dst, xzr for a zero)
+                if (inst.src1 == "xzr") emit2Reg("mov", inst.dst, inst.src1, out);
+                else                    emit3Reg("add", inst.dst, inst.src1, "xzr", out);
                 break;
 
             case IRInstruction::LOAD:
-                // ldur dst, [src1, imm]
-                out.push_back({ID, "ldur"});
-                out.push_back(regToken(inst.dst));
-                out.push_back({COMMA, ","});
-                out.push_back({LBRACK, "["});
-                out.push_back(regToken(inst.src1));
-                out.push_back({COMMA, ","});
-                out.push_back({INT, inst.imm});
-                out.push_back({RBRACK, "]"});
+                // ldur dst, [src1, imm] / ldr dst, [src1, src2{, lsl 3}]
+                emitMem("ldr", "ldur", inst.dst, inst.src1, inst, out);
                 break;
 
             case IRInstruction::STORE:
-                // stur src1, [dst, imm]
-                out.push_back({ID, "stur"});
-                out.push_back(regToken(inst.src1));
-                out.push_back({COMMA, ","});
-                out.push_back({LBRACK, "["});
-                out.push_back(regToken(inst.dst));
-                out.push_back({COMMA, ","});
-                out.push_back({INT, inst.imm});
-                out.push_back({RBRACK, "]"});
+                // stur src1, [dst, imm] / str src1, [dst, src2{, lsl 3}]
+                emitMem("str", "stur", inst.src1, inst.dst, inst, out);
                 break;
 
             case IRInstruction::CMP_BRANCH:
+                if (lowerZeroBranch(inst, out)) break;
                 // cmp src1, src2
-                out.push_back({ID, "cmp"});
-                out.push_back(regToken(inst.src1));
-                out.push_back({COMMA, ","});
-                out.push_back(regToken(inst.src2));
-                out.push_back({NEWLINE, ""});
                 // b .cond label
-                out.push_back({ID, "b"});
-                out.push_back({DOTID, condSuffix(inst.cond)});
-                out.push_back(immOrLabel(inst.label));
+                {
+                    std::string suffix = condSuffix(emitCmp(inst, out));
+                    out.push_back({ID, "b"});
+                    out.push_back({DOTID, suffix});
+                    out.push_back(immOrLabel(inst.label));
+                }
+                break;
+
+            case IRInstruction::SELECT:
+                // cmp src1, src2
+                // csel dst, src3, src4, cond
+                {
+                    std::string cond = condSuffix(emitCmp(inst, out)).substr(1);
+                    emit3Reg("csel", inst.dst, inst.src3, inst.src4, out);
+                    out.push_back({COMMA, ","});
+                    out.push_back({ID, cond});
+                }
                 break;
 
             case IRInstruction::BRANCH:
@@ -159,7 +458,21 @@ private:
                 out.push_back(regToken(inst.src1));
                 break;
 
+            case IRInstruction::CALL_DIRECT:
+                out.push_back({ID, "bl"});
+                out.push_back(immOrLabel(inst.label));
+                break;
+
+            case IRInstruction::FUNC:
+                out.push_back({LABEL, inst.dst + ":"});
+                emitPrologue(frame, out);
+                break;
+
+            case IRInstruction::ENDFUNC:
+                break;
+
             case IRInstruction::RET:
+                emitEpilogue(frame, out);
                 out.push_back({ID, "br"});
                 out.push_back({REG, "x30"});
                 break;
@@ -168,6 +481,30 @@ private:
                 out.push_back({DOTID, ".8byte"});
                 out.push_back(immOrLabel(inst.imm));
                 break;
+
+            case IRInstruction::VLOAD:
+            case IRInstruction::VSTORE:
+                // ld1 {vd.2d}, [src1] / st1 {vs.2d}, [dst]
+                {
+                    bool load = inst.op == IRInstruction::VLOAD;
+                    out.push_back({ID, load ? "ld1" : "st1"});
+                    out.push_back(vecToken(load ? inst.dst : inst.src1));
+                    out.push_back({COMMA, ","});
+                    out.push_back({LBRACK, "["});
+                    out.push_back(regToken(load ? inst.src1 : inst.dst));
+                    out.push_back({RBRACK, "]"});
+                }
+                break;
+
+            case IRInstruction::VADD:
+            case IRInstruction::VSUB:
+                out.push_back({ID, inst.op == IRInstruction::VADD ? "add" : "sub"});
+                out.push_back(vecToken(inst.dst));
+                out.push_back({COMMA, ","});
+                out.push_back(vecToken(inst.src1));
+                out.push_back({COMMA, ","});
+                out.push_back(vecToken(inst.src2));
+                break;
         }
     }
 };
@@ -0,0 +1,783 @@
+#pragma once
+
+#include "ir.h"
+
+#include <algorithm>
+#include <charconv>
+#include <cstddef>
+#include <map>
+#include <set>
+#include <string>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+/// Optimisation passes over the IR, run between HighLevelParser and
+/// IRCodeGen when `-O1` is given.  Each pass rewrites the program in place
+/// and returns how many changes it made (reported by --stats).
+class IRPasses {
+public:
+    /// Number of references to each label (branch targets and .8byte values).
+    static std::map<std::string, int> labelUses(const IRProgram &ir) {
+        std::map<std::string, int> uses;
+        for (auto &i : ir) {
+            if (i.op == IRInstruction::CMP_BRANCH || i.op == IRInstruction::BRANCH ||
+                i.op == IRInstruction::CALL_DIRECT)
+                ++uses[i.label];
+            else if (i.op == IRInstruction::DATA8)
+                ++uses[i.imm];
+        }
+        return uses;
+    }
+
+    /// If-conversion: replace small branch diamonds whose arms are single
+    /// register moves with a SELECT, which lowers to cmp + csel and so has no
+    /// branch to mispredict.
+    ///
+    ///   CMP_BRANCH a op b, Lelse        SELECT d, a op b ? y : x
+    ///   MOV d, x                   →    Lend:
+    ///   BRANCH Lend
+    ///   Lelse:
+    ///   MOV d, y
+    ///   Lend:
+    ///
+    ///   CMP_BRANCH a op b, Lskip        SELECT d, a op b ? d : x
+    ///   MOV d, x                   →    Lskip:
+    ///   Lskip:
+    ///
+    /// Lelse must have no other references, since its code is folded away.
+    /// Lend and Lskip are kept for any other branches to them.
+    static size_t ifConvert(IRProgram &ir) {
+        using I = IRInstruction;
+        auto uses = labelUses(ir);
+        auto isLabel = [&](size_t k, const std::string &name) {
+            return k < ir.size() && ir[k].op == I::LABEL && ir[k].dst == name;
+        };
+        auto isMov = [&](size_t k) { return k < ir.size() && ir[k].op == I::MOV; };
+
+        IRProgram out(ir.get_allocator());
+        out.reserve(ir.size());
+        size_t converted = 0;
+        for (size_t i = 0; i < ir.size(); ++i) {
+            const I &br = ir[i];
+            if (br.op == I::CMP_BRANCH && isMov(i + 1)) {
+                const I &then = ir[i + 1];
+                // diamond
+                if (i + 5 < ir.size() && ir[i + 2].op == I::BRANCH && isLabel(i + 3, br.label) &&
+                    isMov(i + 4) && ir[i + 4].dst == then.dst && isLabel(i + 5, ir[i + 2].label) &&
+                    uses[br.label] == 1) {
+                    out.push_back({I::SELECT, then.dst, br.src1, br.src2, {}, br.cond, {},
+                                   ir[i + 4].src1, then.src1});
+                    out.push_back(ir[i + 5]);
+                    i += 5;
+                    ++converted;
+                    continue;
+                }
+                // triangle
+                if (isLabel(i + 2, br.label)) {
+                    out.push_back({I::SELECT, then.dst, br.src1, br.src2, {}, br.cond, {},
+                                   then.dst, then.src1});
+                    out.push_back(ir[i + 2]);
+                    i += 2;
+                    ++converted;
+                    continue;
+                }
+            }
+            out.push_back(br);
+        }
+        ir = std::move(out);
+        return converted;
+    }
+
+    /// What unroll() did with one loop, for the --stats report.
+    struct UnrollDecision {
+        std::string loop;       // body label
+        int factor = 0;         // 0 if the loop was left alone
+        int renamed = 0;        // registers renamed across the copies
+        std::string reason;     // why not, if factor == 0
+    };
+
+    /// Unroll counted loops in the rotated form the parser emits for
+    /// `while`:
+    ///
+    ///   BRANCH T                       CMP_BRANCH s <wrong sign> xzr, T
+    ///   L:                             SUB lim, n, s       (U-1 times)
+    ///   <body>                   →     BRANCH UT
+    ///   T:                             UL: <body> x U
+    ///   CMP_BRANCH i op n, L           UT: CMP_BRANCH i op lim, UL
+    ///                                  BRANCH T
+    ///                                  L: <body>  T: CMP_BRANCH i op n, L
+    ///
+    /// The body must be straight-line code in which the induction register
+    /// i is written once, by `i = i + s` or `i = i - s`, and neither s nor
+    /// the bound n is written; op is < <= > or >=.  The unrolled loop runs
+    /// while U more iterations are certain (i op n - (U-1)*s, assuming i
+    /// does not wrap), then the original loop finishes as the remainder.
+    /// The entry guard skips straight to the remainder when s steps away
+    /// from n.
+    ///
+    /// `factor` 0 picks U so the unrolled body has about 16 instructions
+    /// (at most 8 copies).  Registers that each iteration writes before
+    /// reading get a fresh name in every copy but the last, so the copies
+    /// do not share false dependencies; fresh registers come from the
+    /// `scratch` registers the IR does not name (see irScratchRegisters),
+    /// as long as they last.
+    static std::vector<UnrollDecision> unroll(IRProgram &ir, const std::vector<std::string> &scratch,
+                                              int factor = 0) {
+        using I = IRInstruction;
+        auto uses = labelUses(ir);
+        std::vector<std::string> pool = irUnnamed(ir, scratch);
+        size_t poolNext = 0;
+        auto fresh = [&]() -> std::string {
+            return poolNext < pool.size() ? pool[poolNext++] : std::string();
+        };
+
+        std::vector<UnrollDecision> decisions;
+        IRProgram out(ir.get_allocator());
+        out.reserve(ir.size());
+        for (size_t i = 0; i < ir.size(); ++i) {
+            RotatedLoop loop;
+            if (!rotatedLoop(ir, i, loop)) {
+                out.push_back(ir[i]);
+                continue;
+            }
+
+            const std::string &bodyLabel = loop.bodyLabel, &testLabel = loop.testLabel;
+            const size_t b0 = loop.b0, b1 = loop.b1, t = loop.b1;
+            UnrollDecision d;
+            d.loop = bodyLabel;
+
+            Induction ind = induction(ir, b0, b1, ir[t + 1]);
+            const std::string &iv = ind.iv, &step = ind.step, &bound = ind.bound, &cond = ind.cond;
+            const I::Op stepOp = ind.stepOp;
+
+            int u = factor;
+            if (u == 0) u = std::min<int>(8, 16 / static_cast<int>(std::max<size_t>(b1 - b0, 1)));
+            std::string lim;
+            if (uses[bodyLabel] != 1 || uses[testLabel] != 1)
+                d.reason = "other branches to the loop";
+            else if (!straightLine(ir, b0, b1))
+                d.reason = "body is not straight-line";
+            else if (cond != "<" && cond != "<=" && cond != ">" && cond != ">=")
+                d.reason = "exit test is not < <= > >=";
+            else if (iv.empty())
+                d.reason = "no induction register";
+            else if (u < 2)
+                d.reason = "body too large";
+            else if ((lim = fresh()).empty())
+                d.reason = "no free register";
+
+            if (!d.reason.empty()) {
+                decisions.push_back(std::move(d));
+                out.push_back(ir[i]);
+                continue;
+            }
+
+            // per-copy renaming of registers each iteration writes before reading
+            std::vector<std::string> temps = iterationTemps(ir, b0, b1, iv);
+            std::vector<std::map<std::string, std::string>> rename(u);
+            for (int c = 0; c + 1 < u; ++c)
+                for (auto &r : temps) {
+                    std::string f = fresh();
+                    if (f.empty()) break;
+                    rename[c][r] = f;
+                    ++d.renamed;
+                }
+
+            // entry guard: d = s for ADD, -s for SUB must step towards n
+            bool up = (cond == "<" || cond == "<=");
+            bool wantPositive = (stepOp == I::ADD) == up;
+            std::string uBody = "__ubody" + std::to_string(decisions.size());
+            std::string uTest = "__utest" + std::to_string(decisions.size());
+            out.push_back({I::CMP_BRANCH, {}, step, "xzr", testLabel, wantPositive ? "<=" : ">=", {}});
+            I::Op back = (stepOp == I::ADD) ? I::SUB : I::ADD;
+            for (int c = 0; c + 1 < u; ++c)
+                out.push_back({back, lim, c ? lim : bound, step, {}, {}, {}});
+            out.push_back({I::BRANCH, {}, {}, {}, uTest, {}, {}});
+            out.push_back({I::LABEL, uBody, {}, {}, {}, {}, {}});
+            for (int c = 0; c < u; ++c)
+                for (size_t k = b0; k < b1; ++k) out.push_back(renamed(ir[k], rename[c]));
+            out.push_back({I::LABEL, uTest, {}, {}, {}, {}, {}});
+            out.push_back({I::CMP_BRANCH, {}, iv, lim, uBody, cond, {}});
+            out.push_back({I::BRANCH, {}, {}, {}, testLabel, {}, {}});
+            for (size_t k = i + 1; k <= t + 1; ++k) out.push_back(ir[k]);
+            i = t + 1;
+
+            d.factor = u;
+            decisions.push_back(std::move(d));
+        }
+        ir = std::move(out);
+        return decisions;
+    }
+
+    /// What vectorize() did with one loop, for the --stats report.
+    struct VectorizeDecision {
+        std::string loop;       // body label
+        int lanes = 0;          // 0 if the loop was left alone
+        std::string reason;     // why not, if lanes == 0
+    };
+
+    /// Vectorize element-wise loops over doubleword arrays to two-lane
+    /// NEON code (ld1/st1 and add/sub on .2d):
+    ///
+    ///   BRANCH T                       <runtime checks, else -> T>
+    ///   L:                             lim = n - s - s
+    ///   LOAD a, [p + 0]                BRANCH VT
+    ///   LOAD b, [q + 0]          →     VL: VLOAD va, [p]  VLOAD vb, [q]
+    ///   ADD c, a, b                        VADD vc, va, vb  VSTORE [r], vc
+    ///   STORE [r + 0], c                   <the increments, twice>
+    ///   ADD p, p, s  ...                VT: CMP_BRANCH i op lim, VL
+    ///   T:                             BRANCH T
+    ///   CMP_BRANCH i op n, L           L: <the original loop>
+    ///
+    /// The body may hold loads at offset 0, then one store at offset 0 of
+    /// a value built from the loaded ones with + and - (or a plain copy),
+    /// and increments `x = x + y` / `x = x - y` of other registers, where y
+    /// is not written in the loop.  Every pointer must be advanced by an
+    /// ADD after its access, and the exit test must be the counted form
+    /// unroll() handles.  MUL is left scalar: NEON has no 64-bit lane
+    /// multiply.
+    ///
+    /// The checks fall back to the scalar loop unless every pointer step
+    /// is 8 and the store pointer is not 1-15 bytes past any load pointer
+    /// (the second lane would load before the first lane's store).  The
+    /// vector loop runs while at least three iterations are left, so the
+    /// original loop always finishes with one or two, which leaves every
+    /// register it writes as it would have.  The limit and the pointer
+    /// check use two `scratch` registers (see irScratchRegisters).
+    static std::vector<VectorizeDecision> vectorize(IRProgram &ir, const std::vector<std::string> &scratch) {
+        using I = IRInstruction;
+        static const char *const vregs[] = {
+            "v0",  "v1",  "v2",  "v3",  "v4",  "v5",  "v6",  "v7",      // v8-v15 are callee-saved
+            "v16", "v17", "v18", "v19", "v20", "v21", "v22", "v23",
+            "v24", "v25", "v26", "v27", "v28", "v29", "v30", "v31",
+        };
+        auto uses = labelUses(ir);
+        std::vector<std::string> pool = irUnnamed(ir, scratch);
+        size_t poolNext = 0;
+
+        std::vector<VectorizeDecision> decisions;
+        IRProgram out(ir.get_allocator());
+        out.reserve(ir.size());
+        for (size_t i = 0; i < ir.size(); ++i) {
+            RotatedLoop loop;
+            if (!rotatedLoop(ir, i, loop)) {
+                out.push_back(ir[i]);
+                continue;
+            }
+            const size_t b0 = loop.b0, b1 = loop.b1;
+            const std::string &testLabel = loop.testLabel;
+            VectorizeDecision d;
+            d.loop = loop.bodyLabel;
+            Induction ind = induction(ir, b0, b1, ir[b1 + 1]);
+
+            // loaded (vector) values, pointers and increments; vbody is the
+            // vector body without the increments
+            std::map<std::string, std::string> vec;        // scalar register -> vN, so far
+            std::map<std::string, std::string> steps;      // incremented register -> y (ADD only)
+            std::set<std::string> incremented;
+            std::vector<std::string> loads;
+            std::string store;
+            std::vector<I> vbody;
+            size_t nextV = 0;
+            auto isVec = [&](const std::string &r) { return vec.count(r) != 0; };
+            auto offsetZero = [](const I &in) { return in.src2.empty() && in.imm == "0"; };
+            auto newVec = [&](const std::string &r) {
+                if (nextV == std::size(vregs)) d.reason = "too many vector registers";
+                else vec[r] = vregs[nextV++];
+                return vec[r];
+            };
+            for (size_t k = b0; k < b1 && d.reason.empty(); ++k) {
+                const I &in = ir[k];
+                const bool def = isReg(in.dst) && !incremented.count(in.dst);
+                if (in.op == I::LOAD && offsetZero(in) && store.empty() && def &&
+                    in.dst != in.src1 && !isVec(in.src1) && !incremented.count(in.src1)) {
+                    loads.push_back(in.src1);
+                    vbody.push_back({I::VLOAD, newVec(in.dst), in.src1, {}, {}, {}, {}});
+                } else if ((in.op == I::ADD || in.op == I::SUB) && isVec(in.src1) && isVec(in.src2) && def) {
+                    std::string a = vec[in.src1], b = vec[in.src2];
+                    vbody.push_back({in.op == I::ADD ? I::VADD : I::VSUB, newVec(in.dst), a, b, {}, {}, {}});
+                } else if (in.op == I::MOV && isVec(in.src1) && def) {
+                    vec[in.dst] = vec[in.src1];
+                } else if (in.op == I::STORE && offsetZero(in) && store.empty() && isVec(in.src1) &&
+                           !isVec(in.dst) && !incremented.count(in.dst)) {
+                    store = in.dst;
+                    vbody.push_back({I::VSTORE, in.dst, vec[in.src1], {}, {}, {}, {}});
+                } else if ((in.op == I::ADD || in.op == I::SUB) && def && !isVec(in.dst) &&
+                           (in.src1 == in.dst || (in.op == I::ADD && in.src2 == in.dst))) {
+                    const std::string &y = (in.src1 == in.dst) ? in.src2 : in.src1;
+                    if (y == in.dst || isVec(y) || writes(ir, b0, b1, y))
+                        d.reason = "body is not element-wise";
+                    incremented.insert(in.dst);
+                    if (in.op == I::ADD && y != "xzr") steps[in.dst] = y;
+                } else {
+                    d.reason = "body is not element-wise";
+                }
+            }
+
+            // every pointer's step register, which must be 8 at run time
+            std::set<std::string> stepRegs;
+            std::vector<std::string> pointers = loads;
+            pointers.push_back(store);
+            if (d.reason.empty() && store.empty())
+                d.reason = "no store";
+            for (auto &p : pointers) {
+                if (!d.reason.empty()) break;
+                auto st = steps.find(p);
+                if (st == steps.end()) d.reason = "pointer " + p + " is not advanced by an ADD";
+                else stepRegs.insert(st->second);
+            }
+            if (!d.reason.empty()) {
+                // already rejected
+            } else if (uses[loop.bodyLabel] != 1 || uses[testLabel] != 1) {
+                d.reason = "other branches to the loop";
+            } else if (ind.iv.empty() || (ind.cond != "<" && ind.cond != "<=" &&
+                                          ind.cond != ">" && ind.cond != ">=")) {
+                d.reason = "not a counted loop";
+            } else if (pool.size() - poolNext < 2) {
+                d.reason = "no free register";
+            }
+            if (!d.reason.empty()) {
+                decisions.push_back(std::move(d));
+                out.push_back(ir[i]);
+                continue;
+            }
+            const std::string lim = pool[poolNext++], tmp = pool[poolNext++];
+
+            const std::string n = std::to_string(decisions.size());
+            const std::string vBody = "__vbody" + n, vTest = "__vtest" + n;
+
+            // runtime checks
+            bool up = (ind.cond == "<" || ind.cond == "<=");
+            bool wantPositive = (ind.stepOp == I::ADD) == up;
+            out.push_back({I::CMP_BRANCH, {}, ind.step, "xzr", testLabel, wantPositive ? "<=" : ">=", {}});
+            for (auto &s : stepRegs)
+                out.push_back({I::CMP_BRANCH, {}, s, "8", testLabel, "!=", {}});
+            std::set<std::string> checked;
+            for (auto &p : loads) {
+                if (p == store || !checked.insert(p).second) continue;
+                std::string ok = "__vok" + n + "_" + std::to_string(checked.size());
+                out.push_back({I::SUB, tmp, store, p, {}, {}, {}});
+                out.push_back({I::CMP_BRANCH, {}, tmp, "xzr", ok, "<=", {}});
+                out.push_back({I::CMP_BRANCH, {}, tmp, "16", testLabel, "<", {}});
+                out.push_back({I::LABEL, ok, {}, {}, {}, {}, {}});
+            }
+            I::Op back = (ind.stepOp == I::ADD) ? I::SUB : I::ADD;
+            out.push_back({back, lim, ind.bound, ind.step, {}, {}, {}});
+            out.push_back({back, lim, lim, ind.step, {}, {}, {}});
+
+            // vector loop
+            out.push_back({I::BRANCH, {}, {}, {}, vTest, {}, {}});
+            out.push_back({I::LABEL, vBody, {}, {}, {}, {}, {}});
+            out.insert(out.end(), vbody.begin(), vbody.end());
+            for (int copy = 0; copy < 2; ++copy)
+                for (size_t k = b0; k < b1; ++k)
+                    if (incremented.count(ir[k].dst) && ir[k].op != I::STORE) out.push_back(ir[k]);
+            out.push_back({I::LABEL, vTest, {}, {}, {}, {}, {}});
+            out.push_back({I::CMP_BRANCH, {}, ind.iv, lim, vBody, ind.cond, {}});
+
+            // the original loop, as the epilogue
+            out.push_back(ir[i]);
+            for (size_t k = i + 1; k <= b1 + 1; ++k) out.push_back(ir[k]);
+            i = b1 + 1;
+
+            d.lanes = 2;
+            decisions.push_back(std::move(d));
+        }
+        ir = std::move(out);
+        return decisions;
+    }
+
+    /// Inline direct calls (CALL_DIRECT) to small functions.  The callee's
+    /// body, from FUNC to ENDFUNC, is cloned in place of the call:
+    ///
+    ///   - its labels get a fresh `__inlN_` prefix;
+    ///   - each RET becomes a branch to a `__inlN_ret` label after the
+    ///     clone, except a final RET, which simply falls through;
+    ///   - callee-saved registers (x19-x28) it writes are renamed to
+    ///     `scratch` registers the IR does not name (callee-saved ones if
+    ///     the callee itself calls out), since the call used to restore
+    ///     them.
+    ///
+    /// A callee qualifies if it has at most `budget` instructions, is not
+    /// the function being inlined into, does not call itself, contains no
+    /// data and does not touch x29, x30 or sp.  Inlining repeats for up to
+    /// three rounds, so small callees of small callees are flattened too,
+    /// and stops once the program has grown by half.  The original
+    /// functions are kept for other callers.
+    static size_t inlineCalls(IRProgram &ir, const std::vector<std::string> &scratch, size_t budget = 12) {
+        using I = IRInstruction;
+        size_t inlined = 0, growth = 0;
+        const size_t growthCap = ir.size() / 2 + 32;
+        for (int round = 0; round < 3; ++round) {
+            // function name -> body [first, ENDFUNC)
+            std::map<std::string, std::pair<size_t, size_t>> funcs;
+            for (size_t i = 0; i < ir.size(); ++i) {
+                if (ir[i].op != I::FUNC) continue;
+                size_t e = i + 1;
+                while (e < ir.size() && ir[e].op != I::ENDFUNC) ++e;
+                funcs[ir[i].dst] = {i + 1, e};
+            }
+            std::vector<std::string> pool = irUnnamed(ir, scratch);
+
+            IRProgram out(ir.get_allocator());
+            out.reserve(ir.size());
+            size_t before = inlined;
+            std::string current;
+            for (size_t i = 0; i < ir.size(); ++i) {
+                const I &call = ir[i];
+                if (call.op == I::FUNC) current = call.dst;
+                if (call.op == I::ENDFUNC) current.clear();
+                auto f = funcs.find(call.label);
+                if (call.op != I::CALL_DIRECT || f == funcs.end() || f->first == current) {
+                    out.push_back(call);
+                    continue;
+                }
+                auto [b0, b1] = f->second;
+                std::map<std::string, std::string> regs;
+                if (b1 - b0 > budget || growth + (b1 - b0) > growthCap ||
+                    !inlinable(ir, b0, b1, call.label, pool, regs)) {
+                    out.push_back(call);
+                    continue;
+                }
+
+                std::string prefix = "__inl" + std::to_string(inlined) + "_";
+                std::set<std::string> local;
+                for (size_t k = b0; k < b1; ++k)
+                    if (ir[k].op == I::LABEL) local.insert(ir[k].dst);
+                for (auto &[from, to] : regs)
+                    if (readBeforeWrite(ir, b0, b1, from)) out.push_back({I::MOV, to, from, {}, {}, {}, {}});
+
+                bool usedRet = false;
+                for (size_t k = b0; k < b1; ++k) {
+                    I c = renamed(ir[k], regs);
+                    if (c.op == I::LABEL) c.dst = prefix + c.dst;
+                    if (local.count(c.label)) c.label = prefix + c.label;
+                    if (c.op == I::RET) {
+                        if (k + 1 == b1) continue;
+                        c = {I::BRANCH, {}, {}, {}, prefix + "ret", {}, {}};
+                        usedRet = true;
+                    }
+                    out.push_back(std::move(c));
+                }
+                if (usedRet) out.push_back({I::LABEL, prefix + "ret", {}, {}, {}, {}, {}});
+                growth += b1 - b0;
+                ++inlined;
+            }
+            ir = std::move(out);
+            if (inlined == before) break;
+        }
+        return inlined;
+    }
+
+    /// What forwardMemory() removed, for the --stats report.
+    struct MemoryStats {
+        size_t forwarded = 0;   // loads replaced by a MOV (or dropped)
+        size_t deadStores = 0;  // stores overwritten or rewriting the same value
+    };
+
+    /// Store-to-load forwarding, redundant load elimination and dead store
+    /// elimination within each basic block:
+    ///
+    ///   STORE [b + 8], v          STORE [b + 8], v
+    ///   LOAD d, [b + 8]     →     MOV d, v
+    ///
+    ///   STORE [b + 8], v    →     STORE [b + 8], w        (nothing read
+    ///   STORE [b + 8], w                                   [b + 8] between)
+    ///
+    /// Every access is a doubleword.  Two addresses off the same base with
+    /// decimal offsets alias only if the offsets are less than 8 apart;
+    /// anything else (different bases, index registers, label offsets)
+    /// may alias unless it is the same address written the same way.  A
+    /// fact dies when its base, index or value register is written.  Calls
+    /// clobber memory and registers, labels and branches end the block, and
+    /// a conditional branch counts as a read of every pending store, since
+    /// the taken side may load it.
+    static MemoryStats forwardMemory(IRProgram &ir) {
+        using I = IRInstruction;
+        struct Known { Address addr; std::string value; };     // memory holds value
+        struct Pending { Address addr; size_t store; };        // not read yet
+
+        MemoryStats stats;
+        std::vector<Known> known;
+        std::vector<Pending> pending;
+        std::vector<bool> dead(ir.size());
+        auto forget = [&](const std::string &r) {
+            if (r.empty() || r == "xzr") return;
+            std::erase_if(known, [&](const Known &k) { return k.addr.uses(r) || k.value == r; });
+            std::erase_if(pending, [&](const Pending &p) { return p.addr.uses(r); });
+        };
+
+        for (size_t i = 0; i < ir.size(); ++i) {
+            I &in = ir[i];
+            switch (in.op) {
+                case I::STORE: {
+                    Address a = Address::of(in);
+                    bool same = std::any_of(known.begin(), known.end(), [&](const Known &k) {
+                        return k.addr.same(a) && k.value == in.src1;
+                    });
+                    if (same) {
+                        dead[i] = true;
+                        ++stats.deadStores;
+                        break;
+                    }
+                    for (auto &p : pending)
+                        if (p.addr.same(a) && !dead[p.store]) {
+                            dead[p.store] = true;
+                            ++stats.deadStores;
+                        }
+                    std::erase_if(pending, [&](const Pending &p) { return p.addr.same(a); });
+                    std::erase_if(known, [&](const Known &k) { return k.addr.mayAlias(a); });
+                    known.push_back({a, in.src1});
+                    pending.push_back({a, i});
+                    break;
+                }
+                case I::LOAD: {
+                    Address a = Address::of(in);
+                    auto k = std::find_if(known.begin(), known.end(),
+                                          [&](const Known &e) { return e.addr.same(a); });
+                    if (k != known.end()) {
+                        std::string value = k->value;
+                        ++stats.forwarded;
+                        if (value == in.dst) {
+                            dead[i] = true;
+                            break;
+                        }
+                        in.op = I::MOV;
+                        in.src1 = value;
+                        in.src2.clear();
+                        in.imm.clear();
+                    } else {
+                        std::erase_if(pending, [&](const Pending &p) { return p.addr.mayAlias(a); });
+                    }
+                    // the destination now holds what is at a, as well
+                    forget(in.dst);
+                    if (!a.uses(in.dst)) known.push_back({a, in.dst});
+                    break;
+                }
+                case I::ADD: case I::SUB: case I::MUL: case I::DIV: case I::MOD:
+                case I::MOV: case I::SELECT:
+                    forget(in.dst);
+                    break;
+                case I::CMP_BRANCH:
+                    pending.clear();
+                    break;
+                default:        // calls, labels, branches, RET, data, function bounds
+                    known.clear();
+                    pending.clear();
+                    break;
+            }
+        }
+
+        size_t w = 0;
+        for (size_t r = 0; r < ir.size(); ++r)
+            if (!dead[r]) {
+                if (w != r) ir[w] = std::move(ir[r]);
+                ++w;
+            }
+        ir.resize(w);
+        return stats;
+    }
+
+private:
+    /// A LOAD/STORE address: base + offset, or base + index * scale.
+    struct Address {
+        std::string base, index, imm;
+        bool numeric = false;   // index is empty and imm is a decimal offset
+        long off = 0;
+
+        static Address of(const IRInstruction &in) {
+            Address a;
+            a.base = in.op == IRInstruction::STORE ? in.dst : in.src1;
+            a.index = in.src2;
+            a.imm = in.imm;
+            if (a.index.empty() && !a.imm.empty()) {
+                auto [end, ec] = std::from_chars(a.imm.data(), a.imm.data() + a.imm.size(), a.off);
+                a.numeric = ec == std::errc() && end == a.imm.data() + a.imm.size();
+            }
+            return a;
+        }
+
+        bool uses(const std::string &r) const { return base == r || index == r; }
+
+        bool same(const Address &o) const {
+            if (base != o.base || index != o.index) return false;
+            return (numeric && o.numeric) ? off == o.off : imm == o.imm;
+        }
+
+        bool mayAlias(const Address &o) const {
+            if (base == o.base && numeric && o.numeric) return off - o.off < 8 && o.off - off < 8;
+            return true;
+        }
+    };
+
+    static bool calleeSaved(const std::string &r) {
+        if (!isReg(r)) return false;
+        int n = std::stoi(r.substr(1));
+        return n >= 19 && n <= 28;
+    }
+
+    /// Can ir[b0, b1), the body of `name`, be inlined?  Fills `regs` with
+    /// fresh names for the callee-saved registers it writes, taken from
+    /// `pool`.
+    static bool inlinable(const IRProgram &ir, size_t b0, size_t b1, const std::string &name,
+                          std::vector<std::string> &pool, std::map<std::string, std::string> &regs) {
+        bool calls = false;
+        std::set<std::string> saved;
+        for (size_t k = b0; k < b1; ++k) {
+            const IRInstruction &in = ir[k];
+            if (in.op == IRInstruction::DATA8 || in.op == IRInstruction::FUNC) return false;
+            if (in.op == IRInstruction::CALL_DIRECT && in.label == name) return false;
+            if (in.op == IRInstruction::CALL || in.op == IRInstruction::CALL_DIRECT) calls = true;
+            if (in.op == IRInstruction::LABEL) continue;
+            for (const std::string *f : {&in.dst, &in.src1, &in.src2, &in.src3, &in.src4})
+                if (*f == "x29" || *f == "x30" || *f == "sp") return false;
+            if (in.op != IRInstruction::STORE && calleeSaved(in.dst)) saved.insert(in.dst);
+        }
+
+        std::vector<std::string> fresh;
+        for (auto &r : pool)
+            if (!calls || calleeSaved(r)) fresh.push_back(r);
+        if (fresh.size() < saved.size()) return false;
+        size_t n = 0;
+        for (auto &r : saved) {
+            regs[r] = fresh[n++];
+            pool.erase(std::find(pool.begin(), pool.end(), regs[r]));
+        }
+        return true;
+    }
+
+    /// Might ir[b0, b1) read r before writing it?  True unless the first
+    /// access is a write that comes before any label or branch.
+    static bool readBeforeWrite(const IRProgram &ir, size_t b0, size_t b1, const std::string &r) {
+        for (size_t k = b0; k < b1; ++k) {
+            const IRInstruction &in = ir[k];
+            if (in.op == IRInstruction::LABEL || in.op == IRInstruction::BRANCH ||
+                in.op == IRInstruction::CMP_BRANCH)
+                return true;
+            for (const std::string *f : {&in.src1, &in.src2, &in.src3, &in.src4})
+                if (*f == r) return true;
+            if (in.dst == r) return in.op == IRInstruction::STORE;
+        }
+        return true;
+    }
+
+    static std::string mirror(const std::string &cond) {
+        if (cond == "<")  return ">";
+        if (cond == "<=") return ">=";
+        if (cond == ">")  return "<";
+        if (cond == ">=") return "<=";
+        return cond;
+    }
+
+    static bool isReg(const std::string &s) {
+        return s.size() >= 2 && s[0] == 'x' && s[1] >= '0' && s[1] <= '9';
+    }
+
+    static bool straightLine(const IRProgram &ir, size_t b0, size_t b1) {
+        for (size_t k = b0; k < b1; ++k)
+            switch (ir[k].op) {
+                case IRInstruction::ADD: case IRInstruction::SUB: case IRInstruction::MUL:
+                case IRInstruction::DIV: case IRInstruction::MOD: case IRInstruction::MOV:
+                case IRInstruction::LOAD: case IRInstruction::STORE: case IRInstruction::SELECT:
+                    break;
+                default:
+                    return false;
+            }
+        return true;
+    }
+
+    /// Does ir[b0, b1) write register r?  (Only meaningful for straight-line code.)
+    static bool writes(const IRProgram &ir, size_t b0, size_t b1, const std::string &r) {
+        for (size_t k = b0; k < b1; ++k)
+            if (ir[k].op != IRInstruction::STORE && ir[k].op != IRInstruction::VSTORE &&
+                ir[k].dst == r)
+                return true;
+        return false;
+    }
+
+    /// A `while` loop in the rotated form the parser emits, starting at
+    /// ir[i]:  BRANCH T;  L: <body>;  T: CMP_BRANCH i op n, L.
+    struct RotatedLoop {
+        std::string bodyLabel, testLabel;
+        size_t b0 = 0, b1 = 0;      // body; ir[b1] is T, ir[b1 + 1] the test
+    };
+
+    static bool rotatedLoop(const IRProgram &ir, size_t i, RotatedLoop &loop) {
+        using I = IRInstruction;
+        if (ir[i].op != I::BRANCH || i + 1 >= ir.size() || ir[i + 1].op != I::LABEL) return false;
+        size_t t = i + 2;
+        while (t < ir.size() && !(ir[t].op == I::LABEL && ir[t].dst == ir[i].label) &&
+               ir[t].op != I::FUNC && ir[t].op != I::ENDFUNC)
+            ++t;
+        if (t + 1 >= ir.size() || ir[t].op != I::LABEL ||
+            ir[t + 1].op != I::CMP_BRANCH || ir[t + 1].label != ir[i + 1].dst)
+            return false;
+        loop = {ir[i + 1].dst, ir[t].dst, i + 2, t};
+        return true;
+    }
+
+    /// The counted-loop shape of a straight-line body: the test reads
+    /// `iv cond bound` (mirrored if the parser wrote it the other way
+    /// round), the body writes iv once, by `iv = iv + step` or
+    /// `iv = iv - step`, and writes neither step nor bound.  iv is empty
+    /// if there is no such register.
+    struct Induction {
+        std::string iv, step, bound, cond;
+        IRInstruction::Op stepOp = IRInstruction::ADD;
+    };
+
+    static Induction induction(const IRProgram &ir, size_t b0, size_t b1, const IRInstruction &test) {
+        using I = IRInstruction;
+        Induction ind;
+        ind.cond = test.cond;
+        for (int side = 0; side < 2 && ind.iv.empty(); ++side) {
+            std::string c = side ? test.src2 : test.src1;
+            std::string other = side ? test.src1 : test.src2;
+            const I *inc = nullptr;
+            bool ok = c != "xzr" && !writes(ir, b0, b1, other);
+            for (size_t k = b0; k < b1 && ok; ++k) {
+                if (ir[k].op == I::STORE || ir[k].op == I::VSTORE || ir[k].dst != c) continue;
+                ok = !inc;
+                inc = &ir[k];
+            }
+            if (!ok || !inc || (inc->op != I::ADD && inc->op != I::SUB)) continue;
+            std::string s = (inc->src1 == c) ? inc->src2
+                          : (inc->op == I::ADD && inc->src2 == c) ? inc->src1 : std::string();
+            if (s.empty() || s == c || s == "xzr" || writes(ir, b0, b1, s)) continue;
+            ind.iv = c;
+            ind.step = s;
+            ind.bound = other;
+            ind.stepOp = inc->op;
+            if (side) ind.cond = mirror(ind.cond);
+        }
+        return ind;
+    }
+
+    /// Registers other than `iv` whose first access in ir[b0, b1) is a write.
+    static std::vector<std::string> iterationTemps(const IRProgram &ir, size_t b0, size_t b1,
+                                                   const std::string &iv) {
+        std::set<std::string> seen;
+        std::vector<std::string> temps;
+        for (size_t k = b0; k < b1; ++k) {
+            const IRInstruction &in = ir[k];
+            bool store = in.op == IRInstruction::STORE;
+            for (const std::string *f : {&in.src1, &in.src2, &in.src3, &in.src4})
+                if (isReg(*f)) seen.insert(*f);
+            if (store) {
+                seen.insert(in.dst);
+            } else if (isReg(in.dst) && seen.insert(in.dst).second && in.dst != iv) {
+                temps.push_back(in.dst);
+            }
+        }
+        return temps;
+    }
+
+    static IRInstruction renamed(IRInstruction in, const std::map<std::string, std::string> &m) {
+        for (std::string *f : {&in.dst, &in.src1, &in.src2, &in.src3, &in.src4}) {
+            auto it = m.find(*f);
+            if (it != m.end()) *f = it->second;
+        }
+        return in;
+    }
+};
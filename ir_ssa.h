@@ -0,0 +1,866 @@
+#pragma once
+
+#include "ir.h"
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+/// SSA form for the IR, and the -O1 optimisations that run on it.
+///
+/// IRSSA::optimize splits the program into regions (each function body,
+/// and each stretch of top-level code between functions) and, per region:
+///
+///   1. builds the CFG and its dominator tree (Cooper-Harvey-Kennedy),
+///      places phis on the iterated dominance frontiers of each register's
+///      definitions and renames every operand to the SSA value it reads.
+///      A value defined by MOV is read from the MOV's source instead while
+///      that register still holds it (copy propagation);
+///   2. runs sparse conditional constant propagation: CMP_BRANCHes with a
+///      known outcome become BRANCH (or nothing), SELECTs with a known
+///      condition become MOV, code in blocks no executable edge reaches is
+///      deleted, and operands known to be zero read xzr;
+///   3. deletes definitions nothing reads anymore and leaves SSA: phis
+///      become parallel copies at the end of their predecessors,
+///      sequentialised with a scratch register when they form a cycle.
+///
+/// Every value stays in the register it was defined in, so leaving SSA
+/// needs no register allocation.  The only copies are for phi arguments
+/// that copy propagation moved to another register, and those are only
+/// moved on edges out of single-successor blocks, so no critical edge
+/// has to be split.
+///
+/// The IR has no immediate moves, so xzr is the only constant source; the
+/// lattice still tracks 64-bit values, so x - x, x * 0 and comparisons of
+/// a value with itself fold too.  Calls clobber every register, labels
+/// referenced from other regions, .8byte or a direct call are extra
+/// entries with unknown register values, and every register counts as
+/// live wherever control leaves the region.  All steps are linear in the
+/// region size except the dominator iteration, which converges in a few
+/// rounds on the reducible CFGs the parser emits.
+class IRSSA {
+public:
+    struct Stats {
+        size_t branches = 0;        // CMP_BRANCH / SELECT conditions folded
+        size_t rewritten = 0;       // operands now reading xzr or a copy source
+        size_t dead = 0;            // definitions deleted
+        size_t unreachable = 0;     // instructions in unreachable blocks deleted
+    };
+
+    /// `scratch` is the pool of irScratchRegisters; one the IR does not
+    /// name breaks copy cycles.
+    static Stats optimize(IRProgram &ir, const std::vector<std::string> &scratch) {
+        using I = IRInstruction;
+        Stats stats;
+
+        // regions: maximal runs of instructions between FUNC / ENDFUNC
+        std::vector<int> regionOf(ir.size(), -1);
+        int regions = 0;
+        bool open = false;
+        for (size_t i = 0; i < ir.size(); ++i) {
+            if (ir[i].op == I::FUNC || ir[i].op == I::ENDFUNC) { open = false; continue; }
+            if (!open) { ++regions; open = true; }
+            regionOf[i] = regions - 1;
+        }
+
+        // labels entered from outside their own region
+        std::unordered_map<std::string, int> labelRegion;
+        for (size_t i = 0; i < ir.size(); ++i)
+            if (ir[i].op == I::LABEL) labelRegion[ir[i].dst] = regionOf[i];
+        std::unordered_map<std::string, bool> external;
+        for (size_t i = 0; i < ir.size(); ++i) {
+            const I &in = ir[i];
+            if (in.op == I::DATA8) external[in.imm] = true;
+            else if (in.op == I::CALL_DIRECT) external[in.label] = true;
+            else if (in.op == I::BRANCH || in.op == I::CMP_BRANCH) {
+                auto it = labelRegion.find(in.label);
+                if (it != labelRegion.end() && it->second != regionOf[i]) external[in.label] = true;
+            }
+        }
+        int cycle = freeRegister(ir, scratch);
+
+        IRProgram out(ir.get_allocator());
+        out.reserve(ir.size());
+        for (size_t i = 0; i < ir.size();) {
+            if (regionOf[i] < 0) { out.push_back(ir[i++]); continue; }
+            size_t end = i;
+            while (end < ir.size() && regionOf[end] == regionOf[i]) ++end;
+            Region r(ir, i, end, external, cycle);
+            r.optimize(out, stats);
+            i = end;
+        }
+        ir = std::move(out);
+        return stats;
+    }
+
+private:
+    enum : int { kXZR = 31, kSP = 32, kNone = -1 };
+    enum : int { kUnknown = 0, kZero = 1, kEntry = 2 };     // predefined values
+    enum Lattice : uint8_t { TOP, CONST, BOTTOM };
+
+    static int regIndex(const std::string &s) {
+        if (s == "xzr") return kXZR;
+        if (s == "sp") return kSP;
+        if (s.size() < 2 || s.size() > 3 || s[0] != 'x') return kNone;
+        int v = 0;
+        for (size_t k = 1; k < s.size(); ++k) {
+            if (s[k] < '0' || s[k] > '9') return kNone;
+            v = v * 10 + (s[k] - '0');
+        }
+        return v <= 30 ? v : kNone;
+    }
+
+    static std::string regName(int r) {
+        if (r == kXZR) return "xzr";
+        if (r == kSP) return "sp";
+        return "x" + std::to_string(r);
+    }
+
+    /// A register of `scratch` no instruction mentions, for breaking copy
+    /// cycles (x16/x17 first); -1 if there is none.
+    static int freeRegister(const IRProgram &ir, const std::vector<std::string> &scratch) {
+        std::vector<std::string> free = irUnnamed(ir, scratch);
+        for (const char *r : {"x16", "x17"})
+            if (std::find(free.begin(), free.end(), r) != free.end()) return regIndex(r);
+        return free.empty() ? -1 : regIndex(free.front());
+    }
+
+    // operand fields of an instruction: dst, src1, src2, src3, src4
+    static std::string &field(IRInstruction &in, int f) {
+        switch (f) {
+            case 0: return in.dst;
+            case 1: return in.src1;
+            case 2: return in.src2;
+            case 3: return in.src3;
+            default: return in.src4;
+        }
+    }
+
+    static const std::string &field(const IRInstruction &in, int f) {
+        return field(const_cast<IRInstruction &>(in), f);
+    }
+
+    static bool isUse(const IRInstruction &in, int f) {
+        using I = IRInstruction;
+        switch (in.op) {
+            case I::ADD: case I::SUB: case I::MUL: case I::DIV: case I::MOD:
+            case I::CMP_BRANCH:
+                return f == 1 || f == 2;
+            case I::MOV: case I::CALL:
+                return f == 1;
+            case I::LOAD:
+                return f == 1 || (f == 2 && !in.src2.empty());
+            case I::STORE:
+                return f == 0 || f == 1 || (f == 2 && !in.src2.empty());
+            case I::SELECT:
+                return f >= 1;
+            default:
+                return false;
+        }
+    }
+
+    static bool defines(const IRInstruction &in) {
+        using I = IRInstruction;
+        switch (in.op) {
+            case I::ADD: case I::SUB: case I::MUL: case I::DIV: case I::MOD:
+            case I::MOV: case I::LOAD: case I::SELECT:
+                return true;
+            default:
+                return false;
+        }
+    }
+
+    /// Can field f read xzr once lowered?  (add/sub take sp as the first
+    /// source and IRCodeGen swaps a zero away only for ADD and SUB;
+    /// addresses cannot take a zero register.)
+    static bool xzrAllowed(const IRInstruction &in, int f) {
+        using I = IRInstruction;
+        switch (in.op) {
+            case I::ADD: case I::SUB: case I::MUL: case I::DIV: case I::MOD: case I::CMP_BRANCH:
+                return f == 1 || f == 2;
+            case I::MOV:
+                return f == 1;
+            case I::STORE:
+                return f == 1;
+            case I::SELECT:
+                return f >= 1;
+            default:
+                return false;
+        }
+    }
+
+    struct Operand {
+        int value = -1;     // SSA value read
+        int reg = kNone;    // register it is read from
+    };
+
+    struct Value {
+        int def = -1;               // defining instruction (region index), or -1
+        int phi = -1;               // defining phi, or -1
+        Operand copy;               // for a MOV: the operand it copies
+    };
+
+    struct Phi {
+        int block, var, value;
+        std::vector<Operand> args;  // one per predecessor
+        bool live = false;
+    };
+
+    struct Block {
+        size_t begin = 0, end = 0;      // region instruction range
+        int fall = -1, taken = -1;      // successors; -1: none / leaves the region
+        int fallPos = -1, takenPos = -1;
+        bool fallExits = false, takenExits = false;
+        std::vector<int> preds, phis;
+        std::vector<char> predExec;
+    };
+
+    class Region {
+    public:
+        Region(const IRProgram &ir, size_t begin, size_t end,
+               const std::unordered_map<std::string, bool> &external, int scratch)
+            : ir_(ir), base_(begin), n_(end - begin), scratch_(scratch) {
+            buildCFG(external);
+            dominators();
+            placePhis();
+            rename();
+        }
+
+        void optimize(IRProgram &out, Stats &stats) {
+            propagate();
+            rewrite(stats);
+            sweep();
+            emit(out, stats);
+        }
+
+    private:
+        using I = IRInstruction;
+        const IRProgram &ir_;
+        size_t base_, n_;
+        int scratch_;
+
+        std::vector<Block> blocks_;             // 0 is the virtual root
+        std::vector<int> blockOf_;              // region index -> block
+        std::vector<std::pair<int, int>> entries_;   // root successors (block, pred position)
+        std::vector<int> rpo_, rpoNum_, idom_;
+        std::vector<Phi> phis_;
+        std::vector<Value> values_;
+        std::vector<std::array<Operand, 5>> opnd_;
+        std::vector<int> defVal_;
+        std::vector<int> exitLive_;             // values live where control leaves the region
+
+        // SCCP state
+        std::vector<uint8_t> lat_;
+        std::vector<uint64_t> const_;
+        std::vector<char> exec_;
+
+        // rewrite / sweep state
+        std::vector<IRInstruction> code_;       // rewritten instructions
+        std::vector<char> keep_;
+
+        const I &at(size_t li) const { return ir_[base_ + li]; }
+
+        // ---- CFG ----
+
+        int addEdge(int from, int to) {
+            blocks_[to].preds.push_back(from);
+            return static_cast<int>(blocks_[to].preds.size()) - 1;
+        }
+
+        void buildCFG(const std::unordered_map<std::string, bool> &external) {
+            blocks_.emplace_back();                             // root
+            blockOf_.assign(n_, 0);
+            std::unordered_map<std::string, int> labelBlock;
+            for (size_t li = 0; li < n_;) {
+                Block b;
+                b.begin = li;
+                do {
+                    const I &in = at(li++);
+                    if (in.op == I::CMP_BRANCH || in.op == I::BRANCH || in.op == I::RET) break;
+                } while (li < n_ && at(li).op != I::LABEL);
+                b.end = li;
+                int id = static_cast<int>(blocks_.size());
+                for (size_t k = b.begin; k < b.end; ++k) blockOf_[k] = id;
+                if (at(b.begin).op == I::LABEL) labelBlock[at(b.begin).dst] = id;
+                blocks_.push_back(std::move(b));
+            }
+
+            auto target = [&](const std::string &label) {
+                auto it = labelBlock.find(label);
+                return it == labelBlock.end() ? -1 : it->second;
+            };
+            int nb = static_cast<int>(blocks_.size());
+            for (int id = 1; id < nb; ++id) {
+                const I &last = at(blocks_[id].end - 1);
+                bool falls = last.op != I::BRANCH && last.op != I::RET;
+                if (last.op == I::BRANCH || last.op == I::CMP_BRANCH) {
+                    int t = target(last.label);
+                    if (t < 0) blocks_[id].takenExits = true;
+                    else { blocks_[id].taken = t; blocks_[id].takenPos = addEdge(id, t); }
+                }
+                if (falls) {
+                    if (id + 1 >= nb) blocks_[id].fallExits = true;
+                    else { blocks_[id].fall = id + 1; blocks_[id].fallPos = addEdge(id, id + 1); }
+                }
+            }
+
+            // entries: the first block, and labels entered from elsewhere
+            if (nb > 1) entries_.push_back({1, addEdge(0, 1)});
+            for (auto &[label, id] : labelBlock) {
+                auto it = external.find(label);
+                if (it != external.end() && it->second && id != 1)
+                    entries_.push_back({id, addEdge(0, id)});
+            }
+            for (auto &b : blocks_) b.predExec.assign(b.preds.size(), 0);
+        }
+
+        template <typename F>
+        void forEachSucc(int b, F f) const {
+            if (b == 0) {
+                for (auto [s, pos] : entries_) f(s, pos);
+                return;
+            }
+            const Block &bl = blocks_[b];
+            if (bl.fall >= 0) f(bl.fall, bl.fallPos);
+            if (bl.taken >= 0) f(bl.taken, bl.takenPos);
+        }
+
+        int succCount(int b) const {
+            const Block &bl = blocks_[b];
+            return (bl.fall >= 0 || bl.fallExits) + (bl.taken >= 0 || bl.takenExits);
+        }
+
+        void dominators() {
+            int nb = static_cast<int>(blocks_.size());
+            rpoNum_.assign(nb, -1);
+            idom_.assign(nb, -1);
+
+            // iterative DFS for the reverse postorder
+            std::vector<char> seen(nb, 0);
+            std::vector<std::pair<int, int>> stack{{0, 0}};
+            seen[0] = 1;
+            std::vector<int> post;
+            while (!stack.empty()) {
+                auto &[b, k] = stack.back();
+                int next = -1, idx = 0, resume = 0;
+                forEachSucc(b, [&](int s, int) {
+                    if (next < 0 && idx >= k && !seen[s]) { next = s; resume = idx + 1; }
+                    ++idx;
+                });
+                if (next < 0) {
+                    post.push_back(b);
+                    stack.pop_back();
+                    continue;
+                }
+                k = resume;
+                seen[next] = 1;
+                stack.push_back({next, 0});
+            }
+            rpo_.assign(post.rbegin(), post.rend());
+            for (size_t k = 0; k < rpo_.size(); ++k) rpoNum_[rpo_[k]] = static_cast<int>(k);
+
+            auto intersect = [&](int a, int b) {
+                while (a != b) {
+                    while (rpoNum_[a] > rpoNum_[b]) a = idom_[a];
+                    while (rpoNum_[b] > rpoNum_[a]) b = idom_[b];
+                }
+                return a;
+            };
+            idom_[0] = 0;
+            for (bool changed = true; changed;) {
+                changed = false;
+                for (size_t k = 1; k < rpo_.size(); ++k) {
+                    int b = rpo_[k], d = -1;
+                    for (int p : blocks_[b].preds)
+                        if (idom_[p] >= 0) d = (d < 0) ? p : intersect(p, d);
+                    if (d != idom_[b]) { idom_[b] = d; changed = true; }
+                }
+            }
+        }
+
+        // ---- phi placement ----
+
+        void placePhis() {
+            int nb = static_cast<int>(blocks_.size());
+            // dominance frontiers
+            std::vector<std::vector<int>> df(nb);
+            std::vector<int> stamp(nb, -1);
+            for (int b = 1; b < nb; ++b) {
+                if (idom_[b] < 0) continue;
+                int reachablePreds = 0;
+                for (int p : blocks_[b].preds) reachablePreds += idom_[p] >= 0;
+                if (reachablePreds < 2) continue;
+                for (int p : blocks_[b].preds) {
+                    for (int runner = p; idom_[p] >= 0 && runner != idom_[b]; runner = idom_[runner]) {
+                        if (stamp[runner] == b) break;
+                        stamp[runner] = b;
+                        df[runner].push_back(b);
+                    }
+                }
+            }
+
+            // registers each block writes (the root defines them all); every
+            // register counts as read where control leaves the region, so
+            // there is no pruning by liveness
+            const uint32_t all = (1u << 31) - 1;
+            std::vector<uint32_t> defMask(nb, 0);
+            defMask[0] = all;
+            for (int b = 1; b < nb; ++b) {
+                for (size_t li = blocks_[b].begin; li < blocks_[b].end; ++li) {
+                    const I &in = at(li);
+                    if (in.op == I::CALL || in.op == I::CALL_DIRECT) defMask[b] = all;
+                    else if (defines(in)) {
+                        int r = regIndex(in.dst);
+                        if (r >= 0 && r <= 30) defMask[b] |= 1u << r;
+                    }
+                }
+            }
+
+            std::vector<int> hasPhi(nb, -1), queued(nb, -1), work;
+            for (int v = 0; v <= 30; ++v) {
+                work.clear();
+                for (int b = 0; b < nb; ++b)
+                    if ((defMask[b] & (1u << v)) && idom_[b] >= 0) { work.push_back(b); queued[b] = v; }
+                while (!work.empty()) {
+                    int d = work.back();
+                    work.pop_back();
+                    for (int y : df[d]) {
+                        if (hasPhi[y] == v) continue;
+                        hasPhi[y] = v;
+                        Phi p{y, v, -1, std::vector<Operand>(blocks_[y].preds.size()), false};
+                        blocks_[y].phis.push_back(static_cast<int>(phis_.size()));
+                        phis_.push_back(std::move(p));
+                        if (queued[y] != v) { queued[y] = v; work.push_back(y); }
+                    }
+                }
+            }
+        }
+
+        // ---- renaming ----
+
+        int newValue(int def, int phi) {
+            values_.push_back({def, phi, {}});
+            return static_cast<int>(values_.size()) - 1;
+        }
+
+        void rename() {
+            values_.assign(3, Value{});                     // kUnknown, kZero, kEntry
+            opnd_.assign(n_, {});
+            defVal_.assign(n_, -1);
+            for (auto &p : phis_) p.value = newValue(-1, static_cast<int>(&p - phis_.data()));
+
+            std::array<std::vector<int>, 31> stack;
+            for (auto &s : stack) s.push_back(kEntry);
+            std::vector<std::pair<int, int>> log;           // (register, value) pushes
+            auto top = [&](int r) { return stack[r].back(); };
+            auto push = [&](int r, int v) { stack[r].push_back(v); log.push_back({r, v}); };
+
+            // what an operand naming register r reads here, after copy propagation
+            auto read = [&](int r, bool zeroOk) -> Operand {
+                if (r == kXZR) return {kZero, kXZR};
+                if (r < 0 || r > 30) return {kUnknown, r};
+                Operand o{top(r), r};
+                const Operand &c = values_[o.value].copy;
+                if (c.value >= 0 && ((c.reg == kXZR && zeroOk) ||
+                                     (c.reg >= 0 && c.reg <= 30 && top(c.reg) == c.value)))
+                    o = c;
+                return o;
+            };
+            auto liveOut = [&]() {
+                for (int r = 0; r <= 30; ++r) exitLive_.push_back(top(r));
+            };
+
+            int nb = static_cast<int>(blocks_.size());
+            std::vector<std::vector<int>> children(nb);
+            for (int b = 1; b < nb; ++b)
+                if (idom_[b] >= 0) children[idom_[b]].push_back(b);
+
+            // (block, log size on entry); a negative block marks the exit
+            std::vector<std::pair<int, size_t>> work{{0, 0}};
+            while (!work.empty()) {
+                auto [b, mark] = work.back();
+                work.pop_back();
+                if (b < 0) {
+                    while (log.size() > mark) { stack[log.back().first].pop_back(); log.pop_back(); }
+                    continue;
+                }
+                mark = log.size();
+                Block &bl = blocks_[b];
+                for (int p : bl.phis) push(phis_[p].var, phis_[p].value);
+
+                for (size_t li = bl.begin; b != 0 && li < bl.end; ++li) {
+                    const I &in = at(li);
+                    for (int f = 0; f < 5; ++f) {
+                        if (!isUse(in, f)) continue;
+                        int r = regIndex(field(in, f));
+                        opnd_[li][f] = read(r, xzrAllowed(in, f));
+                        // the mod sequence writes its destination before it
+                        // has read both sources, so it keeps its own operand
+                        // rather than read a copy in its destination
+                        if (in.op == I::MOD && opnd_[li][f].reg != r &&
+                            opnd_[li][f].reg == regIndex(in.dst))
+                            opnd_[li][f] = {top(r), r};
+                    }
+                    if (in.op == I::RET) liveOut();
+                    if (in.op == I::CALL || in.op == I::CALL_DIRECT) {
+                        liveOut();
+                        int v = newValue(static_cast<int>(li), -1);     // clobbered by the call
+                        for (int r = 0; r <= 30; ++r) push(r, v);
+                    } else if (defines(in)) {
+                        int r = regIndex(in.dst);
+                        int v = newValue(static_cast<int>(li), -1);
+                        defVal_[li] = v;
+                        if (in.op == I::MOV) values_[v].copy = opnd_[li][1];
+                        if (r >= 0 && r <= 30) push(r, v);
+                    }
+                }
+                if (b != 0 && (bl.fallExits || bl.takenExits)) liveOut();
+
+                // phi arguments; moved to the copy source only out of
+                // single-successor blocks, so the copy lands on that block
+                bool single = b != 0 && succCount(b) == 1 && scratch_ >= 0;
+                forEachSucc(b, [&](int s, int pos) {
+                    for (int p : blocks_[s].phis) {
+                        int r = phis_[p].var;
+                        phis_[p].args[pos] = single ? read(r, true) : Operand{top(r), r};
+                    }
+                });
+
+                work.push_back({-1, mark});
+                for (auto it = children[b].rbegin(); it != children[b].rend(); ++it)
+                    work.push_back({*it, 0});
+            }
+        }
+
+        // ---- sparse conditional constant propagation ----
+
+        /// Do a and b read the same value?  The entry value and call
+        /// clobbers stand for every register at once, so they must also
+        /// name the same register.
+        bool same(const Operand &a, const Operand &b) const {
+            if (a.value != b.value || a.value == kUnknown) return false;
+            const Value &v = values_[a.value];
+            bool shared = a.value == kEntry || (v.def >= 0 && defVal_[v.def] != a.value);
+            return !shared || a.reg == b.reg;
+        }
+
+        /// Outcome of `a cond b`: 0 / 1, or -1 if not known yet (TOP), or 2 if
+        /// it can go either way.
+        int decide(const Operand &a, const Operand &b, const std::string &cond) const {
+            if (same(a, b))
+                return cond == "==" || cond == "<=" || cond == ">=";
+            uint8_t la = lat_[a.value], lb = lat_[b.value];
+            if (la == TOP || lb == TOP) return -1;
+            if (la == BOTTOM || lb == BOTTOM) return 2;
+            auto x = static_cast<int64_t>(const_[a.value]), y = static_cast<int64_t>(const_[b.value]);
+            if (cond == "==") return x == y;
+            if (cond == "!=") return x != y;
+            if (cond == "<")  return x < y;
+            if (cond == "<=") return x <= y;
+            if (cond == ">")  return x > y;
+            return x >= y;
+        }
+
+        void propagate() {
+            size_t nv = values_.size();
+            lat_.assign(nv, TOP);
+            const_.assign(nv, 0);
+            lat_[kUnknown] = BOTTOM;
+            lat_[kZero] = CONST;
+            lat_[kEntry] = BOTTOM;
+            for (size_t v = 3; v < nv; ++v)
+                if (values_[v].def >= 0 && defVal_[values_[v].def] != static_cast<int>(v))
+                    lat_[v] = BOTTOM;                       // call clobbers
+            exec_.assign(blocks_.size(), 0);
+
+            // users of each value: instruction li, or ~phi
+            std::vector<uint32_t> start(nv + 1, 0);
+            auto eachUse = [&](auto f) {
+                for (size_t li = 0; li < n_; ++li)
+                    for (int k = 0; k < 5; ++k)
+                        if (opnd_[li][k].value >= 0) f(opnd_[li][k].value, static_cast<int>(li));
+                for (size_t p = 0; p < phis_.size(); ++p)
+                    for (auto &a : phis_[p].args)
+                        if (a.value >= 0) f(a.value, ~static_cast<int>(p));
+            };
+            eachUse([&](int v, int) { ++start[v + 1]; });
+            for (size_t v = 0; v < nv; ++v) start[v + 1] += start[v];
+            std::vector<int> users(start[nv]);
+            std::vector<uint32_t> fill(start.begin(), start.end() - 1);
+            eachUse([&](int v, int u) { users[fill[v]++] = u; });
+
+            std::vector<std::pair<int, int>> flow(entries_.begin(), entries_.end());
+            std::vector<int> ssa;
+
+            auto lower = [&](int v, uint8_t l, uint64_t c) {
+                if (v < 0 || l == TOP || lat_[v] == BOTTOM) return;
+                if (lat_[v] == l && (l != CONST || const_[v] == c)) return;
+                if (lat_[v] == CONST && l == CONST) l = BOTTOM;     // a second constant
+                lat_[v] = l;
+                const_[v] = c;
+                ssa.push_back(v);
+            };
+
+            auto visitPhi = [&](int p) {
+                const Phi &ph = phis_[p];
+                const Block &bl = blocks_[ph.block];
+                uint8_t l = TOP;
+                uint64_t c = 0;
+                for (size_t k = 0; k < ph.args.size() && l != BOTTOM; ++k) {
+                    if (!bl.predExec[k]) continue;
+                    int a = ph.args[k].value;
+                    if (lat_[a] == TOP) continue;
+                    if (lat_[a] == BOTTOM || (l == CONST && const_[a] != c)) l = BOTTOM;
+                    else { l = CONST; c = const_[a]; }
+                }
+                lower(ph.value, l, c);
+            };
+
+            auto edge = [&](int s, int pos) { if (s >= 0) flow.push_back({s, pos}); };
+
+            auto visit = [&](size_t li) {
+                const I &in = at(li);
+                const auto &o = opnd_[li];
+                int b = blockOf_[li];
+                switch (in.op) {
+                    case I::CMP_BRANCH: {
+                        int d = decide(o[1], o[2], in.cond);
+                        if (d == 1 || d == 2) edge(blocks_[b].taken, blocks_[b].takenPos);
+                        if (d == 0 || d == 2) edge(blocks_[b].fall, blocks_[b].fallPos);
+                        return;
+                    }
+                    case I::SELECT: {
+                        int d = decide(o[1], o[2], in.cond);
+                        if (d == 0 || d == 1) {
+                            int a = o[d ? 3 : 4].value;
+                            lower(defVal_[li], lat_[a], const_[a]);
+                        } else if (d == 2) {
+                            int a = o[3].value, e = o[4].value;
+                            if (lat_[a] == TOP || lat_[e] == TOP) return;
+                            bool eq = lat_[a] == CONST && lat_[e] == CONST && const_[a] == const_[e];
+                            lower(defVal_[li], eq ? CONST : BOTTOM, const_[a]);
+                        }
+                        return;
+                    }
+                    case I::MOV:
+                        lower(defVal_[li], lat_[o[1].value], const_[o[1].value]);
+                        return;
+                    case I::ADD: case I::SUB: case I::MUL: case I::DIV: case I::MOD: {
+                        int a = o[1].value, e = o[2].value;
+                        bool zeroA = lat_[a] == CONST && const_[a] == 0;
+                        bool zeroE = lat_[e] == CONST && const_[e] == 0;
+                        if ((in.op == I::MUL && (zeroA || zeroE)) ||
+                            ((in.op == I::SUB || in.op == I::MOD) && same(o[1], o[2]))) {
+                            lower(defVal_[li], CONST, 0);
+                            return;
+                        }
+                        if (lat_[a] == TOP || lat_[e] == TOP) return;
+                        if (lat_[a] == BOTTOM || lat_[e] == BOTTOM) { lower(defVal_[li], BOTTOM, 0); return; }
+                        lower(defVal_[li], CONST, fold(in.op, const_[a], const_[e]));
+                        return;
+                    }
+                    case I::LOAD:
+                        lower(defVal_[li], BOTTOM, 0);
+                        return;
+                    default:
+                        return;
+                }
+            };
+
+            while (!flow.empty() || !ssa.empty()) {
+                while (!flow.empty()) {
+                    auto [b, pos] = flow.back();
+                    flow.pop_back();
+                    Block &bl = blocks_[b];
+                    if (bl.predExec[pos]) continue;
+                    bl.predExec[pos] = 1;
+                    for (int p : bl.phis) visitPhi(p);
+                    if (exec_[b]) continue;
+                    exec_[b] = 1;
+                    for (size_t li = bl.begin; li < bl.end; ++li) visit(li);
+                    const I &last = at(bl.end - 1);
+                    if (last.op == I::BRANCH) edge(bl.taken, bl.takenPos);
+                    else if (last.op != I::RET && last.op != I::CMP_BRANCH) edge(bl.fall, bl.fallPos);
+                }
+                while (!ssa.empty() && flow.empty()) {
+                    int v = ssa.back();
+                    ssa.pop_back();
+                    for (uint32_t k = start[v]; k < start[v + 1]; ++k) {
+                        int u = users[k];
+                        if (u < 0) {
+                            if (exec_[phis_[~u].block]) visitPhi(~u);
+                        } else if (exec_[blockOf_[u]]) {
+                            visit(static_cast<size_t>(u));
+                        }
+                    }
+                }
+            }
+        }
+
+        static uint64_t fold(IRInstruction::Op op, uint64_t a, uint64_t b) {
+            auto sa = static_cast<int64_t>(a), sb = static_cast<int64_t>(b);
+            auto div = [&]() -> uint64_t {          // sdiv: x / 0 = 0, INT64_MIN / -1 wraps
+                if (sb == 0) return 0;
+                if (sb == -1) return 0 - a;
+                return static_cast<uint64_t>(sa / sb);
+            };
+            switch (op) {
+                case IRInstruction::ADD: return a + b;
+                case IRInstruction::SUB: return a - b;
+                case IRInstruction::MUL: return a * b;
+                case IRInstruction::DIV: return div();
+                default:                 return a - div() * b;      // MOD, lowered as sdiv/mul/sub
+            }
+        }
+
+        // ---- rewrite, dead code, out of SSA ----
+
+        void rewrite(Stats &stats) {
+            code_.assign(ir_.begin() + static_cast<std::ptrdiff_t>(base_),
+                         ir_.begin() + static_cast<std::ptrdiff_t>(base_ + n_));
+            keep_.assign(n_, 1);
+            for (size_t li = 0; li < n_; ++li) {
+                I &in = code_[li];
+                auto &o = opnd_[li];
+                if (!exec_[blockOf_[li]]) {
+                    if (in.op != I::LABEL && in.op != I::DATA8) { keep_[li] = 0; ++stats.unreachable; }
+                    continue;
+                }
+                int d = (in.op == I::CMP_BRANCH || in.op == I::SELECT) ? decide(o[1], o[2], in.cond) : 2;
+                bool known = d == 0 || d == 1;
+                if (in.op == I::CMP_BRANCH && known) {
+                    ++stats.branches;
+                    if (d == 1) in = {I::BRANCH, {}, {}, {}, in.label, {}, {}};
+                    else keep_[li] = 0;
+                    o = {};
+                    continue;
+                }
+                int v = defVal_[li];
+                bool zero = v >= 0 && lat_[v] == CONST && const_[v] == 0 && in.op != I::LOAD;
+                if (zero && !(in.op == I::MOV && in.src1 == "xzr")) {
+                    in = {I::MOV, in.dst, "xzr", {}, {}, {}, {}};
+                    o = {};
+                    o[1] = {kZero, kXZR};
+                    ++stats.rewritten;
+                    continue;
+                }
+                if (in.op == I::SELECT && known) {
+                    Operand a = o[d ? 3 : 4];
+                    in = {I::MOV, in.dst, d ? in.src3 : in.src4, {}, {}, {}, {}};
+                    o = {};
+                    o[1] = a;
+                    ++stats.branches;
+                }
+                for (int f = 1; f < 5; ++f) {
+                    Operand &op = o[f];
+                    if (op.value < 0) continue;
+                    if (op.reg != kXZR && xzrAllowed(in, f) && lat_[op.value] == CONST && const_[op.value] == 0)
+                        op = {kZero, kXZR};
+                }
+                for (int f = 0; f < 5; ++f) {
+                    if (o[f].value < 0 || o[f].reg == kNone) continue;
+                    std::string name = regName(o[f].reg);
+                    if (name != field(in, f)) { field(in, f) = name; ++stats.rewritten; }
+                }
+            }
+        }
+
+        void sweep() {
+            std::vector<char> liveVal(values_.size(), 0);
+            std::vector<int> work;
+            auto mark = [&](int v) {
+                if (v >= 0 && !liveVal[v]) { liveVal[v] = 1; work.push_back(v); }
+            };
+            auto markOperands = [&](size_t li) {
+                for (auto &op : opnd_[li])
+                    if (op.value >= 0 && op.reg >= 0 && op.reg <= 30) mark(op.value);
+            };
+            std::vector<char> needed(n_, 0);
+            for (size_t li = 0; li < n_; ++li) {
+                if (!keep_[li]) continue;
+                const I &in = code_[li];
+                int r = regIndex(in.dst);
+                bool removable = defines(in) && in.op != I::LOAD && r >= 0 && r <= 30;
+                if (!removable) { needed[li] = 1; markOperands(li); }
+            }
+            for (int v : exitLive_) mark(v);
+
+            while (!work.empty()) {
+                int v = work.back();
+                work.pop_back();
+                const Value &val = values_[v];
+                if (val.phi >= 0) {
+                    Phi &p = phis_[val.phi];
+                    p.live = true;
+                    const Block &bl = blocks_[p.block];
+                    for (size_t k = 0; k < p.args.size(); ++k)
+                        if (bl.predExec[k] && p.args[k].reg >= 0 && p.args[k].reg <= 30) mark(p.args[k].value);
+                } else if (val.def >= 0 && defVal_[val.def] == v && keep_[val.def] && !needed[val.def]) {
+                    needed[val.def] = 1;
+                    markOperands(static_cast<size_t>(val.def));
+                }
+            }
+            for (size_t li = 0; li < n_; ++li)
+                if (keep_[li] && !needed[li]) keep_[li] = 2;        // dead definition
+        }
+
+        void emit(IRProgram &out, Stats &stats) {
+            int nb = static_cast<int>(blocks_.size());
+            for (int b = 1; b < nb; ++b) {
+                const Block &bl = blocks_[b];
+                std::vector<std::pair<int, int>> copies;        // (dst, src) registers
+                if (exec_[b] && succCount(b) == 1) {
+                    if (bl.fall >= 0) collectCopies(bl.fall, bl.fallPos, copies);
+                    if (bl.taken >= 0) collectCopies(bl.taken, bl.takenPos, copies);
+                }
+
+                size_t last = bl.end - 1;
+                bool beforeLast = code_[last].op == I::BRANCH && keep_[last] == 1;
+                for (size_t li = bl.begin; li < bl.end; ++li) {
+                    if (li == last && beforeLast) sequentialize(copies, out);
+                    if (keep_[li] == 1) out.push_back(std::move(code_[li]));
+                    else if (keep_[li] == 2) ++stats.dead;
+                }
+                if (!beforeLast) sequentialize(copies, out);
+            }
+        }
+
+        void collectCopies(int s, int pos, std::vector<std::pair<int, int>> &copies) const {
+            if (!blocks_[s].predExec[pos]) return;
+            for (int p : blocks_[s].phis) {
+                const Phi &ph = phis_[p];
+                if (ph.live && ph.args[pos].reg != ph.var) copies.push_back({ph.var, ph.args[pos].reg});
+            }
+        }
+
+        /// Emit the parallel copy `dst_i = src_i` as MOVs: a copy is safe
+        /// once no pending copy still reads its destination; a cycle is
+        /// broken by saving one source in the scratch register.
+        void sequentialize(std::vector<std::pair<int, int>> &copies, IRProgram &out) const {
+            auto mov = [&](int d, int s) { out.push_back({I::MOV, regName(d), regName(s), {}, {}, {}, {}}); };
+            while (!copies.empty()) {
+                bool progress = false;
+                for (size_t k = 0; k < copies.size(); ++k) {
+                    int d = copies[k].first;
+                    bool read = false;
+                    for (auto &c : copies) read |= c.second == d;
+                    if (read) continue;
+                    mov(d, copies[k].second);
+                    copies.erase(copies.begin() + static_cast<std::ptrdiff_t>(k));
+                    progress = true;
+                    break;
+                }
+                if (progress) continue;
+                int s = copies.front().second;
+                mov(scratch_, s);
+                for (auto &c : copies)
+                    if (c.second == s) c.second = scratch_;
+            }
+        }
+    };
+};
@@ -1,12 +1,20 @@
 #pragma once
 
 #include "token.h"
+#include "patterns.h"
+#include "expr.h"
+#include "macros.h"
+#include "file_cache.h"
 #include <vector>
 #include <string>
+#include <string_view>
+#include <memory_resource>
 #include <sstream>
 #include <istream>
+#include <array>
 #include <cctype>
 #include <algorithm>
+#include <iterator>
 #include <stdexcept>
 #include <set>
 
@@ -14,8 +22,9 @@
 /// (each line is  "TOKEN_TYPE lexeme"  or  "NEWLINE").
 class TokenizedLexer {
 public:
-    static std::vector<Token> lex(std::istream &in) {
-        std::vector<Token> tokens;
+    static TokenList lex(std::istream &in,
+                         std::pmr::memory_resource *mr = std::pmr::get_default_resource()) {
+        TokenList tokens(mr);
         Token t;
         while (!in.eof()) {
             in >> t;
@@ -28,19 +37,104 @@ public:
 /// Reads raw ARM64 assembly text and produces Token vectors.
 class RawAsmLexer {
 public:
-    static std::vector<Token> lex(std::istream &in) {
-        std::vector<Token> tokens;
+    /// Included files, lexed once each (see file_cache.h).
+    using Includes = FileCache<TokenList>;
+
+    /// Macro blocks and invocations (macros.h) are expanded as they are
+    /// read; `stats`, if given, receives the expander's counts.
+    /// `.include "file"` reads the lines of another file in its place;
+    /// `includes` keeps them across calls (without it, across this call),
+    /// and relative names are relative to `path`, the file being read.
+    static TokenList lex(std::istream &in,
+                         std::pmr::memory_resource *mr = std::pmr::get_default_resource(),
+                         MacroExpander::Stats *stats = nullptr,
+                         Includes *includes = nullptr, const std::string &path = {}) {
+        TokenList tokens(mr);
+        Includes local;
+        Reader r{MacroExpander(&lexText, mr), includes ? *includes : local, tokens};
         std::string line;
         while (std::getline(in, line)) {
+            const size_t first = tokens.size();
             tokenizeLine(line, tokens);
-            tokens.push_back({NEWLINE, ""});
+            r.endLine(first, path);
         }
+        r.macros.finish();
+        if (stats) *stats = r.macros.stats();
         return tokens;
     }
 
 private:
-    static void tokenizeLine(const std::string &raw, std::vector<Token> &out) {
-        std::string line = stripComment(raw);
+    static constexpr int kMaxIncludeDepth = 64;
+
+    /// Where the lines of the input and its included files go.
+    struct Reader {
+        MacroExpander macros;
+        Includes &includes;
+        TokenList &tokens;
+        int depth = 0;
+
+        /// Finish the line lexed onto tokens[first...] of file `from`.
+        void endLine(size_t first, const std::string &from) {
+            if (macros.claims(tokens, first)) {
+                TokenList line(std::make_move_iterator(tokens.begin() + static_cast<long>(first)),
+                               std::make_move_iterator(tokens.end()), tokens.get_allocator());
+                tokens.resize(first);
+                macros.feed(std::move(line), tokens);
+            } else if (first < tokens.size() && tokens[first].type == DOTID &&
+                       tokens[first].lexeme == ".include") {
+                include(first, from);
+            } else {
+                tokens.push_back({NEWLINE, ""});
+            }
+        }
+
+        void include(size_t first, const std::string &from) {
+            if (tokens.size() != first + 2 || tokens[first + 1].type != STRING)
+                throw std::runtime_error(".include needs a file name in quotes");
+            const std::string &quoted = tokens[first + 1].lexeme;
+            std::string name = quoted.substr(1, quoted.size() - 2);
+            tokens.resize(first);
+            if (depth == kMaxIncludeDepth) throw std::runtime_error("Includes nested too deeply: " + name);
+
+            std::string path = Includes::resolve(name, from);
+            const TokenList &lines = includes.get(path, [&](std::string_view text) {
+                return lexFile(text, path);
+            });
+            ++depth;
+            for (size_t i = 0; i < lines.size(); ++i) {
+                size_t f = tokens.size();
+                for (; lines[i].type != NEWLINE; ++i) tokens.push_back(lines[i]);
+                endLine(f, path);
+            }
+            --depth;
+        }
+    };
+
+    /// The lines of an included file, each ending in NEWLINE, before macro
+    /// expansion (which depends on where the file is included).
+    static TokenList lexFile(std::string_view text, const std::string &path) {
+        TokenList out;
+        try {
+            for (size_t pos = 0; pos < text.size();) {
+                size_t end = std::min(text.find('\n', pos), text.size());
+                tokenizeLine(text.substr(pos, end - pos), out);
+                out.push_back({NEWLINE, ""});
+                pos = end + 1;
+            }
+        } catch (const std::runtime_error &e) {
+            throw std::runtime_error(path + ": " + e.what());
+        }
+        return out;
+    }
+
+    static void tokenizeLine(std::string_view raw, TokenList &out) {
+        const size_t first = out.size();
+        lexText(stripComment(raw), out, first);
+        Expr::foldConstants(out, first);
+    }
+
+    /// Lex `line` onto `out`, the tokens of a line that starts at out[first].
+    static void lexText(std::string_view line, TokenList &out, size_t first) {
         size_t i = 0;
         while (i < line.size()) {
             if (std::isspace(static_cast<unsigned char>(line[i]))) { ++i; continue; }
@@ -48,75 +142,140 @@ private:
             if (line[i] == ',') { out.push_back({COMMA, ","}); ++i; continue; }
             if (line[i] == '[') { out.push_back({LBRACK, "["}); ++i; continue; }
             if (line[i] == ']') { out.push_back({RBRACK, "]"}); ++i; continue; }
+            if (line[i] == '!') { out.push_back({EXCLAM, "!"}); ++i; continue; }
+            if (line[i] == '"') {
+                size_t end = stringEnd(line, i);
+                if (end == std::string_view::npos)
+                    throw std::runtime_error("Unterminated string: " + std::string(line.substr(i)));
+                out.push_back({STRING, std::string(line.substr(i, end - i))});
+                i = end;
+                continue;
+            }
+
+            // expression operators (see expr.h)
+            if (line[i] == '(') { out.push_back({LPAREN, "("}); ++i; continue; }
+            if (line[i] == ')') { out.push_back({RPAREN, ")"}); ++i; continue; }
+            if (line[i] == '+') { out.push_back({PLUS, "+"}); ++i; continue; }
+            if (line[i] == '*') { out.push_back({STAR, "*"}); ++i; continue; }
+            if (line[i] == '&') { out.push_back({AMP, "&"}); ++i; continue; }
+            if (line[i] == '|') { out.push_back({PIPE, "|"}); ++i; continue; }
+            if (line.substr(i, 2) == "<<") { out.push_back({LSHIFT, "<<"}); i += 2; continue; }
+            if (line.substr(i, 2) == ">>") { out.push_back({RSHIFT, ">>"}); i += 2; continue; }
+            // '-' subtracts after an operand and otherwise negates; before a
+            // digit it is the sign of a number:  b -8,  ldr x1, [x2, -8]
+            if (line[i] == '-') {
+                bool afterOperand = out.size() > first + 1 && operand(out.back().type);
+                bool sign = i + 1 < line.size() && std::isdigit(static_cast<unsigned char>(line[i + 1]));
+                if (afterOperand || !sign) { out.push_back({MINUS, "-"}); ++i; continue; }
+            }
+
+            // '#' only marks an immediate:  #8  is lexed like  8
+            // '{' '}' only wrap a register list:  {v0.2d}  is lexed like  v0.2d
+            if (line[i] == '#' || line[i] == '{' || line[i] == '}') { ++i; continue; }
+
+            // collect a "word"; the macro separator \() stays inside it
+            size_t start = i++;
+            while (i < line.size()) {
+                if (line[i] == '\\' && line.substr(i + 1, 2) == "()") i += 3;
+                else if (!endsWord(line, i)) ++i;
+                else break;
+            }
+            classifyAndPush(line.substr(start, i - start), out);
+        }
+    }
 
-            // collect a "word"
-            size_t start = i;
-            while (i < line.size() && !std::isspace(static_cast<unsigned char>(line[i]))
-                   && line[i] != ',' && line[i] != '[' && line[i] != ']')
-                ++i;
-            std::string word = line.substr(start, i - start);
-            classifyAndPush(word, out);
+    /// Does line[i] end a word: whitespace, punctuation or an operator?
+    static bool endsWord(std::string_view line, size_t i) {
+        static const auto table = [] {
+            std::array<bool, 256> t{};
+            for (unsigned char c : std::string_view(" \t\r\n\v\f,[]!{}\"()+-*&|")) t[c] = true;
+            return t;
+        }();
+        char c = line[i];
+        if (c == '<' || c == '>') return i + 1 < line.size() && line[i + 1] == c;
+        return table[static_cast<unsigned char>(c)];
+    }
+
+    static bool operand(TokenType t) {
+        return t == ID || t == INT || t == HEXINT || t == RPAREN;
+    }
+
+    static std::string_view stripComment(std::string_view line) {
+        // comments start with ; or // outside a string
+        for (size_t i = 0; i < line.size(); ++i) {
+            if (line[i] == '"') {
+                i = stringEnd(line, i);
+                if (i == std::string_view::npos) return line;
+                --i;
+            } else if (line[i] == ';' || line.substr(i, 2) == "//") {
+                return line.substr(0, i);
+            }
         }
+        return line;
     }
 
-    static std::string stripComment(const std::string &line) {
-        // comments start with ; or //
-        auto pos = line.find(';');
-        if (pos == std::string::npos) pos = line.find("//");
-        return (pos == std::string::npos) ? line : line.substr(0, pos);
+    /// One past the closing quote of the string starting at `open`, or npos.
+    static size_t stringEnd(std::string_view line, size_t open) {
+        for (size_t i = open + 1; i < line.size(); ++i) {
+            if (line[i] == '\\') ++i;
+            else if (line[i] == '"') return i + 1;
+        }
+        return std::string_view::npos;
     }
 
     /// Classify a single word into one or more tokens.
     /// For "b.eq" style conditional branches, emits two tokens: ID "b" + DOTID ".eq".
-    static void classifyAndPush(const std::string &word, std::vector<Token> &out) {
+    static void classifyAndPush(std::string_view word, TokenList &out) {
         if (word.empty()) return;
 
         // b.cond forms: b.eq, b.ne, b.lt, etc.
-        static const std::set<std::string> condSuffixes = {
+        static const std::set<std::string, std::less<>> condSuffixes = {
             ".eq",".ne",".hs",".lo",".hi",".ls",".ge",".lt",".gt",".le"
         };
         if (word.size() >= 4 && word[0] == 'b' && word[1] == '.') {
-            std::string suffix = word.substr(1);
+            std::string_view suffix = word.substr(1);
             if (condSuffixes.count(suffix)) {
                 out.push_back({ID, "b"});
-                out.push_back({DOTID, suffix});
+                out.push_back({DOTID, std::string(suffix)});
                 return;
             }
         }
 
-        out.push_back(classify(word));
+        out.push_back({classify(word), std::string(word)});
     }
 
-    static Token classify(const std::string &word) {
-        if (word.empty()) return {NONE, word};
+    static TokenType classify(std::string_view word) {
+        if (word.empty()) return NONE;
 
         // label definition  e.g.  "loop:"
-        if (word.back() == ':') return {LABEL, word};
+        if (word.back() == ':') return LABEL;
 
         // directive  e.g.  ".8byte"
-        if (word[0] == '.') return {DOTID, word};
+        if (word[0] == '.') return DOTID;
 
         // hex literal
         if (word.size() > 2 && word[0] == '0' && (word[1] == 'x' || word[1] == 'X'))
-            return {HEXINT, word};
+            return HEXINT;
 
         // integer literal (possibly negative)
-        if (isInteger(word)) return {INT, word};
+        if (isInteger(word)) return INT;
 
         // register xzr
-        if (word == "xzr") return {ZREG, word};
+        if (word == "xzr") return ZREG;
 
         // register x0-x30
-        if (word.size() >= 2 && word[0] == 'x' && std::isdigit(static_cast<unsigned char>(word[1]))) {
-            return {REG, word};
-        }
+        if (word.size() >= 2 && word[0] == 'x' && std::isdigit(static_cast<unsigned char>(word[1])))
+            return REG;
+
+        // vector register with arrangement  e.g.  "v0.2d", "v31.4s"
+        if (findVectorReg(word) >= 0) return VREG;
 
         // sp is treated as an ID (handled by assembler as register 31)
         // everything else is an ID (instruction name, label reference, sp, etc.)
-        return {ID, word};
+        return ID;
     }
 
-    static bool isInteger(const std::string &s) {
+    static bool isInteger(std::string_view s) {
         if (s.empty()) return false;
         size_t start = (s[0] == '-' || s[0] == '+') ? 1 : 0;
         if (start >= s.size()) return false;
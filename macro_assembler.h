@@ -0,0 +1,429 @@
+#pragma once
+
+#include "encoder.h"
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+/// Typed code-emission API on top of Encoder.
+///
+///   MacroAssembler masm;
+///   Label loop, done;
+///   masm.bind(loop);
+///   masm.cmp(a64::x1, a64::x2);
+///   masm.b(a64::cond::eq, done);
+///   masm.add(a64::x1, a64::x1, a64::x3);
+///   masm.b(loop);
+///   masm.bind(done);
+///   masm.ret();
+///   masm.finalize();                   // flush literal pool, check labels
+///
+/// Instructions are encoded straight into a growable word buffer; there is
+/// no text or Token round trip.  Every instruction form Encoder supports has
+/// a method, named after the mnemonic, with Pre/Post suffixes for the
+/// writeback addressing modes.  Branches to unbound labels are linked to
+/// the label and backpatched when it is bound.  ldrLiteral() loads a 64-bit
+/// constant from a literal pool that is flushed by emitLiteralPool() or
+/// finalize().
+namespace a64 {
+
+/// An x register.  xzr and sp share code 31; each operand position reads
+/// 31 as one of them, and MacroAssembler rejects the other there.
+struct XReg {
+    int code;
+    bool sp = false;
+};
+
+inline constexpr XReg x0{0},   x1{1},   x2{2},   x3{3},   x4{4},   x5{5},   x6{6},   x7{7},
+                      x8{8},   x9{9},   x10{10}, x11{11}, x12{12}, x13{13}, x14{14}, x15{15},
+                      x16{16}, x17{17}, x18{18}, x19{19}, x20{20}, x21{21}, x22{22}, x23{23},
+                      x24{24}, x25{25}, x26{26}, x27{27}, x28{28}, x29{29}, x30{30},
+                      xzr{31}, sp{31, true};
+
+/// NEON arrangements, named after the register suffixes: b16 is .16b.
+enum class vec : int { b8 = 0, b16 = 1, h4 = 2, h8 = 3, s2 = 4, s4 = 5, d2 = 7 };
+
+/// A vector register with an arrangement: v(3, vec::s4) is v3.4s.
+struct VReg {
+    int code;
+    vec arr;
+};
+
+inline constexpr VReg v(int n, vec arr) { return {n, arr}; }
+
+/// Condition codes, named after the b.cond suffixes.
+enum class cond : int {
+    eq = 0, ne = 1, hs = 2, lo = 3, hi = 8, ls = 9, ge = 10, lt = 11, gt = 12, le = 13,
+};
+
+} // namespace a64
+
+/// A branch target.  Bound at most once; may be referenced before binding.
+class Label {
+public:
+    Label() = default;
+    Label(const Label &) = delete;
+    Label &operator=(const Label &) = delete;
+
+    bool bound() const { return offset_ >= 0; }
+    /// Byte offset from the start of the code buffer (bound labels only).
+    int64_t offset() const { return offset_; }
+
+private:
+    friend class MacroAssembler;
+
+    enum class FixupKind { B26, IMM19, IMM14, ABS64 };
+    struct Use {
+        size_t word;        // index of the word to patch
+        FixupKind kind;
+    };
+
+    int64_t offset_ = -1;
+    std::vector<Use> uses_;
+};
+
+class MacroAssembler {
+public:
+    using XReg = a64::XReg;
+    using VReg = a64::VReg;
+
+    explicit MacroAssembler(size_t reserveWords = 256) { code_.reserve(reserveWords); }
+
+    // ---- arithmetic ----
+
+    /// The extended-register form, which reads 31 as sp in d and n, or the
+    /// shifted-register form if d or n is xzr.  m is never sp.
+    void add(XReg d, XReg n, XReg m) {
+        addSub(Encoder::ADD, Encoder::ADD_SHIFTED, d, n, m, "add");
+    }
+    void sub(XReg d, XReg n, XReg m) {
+        addSub(Encoder::SUB, Encoder::SUB_SHIFTED, d, n, m, "sub");
+    }
+    void mul(XReg d, XReg n, XReg m)   { rrr(Encoder::MUL, d, n, m, "mul"); }
+    void smulh(XReg d, XReg n, XReg m) { rrr(Encoder::SMULH, d, n, m, "smulh"); }
+    void umulh(XReg d, XReg n, XReg m) { rrr(Encoder::UMULH, d, n, m, "umulh"); }
+    void sdiv(XReg d, XReg n, XReg m)  { rrr(Encoder::SDIV, d, n, m, "sdiv"); }
+    void udiv(XReg d, XReg n, XReg m)  { rrr(Encoder::UDIV, d, n, m, "udiv"); }
+    /// subs xzr, n, m, in the form that reads n the way it is named.
+    void cmp(XReg n, XReg m) {
+        int rm = zr(m, "cmp");
+        if (isZr(n)) put(Encoder::encodeRRR(Encoder::SUBS_SHIFTED, 31, 31, rm));
+        else put(Encoder::encodeCmp(n.code, rm));
+    }
+    /// cmp n, #imm (0..4095), which reads 31 as sp.
+    void cmp(XReg n, int imm) { put(Encoder::encodeCmpImm(base(n, "cmp"), imm)); }
+    /// sub d, xzr, m
+    void neg(XReg d, XReg m) {
+        put(Encoder::encodeRRR(Encoder::SUB_SHIFTED, zr(d, "neg"), 31, zr(m, "neg")));
+    }
+    /// add d, n, xzr if either is sp, as add reads 31 as sp; else orr
+    /// d, xzr, n, which reads it as xzr.
+    void mov(XReg d, XReg n) {
+        if (d.sp || n.sp) add(d, n, a64::xzr);
+        else put(Encoder::encodeRRR(Encoder::ORR_SHIFTED, d.code, 31, n.code));
+    }
+
+    // ---- conditional select ----
+    void csel(XReg d, XReg n, XReg m, a64::cond c) {
+        condSel(Encoder::CSEL, d, n, m, c, "csel");
+    }
+    void csinc(XReg d, XReg n, XReg m, a64::cond c) {
+        condSel(Encoder::CSINC, d, n, m, c, "csinc");
+    }
+    void csneg(XReg d, XReg n, XReg m, a64::cond c) {
+        condSel(Encoder::CSNEG, d, n, m, c, "csneg");
+    }
+    void cset(XReg d, a64::cond c) {
+        put(Encoder::encodeCset(zr(d, "cset"), static_cast<int>(c)));
+    }
+
+    // ---- memory ----
+    // The base register reads 31 as sp and the transfer register as xzr.
+    void ldur(XReg t, XReg n, int imm) {
+        put(Encoder::encodeMem(Encoder::LDUR, zr(t, "ldur"), base(n, "ldur"), imm));
+    }
+    void stur(XReg t, XReg n, int imm) {
+        put(Encoder::encodeMem(Encoder::STUR, zr(t, "stur"), base(n, "stur"), imm));
+    }
+
+    /// ldr/str xt, [xn, #imm]: the scaled unsigned offset, or ldur/stur for
+    /// other offsets in -256..255.
+    void ldr(XReg t, XReg n, int imm = 0) { mem(Encoder::LDR_UOFF, t, n, imm, "ldr"); }
+    void str(XReg t, XReg n, int imm = 0) { mem(Encoder::STR_UOFF, t, n, imm, "str"); }
+    /// ldr/str xt, [xn, #imm]!
+    void ldrPre(XReg t, XReg n, int imm)  { indexed(Encoder::LDR_PRE, t, n, imm, "ldr"); }
+    void strPre(XReg t, XReg n, int imm)  { indexed(Encoder::STR_PRE, t, n, imm, "str"); }
+    /// ldr/str xt, [xn], #imm
+    void ldrPost(XReg t, XReg n, int imm) { indexed(Encoder::LDR_POST, t, n, imm, "ldr"); }
+    void strPost(XReg t, XReg n, int imm) { indexed(Encoder::STR_POST, t, n, imm, "str"); }
+    /// ldr/str xt, [xn, xm] or, with shift 3, [xn, xm, lsl #3].
+    void ldr(XReg t, XReg n, XReg m, int shift = 0) {
+        memReg(Encoder::LDR_REG, t, n, m, shift, "ldr");
+    }
+    void str(XReg t, XReg n, XReg m, int shift = 0) {
+        memReg(Encoder::STR_REG, t, n, m, shift, "str");
+    }
+
+    /// ldp/stp xt, xt2, [xn, #imm], and the [xn, #imm]! and [xn], #imm forms.
+    void ldp(XReg t, XReg t2, XReg n, int imm = 0) { pair(Encoder::LDP, t, t2, n, imm, "ldp"); }
+    void stp(XReg t, XReg t2, XReg n, int imm = 0) { pair(Encoder::STP, t, t2, n, imm, "stp"); }
+    void ldpPre(XReg t, XReg t2, XReg n, int imm)  { pair(Encoder::LDP_PRE, t, t2, n, imm, "ldp"); }
+    void stpPre(XReg t, XReg t2, XReg n, int imm)  { pair(Encoder::STP_PRE, t, t2, n, imm, "stp"); }
+    void ldpPost(XReg t, XReg t2, XReg n, int imm) {
+        pair(Encoder::LDP_POST, t, t2, n, imm, "ldp");
+    }
+    void stpPost(XReg t, XReg t2, XReg n, int imm) {
+        pair(Encoder::STP_POST, t, t2, n, imm, "stp");
+    }
+
+    /// PC-relative load of the 8 bytes at `l`.
+    void ldr(XReg t, Label &l) {
+        link(l, Label::FixupKind::IMM19, Encoder::encodeLdr(zr(t, "ldr"), 0));
+    }
+
+    /// Load a 64-bit constant through the literal pool.  Equal values share
+    /// one pool slot.
+    void ldrLiteral(XReg t, uint64_t value) {
+        auto it = poolIndex_.find(value);
+        if (it == poolIndex_.end()) {
+            it = poolIndex_.emplace(value, pool_.size()).first;
+            pool_.push_back(std::make_unique<PoolEntry>());
+            pool_.back()->value = value;
+        }
+        ldr(t, pool_[it->second]->label);
+    }
+
+    // ---- NEON ----
+    void add(VReg d, VReg n, VReg m) { vec3(Encoder::ADD_V, d, n, m); }
+    void sub(VReg d, VReg n, VReg m) { vec3(Encoder::SUB_V, d, n, m); }
+    void mul(VReg d, VReg n, VReg m) { vec3(Encoder::MUL_V, d, n, m); }
+    /// ld1/st1 {vt.T}, [xn]
+    void ld1(VReg t, XReg n) { vecMem(Encoder::LD1, t, n, "ld1"); }
+    void st1(VReg t, XReg n) { vecMem(Encoder::ST1, t, n, "st1"); }
+    /// ld1/st1 {vt.T}, [xn], #size: xn advances by the register size.
+    void ld1Post(VReg t, XReg n) { vecPost(Encoder::LD1_POST, t, n, "ld1"); }
+    void st1Post(VReg t, XReg n) { vecPost(Encoder::ST1_POST, t, n, "st1"); }
+
+    // ---- control flow ----
+    void b(Label &l)  { link(l, Label::FixupKind::B26, Encoder::encodeBranch(0)); }
+    void bl(Label &l) { link(l, Label::FixupKind::B26, Encoder::encodeBranchLink(0)); }
+    void b(a64::cond c, Label &l) {
+        link(l, Label::FixupKind::IMM19, Encoder::encodeBCond(static_cast<int>(c), 0));
+    }
+    void cbz(XReg t, Label &l) {
+        uint32_t w = Encoder::encodeCompareBranch(Encoder::CBZ, zr(t, "cbz"), 0);
+        link(l, Label::FixupKind::IMM19, w);
+    }
+    void cbnz(XReg t, Label &l) {
+        uint32_t w = Encoder::encodeCompareBranch(Encoder::CBNZ, zr(t, "cbnz"), 0);
+        link(l, Label::FixupKind::IMM19, w);
+    }
+    void tbz(XReg t, int bit, Label &l) {
+        uint32_t w = Encoder::encodeTestBranch(Encoder::TBZ, zr(t, "tbz"), bit, 0);
+        link(l, Label::FixupKind::IMM14, w);
+    }
+    void tbnz(XReg t, int bit, Label &l) {
+        uint32_t w = Encoder::encodeTestBranch(Encoder::TBNZ, zr(t, "tbnz"), bit, 0);
+        link(l, Label::FixupKind::IMM14, w);
+    }
+    void br(XReg n)  { put(Encoder::encodeBranchReg(Encoder::BR, zr(n, "br"))); }
+    void blr(XReg n) { put(Encoder::encodeBranchReg(Encoder::BLR, zr(n, "blr"))); }
+    void ret()       { br(a64::x30); }
+    void nop()       { put(Encoder::NOP); }
+
+    // ---- data ----
+    void dc64(uint64_t v) {
+        put(static_cast<uint32_t>(v));
+        put(static_cast<uint32_t>(v >> 32));
+    }
+
+    /// Absolute address of `l` (relative to the start of the buffer), like
+    /// `.8byte label`.
+    void dc64(Label &l) {
+        if (l.bound()) { dc64(static_cast<uint64_t>(l.offset_)); return; }
+        l.uses_.push_back({code_.size(), Label::FixupKind::ABS64});
+        ++unresolved_;
+        dc64(uint64_t{0});
+    }
+
+    /// Pad to a multiple of `bytes` (a power of two), like `.balign`: with
+    /// nops before code, or with zeros before data.
+    void align(uint64_t bytes, bool data = false) {
+        if (bytes == 0 || (bytes & (bytes - 1)))
+            throw std::runtime_error("MacroAssembler: alignment must be a power of two");
+        while (static_cast<uint64_t>(cursor()) % bytes) put(data ? 0 : Encoder::NOP);
+    }
+
+    // ---- labels ----
+
+    /// Bind `l` to the current position and backpatch its earlier uses.
+    void bind(Label &l) {
+        if (l.bound()) throw std::runtime_error("MacroAssembler: label bound twice");
+        l.offset_ = cursor();
+        for (const auto &u : l.uses_) patch(u, l.offset_);
+        unresolved_ -= l.uses_.size();
+        l.uses_.clear();
+    }
+
+    // ---- literal pool ----
+
+    /// Place all pending literals here.  With `branchOver`, a `b` around the
+    /// pool is emitted first so it can sit in the middle of straight-line code.
+    void emitLiteralPool(bool branchOver = true) {
+        if (pool_.empty()) return;
+        Label after;
+        if (branchOver) b(after);
+        for (auto &e : pool_) {
+            bind(e->label);
+            dc64(e->value);
+        }
+        if (branchOver) bind(after);
+        pool_.clear();
+        poolIndex_.clear();
+    }
+
+    /// Flush the literal pool (without a branch over it) and check that
+    /// every referenced label has been bound.
+    void finalize() {
+        emitLiteralPool(false);
+        if (unresolved_)
+            throw std::runtime_error("MacroAssembler: reference to unbound label");
+    }
+
+    // ---- output ----
+
+    int64_t cursor() const { return static_cast<int64_t>(code_.size()) * 4; }
+    const std::vector<uint32_t> &words() const { return code_; }
+
+    void write(std::ostream &out) const {
+        for (uint32_t w : code_) {
+            char b[4] = {static_cast<char>(w & 0xFF), static_cast<char>((w >> 8) & 0xFF),
+                         static_cast<char>((w >> 16) & 0xFF), static_cast<char>((w >> 24) & 0xFF)};
+            out.write(b, 4);
+        }
+    }
+
+private:
+    struct PoolEntry {
+        uint64_t value = 0;
+        Label label;
+    };
+
+    std::vector<uint32_t> code_;
+    size_t unresolved_ = 0;
+    std::vector<std::unique_ptr<PoolEntry>> pool_;
+    std::map<uint64_t, size_t> poolIndex_;
+
+    void put(uint32_t w) { code_.push_back(w); }
+
+    static bool isZr(XReg r) { return r.code == 31 && !r.sp; }
+
+    /// `r` in a position that reads 31 as xzr.
+    static int zr(XReg r, const char *op) {
+        if (r.sp) reject(op, "sp");
+        return r.code;
+    }
+
+    /// `r` in a position that reads 31 as sp.
+    static int base(XReg r, const char *op) {
+        if (isZr(r)) reject(op, "xzr");
+        return r.code;
+    }
+
+    [[noreturn]] static void reject(const char *op, const char *reg) {
+        throw std::runtime_error(std::string("MacroAssembler: ") + op + " cannot take " + reg +
+                                 " here");
+    }
+
+    void mem(uint32_t opcode, XReg t, XReg n, int imm, const char *op) {
+        uint32_t unscaled = opcode == Encoder::LDR_UOFF ? Encoder::LDUR : Encoder::STUR;
+        put(Encoder::encodeMemUOff(opcode, unscaled, zr(t, op), base(n, op), imm));
+    }
+
+    void indexed(uint32_t opcode, XReg t, XReg n, int imm, const char *op) {
+        put(Encoder::encodeMemIndexed(opcode, zr(t, op), base(n, op), imm));
+    }
+
+    void memReg(uint32_t opcode, XReg t, XReg n, XReg m, int shift, const char *op) {
+        put(Encoder::encodeMemReg(opcode, zr(t, op), base(n, op), zr(m, op), shift));
+    }
+
+    void pair(uint32_t opcode, XReg t, XReg t2, XReg n, int imm, const char *op) {
+        bool writeback = opcode != Encoder::LDP && opcode != Encoder::STP;
+        put(Encoder::encodePair(opcode, zr(t, op), zr(t2, op), base(n, op), imm, writeback));
+    }
+
+    /// The operand value Encoder takes: n | q << 5 | size << 6.
+    static int vreg(VReg v) { return v.code | static_cast<int>(v.arr) << 5; }
+
+    void vec3(uint32_t opcode, VReg d, VReg n, VReg m) {
+        put(Encoder::encodeVec3(opcode, vreg(d), vreg(n), vreg(m)));
+    }
+
+    void vecMem(uint32_t opcode, VReg t, XReg n, const char *op) {
+        put(Encoder::encodeVecMem(opcode, vreg(t), base(n, op)));
+    }
+
+    void vecPost(uint32_t opcode, VReg t, XReg n, const char *op) {
+        int size = static_cast<int>(t.arr) & 1 ? 16 : 8;
+        put(Encoder::encodeVecMemPost(opcode, vreg(t), base(n, op), size));
+    }
+
+    void addSub(uint32_t extended, uint32_t shifted, XReg d, XReg n, XReg m, const char *op) {
+        int rm = zr(m, op);
+        if (isZr(d) || isZr(n)) put(Encoder::encodeRRR(shifted, zr(d, op), zr(n, op), rm));
+        else put(Encoder::encodeRRR(extended, d.code, n.code, rm));
+    }
+
+    void rrr(uint32_t opcode, XReg d, XReg n, XReg m, const char *op) {
+        put(Encoder::encodeRRR(opcode, zr(d, op), zr(n, op), zr(m, op)));
+    }
+
+    void condSel(uint32_t opcode, XReg d, XReg n, XReg m, a64::cond c, const char *op) {
+        int cc = static_cast<int>(c);
+        put(Encoder::encodeCondSel(opcode, zr(d, op), zr(n, op), zr(m, op), cc));
+    }
+
+    /// Emit `w` (encoded with a zero offset) and resolve or record its target.
+    void link(Label &l, Label::FixupKind kind, uint32_t w) {
+        Label::Use u{code_.size(), kind};
+        put(w);
+        if (l.bound()) {
+            patch(u, l.offset_);
+        } else {
+            l.uses_.push_back(u);
+            ++unresolved_;
+        }
+    }
+
+    void patch(const Label::Use &u, int64_t target) {
+        if (u.kind == Label::FixupKind::ABS64) {
+            code_[u.word]     = static_cast<uint32_t>(target);
+            code_[u.word + 1] = static_cast<uint32_t>(static_cast<uint64_t>(target) >> 32);
+            return;
+        }
+        int64_t words = (target - static_cast<int64_t>(u.word) * 4) / 4;
+        if (u.kind == Label::FixupKind::B26) {
+            if (!fits(words, 26))
+                throw std::runtime_error("MacroAssembler: b target out of range");
+            code_[u.word] |= static_cast<uint32_t>(words) & 0x3FFFFFF;
+        } else if (u.kind == Label::FixupKind::IMM14) {
+            if (!fits(words, 14))
+                throw std::runtime_error("MacroAssembler: tbz/tbnz target out of range");
+            code_[u.word] |= (static_cast<uint32_t>(words) & 0x3FFF) << 5;
+        } else {
+            if (!fits(words, 19))
+                throw std::runtime_error("MacroAssembler: pc-relative target out of range");
+            code_[u.word] |= (static_cast<uint32_t>(words) & 0x7FFFF) << 5;
+        }
+    }
+
+    static bool fits(int64_t v, int bits) {
+        return -(int64_t{1} << (bits - 1)) <= v && v < (int64_t{1} << (bits - 1));
+    }
+};
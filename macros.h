@@ -0,0 +1,338 @@
+#pragma once
+
+#include "token.h"
+#include "expr.h"
+
+#include <cctype>
+#include <cstddef>
+#include <cstdint>
+#include <memory_resource>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+/// `.macro` / `.rept` / `.irp` for the `--raw` pipeline.  RawAsmLexer
+/// hands over every line it lexes while a block is open or when the line
+/// opens one or invokes a macro; everything else bypasses this class.
+///
+///   .macro name a, b=1        define; the body refers to \a, \b, and \@
+///   ...                       (a number unique to each expansion)
+///   .endm
+///   name x1, 8                invoke
+///   .rept 4 ... .endr         repeat the body
+///   .irp r, x1, x2 ... .endr  repeat the body with \r = x1, then x2
+///
+/// Bodies are stored as token lines, lexed once.  Expansion copies them,
+/// replacing a token that is exactly `\param` with the argument's tokens;
+/// a parameter inside a longer word (`x\n`, `loop\@:`) is substituted into
+/// the text, and only that word is lexed again.  Expanded lines go through
+/// the same processing, so bodies may invoke macros and open blocks.
+///
+/// An invocation whose expansion neither uses \@ nor defines a macro
+/// depends only on its arguments, so it is memoized: a repeat with the
+/// same arguments copies the cached tokens.  A `.rept` body is expanded
+/// once and copied the same way.
+class MacroExpander {
+public:
+    /// Lexes `text` (a substituted word) onto `out`, the tokens of a line
+    /// that starts at out[lineStart].
+    using LexText = void (*)(std::string_view text, TokenList &out, size_t lineStart);
+
+    struct Stats {
+        size_t defined = 0;       // macros defined
+        size_t expansions = 0;    // invocations and .rept/.irp blocks expanded
+        size_t memoized = 0;      // of those, copied from a cached expansion
+        size_t lines = 0;         // lines produced by expansion
+    };
+
+    MacroExpander(LexText lex, std::pmr::memory_resource *mr) : lex_(lex), mr_(mr) {}
+
+    /// Does the line out[first...] need this class?
+    bool claims(const TokenList &out, size_t first) const {
+        if (open_) return true;
+        if (first == out.size()) return false;
+        const Token &t = out[first];
+        if (t.type == DOTID)
+            return t.lexeme == ".macro" || t.lexeme == ".rept" || t.lexeme == ".irp" ||
+                   t.lexeme == ".endm" || t.lexeme == ".endr";
+        return t.type == ID && !macros_.empty() && macros_.count(t.lexeme);
+    }
+
+    /// Process one line; output lines are appended to `out`, each followed
+    /// by a NEWLINE.
+    void feed(TokenList line, TokenList &out) {
+        if (line.empty()) {
+            if (!open_) out.push_back({NEWLINE, ""});
+            return;
+        }
+        const Token &head = line[0];
+        if (open_) {
+            if (head.type == DOTID && (head.lexeme == ".macro" || head.lexeme == ".rept" ||
+                                       head.lexeme == ".irp"))
+                ++open_->depth;
+            else if (head.type == DOTID && (head.lexeme == ".endm" || head.lexeme == ".endr") &&
+                     --open_->depth == 0)
+                return close(head.lexeme, out);
+            open_->body.push_back(std::move(line));
+            return;
+        }
+        if (head.type == DOTID) {
+            if (head.lexeme == ".macro") return openMacro(line);
+            if (head.lexeme == ".rept" || head.lexeme == ".irp") return openRepeat(line);
+            if (head.lexeme == ".endm" || head.lexeme == ".endr")
+                throw std::runtime_error("Unexpected " + head.lexeme);
+        }
+        if (head.type == ID) {
+            auto it = macros_.find(head.lexeme);
+            if (it != macros_.end()) return invoke(it->second, line, out);
+        }
+        out.insert(out.end(), line.begin(), line.end());
+        out.push_back({NEWLINE, ""});
+    }
+
+    /// At the end of input: every block must be closed.
+    void finish() const {
+        if (open_)
+            throw std::runtime_error("Missing " + std::string(open_->kind == Block::MACRO ? ".endm" : ".endr") +
+                                     " for " + open_->opener);
+    }
+
+    const Stats &stats() const { return stats_; }
+
+private:
+    struct Param {
+        std::string name;
+        TokenList fallback;       // default value
+    };
+
+    struct Macro {
+        std::vector<Param> params;
+        std::vector<TokenList> body;
+    };
+
+    using Bindings = std::vector<std::pair<std::string_view, const TokenList *>>;
+
+    /// A block being collected, up to its matching .endm / .endr.
+    struct Block {
+        enum Kind { MACRO, REPT, IRP } kind;
+        std::string opener;               // "name" / ".rept" / ".irp" for errors
+        std::string name;                 // macro name or .irp symbol
+        std::vector<Param> params;        // .macro
+        uint64_t count = 0;               // .rept
+        std::vector<TokenList> values;    // .irp
+        std::vector<TokenList> body;
+        int depth = 1;
+    };
+
+    static constexpr int kMaxDepth = 256;
+    static constexpr size_t kMaxMemoTokens = 1 << 16;
+
+    LexText lex_;
+    std::pmr::memory_resource *mr_;
+    std::unordered_map<std::string, Macro> macros_;
+    std::unordered_map<std::string, TokenList> memo_;     // name + arguments -> expansion
+    std::optional<Block> open_;
+    uint64_t counter_ = 0;       // macro invocations so far
+    uint64_t current_ = 0;       // \@ of the innermost expansion
+    bool counterUsed_ = false;
+    int depth_ = 0;
+    Stats stats_;
+
+    /// The comma-separated token groups of line[from...].
+    std::vector<TokenList> groups(const TokenList &line, size_t from) const {
+        std::vector<TokenList> out;
+        if (from >= line.size()) return out;
+        out.emplace_back(mr_);
+        for (size_t i = from; i < line.size(); ++i) {
+            if (line[i].type == COMMA) out.emplace_back(mr_);
+            else out.back().push_back(line[i]);
+        }
+        return out;
+    }
+
+    void openMacro(const TokenList &line) {
+        if (line.size() < 2 || line[1].type != ID)
+            throw std::runtime_error("Expected macro name after .macro");
+        Block b{Block::MACRO, line[1].lexeme, line[1].lexeme, {}, 0, {}, {}, 1};
+        for (TokenList &g : groups(line, 2)) {
+            if (g.empty() || g[0].type != ID)
+                throw std::runtime_error("Expected parameter name in .macro " + b.name);
+            // name, name=default or name = default ('=' does not end a word)
+            Param p{g[0].lexeme, TokenList(mr_)};
+            size_t rest = 1;
+            std::string text;
+            if (size_t eq = p.name.find('='); eq != std::string::npos) {
+                text = p.name.substr(eq + 1);
+                p.name.resize(eq);
+            } else if (g.size() > 1 && g[1].lexeme[0] == '=') {
+                text = g[1].lexeme.substr(1);
+                rest = 2;
+            } else if (g.size() > 1) {
+                throw std::runtime_error("Unexpected '" + g[1].lexeme + "' in .macro " + b.name);
+            }
+            if (!text.empty()) lex_(text, p.fallback, 0);
+            p.fallback.insert(p.fallback.end(), g.begin() + static_cast<long>(rest), g.end());
+            b.params.push_back(std::move(p));
+        }
+        open_ = std::move(b);
+    }
+
+    void openRepeat(const TokenList &line) {
+        Block b{line[0].lexeme == ".rept" ? Block::REPT : Block::IRP, line[0].lexeme, {}, {}, 0, {}, {}, 1};
+        if (b.kind == Block::REPT) {
+            size_t ti = 1;
+            Expr::Value v;
+            auto noLabels = [](const std::string &) -> std::optional<uint64_t> { return std::nullopt; };
+            std::string err = Expr::parse(line, ti, noLabels, v);
+            if (err.empty() && ti != line.size()) err = "Extra tokens after .rept";
+            if (!err.empty()) throw std::runtime_error(".rept needs a constant count: " + err);
+            if (v.value < 0) throw std::runtime_error(".rept count must not be negative");
+            b.count = static_cast<uint64_t>(v.value);
+        } else {
+            auto g = groups(line, 1);
+            if (g.empty() || g[0].size() != 1 || g[0][0].type != ID)
+                throw std::runtime_error("Expected symbol after .irp");
+            b.name = g[0][0].lexeme;
+            b.values.assign(std::make_move_iterator(g.begin() + 1), std::make_move_iterator(g.end()));
+            if (b.values.empty()) b.values.emplace_back(mr_);
+        }
+        open_ = std::move(b);
+    }
+
+    void close(const std::string &end, TokenList &out) {
+        Block b = std::move(*open_);
+        open_.reset();
+        if ((b.kind == Block::MACRO) != (end == ".endm"))
+            throw std::runtime_error("Unexpected " + end + " closing " + b.opener);
+        if (b.kind == Block::MACRO) {
+            if (!macros_.emplace(b.name, Macro{std::move(b.params), std::move(b.body)}).second)
+                throw std::runtime_error("Duplicate macro: " + b.name);
+            ++stats_.defined;
+            memo_.clear();       // a cached expansion may use the name as a mnemonic
+            return;
+        }
+        Enter enter(*this);
+        ++stats_.expansions;
+        if (b.kind == Block::IRP) {
+            for (const TokenList &v : b.values) expand(b.body, {{b.name, &v}}, out);
+            return;
+        }
+        for (uint64_t k = 0; k < b.count; ++k) {
+            size_t start = out.size();
+            Scope scope(*this);
+            expand(b.body, {}, out);
+            if (!scope.pure() || k + 1 == b.count) continue;
+            // every further iteration is the same: copy this one
+            size_t len = out.size() - start;
+            out.reserve(out.size() + len * (b.count - k - 1));
+            for (++k; k < b.count; ++k)
+                for (size_t i = start; i < start + len; ++i) out.push_back(out[i]);
+            ++stats_.memoized;
+        }
+    }
+
+    void invoke(const Macro &m, const TokenList &line, TokenList &out) {
+        auto args = groups(line, 1);
+        if (args.size() > m.params.size())
+            throw std::runtime_error("Too many arguments for macro " + line[0].lexeme);
+
+        std::string key = line[0].lexeme;
+        for (size_t i = 1; i < line.size(); ++i) {
+            key += '\x1f';
+            key += line[i].lexeme;
+        }
+        ++stats_.expansions;
+        if (auto it = memo_.find(key); it != memo_.end()) {
+            out.insert(out.end(), it->second.begin(), it->second.end());
+            stats_.memoized++;
+            return;
+        }
+
+        Bindings b;
+        for (size_t i = 0; i < m.params.size(); ++i) {
+            const TokenList *v = i < args.size() && !args[i].empty() ? &args[i] : &m.params[i].fallback;
+            b.push_back({m.params[i].name, v});
+        }
+        Enter enter(*this);
+        size_t start = out.size();
+        Scope scope(*this);
+        uint64_t outer = current_;
+        current_ = counter_++;
+        expand(m.body, b, out);
+        current_ = outer;
+        if (scope.pure() && out.size() - start <= kMaxMemoTokens)
+            memo_.emplace(std::move(key), TokenList(out.begin() + static_cast<long>(start), out.end(), mr_));
+    }
+
+    /// Bounds the nesting of expansions (a macro invoking itself).
+    struct Enter {
+        MacroExpander &x;
+        explicit Enter(MacroExpander &x) : x(x) {
+            if (++x.depth_ > kMaxDepth) throw std::runtime_error("Macro expansion nested too deeply");
+        }
+        ~Enter() { --x.depth_; }
+    };
+
+    /// Watches an expansion for anything that makes it unrepeatable: \@
+    /// or a macro definition.
+    struct Scope {
+        MacroExpander &x;
+        bool outerUsed;
+        size_t defined;
+        explicit Scope(MacroExpander &x) : x(x), outerUsed(x.counterUsed_), defined(x.stats_.defined) {
+            x.counterUsed_ = false;
+        }
+        bool pure() const { return !x.counterUsed_ && x.stats_.defined == defined && !x.open_; }
+        ~Scope() { x.counterUsed_ = x.counterUsed_ || outerUsed; }
+    };
+
+    void expand(const std::vector<TokenList> &body, const Bindings &b, TokenList &out) {
+        for (const TokenList &line : body) {
+            TokenList l(mr_);
+            for (const Token &t : line) substitute(t, b, l);
+            Expr::foldConstants(l, 0);
+            ++stats_.lines;
+            feed(std::move(l), out);
+        }
+    }
+
+    /// Copy `t` onto `l`, replacing parameters.  Strings are left alone.
+    void substitute(const Token &t, const Bindings &b, TokenList &l) {
+        if (t.type == STRING || t.lexeme.find('\\') == std::string::npos) {
+            l.push_back(t);
+            return;
+        }
+        for (auto &[name, value] : b)
+            if (t.lexeme.size() == name.size() + 1 && std::string_view(t.lexeme).substr(1) == name) {
+                l.insert(l.end(), value->begin(), value->end());
+                return;
+            }
+
+        std::string text;
+        const std::string &s = t.lexeme;
+        for (size_t i = 0; i < s.size(); ++i) {
+            if (s[i] != '\\' || i + 1 == s.size()) { text += s[i]; continue; }
+            if (s[i + 1] == '@') {
+                text += std::to_string(current_);
+                counterUsed_ = true;
+                ++i;
+                continue;
+            }
+            if (s.compare(i + 1, 2, "()") == 0) { i += 2; continue; }     // \() separates
+            size_t j = i + 1;
+            while (j < s.size() && (std::isalnum(static_cast<unsigned char>(s[j])) || s[j] == '_')) ++j;
+            std::string_view name(s.data() + i + 1, j - i - 1);
+            const TokenList *value = nullptr;
+            for (auto &[n, v] : b)
+                if (n == name) value = v;
+            if (!value) { text += s[i]; continue; }        // not ours: keep (nested .macro)
+            for (const Token &v : *value) text += v.lexeme;
+            i = j - 1;
+        }
+        lex_(text, l, 0);
+    }
+};
@@ -1,4 +1,5 @@
 #include "token.h"
+#include "arena.h"
 #include "lexer.h"
 #include "encoder.h"
 #include "symbol_table.h"
@@ -6,11 +7,21 @@
 #include "ir.h"
 #include "highlevel.h"
 #include "ir_codegen.h"
+#include "ir_passes.h"
+#include "ir_ssa.h"
+#include "raw_optimizer.h"
+#include "outliner.h"
+#include "x86_codegen.h"
+#include "stats.h"
 
 #include <fstream>
+#include <optional>
 #include <iostream>
 #include <string>
+#include <cstdlib>
 #include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
 #include <vector>
 
 static void printUsage() {
@@ -21,30 +32,373 @@ static void printUsage() {
               << "  --raw         Input is raw ARM64 assembly text\n"
               << "  --high        Input is high-level pseudocode syntax\n\n"
               << "Options:\n"
-              << "  --dump-ir     (--high only) Print IR to stderr instead of assembling\n\n"
-              << "If FILE is omitted or is `-`, reads from stdin.\n";
+              << "  --dump-ir     (--high only) Print IR to stderr instead of assembling\n"
+              << "  -O1           Optimise: for --high, IR passes (inlining, load/store\n"
+              << "                forwarding, SSA constant and copy propagation,\n"
+              << "                if-conversion, vectorization, unrolling);\n"
+              << "                otherwise peepholes (nops, dead cmps, branch chains)\n"
+              << "  --unroll=N    (--high only) Unroll counted loops N times (1 = off;\n"
+              << "                default at -O1 picks N per loop)\n"
+              << "  --align-loops=N  (--high only) Align loop headers to N bytes\n"
+              << "                (a power of two) with nop padding\n"
+              << "  --superopt[=N] Replace runs of up to 4 arithmetic instructions with\n"
+              << "                the shortest equivalent of up to N (1-3, default 2)\n"
+              << "                instructions, remembered in a cache that -O1 then\n"
+              << "                also applies\n"
+              << "  --superopt-cache=FILE  Cache file (default ~/.cache/asm-superopt);\n"
+              << "                with -O1, apply its rewrites without searching\n"
+              << "  --outline     Fold identical routines and outline repeated\n"
+              << "                instruction sequences into shared bodies\n"
+              << "  --x86-64      (--high only) Write an x86-64 Linux executable instead\n"
+              << "                of ARM64 code; it exits with x0 as its status\n"
+              << "  --run         (--high only) Compile to x86-64 in memory, run it and\n"
+              << "                print the non-zero registers\n"
+              << "  --set xN=V    Start --run / --x86-64 programs with xN = V (x0-x29)\n"
+              << "  --stats       Print per-phase timing and hardware counters to stderr\n"
+              << "  -o OUT        Write the binary to OUT instead of stdout\n"
+              << "  --batch       Assemble each FILE (or each path read from stdin, one\n"
+              << "                per line, if there is none) to FILE with its extension\n"
+              << "                replaced by .bin; included files are read once\n\n"
+              << "If FILE is omitted or is `-`, reads from stdin.  Long runs of zeros\n"
+              << "(.zero, .bss) are written as holes when the output is a regular file.\n";
+}
+
+enum Mode { TOKENIZED, RAW, HIGH };
+
+struct Options {
+    Mode mode = TOKENIZED;
+    bool dumpIR = false;
+    bool stats = false;
+    bool outline = false;
+    int optLevel = 0;
+    unsigned superopt = 0;      // --superopt: longest candidate, 0: off
+    std::string superoptCache;
+    int unrollFactor = -1;      // -1: heuristic at -O1, 1: off
+    unsigned loopAlign = 0;     // bytes, 0: off
+    bool x86 = false;           // --x86-64: ELF executable
+    bool runNative = false;     // --run
+    X86Registers regs;          // --set values for either
+};
+
+/// Superoptimiser results, loaded on first use and saved at exit.  Only
+/// an explicit --superopt or --superopt-cache opts in to the cache file;
+/// otherwise -O1 does not touch it.
+struct Rewrites {
+    std::string path;
+    bool enabled = false;
+    std::optional<Superoptimizer::Cache> cache;
+
+    Superoptimizer::Cache &get() {
+        if (!cache) cache.emplace(path.empty() ? Superoptimizer::Cache::defaultPath() : path);
+        return *cache;
+    }
+    void save() {
+        if (cache) cache->save();
+    }
+};
+
+/// Files pulled in by `.include` / `include`, kept for the whole process.
+struct Includes {
+    RawAsmLexer::Includes raw;
+    HighLevelParser::Includes high;
+
+    size_t loads() const { return raw.stats().loads + high.stats().loads; }
+    size_t hits() const { return raw.stats().hits + high.stats().hits; }
+};
+
+/// The output file descriptor: `name`, or stdout if null.
+struct Output {
+    int fd = STDOUT_FILENO;
+    explicit Output(const char *name, mode_t mode = 0666) {
+        if (name && (fd = ::open(name, O_WRONLY | O_CREAT | O_TRUNC, mode)) < 0)
+            throw std::runtime_error("Cannot open output file: " + std::string(name));
+    }
+    ~Output() {
+        if (fd != STDOUT_FILENO) ::close(fd);
+    }
+    Output(const Output &) = delete;
+    Output &operator=(const Output &) = delete;
+    operator int() const { return fd; }
+};
+
+/// `path` with its extension replaced by .bin.
+static std::string binaryName(const std::string &path) {
+    size_t dot = path.rfind('.'), slash = path.rfind('/');
+    std::string base = dot != std::string::npos && (slash == std::string::npos || dot > slash)
+                           ? path.substr(0, dot) : path;
+    return base + ".bin" == path ? path + ".bin" : base + ".bin";
+}
+
+/// Lower `ir` to x86-64 and either run it in process (--run), printing the
+/// registers it leaves non-zero, or write it as an executable to `outname`.
+static void runX86(const IRProgram &ir, const char *outname, const Options &opt,
+                   PipelineStats &stats, Arena &arena) {
+    X86Program program = stats.measure("x86_codegen", [&] { return X86CodeGen::lower(ir); });
+    stats.note("x86 code", std::to_string(program.code.size()) + " bytes");
+    if (opt.runNative) {
+        X86Executable exe(std::move(program));
+        X86Registers regs = opt.regs;
+        stats.measure("run", [&] { exe.run(regs); });
+        for (int r = 0; r < 30; ++r)
+            if (regs.x[r])
+                std::cout << "x" << r << " = " << static_cast<int64_t>(regs.x[r]) << "\n";
+    } else {
+        Output out(outname, 0777);
+        Image image;
+        image.bytes() = stats.measure("elf", [&] { return x86Elf(std::move(program), opt.regs); });
+        image.write(out);
+    }
+    stats.note("arena", arena.summary());
+    stats.report(std::cerr);
+}
+
+/// Assemble one program read from `in` (the file `path`, or empty for
+/// stdin) to `outname` (stdout if null).  Allocates from `arena`.
+static void run(std::istream &in, const std::string &path, const char *outname,
+                const Options &opt, Arena &arena, Includes &includes, Rewrites &rewrites) {
+
+    PipelineStats stats(opt.stats);
+    const size_t loads = includes.loads(), hits = includes.hits();
+
+    // --- build token stream ---
+    TokenList tokens(&arena);
+    std::vector<std::string> scratch;       // --high: registers the program never names
+
+    if (opt.mode == HIGH) {
+        // High-level pipeline:  source → IR → tokens
+        auto ir = stats.measure("parser", [&] {
+            return HighLevelParser::parse(in, &arena, &includes.high, path);
+        });
+        scratch = irScratchRegisters(ir);
+
+        if (opt.optLevel > 0) {
+            size_t inlined =
+                stats.measure("inline", [&] { return IRPasses::inlineCalls(ir, scratch); });
+            stats.note("inlined", std::to_string(inlined));
+            auto mem = stats.measure("memory", [&] { return IRPasses::forwardMemory(ir); });
+            stats.note("memory", std::to_string(mem.forwarded) + " loads forwarded, " +
+                                     std::to_string(mem.deadStores) + " dead stores removed");
+            auto ssa = stats.measure("ssa", [&] { return IRSSA::optimize(ir, scratch); });
+            stats.note("ssa", std::to_string(ssa.branches) + " conditions folded, " +
+                                  std::to_string(ssa.rewritten) + " operands rewritten, " +
+                                  std::to_string(ssa.dead) + " dead and " +
+                                  std::to_string(ssa.unreachable) + " unreachable instructions removed");
+            size_t n = stats.measure("ir_passes", [&] { return IRPasses::ifConvert(ir); });
+            stats.note("if-converted", std::to_string(n));
+            auto vectorized = stats.measure("vectorize", [&] { return IRPasses::vectorize(ir, scratch); });
+            for (auto &d : vectorized)
+                stats.note("vectorize " + d.loop,
+                           d.lanes ? std::to_string(d.lanes) + " lanes"
+                                   : "skipped (" + d.reason + ")");
+        }
+
+        if (opt.unrollFactor > 1 || (opt.optLevel > 0 && opt.unrollFactor < 0)) {
+            auto decisions = stats.measure("unroll", [&] {
+                return IRPasses::unroll(ir, scratch, opt.unrollFactor > 1 ? opt.unrollFactor : 0);
+            });
+            for (auto &d : decisions)
+                stats.note("unroll " + d.loop,
+                           d.factor ? "x" + std::to_string(d.factor) + ", " +
+                                          std::to_string(d.renamed) + " registers renamed"
+                                    : "skipped (" + d.reason + ")");
+        }
+
+        if (opt.dumpIR) {
+            dumpIR(ir, std::cerr);
+            return;
+        }
+
+        if (opt.x86 || opt.runNative) {
+            runX86(ir, outname, opt, stats, arena);
+            return;
+        }
+
+        tokens = stats.measure("ir_codegen", [&] { return IRCodeGen::lower(ir, &arena, opt.loopAlign); });
+    } else {
+        // Tokenized / raw pipelines go straight to tokens
+        MacroExpander::Stats macros;
+        tokens = stats.measure("lexer", [&] {
+            return (opt.mode == TOKENIZED) ? TokenizedLexer::lex(in, &arena)
+                                       : RawAsmLexer::lex(in, &arena, &macros, &includes.raw, path);
+        });
+        if (macros.expansions || macros.defined)
+            stats.note("macros", std::to_string(macros.defined) + " defined, " +
+                                     std::to_string(macros.expansions) + " expansions (" +
+                                     std::to_string(macros.memoized) + " memoized), " +
+                                     std::to_string(macros.lines) + " lines");
+
+        if (opt.optLevel > 0) {
+            Superoptimizer::Cache *cached = rewrites.enabled ? &rewrites.get() : nullptr;
+            size_t n = stats.measure("peephole", [&] { return RawOptimizer::optimize(tokens, cached); });
+            stats.note("peepholes", std::to_string(n));
+        }
+    }
+
+    // --superopt searches; -O1 with a cache applies its rewrites to --high
+    // output (other input already got them with the peepholes)
+    if (opt.superopt || (opt.optLevel > 0 && opt.mode == HIGH && rewrites.enabled)) {
+        auto r = stats.measure("superopt", [&] {
+            return RawOptimizer::superoptimize(tokens, rewrites.get(), opt.superopt);
+        });
+        stats.note("superopt", std::to_string(r.windows) + " windows, " + std::to_string(r.hits) +
+                                   " from cache, " + std::to_string(r.searched) + " searched, " +
+                                   std::to_string(r.rewrites) + " rewrites, " +
+                                   std::to_string(r.saved) + " instructions saved");
+    }
+
+    if (opt.outline) {
+        auto r = stats.measure("outline", [&] { return Outliner::run(tokens, opt.mode == HIGH ? &scratch : nullptr); });
+        stats.note("outline", std::to_string(r.folded) + " routines folded, " +
+                                  std::to_string(r.outlined) + " sequences outlined at " +
+                                  std::to_string(r.sites) + " sites, " +
+                                  std::to_string(r.bytesSaved) + " bytes saved");
+    }
+
+    // --- assemble ---
+    Output out(outname);
+    Assembler assembler;
+    assembler.assemble(tokens, out, &stats);
+    if (!stats.enabled()) return;
+
+    std::string sections;
+    for (auto &s : assembler.sections())
+        if (s.size) sections += (sections.empty() ? "" : ", ") + s.name + " " + std::to_string(s.size);
+    stats.note("sections", sections + " bytes (image " + std::to_string(assembler.image().size()) +
+                               ", " + std::to_string(assembler.image().holeBytes()) + " in holes)");
+    if (auto &pad = assembler.padding(); pad.directives)
+        stats.note("padding", std::to_string(pad.directives) + " alignments, " +
+                                  std::to_string(pad.bytes) + " bytes (" +
+                                  std::to_string(pad.nops) + " nops, " +
+                                  std::to_string(pad.executedNops) + " on fall-through paths)");
+    if (auto &enc = assembler.encoding(); enc.lines)
+        stats.note("encode cache", std::to_string(enc.hits) + " of " + std::to_string(enc.lines) +
+                                       " instructions (" + std::to_string(enc.hits * 100 / enc.lines) +
+                                       "%), " + std::to_string(enc.relocated) + " label offsets re-encoded, " +
+                                       std::to_string(enc.entries) + " distinct");
+    if (includes.loads() + includes.hits() > loads + hits)
+        stats.note("includes", std::to_string(includes.loads() - loads) + " files lexed, " +
+                                   std::to_string(includes.hits() - hits) + " from cache");
+    stats.note("arena", arena.summary());
+    stats.report(std::cerr);
 }
 
 int main(int argc, char *argv[]) {
     try {
-        enum Mode { TOKENIZED, RAW, HIGH } mode = TOKENIZED;
-        bool dumpIRFlag = false;
-        const char *filename = nullptr;
+        Options opt;
+        bool batch = false;
+        std::vector<const char *> files;
+        const char *outname = nullptr;
 
         for (int i = 1; i < argc; ++i) {
-            if (std::strcmp(argv[i], "--tokenized") == 0)      mode = TOKENIZED;
-            else if (std::strcmp(argv[i], "--raw") == 0)       mode = RAW;
-            else if (std::strcmp(argv[i], "--high") == 0)      mode = HIGH;
-            else if (std::strcmp(argv[i], "--dump-ir") == 0)   dumpIRFlag = true;
+            if (std::strcmp(argv[i], "--tokenized") == 0)      opt.mode = TOKENIZED;
+            else if (std::strcmp(argv[i], "--raw") == 0)       opt.mode = RAW;
+            else if (std::strcmp(argv[i], "--high") == 0)      opt.mode = HIGH;
+            else if (std::strcmp(argv[i], "--dump-ir") == 0)   opt.dumpIR = true;
+            else if (std::strcmp(argv[i], "--stats") == 0)     opt.stats = true;
+            else if (std::strcmp(argv[i], "--outline") == 0)   opt.outline = true;
+            else if (std::strcmp(argv[i], "--batch") == 0)     batch = true;
+            else if (std::strcmp(argv[i], "--x86-64") == 0)    opt.x86 = true;
+            else if (std::strcmp(argv[i], "--run") == 0)       opt.runNative = true;
+            else if (std::strcmp(argv[i], "--set") == 0) {
+                const char *eq = ++i < argc ? std::strchr(argv[i], '=') : nullptr;
+                char *end = nullptr;
+                int r = eq && argv[i][0] == 'x' ? std::atoi(argv[i] + 1) : -1;
+                long long v = eq ? std::strtoll(eq + 1, &end, 0) : 0;
+                if (r < 0 || r > 29 || !end || *end || end == eq + 1) {
+                    std::cerr << "ERROR: --set needs xN=VALUE with N from 0 to 29\n";
+                    return 1;
+                }
+                opt.regs.x[r] = static_cast<uint64_t>(v);
+            }
+            else if (std::strcmp(argv[i], "-O0") == 0)         opt.optLevel = 0;
+            else if (std::strcmp(argv[i], "-O1") == 0)         opt.optLevel = 1;
+            else if (std::strncmp(argv[i], "--unroll=", 9) == 0) {
+                opt.unrollFactor = std::atoi(argv[i] + 9);
+                if (opt.unrollFactor < 1 || opt.unrollFactor > 16) {
+                    std::cerr << "ERROR: --unroll needs a factor from 1 to 16\n";
+                    return 1;
+                }
+            }
+            else if (std::strcmp(argv[i], "--superopt") == 0)  opt.superopt = 2;
+            else if (std::strncmp(argv[i], "--superopt=", 11) == 0) {
+                int n = std::atoi(argv[i] + 11);
+                if (n < 1 || n > static_cast<int>(Superoptimizer::kMaxLength)) {
+                    std::cerr << "ERROR: --superopt needs a length from 1 to "
+                              << Superoptimizer::kMaxLength << "\n";
+                    return 1;
+                }
+                opt.superopt = static_cast<unsigned>(n);
+            }
+            else if (std::strncmp(argv[i], "--superopt-cache=", 17) == 0)
+                opt.superoptCache = argv[i] + 17;
+            else if (std::strncmp(argv[i], "--align-loops=", 14) == 0) {
+                int n = std::atoi(argv[i] + 14);
+                if (n < 4 || n > 4096 || (n & (n - 1))) {
+                    std::cerr << "ERROR: --align-loops needs a power of two from 4 to 4096\n";
+                    return 1;
+                }
+                opt.loopAlign = static_cast<unsigned>(n);
+            }
+            else if (std::strcmp(argv[i], "-o") == 0) {
+                if (++i == argc) {
+                    std::cerr << "ERROR: -o needs a file name\n";
+                    return 1;
+                }
+                outname = argv[i];
+            }
             else if (std::strcmp(argv[i], "--help") == 0 ||
                      std::strcmp(argv[i], "-h") == 0) {
                 printUsage();
                 return 0;
             }
-            else filename = argv[i];
+            else files.push_back(argv[i]);
+        }
+
+        if ((opt.x86 || opt.runNative) && opt.mode != HIGH) {
+            std::cerr << "ERROR: --x86-64 and --run need --high input\n";
+            return 1;
+        }
+        if ((opt.x86 || opt.runNative) && (opt.outline || opt.loopAlign || opt.superopt)) {
+            std::cerr << "ERROR: --outline, --align-loops and --superopt apply to ARM64 output only\n";
+            return 1;
+        }
+
+        // token streams, grouped lines and the IR allocate from one pool;
+        // blocks they free are reused, and the rest is released when main
+        // returns (or reset between the programs of a batch).  Strings, the
+        // symbol table and the output image use the heap.
+        Arena arena;
+        Includes includes;
+        Rewrites rewrites{opt.superoptCache, opt.superopt > 0 || !opt.superoptCache.empty(), {}};
+
+        if (batch) {
+            if (outname) {
+                std::cerr << "ERROR: -o cannot be used with --batch\n";
+                return 1;
+            }
+            int status = 0;
+            auto one = [&](const std::string &file) {
+                try {
+                    std::ifstream fp(file);
+                    if (!fp) throw std::runtime_error("Cannot open file");
+                    arena.reset();
+                    run(fp, file, binaryName(file).c_str(), opt, arena, includes, rewrites);
+                } catch (const std::exception &e) {
+                    std::cerr << "ERROR: " << file << ": " << e.what() << "\n";
+                    status = 1;
+                }
+            };
+            if (files.empty()) {
+                for (std::string line; std::getline(std::cin, line);)
+                    if (!line.empty()) one(line);
+            }
+            for (const char *f : files) one(f);
+            rewrites.save();
+            return status;
         }
 
         // open input
+        const char *filename = files.empty() ? nullptr : files.back();
         std::ifstream fp;
         if (filename && std::string(filename) != "-") {
             fp.open(filename);
@@ -54,30 +408,8 @@ int main(int argc, char *argv[]) {
             }
         }
         std::istream &in = fp.is_open() ? fp : std::cin;
-
-        // --- build token stream ---
-        std::vector<Token> tokens;
-
-        if (mode == HIGH) {
-            // High-level pipeline:  source → IR → tokens
-            auto ir = HighLevelParser::parse(in);
-
-            if (dumpIRFlag) {
-                dumpIR(ir, std::cerr);
-                return 0;
-            }
-
-            tokens = IRCodeGen::lower(ir);
-        } else {
-            // Tokenized / raw pipelines go straight to tokens
-            if (mode == TOKENIZED)  tokens = TokenizedLexer::lex(in);
-            else                    tokens = RawAsmLexer::lex(in);
-        }
-
-        // --- assemble ---
-        Assembler assembler;
-        assembler.assemble(tokens);
-
+        run(in, fp.is_open() ? filename : "", outname, opt, arena, includes, rewrites);
+        rewrites.save();
         return 0;
     } catch (const std::exception &e) {
         std::cerr << "ERROR: " << e.what() << "\n";
@@ -0,0 +1,497 @@
+#pragma once
+
+#include "token.h"
+#include "assembler.h"
+#include "raw_optimizer.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <map>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+/// Code-size passes over the final token stream, run with `--outline`
+/// after every other optimisation (so it sees exactly what is assembled).
+///
+///   identical-code folding   A routine -- a label that nothing falls into,
+///                            through to an unconditional `b` / `br` -- that
+///                            repeats an earlier routine instruction for
+///                            instruction is deleted, and references to its
+///                            labels are redirected to the earlier copy.
+///   machine outlining        Repeated instruction sequences are moved into
+///                            one `__outlinedN` body and each occurrence is
+///                            replaced by a call, when the cost model says
+///                            that saves space.
+///
+/// Repeats are found with a suffix array of the instruction stream: every
+/// LCP interval (an internal node of the suffix tree) is a sequence that
+/// occurs at each of its suffixes.  A sequence ending in `b` / `br` is
+/// reached with `b` and needs no return; any other sequence is called with
+/// `bl` and returns with `br x30`, so it may not branch or touch x30.  The
+/// call clobbers x30, which costs nothing where x30 is dead and otherwise
+/// needs `mov x16, x30` / `mov x30, x16` around it (x16 or x17, whichever
+/// the program never names; for lowered IR, also one of the `scratch`
+/// registers of irScratchRegisters).  A sequence is outlined when
+///
+///   sites * length  >  sites * call cost + length + (1 for the return)
+///
+/// taking the biggest saving first.  Like RawOptimizer, code with numeric
+/// PC-relative offsets is left alone.
+class Outliner {
+public:
+    struct Result {
+        size_t folded = 0;        // routines removed by folding
+        size_t outlined = 0;      // outlined bodies created
+        size_t sites = 0;         // sequences replaced by a call
+        size_t bytesSaved = 0;
+    };
+
+    static Result run(TokenList &tokens, const std::vector<std::string> *scratch = nullptr) {
+        auto *mr = tokens.get_allocator().resource();
+        TokenLines lines = Assembler::groupLines(tokens, mr);
+        Result r;
+        if (RawOptimizer::hasNumericOffsets(lines)) return r;
+
+        size_t before = byteSize(lines);
+        while (size_t n = foldIdentical(lines)) r.folded += n;
+        outline(lines, r, scratch);
+        r.bytesSaved = before - byteSize(lines);
+
+        TokenList out(mr);
+        for (auto &line : lines) {
+            out.insert(out.end(), line.begin(), line.end());
+            out.push_back({NEWLINE, ""});
+        }
+        tokens = std::move(out);
+        return r;
+    }
+
+private:
+    // ---------- line classification ----------
+
+    static bool isLabel(const TokenList &l) { return l.size() == 1 && l[0].type == LABEL; }
+    static bool isInstr(const TokenList &l) { return !l.empty() && l[0].type == ID; }
+    static bool isData(const TokenList &l)  { return !l.empty() && l[0].type == DOTID && isDataDirective(l[0].lexeme); }
+
+    static std::string labelName(const TokenList &l) {
+        std::string name = l[0].lexeme;
+        if (!name.empty() && name.back() == ':') name.pop_back();
+        return name;
+    }
+
+    static bool isOp(const TokenList &l, const char *name) {
+        return isInstr(l) && l[0].lexeme == name;
+    }
+
+    /// `b label` or `br xN`: control never reaches the next line.
+    static bool isTerminator(const TokenList &l) {
+        if (isOp(l, "br")) return true;
+        return isOp(l, "b") && !(l.size() > 1 && l[1].type == DOTID);
+    }
+
+    static bool isBranch(const TokenList &l) {
+        static const std::set<std::string, std::less<>> branches = {
+            "b", "bl", "br", "blr", "cbz", "cbnz", "tbz", "tbnz",
+        };
+        return isInstr(l) && branches.count(l[0].lexeme);
+    }
+
+    static bool mentions(const TokenList &l, const char *reg) {
+        for (auto &t : l)
+            if (t.type == REG && t.lexeme == reg) return true;
+        return false;
+    }
+
+    /// May be part of a sequence called with `bl`: falls through, and
+    /// leaves x30 (the return address) alone.
+    static bool callable(const TokenList &l) {
+        return isInstr(l) && !isBranch(l) && !mentions(l, "x30");
+    }
+
+    /// dead[i]: x30 is overwritten before it is read, looking forward from
+    /// line i through straight-line code.  Anything else counts as live.
+    static std::vector<bool> x30Dead(const TokenLines &lines) {
+        static const std::set<std::string, std::less<>> readAll = {
+            "str", "stur", "stp", "st1", "cmp", "cbz", "cbnz", "tbz", "tbnz",
+        };
+        std::vector<bool> dead(lines.size() + 1);
+        for (size_t i = lines.size(); i-- > 0;) {
+            const TokenList &l = lines[i];
+            if (!isInstr(l)) dead[i] = false;
+            else if (isOp(l, "bl")) dead[i] = true;
+            else if (isOp(l, "blr")) dead[i] = !mentions(l, "x30");
+            else if (isBranch(l)) dead[i] = false;
+            else if (!mentions(l, "x30")) dead[i] = dead[i + 1];
+            else {
+                // every x30 must be a destination: a register before the
+                // '[' of a load, or the first operand of anything else
+                bool load = isOp(l, "ldr") || isOp(l, "ldur") || isOp(l, "ldp");
+                bool written = load || !readAll.count(l[0].lexeme);
+                bool address = false;
+                for (size_t k = 1; k < l.size(); ++k) {
+                    if (l[k].type == LBRACK) address = true;
+                    if (l[k].type == REG && l[k].lexeme == "x30" && (address || (!load && k != 1)))
+                        written = false;
+                }
+                dead[i] = written;
+            }
+        }
+        return dead;
+    }
+
+    /// text[i]: line i is code or data in `.text`.  Section directives
+    /// themselves are not, so no routine or sequence can span one.
+    static std::vector<bool> inText(const TokenLines &lines) {
+        std::vector<bool> text(lines.size());
+        bool cur = true;
+        for (size_t i = 0; i < lines.size(); ++i) {
+            const TokenList &l = lines[i];
+            bool directive = !l.empty() && l[0].type == DOTID && isSectionDirective(l[0].lexeme);
+            if (directive) cur = Assembler::sectionName(l) == ".text";
+            text[i] = cur && !directive;
+        }
+        return text;
+    }
+
+    static std::string key(const TokenList &l) {
+        std::string k;
+        for (auto &t : l) { k += t.lexeme; k += ' '; }
+        return k;
+    }
+
+    /// Instruction and `.byte` / `.4byte` / `.8byte` bytes; alignment
+    /// padding depends on the final layout and is not counted.
+    static size_t byteSize(const TokenLines &lines) {
+        size_t n = 0;
+        for (auto &l : lines)
+            if (isInstr(l)) n += 4;
+            else if (isData(l)) n += dataWidth(l[0].lexeme) * (l.size() / 2);
+        return n;
+    }
+
+    // ---------- identical-code folding ----------
+
+    /// Lines [begin, end) from an entry label to an unconditional branch.
+    /// `labels` maps each label defined inside to its offset (counted in
+    /// non-label lines), and `text` is the routine with references to
+    /// those labels replaced by their offsets, so two copies that differ
+    /// only in their label names compare equal.
+    struct Routine {
+        size_t begin, end;
+        std::map<std::string, size_t> labels;
+        std::string text;
+    };
+
+    /// A label nothing falls into starts a routine; it runs to the next
+    /// such label.  Only routines wholly in `.text` count: folding two
+    /// copies of writable data would merge them.
+    static std::vector<Routine> routines(const TokenLines &lines) {
+        std::vector<bool> text = inText(lines);
+        auto entry = [&](size_t i) {
+            return isLabel(lines[i]) &&
+                   (i == 0 || isTerminator(lines[i - 1]) || isData(lines[i - 1]));
+        };
+        std::vector<Routine> out;
+        for (size_t i = 0; i < lines.size(); ++i) {
+            if (!entry(i)) continue;
+            size_t j = i + 1;
+            while (j < lines.size() && !entry(j) && text[j]) ++j;
+            if (!text[i] || !isTerminator(lines[j - 1])) continue;      // falls off the end
+
+            Routine r{i, j, {}, ""};
+            size_t offset = 0;
+            for (size_t k = i; k < j; ++k) {
+                if (isLabel(lines[k])) r.labels[labelName(lines[k])] = offset;
+                else ++offset;
+            }
+            bool pending = false;       // a label marker is due at this offset
+            for (size_t k = i; k < j; ++k) {
+                if (isLabel(lines[k])) { pending = true; continue; }
+                if (pending) r.text += ":\n";
+                pending = false;
+                for (size_t t = 0; t < lines[k].size(); ++t) {
+                    auto it = r.labels.find(lines[k][t].lexeme);
+                    if (t > 0 && lines[k][t].type == ID && it != r.labels.end())
+                        r.text += "@" + std::to_string(it->second);
+                    else
+                        r.text += lines[k][t].lexeme;
+                    r.text += ' ';
+                }
+                r.text += '\n';
+            }
+            out.push_back(std::move(r));
+            i = j - 1;
+        }
+        return out;
+    }
+
+    /// Fold every routine that repeats an earlier one; returns how many.
+    static size_t foldIdentical(TokenLines &lines) {
+        std::vector<Routine> all = routines(lines);
+        std::unordered_map<std::string, size_t> first;     // text -> routine
+        std::map<std::string, std::string> rename;
+        std::vector<bool> dead(lines.size());
+        size_t folded = 0;
+
+        for (size_t r = 0; r < all.size(); ++r) {
+            auto [it, fresh] = first.emplace(all[r].text, r);
+            if (fresh) continue;
+            const Routine &keep = all[it->second];
+            std::map<size_t, std::string> at;      // offset -> kept label
+            size_t offset = 0;
+            for (size_t k = keep.begin; k < keep.end; ++k) {
+                if (isLabel(lines[k])) at.emplace(offset, labelName(lines[k]));
+                else ++offset;
+            }
+            for (auto &[name, off] : all[r].labels) rename[name] = at.at(off);
+            for (size_t k = all[r].begin; k < all[r].end; ++k) dead[k] = true;
+            ++folded;
+        }
+        if (!folded) return 0;
+
+        size_t w = 0;
+        for (size_t i = 0; i < lines.size(); ++i) {
+            if (dead[i]) continue;
+            for (size_t t = 1; t < lines[i].size(); ++t) {
+                Token &tok = lines[i][t];
+                if (tok.type != ID) continue;
+                auto it = rename.find(tok.lexeme);
+                if (it != rename.end()) tok.lexeme = it->second;
+            }
+            if (w != i) lines[w] = std::move(lines[i]);
+            ++w;
+        }
+        lines.resize(w);
+        return folded;
+    }
+
+    // ---------- suffix array ----------
+
+    /// Suffix array of `s` by prefix doubling, and the Kasai LCP array:
+    /// lcp[i] is the common prefix length of suffixes sa[i-1] and sa[i].
+    static void suffixArray(const std::vector<int> &s, std::vector<size_t> &sa,
+                            std::vector<size_t> &lcp) {
+        size_t n = s.size();
+        sa.resize(n);
+        lcp.assign(n, 0);
+        if (n == 0) return;
+        std::vector<long> rank(s.begin(), s.end()), tmp(n);
+        for (size_t i = 0; i < n; ++i) sa[i] = i;
+        for (size_t k = 1;; k <<= 1) {
+            auto cmp = [&](size_t a, size_t b) {
+                if (rank[a] != rank[b]) return rank[a] < rank[b];
+                long ra = a + k < n ? rank[a + k] : -1;
+                long rb = b + k < n ? rank[b + k] : -1;
+                return ra < rb;
+            };
+            std::sort(sa.begin(), sa.end(), cmp);
+            tmp[sa[0]] = 0;
+            for (size_t i = 1; i < n; ++i)
+                tmp[sa[i]] = tmp[sa[i - 1]] + (cmp(sa[i - 1], sa[i]) ? 1 : 0);
+            rank.swap(tmp);
+            if (rank[sa[n - 1]] == static_cast<long>(n - 1)) break;
+        }
+
+        size_t h = 0;
+        for (size_t i = 0; i < n; ++i) {
+            if (rank[i] == 0) { h = 0; continue; }
+            size_t j = sa[rank[i] - 1];
+            while (i + h < n && j + h < n && s[i + h] == s[j + h]) ++h;
+            lcp[rank[i]] = h;
+            if (h) --h;
+        }
+    }
+
+    // ---------- outlining ----------
+
+    /// Longest sequence considered; keeps the interval walk linear on
+    /// long runs of one repeated instruction.
+    static constexpr size_t kMaxLength = 64;
+
+    struct Candidate {
+        size_t length;
+        bool tail;                  // ends in b / br: reached with `b`
+        std::vector<size_t> starts;
+        long benefit = 0;           // instructions saved
+    };
+
+    /// Instruction cost at each call site, or 0 if it cannot be called.
+    static size_t siteCost(const std::vector<bool> &x30dead, const Candidate &c, size_t start,
+                           bool haveScratch) {
+        if (c.tail || x30dead[start + c.length]) return 1;
+        return haveScratch ? 3 : 0;
+    }
+
+    /// Keep the non-overlapping starts that can be called (left to right,
+    /// skipping lines in `used`) and price the result.
+    static void price(const std::vector<bool> &x30dead, Candidate &c,
+                      const std::vector<bool> &used, bool haveScratch) {
+        std::vector<size_t> keep;
+        long saved = 0;
+        size_t next = 0;
+        for (size_t s : c.starts) {
+            if (s < next) continue;
+            bool free = true;
+            for (size_t k = s; k < s + c.length && free; ++k) free = !used[k];
+            size_t cost = siteCost(x30dead, c, s, haveScratch);
+            if (!free || cost == 0) continue;
+            keep.push_back(s);
+            saved += static_cast<long>(c.length) - static_cast<long>(cost);
+            next = s + c.length;
+        }
+        c.starts = std::move(keep);
+        c.benefit = c.starts.size() < 2 ? 0
+                  : saved - static_cast<long>(c.length + (c.tail ? 0 : 1));
+    }
+
+    static void outline(TokenLines &lines, Result &result, const std::vector<std::string> *scratch) {
+        // bodies go after the last line of .text, which must not fall
+        // through into them
+        std::vector<bool> text = inText(lines);
+        size_t last = lines.size();
+        while (last > 0 && !text[last - 1]) --last;
+        if (last == 0 || !(isTerminator(lines[last - 1]) || isData(lines[last - 1]))) return;
+
+        std::set<std::string> named;
+        for (auto &l : lines)
+            for (auto &t : l)
+                if (t.type == REG) named.insert(t.lexeme);
+        if (scratch)
+            for (const char *r : {"x16", "x17"})
+                if (std::find(scratch->begin(), scratch->end(), r) == scratch->end()) named.insert(r);
+        std::string save = !named.count("x16") ? "x16" : !named.count("x17") ? "x17" : "";
+        std::vector<bool> x30dead = x30Dead(lines);
+
+        // instructions share an id per distinct text; labels and data get
+        // fresh ones so no repeat can span them
+        std::vector<int> ids(lines.size());
+        std::unordered_map<std::string, int> idOf;
+        int fresh = -1;
+        for (size_t i = 0; i < lines.size(); ++i)
+            ids[i] = isInstr(lines[i]) && text[i] ? idOf.emplace(key(lines[i]), static_cast<int>(idOf.size())).first->second
+                                       : fresh--;
+        for (auto &id : ids) id += static_cast<int>(lines.size());      // keep ids non-negative
+
+        std::vector<size_t> sa, lcp;
+        suffixArray(ids, sa, lcp);
+
+        // bottom-up walk of the LCP intervals
+        std::vector<Candidate> candidates;
+        const std::vector<bool> none(lines.size());
+        auto consider = [&](size_t depth, size_t lb, size_t rb) {
+            size_t s = sa[lb];
+            depth = std::min(depth, kMaxLength);
+            size_t tailLen = 0, callLen = 0;
+            while (callLen < depth && callable(lines[s + callLen])) ++callLen;
+            for (size_t k = 0; k < depth; ++k)
+                if (isTerminator(lines[s + k])) { tailLen = k + 1; break; }
+            std::vector<size_t> starts(sa.begin() + lb, sa.begin() + rb + 1);
+            std::sort(starts.begin(), starts.end());
+            for (auto [len, tail] : {std::pair{tailLen, true}, std::pair{callLen, false}}) {
+                if (len < 2) continue;
+                Candidate c{len, tail, starts};
+                price(x30dead, c, none, !save.empty());
+                if (c.benefit > 0) candidates.push_back(std::move(c));
+            }
+        };
+        std::vector<std::pair<size_t, size_t>> stack{{0, 0}};     // (depth, lb)
+        for (size_t i = 1; i <= sa.size(); ++i) {
+            size_t h = i < sa.size() ? lcp[i] : 0;
+            size_t lb = i - 1;
+            while (h < stack.back().first) {
+                auto [depth, start] = stack.back();
+                stack.pop_back();
+                // a parent at the cap already priced these starts at
+                // the capped length
+                if (std::max(h, stack.back().first) < kMaxLength) consider(depth, start, i - 1);
+                lb = start;
+            }
+            if (h > stack.back().first) stack.push_back({h, lb});
+        }
+
+        std::sort(candidates.begin(), candidates.end(), [](const Candidate &a, const Candidate &b) {
+            if (a.benefit != b.benefit) return a.benefit > b.benefit;
+            if (a.length != b.length) return a.length > b.length;
+            return a.starts[0] < b.starts[0];
+        });
+
+        std::set<std::string> labels;
+        for (auto &l : lines)
+            if (isLabel(l)) labels.insert(labelName(l));
+        size_t nextName = 0;
+
+        std::vector<bool> used(lines.size());
+        std::vector<const Candidate *> siteOf(lines.size());
+        std::vector<std::string> nameOf(candidates.size());
+        std::vector<Candidate *> chosen;
+        for (size_t ci = 0; ci < candidates.size(); ++ci) {
+            Candidate &c = candidates[ci];
+            price(x30dead, c, used, !save.empty());
+            if (c.benefit <= 0) continue;
+            for (size_t s : c.starts) {
+                for (size_t k = s; k < s + c.length; ++k) used[k] = true;
+                siteOf[s] = &c;
+            }
+            do nameOf[ci] = "__outlined" + std::to_string(nextName++);
+            while (labels.count(nameOf[ci]));
+            chosen.push_back(&c);
+            result.sites += c.starts.size();
+        }
+        result.outlined = chosen.size();
+        if (chosen.empty()) return;
+
+        auto *mr = lines.get_allocator().resource();
+        auto nameFor = [&](const Candidate *c) { return nameOf[c - candidates.data()]; };
+        auto emitMov = [&](TokenLines &out, const std::string &dst, const std::string &src) {
+            TokenList l(mr);
+            l.push_back({ID, "mov"});
+            l.push_back({REG, dst});
+            l.push_back({COMMA, ","});
+            l.push_back({REG, src});
+            out.push_back(std::move(l));
+        };
+        auto emitBranch = [&](TokenLines &out, const char *op, const std::string &target) {
+            TokenList l(mr);
+            l.push_back({ID, op});
+            l.push_back({ID, target});
+            out.push_back(std::move(l));
+        };
+
+        TokenLines bodies(mr);
+        for (const Candidate *c : chosen) {
+            TokenList label(mr);
+            label.push_back({LABEL, nameFor(c) + ":"});
+            bodies.push_back(std::move(label));
+            size_t s = c->starts[0];
+            for (size_t k = s; k < s + c->length; ++k) bodies.push_back(lines[k]);
+            if (!c->tail) {
+                TokenList ret(mr);
+                ret.push_back({ID, "br"});
+                ret.push_back({REG, "x30"});
+                bodies.push_back(std::move(ret));
+            }
+        }
+
+        TokenLines out(mr);
+        for (size_t i = 0; i < last;) {
+            const Candidate *c = siteOf[i];
+            if (!c) { out.push_back(std::move(lines[i++])); continue; }
+            if (c->tail) {
+                emitBranch(out, "b", nameFor(c));
+            } else if (x30dead[i + c->length]) {
+                emitBranch(out, "bl", nameFor(c));
+            } else {
+                emitMov(out, save, "x30");
+                emitBranch(out, "bl", nameFor(c));
+                emitMov(out, "x30", save);
+            }
+            i += c->length;
+        }
+        for (auto &l : bodies) out.push_back(std::move(l));
+        for (size_t i = last; i < lines.size(); ++i) out.push_back(std::move(lines[i]));
+        lines = std::move(out);
+    }
+};
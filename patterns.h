@@ -0,0 +1,190 @@
+#pragma once
+
+#include <cstdint>
+#include <stdexcept>
+#include <string_view>
+
+/// Operand syntax of every instruction, shared by the runtime Assembler and
+/// the compile-time assembler in a64.h.
+///
+/// A mnemonic may have several entries; they are tried in order and the
+/// first whose pattern matches the operands selects the encoder `form`
+/// passed to Encoder::encode.
+///
+/// r = REG or sp,  z = REG or ZREG,  i = INT/HEXINT,
+/// j = INT/HEXINT/label,  c = COMMA,  l = '[',  t = ']',  e = '!',
+/// s = the shift keyword `lsl` (its amount follows as an `i`),
+/// k = a condition name (eq, ne, lt, ...; see kCondCodes),
+/// v = a NEON vector register with arrangement (v0.2d, v3.4s, ...; see
+///     findVectorReg).  `{v0.2d}` register lists are written with or
+///     without the braces.
+struct InstrPattern {
+    std::string_view mnemonic;
+    std::string_view pattern;
+    std::string_view form;
+};
+
+inline constexpr InstrPattern kInstrPatterns[] = {
+    {"add",   "rcrcz",   "add"},   {"add",   "vcvcv",   "add.v"},
+    {"sub",   "rcrcz",   "sub"},   {"sub",   "vcvcv",   "sub.v"},
+    {"mul",   "zczcz",   "mul"},   {"mul",   "vcvcv",   "mul.v"},
+    {"smulh", "zczcz",   "smulh"}, {"umulh", "zczcz",   "umulh"},
+    {"sdiv",  "zczcz",   "sdiv"},  {"udiv",  "zczcz",   "udiv"},
+    {"cmp",   "rcz",     "cmp"},   {"cmp",   "rci",     "cmp.imm"},
+    {"neg",   "zcz",     "neg"},   {"mov",   "zcz",     "mov"},
+    {"br",    "r",       "br"},    {"blr",   "r",       "blr"},
+    {"ldur",  "zclrcit", "ldur"},  {"stur",  "zclrcit", "stur"},
+    {"b",     "j",       "b"},     {"bl",    "j",       "bl"},
+    {"nop",   "",        "nop"},
+
+    // conditional select, compare-and-branch, test-and-branch
+    {"csel",  "zczczck", "csel"},  {"csinc", "zczczck", "csinc"},
+    {"csneg", "zczczck", "csneg"}, {"cset",  "zck",     "cset"},
+    {"cbz",   "zcj",     "cbz"},   {"cbnz",  "zcj",     "cbnz"},
+    {"tbz",   "zcicj",   "tbz"},   {"tbnz",  "zcicj",   "tbnz"},
+
+    // ldr / str : literal, [xn], [xn, #imm], [xn, #imm]!, [xn], #imm,
+    //             [xn, xm], [xn, xm, lsl #3]
+    {"ldr",   "zcj",        "ldr"},
+    {"ldr",   "zclrt",      "ldr.uoff"},
+    {"ldr",   "zclrcit",    "ldr.uoff"},
+    {"ldr",   "zclrcite",   "ldr.pre"},
+    {"ldr",   "zclrtci",    "ldr.post"},
+    {"ldr",   "zclrczt",    "ldr.reg"},
+    {"ldr",   "zclrczcsit", "ldr.reg"},
+    {"str",   "zclrt",      "str.uoff"},
+    {"str",   "zclrcit",    "str.uoff"},
+    {"str",   "zclrcite",   "str.pre"},
+    {"str",   "zclrtci",    "str.post"},
+    {"str",   "zclrczt",    "str.reg"},
+    {"str",   "zclrczcsit", "str.reg"},
+
+    // ldp / stp : [xn], [xn, #imm], [xn, #imm]!, [xn], #imm
+    {"ldp",   "zczclrt",    "ldp"},
+    {"ldp",   "zczclrcit",  "ldp"},
+    {"ldp",   "zczclrcite", "ldp.pre"},
+    {"ldp",   "zczclrtci",  "ldp.post"},
+    {"stp",   "zczclrt",    "stp"},
+    {"stp",   "zczclrcit",  "stp"},
+    {"stp",   "zczclrcite", "stp.pre"},
+    {"stp",   "zczclrtci",  "stp.post"},
+
+    // NEON ld1 / st1 of one register : [xn], [xn], #imm (imm = 8 or 16,
+    // the register size)
+    {"ld1",   "vclrt",      "ld1"},
+    {"ld1",   "vclrtci",    "ld1.post"},
+    {"st1",   "vclrt",      "st1"},
+    {"st1",   "vclrtci",    "st1.post"},
+};
+
+/// NEON arrangements: Q (128-bit register) and element size (0 = bytes,
+/// 3 = doublewords) as they appear in the encodings.
+struct VectorArrangement {
+    std::string_view suffix;
+    int q;
+    int size;
+};
+
+inline constexpr VectorArrangement kVectorArrangements[] = {
+    {".8b", 0, 0},  {".16b", 1, 0}, {".4h", 0, 1}, {".8h", 1, 1},
+    {".2s", 0, 2},  {".4s", 1, 2},  {".2d", 1, 3},
+};
+
+/// `vN.<arrangement>` as the operand value the Encoder takes:
+/// N | q << 5 | size << 6.  Returns -1 if `s` is not a vector register.
+constexpr int findVectorReg(std::string_view s) {
+    if (s.size() < 4 || s[0] != 'v') return -1;
+    size_t dot = s.find('.');
+    if (dot < 2 || dot > 3) return -1;     // also npos
+    int n = 0;
+    for (size_t i = 1; i < dot; ++i) {
+        if (s[i] < '0' || s[i] > '9') return -1;
+        n = n * 10 + (s[i] - '0');
+    }
+    if (n > 31) return -1;
+    for (const auto &a : kVectorArrangements)
+        if (a.suffix == s.substr(dot)) return n | (a.q << 5) | (a.size << 6);
+    return -1;
+}
+
+/// b.cond suffixes and their condition-code encodings.
+struct CondCode {
+    std::string_view suffix;
+    int code;
+};
+
+inline constexpr CondCode kCondCodes[] = {
+    {".eq", 0},  {".ne", 1},  {".hs", 2},  {".lo", 3},
+    {".hi", 8},  {".ls", 9},  {".ge", 10}, {".lt", 11},
+    {".gt", 12}, {".le", 13},
+};
+
+/// First pattern entry for `mnemonic`; the alternatives follow it
+/// contiguously in kInstrPatterns.
+constexpr const InstrPattern *findInstrPattern(std::string_view mnemonic) {
+    for (const auto &p : kInstrPatterns)
+        if (p.mnemonic == mnemonic) return &p;
+    return nullptr;
+}
+
+constexpr const InstrPattern *instrPatternsEnd() {
+    return kInstrPatterns + sizeof(kInstrPatterns) / sizeof(kInstrPatterns[0]);
+}
+
+/// Returns -1 for an unknown suffix.
+constexpr int findCondCode(std::string_view suffix) {
+    for (const auto &c : kCondCodes)
+        if (c.suffix == suffix) return c.code;
+    return -1;
+}
+
+/// Condition operand of csel/cset ("eq", no dot).  Returns -1 if unknown.
+constexpr int findCondName(std::string_view name) {
+    for (const auto &c : kCondCodes)
+        if (c.suffix.substr(1) == name) return c.code;
+    return -1;
+}
+
+constexpr bool isAlignDirective(std::string_view directive) {
+    return directive == ".p2align" || directive == ".align" || directive == ".balign";
+}
+
+/// Alignment in bytes requested by `.p2align n` / `.align n` (2^n, as on
+/// AArch64) or `.balign n` (n, a power of two), up to 64 KiB.  Returns 0
+/// if `directive` is not an alignment directive, and throws if `n` is out
+/// of range.
+constexpr uint64_t alignmentOf(std::string_view directive, int64_t n) {
+    if (directive == ".p2align" || directive == ".align") {
+        if (n < 0 || n > 16) throw std::runtime_error(".p2align / .align take 0..16");
+        return uint64_t{1} << n;
+    }
+    if (directive == ".balign") {
+        if (n < 1 || n > 65536 || (n & (n - 1)))
+            throw std::runtime_error(".balign takes a power of two up to 65536");
+        return static_cast<uint64_t>(n);
+    }
+    return 0;
+}
+
+/// Bytes of padding that bring `pc` up to a multiple of `align`.
+constexpr uint64_t alignPadding(uint64_t pc, uint64_t align) {
+    return (align - pc % align) % align;
+}
+
+/// Bytes per value of `.byte` / `.4byte` / `.8byte`, or 0 for any other
+/// directive.
+constexpr unsigned dataWidth(std::string_view directive) {
+    return directive == ".byte" ? 1 : directive == ".4byte" ? 4 : directive == ".8byte" ? 8 : 0;
+}
+
+/// Directives that emit data rather than code.
+constexpr bool isDataDirective(std::string_view directive) {
+    return dataWidth(directive) || directive == ".ascii" || directive == ".zero" ||
+           directive == ".space";
+}
+
+/// `.text`, `.data`, `.bss` and `.section name`.
+constexpr bool isSectionDirective(std::string_view directive) {
+    return directive == ".text" || directive == ".data" || directive == ".bss" ||
+           directive == ".section";
+}
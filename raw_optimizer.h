@@ -0,0 +1,237 @@
+#pragma once
+
+#include "token.h"
+#include "assembler.h"
+#include "superopt.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+/// Peephole optimiser for `--raw` / `--tokenized` input, run on the token
+/// stream when `-O1` is given.  The program is lifted into lines (one
+/// instruction, label or directive each), rewritten until nothing changes,
+/// and flattened back into tokens for the Assembler.
+///
+///   add xN, xN, xzr / sub xN, xN, xzr / mov xN, xN    removed
+///   cmp whose flags a later cmp overwrites before     removed
+///     anything reads them (through labels and `b`)
+///   b / b.cond / cbz / cbnz to a label whose first     retargeted to the
+///     instruction is `b L2`                             final destination
+///   b / b.cond / cbz / cbnz to the next line           removed
+///   arithmetic with a shorter equivalent in the          replaced by it
+///     superoptimiser cache (see superopt.h)
+///
+/// Labels are never removed or moved relative to their instructions, so
+/// `.8byte label` still yields the label's (new) address.  Code with a
+/// numeric PC-relative offset (`b 8`, `ldr x1, -16`, ...) is left alone,
+/// since deleting an instruction would silently change its target.
+class RawOptimizer {
+public:
+    /// Returns the number of rewrites made (reported by --stats).  With
+    /// `rewrites`, cached superoptimiser results are applied as well.
+    static size_t optimize(TokenList &tokens, Superoptimizer::Cache *rewrites = nullptr) {
+        auto *mr = tokens.get_allocator().resource();
+        TokenLines lines = Assembler::groupLines(tokens, mr);
+        if (hasNumericOffsets(lines)) return 0;
+
+        size_t total = 0;
+        for (;;) {
+            size_t n = removeNops(lines) + removeDeadCmps(lines) +
+                       threadBranches(lines) + removeFallthroughBranches(lines);
+            if (rewrites) n += Superoptimizer::optimize(lines, *rewrites, 0).rewrites;
+            if (n == 0) break;
+            total += n;
+        }
+
+        tokens = flatten(lines, mr);
+        return total;
+    }
+
+    /// --superopt: search windows missing from `cache` for sequences of up
+    /// to maxLength instructions and apply every rewrite found or cached.
+    static Superoptimizer::Stats superoptimize(TokenList &tokens, Superoptimizer::Cache &cache,
+                                               unsigned maxLength) {
+        auto *mr = tokens.get_allocator().resource();
+        TokenLines lines = Assembler::groupLines(tokens, mr);
+        if (hasNumericOffsets(lines)) return {};
+        auto st = Superoptimizer::optimize(lines, cache, maxLength);
+        tokens = flatten(lines, mr);
+        return st;
+    }
+
+    /// True if any line branches or loads by a numeric PC-relative offset;
+    /// such code must keep its layout, so no pass may insert or delete
+    /// instructions in it.  Also used by the Outliner.
+    static bool hasNumericOffsets(const TokenLines &lines) {
+        for (auto &l : lines)
+            if (hasNumericOffsets(l)) return true;
+        return false;
+    }
+
+private:
+    static TokenList flatten(const TokenLines &lines, std::pmr::memory_resource *mr) {
+        TokenList out(mr);
+        for (auto &line : lines) {
+            out.insert(out.end(), line.begin(), line.end());
+            out.push_back({NEWLINE, ""});
+        }
+        return out;
+    }
+
+    static bool hasNumericOffsets(const TokenList &l) {
+        static const std::set<std::string, std::less<>> pcRelative = {
+            "b", "bl", "cbz", "cbnz", "tbz", "tbnz",
+        };
+        if (l.empty() || l[0].type != ID) return false;
+        bool literalLoad = l[0].lexeme == "ldr" &&                      // ldr xd, <offset>
+                           std::none_of(l.begin(), l.end(), [](const Token &t) { return t.type == LBRACK; });
+        if (!literalLoad && !pcRelative.count(l[0].lexeme)) return false;
+        // the target follows the last comma (or the mnemonic); without a
+        // label it is an offset, whatever expression spells it
+        size_t k = l.size();
+        while (k > 1 && l[k - 1].type != COMMA) --k;
+        return std::none_of(l.begin() + static_cast<long>(k), l.end(),
+                            [](const Token &t) { return t.type == ID; });
+    }
+
+    static bool isLabel(const TokenList &l) { return l.size() == 1 && l[0].type == LABEL; }
+
+    static std::string labelName(const TokenList &l) {
+        std::string name = l[0].lexeme;
+        if (!name.empty() && name.back() == ':') name.pop_back();
+        return name;
+    }
+
+    static bool isOp(const TokenList &l, const char *name) {
+        return !l.empty() && l[0].type == ID && l[0].lexeme == name;
+    }
+
+    static bool isCondBranch(const TokenList &l) {
+        return isOp(l, "b") && l.size() > 1 && l[1].type == DOTID;
+    }
+
+    /// The label operand of b / b.cond / cbz / cbnz, or nullptr if the line
+    /// is not one of those or branches to a numeric offset.
+    static Token *branchTarget(TokenList &l) {
+        Token *t = nullptr;
+        if (isOp(l, "b") && (l.size() == 2 || (l.size() == 3 && l[1].type == DOTID))) t = &l.back();
+        else if ((isOp(l, "cbz") || isOp(l, "cbnz")) && l.size() == 4) t = &l[3];
+        return (t && t->type == ID) ? t : nullptr;
+    }
+
+    /// Drop the lines marked in `dead`; returns how many there were.
+    static size_t erase(TokenLines &lines, const std::vector<bool> &dead) {
+        size_t w = 0;
+        for (size_t r = 0; r < lines.size(); ++r)
+            if (!dead[r]) {
+                if (w != r) lines[w] = std::move(lines[r]);
+                ++w;
+            }
+        size_t removed = lines.size() - w;
+        lines.resize(w);
+        return removed;
+    }
+
+    static size_t removeNops(TokenLines &lines) {
+        std::vector<bool> dead(lines.size());
+        for (size_t i = 0; i < lines.size(); ++i) {
+            const TokenList &l = lines[i];
+            if ((isOp(l, "add") || isOp(l, "sub")) && l.size() == 6 &&
+                l[1].lexeme == l[3].lexeme && l[5].type == ZREG)
+                dead[i] = true;
+            else if (isOp(l, "mov") && l.size() == 4 && l[1].lexeme == l[3].lexeme)
+                dead[i] = true;
+        }
+        return erase(lines, dead);
+    }
+
+    /// A cmp is dead if, on the path out of it, another cmp comes before
+    /// anything that reads the flags.  The scan steps over labels (other
+    /// paths into them do not read this cmp's flags) and follows `b label`;
+    /// conditional branches, cbz/tbz, calls, br, directives and data end it
+    /// with the flags assumed live, as does a `b` back to a line it has
+    /// already followed.
+    static size_t removeDeadCmps(TokenLines &lines) {
+        static const std::set<std::string, std::less<>> readers = {
+            "csel", "csinc", "csneg", "cset",
+        };
+        static const std::set<std::string, std::less<>> barriers = {
+            "bl", "br", "blr", "cbz", "cbnz", "tbz", "tbnz",
+        };
+        std::map<std::string, size_t> target = labelTargets(lines);
+        std::vector<bool> dead(lines.size());
+        for (size_t i = 0; i < lines.size(); ++i) {
+            if (!isOp(lines[i], "cmp")) continue;
+            std::set<size_t> followed;
+            for (size_t j = i + 1; j < lines.size();) {
+                TokenList &l = lines[j];
+                if (isLabel(l)) { ++j; continue; }
+                if (isOp(l, "cmp")) { dead[i] = true; break; }
+                if (isOp(l, "b") && !isCondBranch(l)) {
+                    Token *t = branchTarget(l);
+                    auto it = t ? target.find(t->lexeme) : target.end();
+                    if (it == target.end() || !followed.insert(it->second).second) break;
+                    j = it->second;
+                    continue;
+                }
+                if (l[0].type != ID || isOp(l, "b") || readers.count(l[0].lexeme) ||
+                    barriers.count(l[0].lexeme))
+                    break;
+                ++j;
+            }
+        }
+        return erase(lines, dead);
+    }
+
+    /// label -> index of the first non-label line after it
+    static std::map<std::string, size_t> labelTargets(const TokenLines &lines) {
+        std::map<std::string, size_t> target;
+        for (size_t i = 0; i < lines.size(); ++i) {
+            if (!isLabel(lines[i])) continue;
+            size_t k = i;
+            while (k < lines.size() && isLabel(lines[k])) ++k;
+            target[labelName(lines[i])] = k;
+        }
+        return target;
+    }
+
+    static size_t threadBranches(TokenLines &lines) {
+        std::map<std::string, size_t> target = labelTargets(lines);
+
+        size_t changed = 0;
+        for (auto &l : lines) {
+            Token *t = branchTarget(l);
+            if (!t) continue;
+            std::string dest = t->lexeme;
+            std::set<std::string> seen{dest};
+            for (;;) {
+                auto it = target.find(dest);
+                if (it == target.end() || it->second >= lines.size()) break;
+                TokenList &next = lines[it->second];
+                if (!isOp(next, "b") || isCondBranch(next) || !branchTarget(next)) break;
+                if (!seen.insert(next.back().lexeme).second) break;     // b-only cycle
+                dest = next.back().lexeme;
+            }
+            if (dest != t->lexeme) {
+                t->lexeme = dest;
+                ++changed;
+            }
+        }
+        return changed;
+    }
+
+    static size_t removeFallthroughBranches(TokenLines &lines) {
+        std::vector<bool> dead(lines.size());
+        for (size_t i = 0; i < lines.size(); ++i) {
+            Token *t = branchTarget(lines[i]);
+            if (!t) continue;
+            for (size_t k = i + 1; k < lines.size() && isLabel(lines[k]); ++k)
+                if (labelName(lines[k]) == t->lexeme) { dead[i] = true; break; }
+        }
+        return erase(lines, dead);
+    }
+};
@@ -0,0 +1,228 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#ifdef __linux__
+#include <cerrno>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+/// Optional hardware performance counters read through perf_event_open.
+///
+/// Each counter is opened independently for the calling thread (user space
+/// only), so a machine that exposes cycles but not cache events still reports
+/// what it can.  When nothing can be opened -- non-Linux builds, containers
+/// without perf access, perf_event_paranoid too strict -- available() is false
+/// and reason() says why; callers simply print "n/a".
+class PerfCounters {
+public:
+    enum Event { CYCLES, INSTRUCTIONS, BRANCH_MISSES, L1D_MISSES, LLC_MISSES, NUM_EVENTS };
+
+    struct Sample {
+        uint64_t value[NUM_EVENTS] = {};
+        bool valid[NUM_EVENTS] = {};
+    };
+
+    static const char *eventName(Event e) {
+        static const char *const names[NUM_EVENTS] = {
+            "cycles", "instructions", "branch-misses", "L1D-misses", "LLC-misses"
+        };
+        return names[e];
+    }
+
+    PerfCounters() { open(); }
+    ~PerfCounters() { close(); }
+    PerfCounters(const PerfCounters &) = delete;
+    PerfCounters &operator=(const PerfCounters &) = delete;
+
+    bool available() const {
+        for (int fd : fds_) if (fd >= 0) return true;
+        return false;
+    }
+    const std::string &reason() const { return reason_; }
+
+    void start() {
+#ifdef __linux__
+        for (int fd : fds_) {
+            if (fd < 0) continue;
+            ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+            ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+        }
+#endif
+    }
+
+    /// Stop counting and return the values since start(), scaled up when the
+    /// kernel had to multiplex the counters.
+    Sample stop() {
+        Sample s;
+#ifdef __linux__
+        for (int e = 0; e < NUM_EVENTS; ++e) {
+            int fd = fds_[e];
+            if (fd < 0) continue;
+            ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+            uint64_t buf[3] = {};   // value, time_enabled, time_running
+            if (read(fd, buf, sizeof buf) != static_cast<ssize_t>(sizeof buf)) continue;
+            uint64_t v = buf[0];
+            if (buf[2] == 0) continue;
+            if (buf[2] < buf[1])
+                v = static_cast<uint64_t>(static_cast<double>(v) * buf[1] / buf[2]);
+            s.value[e] = v;
+            s.valid[e] = true;
+        }
+#endif
+        return s;
+    }
+
+private:
+    int fds_[NUM_EVENTS] = {-1, -1, -1, -1, -1};
+    std::string reason_;
+
+    void open() {
+#ifdef __linux__
+        static const std::pair<uint32_t, uint64_t> config[NUM_EVENTS] = {
+            {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+            {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+            {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+            {PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D |
+                                 (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                                 (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+            {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+        };
+        for (int e = 0; e < NUM_EVENTS; ++e) {
+            perf_event_attr attr;
+            std::memset(&attr, 0, sizeof attr);
+            attr.size = sizeof attr;
+            attr.type = config[e].first;
+            attr.config = config[e].second;
+            attr.disabled = 1;
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+            long fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+            if (fd < 0) {
+                if (reason_.empty())
+                    reason_ = std::string("perf_event_open: ") + std::strerror(errno);
+                continue;
+            }
+            fds_[e] = static_cast<int>(fd);
+        }
+#else
+        reason_ = "perf_event_open is only available on Linux";
+#endif
+    }
+
+    void close() {
+#ifdef __linux__
+        for (int &fd : fds_) {
+            if (fd >= 0) ::close(fd);
+            fd = -1;
+        }
+#endif
+    }
+};
+
+/// Collects per-phase wall time and hardware counters for --stats and
+/// prints them as a table on stderr.  When disabled, measure() just runs
+/// the phase.
+class PipelineStats {
+public:
+    explicit PipelineStats(bool enabled) : enabled_(enabled) {
+        if (enabled_) counters_ = std::make_unique<PerfCounters>();
+    }
+
+    bool enabled() const { return enabled_; }
+
+    /// Run `f` as pipeline phase `name` and return its result.
+    template <typename F>
+    auto measure(const std::string &name, F &&f) -> decltype(f()) {
+        if (!enabled_) return f();
+        Phase ph;
+        ph.name = name;
+        counters_->start();
+        auto t0 = std::chrono::steady_clock::now();
+        if constexpr (std::is_void_v<decltype(f())>) {
+            f();
+            record(ph, t0);
+        } else {
+            auto r = f();
+            record(ph, t0);
+            return r;
+        }
+    }
+
+    /// Extra "name: value" lines printed below the phase table.
+    void note(const std::string &name, const std::string &value) {
+        if (enabled_) notes_.push_back({name, value});
+    }
+
+    void report(std::ostream &out) const {
+        if (!enabled_) return;
+        const bool hw = counters_->available();
+        out << "--- stats ---\n";
+        out << std::left << std::setw(12) << "phase" << std::right << std::setw(12) << "time(us)";
+        if (hw)
+            for (int e = 0; e < PerfCounters::NUM_EVENTS; ++e)
+                out << std::setw(15) << PerfCounters::eventName(static_cast<PerfCounters::Event>(e));
+        out << "\n";
+
+        Phase total;
+        total.name = "total";
+        for (auto &ph : phases_) {
+            printPhase(out, ph, hw);
+            total.micros += ph.micros;
+            for (int e = 0; e < PerfCounters::NUM_EVENTS; ++e) {
+                total.counters.value[e] += ph.counters.value[e];
+                total.counters.valid[e] |= ph.counters.valid[e];
+            }
+        }
+        printPhase(out, total, hw);
+
+        if (!hw)
+            out << "hardware counters: n/a (" << counters_->reason() << ")\n";
+        for (auto &n : notes_)
+            out << n.first << ": " << n.second << "\n";
+    }
+
+private:
+    struct Phase {
+        std::string name;
+        double micros = 0.0;
+        PerfCounters::Sample counters;
+    };
+
+    bool enabled_;
+    std::unique_ptr<PerfCounters> counters_;
+    std::vector<Phase> phases_;
+    std::vector<std::pair<std::string, std::string>> notes_;
+
+    void record(Phase &ph, std::chrono::steady_clock::time_point t0) {
+        auto t1 = std::chrono::steady_clock::now();
+        ph.counters = counters_->stop();
+        ph.micros = std::chrono::duration<double, std::micro>(t1 - t0).count();
+        phases_.push_back(std::move(ph));
+    }
+
+    static void printPhase(std::ostream &out, const Phase &ph, bool hw) {
+        out << std::left << std::setw(12) << ph.name << std::right << std::fixed
+            << std::setprecision(1) << std::setw(12) << ph.micros;
+        if (hw) {
+            for (int e = 0; e < PerfCounters::NUM_EVENTS; ++e) {
+                if (ph.counters.valid[e]) out << std::setw(15) << ph.counters.value[e];
+                else                      out << std::setw(15) << "n/a";
+            }
+        }
+        out << "\n" << std::defaultfloat;
+    }
+};
@@ -0,0 +1,521 @@
+#pragma once
+
+#include "token.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <map>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <sys/stat.h>
+
+/// Superoptimiser for short runs of integer arithmetic (--superopt).
+///
+/// A window is up to kMaxWindow consecutive lines of add, sub, mul, smulh,
+/// umulh, sdiv, udiv, neg or mov on x registers and xzr.  Its registers are
+/// renamed in order of appearance (r0, r1, ...), so windows that differ
+/// only in register choice share one cache entry, and a register it writes
+/// is an output if a later line may read it before overwriting it; the
+/// scan for readers stops at the first label, branch or directive, where
+/// everything is assumed live.
+///
+/// The search enumerates sequences of 0, 1, ... N instructions over the
+/// window's registers and xzr, writing only registers the window writes.
+/// A candidate must first agree with the window on a few 64-bit test
+/// vectors; the survivors are checked on 256 more and then exhaustively at
+/// every bit width w = 1, 2, ... for which all (2^w)^k inputs of the k
+/// registers number at most 2^18, with each opcode's w-bit semantics.  The
+/// first candidate that passes is the rewrite.  This is testing, not a
+/// proof at 64 bits, but a wrong rewrite has to agree with the window on
+/// every input at each of those widths.  The ISA has no immediate forms of
+/// these instructions, so xzr is the only constant.
+///
+/// Results, including "nothing shorter up to N", go to a Cache that
+/// persists between runs; RawOptimizer applies the cached rewrites at -O1
+/// without searching.
+class Superoptimizer {
+public:
+    static constexpr size_t kMaxWindow = 4;
+    static constexpr unsigned kMaxLength = 3;
+
+    enum Kind : uint8_t { ADD, SUB, MUL, SMULH, UMULH, SDIV, UDIV, NEG, MOV, KINDS };
+    static constexpr uint8_t kZero = 0xFF;      // xzr in a renamed instruction
+
+    struct Instr {
+        uint8_t kind, d, n, m;                  // n unused by NEG and MOV
+    };
+
+    /// Search results keyed by renamed window, kept in a text file with one
+    /// `key<TAB>result` line per entry; result is `= seq` (a rewrite,
+    /// possibly empty) or `! N` (nothing shorter of up to N instructions).
+    class Cache {
+    public:
+        struct Entry {
+            bool found = false;
+            unsigned searched = 0;              // longest length fully enumerated
+            std::vector<Instr> seq;
+        };
+
+        Cache() = default;
+        explicit Cache(std::string path) : path_(std::move(path)) {
+            std::ifstream in(path_);
+            for (std::string line; std::getline(in, line);) {
+                size_t tab = line.find('\t');
+                if (tab == std::string::npos) continue;
+                Entry e;
+                if (decode(line.substr(tab + 1), e)) entries_[line.substr(0, tab)] = std::move(e);
+            }
+        }
+
+        /// $XDG_CACHE_HOME/asm-superopt, else ~/.cache/asm-superopt, else
+        /// .asm-superopt in the current directory.
+        static std::string defaultPath() {
+            std::string dir;
+            if (const char *x = std::getenv("XDG_CACHE_HOME"); x && *x) dir = x;
+            else if (const char *h = std::getenv("HOME"); h && *h) dir = std::string(h) + "/.cache";
+            else return ".asm-superopt";
+            ::mkdir(dir.c_str(), 0755);
+            return dir + "/asm-superopt";
+        }
+
+        const Entry *find(const std::string &key) const {
+            auto it = entries_.find(key);
+            return it == entries_.end() ? nullptr : &it->second;
+        }
+
+        void put(const std::string &key, Entry e) {
+            entries_[key] = std::move(e);
+            dirty_ = true;
+        }
+
+        size_t size() const { return entries_.size(); }
+        size_t rewrites() const {
+            return static_cast<size_t>(std::count_if(entries_.begin(), entries_.end(),
+                                                     [](auto &kv) { return kv.second.found; }));
+        }
+
+        /// Write the file if anything was added (atomically, by rename).
+        void save() {
+            if (!dirty_ || path_.empty()) return;
+            std::string tmp = path_ + ".tmp";
+            {
+                std::ofstream out(tmp);
+                for (auto &[key, e] : entries_) out << key << '\t' << encode(e) << '\n';
+                if (!out) throw std::runtime_error("Cannot write superoptimizer cache: " + tmp);
+            }
+            if (std::rename(tmp.c_str(), path_.c_str()) != 0)
+                throw std::runtime_error("Cannot write superoptimizer cache: " + path_);
+            dirty_ = false;
+        }
+
+    private:
+        std::string path_;
+        std::map<std::string, Entry> entries_;
+        bool dirty_ = false;
+
+        static std::string encode(const Entry &e) {
+            if (!e.found) return "! " + std::to_string(e.searched);
+            return "= " + text(e.seq);
+        }
+
+        static bool decode(const std::string &s, Entry &e) {
+            if (s.size() >= 3 && s[0] == '!' && s[1] == ' ') {
+                e.searched = static_cast<unsigned>(std::atoi(s.c_str() + 2));
+                return true;
+            }
+            if (s.size() < 2 || s[0] != '=' || s[1] != ' ') return false;
+            e.found = true;
+            return parse(s.substr(2), e.seq);
+        }
+    };
+
+    struct Stats {
+        size_t windows = 0;         // windows looked up
+        size_t hits = 0;            // ... answered by the cache
+        size_t searched = 0;        // ... searched
+        size_t rewrites = 0;
+        size_t saved = 0;           // instructions removed
+    };
+
+    /// Rewrite every window that has a shorter equivalent.  With maxLength
+    /// 0 only cached results are used; otherwise windows missing from the
+    /// cache are searched for sequences of up to maxLength instructions
+    /// and the results recorded.
+    static Stats optimize(TokenLines &lines, Cache &cache, unsigned maxLength) {
+        Stats st;
+        std::set<std::string> tried;        // searched in this call (budget may have run out)
+        size_t i = 0;
+        while (i < lines.size()) {
+            size_t run = 0;
+            Line line;
+            while (run < kMaxWindow && i + run < lines.size() && parseLine(lines[i + run], line)) ++run;
+
+            bool rewritten = false;
+            for (size_t s = run; s >= 1 && !rewritten; --s) {
+                Window w = window(lines, i, s);
+                ++st.windows;
+                const unsigned want = std::min<unsigned>(maxLength, static_cast<unsigned>(s - 1));
+                const Cache::Entry *e = cache.find(w.key);
+                if (e && (e->found || e->searched >= want)) {
+                    ++st.hits;
+                } else if (maxLength && tried.insert(w.key).second) {
+                    ++st.searched;
+                    cache.put(w.key, search(w.problem, want));
+                    e = cache.find(w.key);
+                } else {
+                    continue;
+                }
+                if (!e->found || e->seq.size() >= s) continue;
+
+                TokenLines out(lines.get_allocator());
+                for (auto &in : e->seq) out.push_back(tokens(in, w.names, lines.get_allocator()));
+                lines.erase(lines.begin() + static_cast<long>(i), lines.begin() + static_cast<long>(i + s));
+                lines.insert(lines.begin() + static_cast<long>(i), out.begin(), out.end());
+                ++st.rewrites;
+                st.saved += s - e->seq.size();
+                i += e->seq.size();
+                rewritten = true;
+            }
+            if (!rewritten) ++i;
+        }
+        return st;
+    }
+
+    // ---------- semantics ----------
+
+    /// One instruction on w-bit values (1 <= w <= 64), as ARM64 computes it
+    /// at 64 bits: division by zero gives 0 and MIN / -1 gives MIN.
+    static uint64_t eval(uint8_t kind, uint64_t a, uint64_t b, int w) {
+        const uint64_t mask = w == 64 ? ~uint64_t{0} : (uint64_t{1} << w) - 1;
+        auto sx = [w](uint64_t v) {
+            return w == 64 ? static_cast<int64_t>(v)
+                           : static_cast<int64_t>(v << (64 - w)) >> (64 - w);
+        };
+        switch (kind) {
+            case ADD: return (a + b) & mask;
+            case SUB: return (a - b) & mask;
+            case MUL: return (a * b) & mask;
+            case SMULH:
+                if (w == 64) return static_cast<uint64_t>((static_cast<__int128>(sx(a)) * sx(b)) >> 64);
+                return static_cast<uint64_t>((sx(a) * sx(b)) >> w) & mask;
+            case UMULH:
+                if (w == 64) return static_cast<uint64_t>((static_cast<unsigned __int128>(a) * b) >> 64);
+                return ((a * b) >> w) & mask;
+            case SDIV:
+                if (b == 0) return 0;
+                if (sx(b) == -1) return (0 - a) & mask;         // MIN / -1 wraps to MIN
+                return static_cast<uint64_t>(sx(a) / sx(b)) & mask;
+            case UDIV: return b == 0 ? 0 : a / b;
+            case NEG: return (0 - b) & mask;
+            case MOV: return b;
+        }
+        return 0;
+    }
+
+private:
+    static constexpr const char *kNames[KINDS] = {
+        "add", "sub", "mul", "smulh", "umulh", "sdiv", "udiv", "neg", "mov",
+    };
+    static constexpr size_t kVectors = 8, kCheckVectors = 256;
+    static constexpr int kExhaustiveBits = 18;                  // 2^18 inputs per width
+    static constexpr uint64_t kBudget = uint64_t{1} << 22;      // leaves per search
+
+    /// A parsed arithmetic line, with register names.
+    struct Line {
+        uint8_t kind;
+        std::string d, n, m;
+    };
+
+    struct Problem {
+        int k = 0;                          // registers r0 .. r(k-1)
+        std::vector<Instr> window;
+        std::vector<uint8_t> written, live;
+    };
+
+    struct Window {
+        std::string key;
+        std::vector<std::string> names;     // renamed register -> real name
+        Problem problem;
+    };
+
+    static bool threeReg(uint8_t kind) { return kind < NEG; }
+
+    /// add xd, xn, xm (xm may be xzr) ... / neg xd, xm / mov xd, xm.  sp and
+    /// an xzr destination are left alone (sp means xzr to mul and friends).
+    static bool parseLine(const TokenList &l, Line &out) {
+        if (l.empty() || l[0].type != ID) return false;
+        auto it = std::find(std::begin(kNames), std::end(kNames), l[0].lexeme);
+        if (it == std::end(kNames)) return false;
+        out.kind = static_cast<uint8_t>(it - std::begin(kNames));
+        auto reg = [](const Token &t, bool zero) { return t.type == REG || (zero && t.type == ZREG); };
+        if (threeReg(out.kind)) {
+            if (l.size() != 6 || l[2].type != COMMA || l[4].type != COMMA ||
+                !reg(l[1], false) || !reg(l[3], false) || !reg(l[5], true))
+                return false;
+            out.d = l[1].lexeme, out.n = l[3].lexeme, out.m = l[5].lexeme;
+        } else {
+            if (l.size() != 4 || l[2].type != COMMA || !reg(l[1], false) || !reg(l[3], true))
+                return false;
+            out.d = l[1].lexeme, out.n.clear(), out.m = l[3].lexeme;
+        }
+        return true;
+    }
+
+    /// Might a line at or after `from` read `reg` before something writes it?
+    static bool liveAfter(const TokenLines &lines, size_t from, const std::string &reg) {
+        static const std::set<std::string, std::less<>> barriers = {
+            "b", "bl", "br", "blr", "cbz", "cbnz", "tbz", "tbnz",
+        };
+        Line a;
+        for (size_t j = from; j < lines.size(); ++j) {
+            const TokenList &l = lines[j];
+            if (parseLine(l, a)) {
+                if (a.n == reg || a.m == reg) return true;
+                if (a.d == reg) return false;
+                continue;
+            }
+            if (l.empty() || l[0].type != ID || barriers.count(l[0].lexeme)) return true;
+            for (auto &t : l)
+                if (t.type == REG && t.lexeme == reg) return true;
+        }
+        return true;
+    }
+
+    static Window window(const TokenLines &lines, size_t at, size_t size) {
+        Window w;
+        std::map<std::string, uint8_t> index;
+        auto rename = [&](const std::string &s) -> uint8_t {
+            if (s == "xzr") return kZero;
+            auto [it, fresh] = index.emplace(s, static_cast<uint8_t>(w.names.size()));
+            if (fresh) w.names.push_back(s);
+            return it->second;
+        };
+        Line l;
+        for (size_t j = at; j < at + size; ++j) {
+            parseLine(lines[j], l);
+            Instr in{l.kind, 0, 0, 0};
+            in.d = rename(l.d);
+            if (threeReg(l.kind)) in.n = rename(l.n);
+            in.m = rename(l.m);
+            w.problem.window.push_back(in);
+        }
+        w.problem.k = static_cast<int>(w.names.size());
+        w.problem.written.assign(w.names.size(), 0);
+        for (auto &in : w.problem.window) w.problem.written[in.d] = 1;
+        std::string live;
+        for (int r = 0; r < w.problem.k; ++r)
+            if (w.problem.written[r] && liveAfter(lines, at + size, w.names[r])) {
+                w.problem.live.push_back(static_cast<uint8_t>(r));
+                live += " r" + std::to_string(r);
+            }
+        w.key = text(w.problem.window) + " |" + live;
+        return w;
+    }
+
+    static TokenList tokens(const Instr &in, const std::vector<std::string> &names,
+                            const TokenList::allocator_type &alloc) {
+        auto reg = [&](uint8_t r) { return r == kZero ? Token{ZREG, "xzr"} : Token{REG, names[r]}; };
+        TokenList l(alloc);
+        l.push_back({ID, kNames[in.kind]});
+        l.push_back(reg(in.d));
+        l.push_back({COMMA, ","});
+        if (threeReg(in.kind)) {
+            l.push_back(reg(in.n));
+            l.push_back({COMMA, ","});
+        }
+        l.push_back(reg(in.m));
+        return l;
+    }
+
+    // ---------- text form of renamed sequences ----------
+
+    static std::string text(const std::vector<Instr> &seq) {
+        std::string s;
+        auto reg = [](uint8_t r) { return r == kZero ? std::string("z") : "r" + std::to_string(r); };
+        for (auto &in : seq) {
+            if (!s.empty()) s += "; ";
+            s += std::string(kNames[in.kind]) + " " + reg(in.d) + ",";
+            if (threeReg(in.kind)) s += reg(in.n) + ",";
+            s += reg(in.m);
+        }
+        return s;
+    }
+
+    static bool parse(const std::string &s, std::vector<Instr> &seq) {
+        size_t p = 0;
+        auto reg = [&](uint8_t &r) {
+            if (p < s.size() && s[p] == 'z') { r = kZero; ++p; return true; }
+            if (p >= s.size() || s[p] != 'r') return false;
+            char *end;
+            long v = std::strtol(s.c_str() + p + 1, &end, 10);
+            if (end == s.c_str() + p + 1 || v < 0 || v >= kZero) return false;
+            r = static_cast<uint8_t>(v);
+            p = static_cast<size_t>(end - s.c_str());
+            return true;
+        };
+        while (p < s.size()) {
+            size_t sp = s.find(' ', p);
+            if (sp == std::string::npos) return false;
+            auto it = std::find(std::begin(kNames), std::end(kNames), s.substr(p, sp - p));
+            if (it == std::end(kNames)) return false;
+            Instr in{static_cast<uint8_t>(it - std::begin(kNames)), 0, 0, 0};
+            p = sp + 1;
+            if (!reg(in.d) || in.d == kZero || p >= s.size() || s[p++] != ',') return false;
+            if (threeReg(in.kind) && (!reg(in.n) || in.n == kZero || p >= s.size() || s[p++] != ','))
+                return false;
+            if (!reg(in.m)) return false;
+            seq.push_back(in);
+            if (p < s.size() && s.compare(p, 2, "; ") != 0) return false;
+            if (p < s.size()) p += 2;
+        }
+        return true;
+    }
+
+    // ---------- search ----------
+
+    static void exec(const std::vector<Instr> &seq, uint64_t *regs, int w) {
+        for (auto &in : seq) {
+            uint64_t a = threeReg(in.kind) ? regs[in.n] : 0;
+            uint64_t b = in.m == kZero ? 0 : regs[in.m];
+            regs[in.d] = eval(in.kind, a, b, w);
+        }
+    }
+
+    static uint64_t splitmix(uint64_t &s) {
+        uint64_t z = (s += 0x9E3779B97F4A7C15ull);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+        return z ^ (z >> 31);
+    }
+
+    /// k-register 64-bit inputs: edge values mixed with random ones.
+    static std::vector<uint64_t> vectors(size_t count, int k, uint64_t seed) {
+        static const uint64_t edges[] = {
+            0, 1, ~uint64_t{0}, 2, uint64_t{1} << 63, (uint64_t{1} << 63) - 1, 3, ~uint64_t{1},
+        };
+        std::vector<uint64_t> v(count * static_cast<size_t>(k));
+        for (size_t t = 0; t < count; ++t)
+            for (int r = 0; r < k; ++r) {
+                uint64_t x = splitmix(seed);
+                v[t * k + r] = (t < 2 || x % 3 == 0) ? edges[(t + static_cast<size_t>(r) + x) % 8] : x;
+            }
+        return v;
+    }
+
+    /// Does `cand` leave every live register as the window does on these inputs?
+    static bool agrees(const Problem &p, const std::vector<Instr> &cand, const uint64_t *in, int w) {
+        uint64_t a[256], b[256];
+        std::copy(in, in + p.k, a);
+        std::copy(in, in + p.k, b);
+        exec(p.window, a, w);
+        exec(cand, b, w);
+        for (uint8_t r : p.live)
+            if (a[r] != b[r]) return false;
+        return true;
+    }
+
+    static bool verify(const Problem &p, const std::vector<Instr> &cand) {
+        auto check = vectors(kCheckVectors, p.k, 0x5eed5eedull);
+        for (size_t t = 0; t < kCheckVectors; ++t)
+            if (!agrees(p, cand, &check[t * p.k], 64)) return false;
+        std::vector<uint64_t> in(static_cast<size_t>(p.k));
+        for (int w = 1; w * p.k <= kExhaustiveBits; ++w) {
+            const uint64_t total = uint64_t{1} << (w * p.k), mask = (uint64_t{1} << w) - 1;
+            for (uint64_t bits = 0; bits < total; ++bits) {
+                for (int r = 0; r < p.k; ++r) in[r] = (bits >> (w * r)) & mask;
+                if (!agrees(p, cand, in.data(), w)) return false;
+            }
+        }
+        return true;
+    }
+
+    /// Instructions worth trying: destinations the window writes, sources
+    /// in canonical order for commutative ops, nothing that is a plain
+    /// `mov` in disguise (op with xzr) or a no-op.
+    static std::vector<Instr> alphabet(const Problem &p) {
+        std::vector<Instr> a;
+        for (int d = 0; d < p.k; ++d) {
+            if (!p.written[d]) continue;
+            const uint8_t dd = static_cast<uint8_t>(d);
+            for (uint8_t kind = 0; kind < NEG; ++kind)
+                for (int n = 0; n < p.k; ++n)
+                    for (int m = 0; m < p.k; ++m) {
+                        bool commutative = kind == ADD || kind == MUL || kind == SMULH || kind == UMULH;
+                        if (commutative && m < n) continue;
+                        a.push_back({kind, dd, static_cast<uint8_t>(n), static_cast<uint8_t>(m)});
+                    }
+            for (int m = 0; m < p.k; ++m) a.push_back({NEG, dd, 0, static_cast<uint8_t>(m)});
+            a.push_back({MOV, dd, 0, kZero});
+            for (int m = 0; m < p.k; ++m)
+                if (m != d) a.push_back({MOV, dd, 0, static_cast<uint8_t>(m)});
+        }
+        return a;
+    }
+
+    /// Shortest equivalent of up to maxLength instructions.
+    static Cache::Entry search(const Problem &p, unsigned maxLength) {
+        Cache::Entry result;
+        const auto tests = vectors(kVectors, p.k, 0x243F6A8885A308D3ull);
+        const auto alpha = alphabet(p);
+        uint64_t budget = kBudget;
+
+        for (unsigned len = 0; len <= maxLength; ++len) {
+            // states[depth][test][reg]: registers after `depth` instructions
+            std::vector<uint64_t> states((len + 1) * kVectors * p.k);
+            std::copy(tests.begin(), tests.end(), states.begin());
+            std::vector<uint64_t> want(kVectors * p.live.size());
+            for (size_t t = 0; t < kVectors; ++t) {
+                uint64_t r[256];
+                std::copy(&tests[t * p.k], &tests[t * p.k] + p.k, r);
+                exec(p.window, r, 64);
+                for (size_t j = 0; j < p.live.size(); ++j) want[t * p.live.size() + j] = r[p.live[j]];
+            }
+
+            std::vector<Instr> cand(len);
+            bool out = false;
+            auto dfs = [&](auto &self, unsigned depth) -> bool {
+                const uint64_t *cur = &states[depth * kVectors * p.k];
+                if (depth == len) {
+                    if (!budget--) { out = true; return false; }
+                    for (size_t t = 0; t < kVectors; ++t)
+                        for (size_t j = 0; j < p.live.size(); ++j)
+                            if (cur[t * p.k + p.live[j]] != want[t * p.live.size() + j]) return false;
+                    return verify(p, cand);
+                }
+                uint64_t *next = &states[(depth + 1) * kVectors * p.k];
+                for (const Instr &in : alpha) {
+                    // the last instruction must write something live
+                    if (depth + 1 == len &&
+                        std::find(p.live.begin(), p.live.end(), in.d) == p.live.end())
+                        continue;
+                    cand[depth] = in;
+                    std::copy(cur, cur + kVectors * p.k, next);
+                    for (size_t t = 0; t < kVectors; ++t) {
+                        uint64_t *r = next + t * p.k;
+                        uint64_t a = threeReg(in.kind) ? r[in.n] : 0;
+                        uint64_t b = in.m == kZero ? 0 : r[in.m];
+                        r[in.d] = eval(in.kind, a, b, 64);
+                    }
+                    if (self(self, depth + 1)) return true;
+                    if (out) return false;
+                }
+                return false;
+            };
+            if (dfs(dfs, 0)) {
+                result.found = true;
+                result.seq = cand;
+                return result;
+            }
+            if (out) break;
+            result.searched = len;
+        }
+        return result;
+    }
+};
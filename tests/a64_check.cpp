@@ -0,0 +1,146 @@
+// Compiled by `make check`: a64::assemble must give the same words as the
+// runtime assembler for the snippets in tests/encoding, and the build
+// fails at the first static_assert that does not hold.
+#include "../a64.h"
+
+#include <array>
+#include <cstdint>
+
+// three-register arithmetic, moves, compares and register branches
+constexpr auto arith = a64::assemble<R"(
+    add x0, x1, x2         // 8b226020
+    add x29, sp, xzr       // 8b3f63fd
+    add sp, sp, x3         // 8b2363ff
+    sub x3, x4, x5         // cb256083
+    sub sp, sp, x16        // cb3063ff
+    mul x6, x7, x8         // 9b087ce6
+    smulh x9, x10, x11     // 9b4b7d49
+    umulh x12, x13, x14    // 9bce7dac
+    sdiv x15, x16, x17     // 9ad10e0f
+    udiv x18, x19, x20     // 9ad40a72
+    mul x3, xzr, xzr       // 9b1f7fe3
+    sdiv x3, xzr, x4       // 9ac40fe3
+    udiv xzr, x1, xzr      // 9adf083f
+    neg x21, x22           // cb1603f5
+    mov x23, x24           // aa1803f7
+    mov x25, xzr           // aa1f03f9
+    cmp x1, x2             // eb22603f
+    cmp sp, x3             // eb2363ff
+    cmp x4, 4095           // f13ffc9f
+    cmp x5, #0             // f10000bf
+    br x30                 // d61f03c0
+    blr x9                 // d63f0120
+    nop                    // d503201f
+)">();
+static_assert(arith == std::array<uint32_t, 23>{
+    0x8b226020, 0x8b3f63fd, 0x8b2363ff, 0xcb256083, 0xcb3063ff, 0x9b087ce6,
+    0x9b4b7d49, 0x9bce7dac, 0x9ad10e0f, 0x9ad40a72, 0x9b1f7fe3, 0x9ac40fe3,
+    0x9adf083f, 0xcb1603f5, 0xaa1803f7, 0xaa1f03f9, 0xeb22603f, 0xeb2363ff,
+    0xf13ffc9f, 0xf10000bf, 0xd61f03c0, 0xd63f0120, 0xd503201f,
+});
+
+// pc-relative branches and literal loads, forwards and backwards
+constexpr auto branch = a64::assemble<R"(
+start:
+    b fwd                    // 14000014
+    bl start                 // 97ffffff
+    b.eq fwd                 // 54000240
+    b.ne start               // 54ffffa1
+    b.hs fwd                 // 54000202
+    b.lo fwd                 // 540001e3
+    b.hi fwd                 // 540001c8
+    b.ls fwd                 // 540001a9
+    b.ge fwd                 // 5400018a
+    b.lt fwd                 // 5400016b
+    b.gt fwd                 // 5400014c
+    b.le start               // 54fffead
+    cbz x1, fwd              // b4000101
+    cbnz x30, start          // b5fffe7e
+    tbz x2, 0, fwd           // 360000c2
+    tbnz x3, 63, start       // b7fffe23
+    tbz x4, #35, fwd         // b6180084
+    ldr x5, lit              // 58000125
+    b 8                      // 14000002
+    b -4                     // 17ffffff
+fwd:
+    csel x0, x1, x2, eq      // 9a820020
+    csel x3, xzr, x4, lt     // 9a84b3e3
+    csinc x5, x6, x7, ne     // 9a8714c5
+    csneg x8, x9, x10, gt    // da8ac528
+    cset x11, eq             // 9a9f17eb
+    cset x12, le             // 9a9fc7ec
+lit:
+    .8byte 0                 // 00000000 00000000
+)">();
+static_assert(branch == std::array<uint32_t, 28>{
+    0x14000014, 0x97ffffff, 0x54000240, 0x54ffffa1, 0x54000202, 0x540001e3,
+    0x540001c8, 0x540001a9, 0x5400018a, 0x5400016b, 0x5400014c, 0x54fffead,
+    0xb4000101, 0xb5fffe7e, 0x360000c2, 0xb7fffe23, 0xb6180084, 0x58000125,
+    0x14000002, 0x17ffffff, 0x9a820020, 0x9a84b3e3, 0x9a8714c5, 0xda8ac528,
+    0x9a9f17eb, 0x9a9fc7ec, 0x00000000, 0x00000000,
+});
+
+// loads and stores in every addressing mode
+constexpr auto memory = a64::assemble<R"(
+    ldur x1, [x2, -8]            // f85f8041
+    ldur x3, [sp, 255]           // f84ff3e3
+    stur x4, [x29, -256]         // f81003a4
+    stur xzr, [sp, 0]            // f80003ff
+    ldur xzr, [x1, 8]            // f840803f
+    ldr xzr, [x2, #8]            // f940045f
+    ldr x1, [x2]                 // f9400041
+    ldr x1, [x2, #8]             // f9400441
+    ldr x1, [sp, 32760]          // f97fffe1
+    ldr x1, [x2, -16]            // f85f0041
+    ldr x1, [x2, 12]             // f840c041
+    ldr x1, [x2, #8]!            // f8408c41
+    ldr x1, [x2], #-16           // f85f0441
+    ldr x1, [x2, x3]             // f8636841
+    ldr x1, [x2, x3, lsl #3]     // f8637841
+    str x1, [x2]                 // f9000041
+    str xzr, [x2, 4096]          // f908005f
+    str x1, [sp, #-16]!          // f81f0fe1
+    str x1, [sp], 16             // f80107e1
+    str x1, [x2, x3]             // f8236841
+    str x1, [x2, x3, lsl 3]      // f8237841
+    ldp x1, x2, [x3]             // a9400861
+    ldp x29, x30, [sp, 16]       // a9417bfd
+    ldp x1, x2, [sp, -512]!      // a9e00be1
+    ldp x29, x30, [sp], 16       // a8c17bfd
+    stp x29, x30, [sp, #-16]!    // a9bf7bfd
+    stp x19, xzr, [sp, 504]      // a91ffff3
+    stp x1, x2, [x3], -8         // a8bf8861
+    stp x1, x2, [x3]             // a9000861
+)">();
+static_assert(memory == std::array<uint32_t, 29>{
+    0xf85f8041, 0xf84ff3e3, 0xf81003a4, 0xf80003ff, 0xf840803f, 0xf940045f,
+    0xf9400041, 0xf9400441, 0xf97fffe1, 0xf85f0041, 0xf840c041, 0xf8408c41,
+    0xf85f0441, 0xf8636841, 0xf8637841, 0xf9000041, 0xf908005f, 0xf81f0fe1,
+    0xf80107e1, 0xf8236841, 0xf8237841, 0xa9400861, 0xa9417bfd, 0xa9e00be1,
+    0xa8c17bfd, 0xa9bf7bfd, 0xa91ffff3, 0xa8bf8861, 0xa9000861,
+});
+
+// NEON add/sub/mul and single-register ld1/st1
+constexpr auto neon = a64::assemble<R"(
+    add v0.2d, v1.2d, v2.2d          // 4ee28420
+    add v3.4s, v4.4s, v5.4s          // 4ea58483
+    add v6.8b, v7.8b, v8.8b          // 0e2884e6
+    sub v9.2d, v10.2d, v11.2d        // 6eeb8549
+    sub v12.8h, v13.8h, v14.8h       // 6e6e85ac
+    sub v15.2s, v16.2s, v17.2s       // 2eb1860f
+    mul v18.4s, v19.4s, v20.4s       // 4eb49e72
+    mul v21.16b, v22.16b, v23.16b    // 4e379ed5
+    mul v24.4h, v25.4h, v26.4h       // 0e7a9f38
+    ld1 {v0.2d}, [x1]                // 4c407c20
+    ld1 v31.8b, [sp]                 // 0c4073ff
+    ld1 {v2.4s}, [x3], 16            // 4cdf7862
+    st1 {v4.2d}, [x5]                // 4c007ca4
+    st1 {v6.2s}, [x7], #8            // 0c9f78e6
+)">();
+static_assert(neon == std::array<uint32_t, 14>{
+    0x4ee28420, 0x4ea58483, 0x0e2884e6, 0x6eeb8549, 0x6e6e85ac, 0x2eb1860f,
+    0x4eb49e72, 0x4e379ed5, 0x0e7a9f38, 0x4c407c20, 0x0c4073ff, 0x4cdf7862,
+    0x4c007ca4, 0x0c9f78e6,
+});
+
+int main() {}
@@ -0,0 +1,252 @@
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+/// Minimal AArch64 interpreter for `make check`.
+///
+/// Runs a flat binary written by `asm` the way `asm --run` runs the same
+/// program natively, so the two can be compared:
+///
+///   a64sim [--set xN=V]... FILE
+///
+/// The image is loaded at address 0 (where its labels point), sp starts at
+/// the top of a separate 1 MiB stack and x30 at an exit address; the run
+/// ends when control reaches it.  Then the registers x0-x29 that are
+/// non-zero are printed in the format of `asm --run`.
+///
+/// Only the instructions Encoder can produce are decoded, and they are
+/// matched against the architectural encodings rather than Encoder's
+/// constants, so an encoding bug shows up as a wrong result or an
+/// "unknown instruction" error instead of being mirrored here.
+
+namespace {
+
+constexpr uint64_t kStackTop = 0x80000000;
+constexpr uint64_t kStackBytes = 1 << 20;
+constexpr uint64_t kExit = 0xFFFFFFFFFFFFFFF0;
+constexpr uint64_t kMaxSteps = 200000000;
+
+struct Machine {
+    uint64_t x[31] = {};
+    uint64_t sp = kStackTop;
+    uint64_t v[32][2] = {};
+    bool n = false, z = false, c = false, vf = false;
+    uint64_t pc = 0;
+    std::vector<uint8_t> image, stack = std::vector<uint8_t>(kStackBytes);
+
+    // register 31 is xzr or sp depending on the operand
+    uint64_t reg(uint32_t r) const { return r == 31 ? 0 : x[r]; }
+    uint64_t regSp(uint32_t r) const { return r == 31 ? sp : x[r]; }
+    void set(uint32_t r, uint64_t val) { if (r != 31) x[r] = val; }
+    void setSp(uint32_t r, uint64_t val) { (r == 31 ? sp : x[r]) = val; }
+
+    uint8_t *at(uint64_t addr, uint64_t size) {
+        if (addr + size <= image.size() && addr + size >= addr) return image.data() + addr;
+        if (addr >= kStackTop - kStackBytes && addr + size <= kStackTop)
+            return stack.data() + (addr - (kStackTop - kStackBytes));
+        throw std::runtime_error("memory access out of range at pc " + std::to_string(pc));
+    }
+    uint64_t load(uint64_t addr) {
+        uint64_t val;
+        std::memcpy(&val, at(addr, 8), 8);
+        return val;
+    }
+    void store(uint64_t addr, uint64_t val) { std::memcpy(at(addr, 8), &val, 8); }
+
+    bool cond(uint32_t cc) const {
+        bool r = false;
+        switch (cc >> 1) {
+            case 0: r = z; break;
+            case 1: r = c; break;
+            case 2: r = n; break;
+            case 3: r = vf; break;
+            case 4: r = c && !z; break;
+            case 5: r = n == vf; break;
+            case 6: r = !z && n == vf; break;
+            case 7: return true;
+        }
+        return (cc & 1) ? !r : r;
+    }
+
+    void subs(uint64_t a, uint64_t b) {
+        uint64_t r = a - b;
+        n = r >> 63;
+        z = r == 0;
+        c = a >= b;
+        vf = ((a ^ b) & (a ^ r)) >> 63;
+    }
+
+    static int64_t sext(uint64_t v, int bits) {
+        return static_cast<int64_t>(v << (64 - bits)) >> (64 - bits);
+    }
+
+    static uint64_t sdiv(uint64_t a, uint64_t b) {
+        int64_t sa = static_cast<int64_t>(a), sb = static_cast<int64_t>(b);
+        if (sb == 0) return 0;
+        if (sb == -1) return 0 - a;
+        return static_cast<uint64_t>(sa / sb);
+    }
+
+    /// Lane-wise add/sub/mul of 8 << size-bit lanes.
+    void vec3(uint32_t w, int op) {
+        uint32_t d = w & 31, nn = (w >> 5) & 31, m = (w >> 16) & 31;
+        int bits = 8 << ((w >> 22) & 3), words = (w >> 30) & 1 ? 2 : 1;
+        uint64_t mask = bits == 64 ? ~uint64_t{0} : (uint64_t{1} << bits) - 1;
+        uint64_t out[2] = {};
+        for (int k = 0; k < words; ++k)
+            for (int s = 0; s < 64; s += bits) {
+                uint64_t a = (v[nn][k] >> s) & mask, b = (v[m][k] >> s) & mask;
+                uint64_t r = op == 0 ? a + b : op == 1 ? a - b : a * b;
+                out[k] |= (r & mask) << s;
+            }
+        v[d][0] = out[0];
+        v[d][1] = out[1];
+    }
+
+    void step() {
+        uint64_t here = pc;
+        uint32_t w;
+        std::memcpy(&w, at(pc, 4), 4);
+        pc += 4;
+        const uint32_t d = w & 31, nn = (w >> 5) & 31, m = (w >> 16) & 31;
+        const int64_t imm9 = sext((w >> 12) & 0x1FF, 9);
+
+        if ((w & 0xFFE0FC00) == 0x8B206000) setSp(d, regSp(nn) + reg(m));              // add (extended, uxtx)
+        else if ((w & 0xFFE0FC00) == 0xCB206000) setSp(d, regSp(nn) - reg(m));         // sub (extended, uxtx)
+        else if ((w & 0xFFE0FC00) == 0xEB206000) { subs(regSp(nn), reg(m)); set(d, regSp(nn) - reg(m)); }
+        else if ((w & 0xFFC00000) == 0xF1000000) {                                      // subs (immediate)
+            uint64_t imm = (w >> 10) & 0xFFF;
+            subs(regSp(nn), imm);
+            set(d, regSp(nn) - imm);
+        }
+        else if ((w & 0xFFE0FC00) == 0xCB000000) set(d, reg(nn) - reg(m));             // sub (shifted, lsl 0)
+        else if ((w & 0xFFE0FC00) == 0xAA000000) set(d, reg(nn) | reg(m));             // orr (shifted, lsl 0)
+        else if ((w & 0xFFE0FC00) == 0x9B007C00) set(d, reg(nn) * reg(m));             // madd ..., xzr
+        else if ((w & 0xFFE0FC00) == 0x9B407C00)
+            set(d, static_cast<uint64_t>((static_cast<__int128>(static_cast<int64_t>(reg(nn))) *
+                                          static_cast<int64_t>(reg(m))) >> 64));
+        else if ((w & 0xFFE0FC00) == 0x9BC07C00)
+            set(d, static_cast<uint64_t>((static_cast<unsigned __int128>(reg(nn)) * reg(m)) >> 64));
+        else if ((w & 0xFFE0FC00) == 0x9AC00C00) set(d, sdiv(reg(nn), reg(m)));
+        else if ((w & 0xFFE0FC00) == 0x9AC00800) set(d, reg(m) ? reg(nn) / reg(m) : 0);
+        else if (w == 0xD503201F) {}                                                    // nop
+        else if ((w & 0xFFFFFC1F) == 0xD61F0000) pc = reg(nn);                          // br
+        else if ((w & 0xFFFFFC1F) == 0xD63F0000) { uint64_t t = reg(nn); x[30] = pc; pc = t; }
+        else if ((w & 0xFC000000) == 0x14000000) pc = here + sext(w & 0x3FFFFFF, 26) * 4;
+        else if ((w & 0xFC000000) == 0x94000000) { x[30] = pc; pc = here + sext(w & 0x3FFFFFF, 26) * 4; }
+        else if ((w & 0xFF000010) == 0x54000000) {
+            if (cond(w & 15)) pc = here + sext((w >> 5) & 0x7FFFF, 19) * 4;
+        }
+        else if ((w & 0xFE000000) == 0xB4000000) {                                      // cbz / cbnz
+            if ((reg(d) == 0) == !(w & 0x01000000)) pc = here + sext((w >> 5) & 0x7FFFF, 19) * 4;
+        }
+        else if ((w & 0x7E000000) == 0x36000000) {                                      // tbz / tbnz
+            uint32_t bit = ((w >> 31) << 5) | ((w >> 19) & 31);
+            if ((((reg(d) >> bit) & 1) == 0) == !(w & 0x01000000))
+                pc = here + sext((w >> 5) & 0x3FFF, 14) * 4;
+        }
+        else if ((w & 0xFFE00C00) == 0x9A800000) set(d, cond((w >> 12) & 15) ? reg(nn) : reg(m));
+        else if ((w & 0xFFE00C00) == 0x9A800400) set(d, cond((w >> 12) & 15) ? reg(nn) : reg(m) + 1);
+        else if ((w & 0xFFE00C00) == 0xDA800400) set(d, cond((w >> 12) & 15) ? reg(nn) : 0 - reg(m));
+        else if ((w & 0xFF000000) == 0x58000000) set(d, load(here + sext((w >> 5) & 0x7FFFF, 19) * 4));
+        else if ((w & 0xFFE00C00) == 0xF8400000) set(d, load(regSp(nn) + imm9));           // ldur
+        else if ((w & 0xFFE00C00) == 0xF8000000) store(regSp(nn) + imm9, reg(d));          // stur
+        else if ((w & 0xFFE00400) == 0xF8400400) {                                          // ldr pre/post
+            uint64_t a = regSp(nn) + imm9;
+            uint64_t val = load(w & 0x800 ? a : regSp(nn));
+            setSp(nn, a);
+            set(d, val);
+        }
+        else if ((w & 0xFFE00400) == 0xF8000400) {                                          // str pre/post
+            uint64_t a = regSp(nn) + imm9;
+            store(w & 0x800 ? a : regSp(nn), reg(d));
+            setSp(nn, a);
+        }
+        else if ((w & 0xFFE0EC00) == 0xF8606800) set(d, load(regSp(nn) + (reg(m) << (w & 0x1000 ? 3 : 0))));
+        else if ((w & 0xFFE0EC00) == 0xF8206800) store(regSp(nn) + (reg(m) << (w & 0x1000 ? 3 : 0)), reg(d));
+        else if ((w & 0xFFC00000) == 0xF9400000) set(d, load(regSp(nn) + ((w >> 10) & 0xFFF) * 8));
+        else if ((w & 0xFFC00000) == 0xF9000000) store(regSp(nn) + ((w >> 10) & 0xFFF) * 8, reg(d));
+        else if ((w & 0xFE000000) == 0xA8000000 && ((w >> 23) & 3) != 0) {                 // ldp / stp
+            uint32_t mode = (w >> 23) & 3;                  // 1 post, 2 offset, 3 pre
+            bool isLoad = w & 0x00400000;
+            uint32_t t2 = (w >> 10) & 31;
+            uint64_t a = regSp(nn) + sext((w >> 15) & 0x7F, 7) * 8;
+            uint64_t at0 = mode == 1 ? regSp(nn) : a;
+            if (isLoad) {
+                uint64_t v0 = load(at0), v1 = load(at0 + 8);
+                if (mode != 2) setSp(nn, a);
+                set(d, v0);
+                set(t2, v1);
+            } else {
+                store(at0, reg(d));
+                store(at0 + 8, reg(t2));
+                if (mode != 2) setSp(nn, a);
+            }
+        }
+        else if ((w & 0xBF20FC00) == 0x0E208400) vec3(w, 0);                              // add (vector)
+        else if ((w & 0xBF20FC00) == 0x2E208400) vec3(w, 1);                              // sub (vector)
+        else if ((w & 0xBF20FC00) == 0x0E209C00) vec3(w, 2);                              // mul (vector)
+        else if ((w & 0xBFFFF000) == 0x0C407000 || (w & 0xBFFFF000) == 0x0CDF7000 ||      // ld1 / st1
+                 (w & 0xBFFFF000) == 0x0C007000 || (w & 0xBFFFF000) == 0x0C9F7000) {
+            bool isLoad = w & 0x00400000, post = w & 0x00800000;
+            int words = (w >> 30) & 1 ? 2 : 1;
+            uint64_t a = regSp(nn);
+            for (int k = 0; k < 2; ++k) {
+                if (isLoad) v[d][k] = k < words ? load(a + 8 * k) : 0;
+                else if (k < words) store(a + 8 * k, v[d][k]);
+            }
+            if (post) setSp(nn, a + 8 * words);
+        }
+        else {
+            char buf[64];
+            std::snprintf(buf, sizeof buf, "unknown instruction %08x at %llu", w,
+                          static_cast<unsigned long long>(here));
+            throw std::runtime_error(buf);
+        }
+    }
+};
+
+}  // namespace
+
+int main(int argc, char *argv[]) {
+    try {
+        Machine m;
+        m.x[30] = kExit;
+        const char *path = nullptr;
+        for (int i = 1; i < argc; ++i) {
+            if (std::strcmp(argv[i], "--set") == 0 && i + 1 < argc) {
+                const char *s = argv[++i], *eq = std::strchr(s, '=');
+                int r = s[0] == 'x' && eq ? std::atoi(s + 1) : -1;
+                if (r < 0 || r > 29) throw std::runtime_error(std::string("bad --set ") + s);
+                m.x[r] = static_cast<uint64_t>(std::strtoll(eq + 1, nullptr, 0));
+            } else {
+                path = argv[i];
+            }
+        }
+        if (!path) {
+            std::cerr << "Usage: a64sim [--set xN=V]... FILE\n";
+            return 2;
+        }
+        std::ifstream in(path, std::ios::binary);
+        if (!in) throw std::runtime_error(std::string("cannot open ") + path);
+        m.image.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+
+        uint64_t steps = 0;
+        while (m.pc != kExit) {
+            if (++steps > kMaxSteps) throw std::runtime_error("step limit reached");
+            m.step();
+        }
+        for (int r = 0; r < 30; ++r)
+            if (m.x[r]) std::cout << "x" << r << " = " << static_cast<int64_t>(m.x[r]) << "\n";
+    } catch (const std::exception &e) {
+        std::cerr << "a64sim: " << e.what() << "\n";
+        return 1;
+    }
+    return 0;
+}
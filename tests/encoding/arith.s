@@ -0,0 +1,24 @@
+// three-register arithmetic, moves, compares and register branches
+    add x0, x1, x2         // 8b226020
+    add x29, sp, xzr       // 8b3f63fd
+    add sp, sp, x3         // 8b2363ff
+    sub x3, x4, x5         // cb256083
+    sub sp, sp, x16        // cb3063ff
+    mul x6, x7, x8         // 9b087ce6
+    smulh x9, x10, x11     // 9b4b7d49
+    umulh x12, x13, x14    // 9bce7dac
+    sdiv x15, x16, x17     // 9ad10e0f
+    udiv x18, x19, x20     // 9ad40a72
+    mul x3, xzr, xzr       // 9b1f7fe3
+    sdiv x3, xzr, x4       // 9ac40fe3
+    udiv xzr, x1, xzr      // 9adf083f
+    neg x21, x22           // cb1603f5
+    mov x23, x24           // aa1803f7
+    mov x25, xzr           // aa1f03f9
+    cmp x1, x2             // eb22603f
+    cmp sp, x3             // eb2363ff
+    cmp x4, 4095           // f13ffc9f
+    cmp x5, #0             // f10000bf
+    br x30                 // d61f03c0
+    blr x9                 // d63f0120
+    nop                    // d503201f
@@ -0,0 +1,31 @@
+// pc-relative branches and literal loads, forwards and backwards
+start:
+    b fwd                    // 14000014
+    bl start                 // 97ffffff
+    b.eq fwd                 // 54000240
+    b.ne start               // 54ffffa1
+    b.hs fwd                 // 54000202
+    b.lo fwd                 // 540001e3
+    b.hi fwd                 // 540001c8
+    b.ls fwd                 // 540001a9
+    b.ge fwd                 // 5400018a
+    b.lt fwd                 // 5400016b
+    b.gt fwd                 // 5400014c
+    b.le start               // 54fffead
+    cbz x1, fwd              // b4000101
+    cbnz x30, start          // b5fffe7e
+    tbz x2, 0, fwd           // 360000c2
+    tbnz x3, 63, start       // b7fffe23
+    tbz x4, #35, fwd         // b6180084
+    ldr x5, lit              // 58000125
+    b 8                      // 14000002
+    b -4                     // 17ffffff
+fwd:
+    csel x0, x1, x2, eq      // 9a820020
+    csel x3, xzr, x4, lt     // 9a84b3e3
+    csinc x5, x6, x7, ne     // 9a8714c5
+    csneg x8, x9, x10, gt    // da8ac528
+    cset x11, eq             // 9a9f17eb
+    cset x12, le             // 9a9fc7ec
+lit:
+    .8byte 0                 // 00000000 00000000
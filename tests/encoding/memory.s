@@ -0,0 +1,30 @@
+// loads and stores in every addressing mode
+    ldur x1, [x2, -8]            // f85f8041
+    ldur x3, [sp, 255]           // f84ff3e3
+    stur x4, [x29, -256]         // f81003a4
+    stur xzr, [sp, 0]            // f80003ff
+    ldur xzr, [x1, 8]            // f840803f
+    ldr xzr, [x2, #8]            // f940045f
+    ldr x1, [x2]                 // f9400041
+    ldr x1, [x2, #8]             // f9400441
+    ldr x1, [sp, 32760]          // f97fffe1
+    ldr x1, [x2, -16]            // f85f0041
+    ldr x1, [x2, 12]             // f840c041
+    ldr x1, [x2, #8]!            // f8408c41
+    ldr x1, [x2], #-16           // f85f0441
+    ldr x1, [x2, x3]             // f8636841
+    ldr x1, [x2, x3, lsl #3]     // f8637841
+    str x1, [x2]                 // f9000041
+    str xzr, [x2, 4096]          // f908005f
+    str x1, [sp, #-16]!          // f81f0fe1
+    str x1, [sp], 16             // f80107e1
+    str x1, [x2, x3]             // f8236841
+    str x1, [x2, x3, lsl 3]      // f8237841
+    ldp x1, x2, [x3]             // a9400861
+    ldp x29, x30, [sp, 16]       // a9417bfd
+    ldp x1, x2, [sp, -512]!      // a9e00be1
+    ldp x29, x30, [sp], 16       // a8c17bfd
+    stp x29, x30, [sp, #-16]!    // a9bf7bfd
+    stp x19, xzr, [sp, 504]      // a91ffff3
+    stp x1, x2, [x3], -8         // a8bf8861
+    stp x1, x2, [x3]             // a9000861
@@ -0,0 +1,15 @@
+// NEON add/sub/mul and single-register ld1/st1
+    add v0.2d, v1.2d, v2.2d          // 4ee28420
+    add v3.4s, v4.4s, v5.4s          // 4ea58483
+    add v6.8b, v7.8b, v8.8b          // 0e2884e6
+    sub v9.2d, v10.2d, v11.2d        // 6eeb8549
+    sub v12.8h, v13.8h, v14.8h       // 6e6e85ac
+    sub v15.2s, v16.2s, v17.2s       // 2eb1860f
+    mul v18.4s, v19.4s, v20.4s       // 4eb49e72
+    mul v21.16b, v22.16b, v23.16b    // 4e379ed5
+    mul v24.4h, v25.4h, v26.4h       // 0e7a9f38
+    ld1 {v0.2d}, [x1]                // 4c407c20
+    ld1 v31.8b, [sp]                 // 0c4073ff
+    ld1 {v2.4s}, [x3], 16            // 4cdf7862
+    st1 {v4.2d}, [x5]                // 4c007ca4
+    st1 {v6.2s}, [x7], #8            // 0c9f78e6
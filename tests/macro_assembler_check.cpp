@@ -0,0 +1,150 @@
+// Run by `make check`: a MacroAssembler program must produce the words
+// `asm --raw` gives for the text in the comments, and operands that name
+// the wrong one of sp and xzr must be rejected.
+#include "../macro_assembler.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <stdexcept>
+#include <vector>
+
+using namespace a64;
+
+static int compare(const char *what, const std::vector<uint32_t> &got,
+                   const std::vector<uint32_t> &want) {
+    int failures = got.size() == want.size() ? 0 : 1;
+    if (failures) std::printf("FAIL: %s: %zu words, want %zu\n", what, got.size(), want.size());
+    for (size_t i = 0; i < got.size() && i < want.size(); ++i)
+        if (got[i] != want[i]) {
+            std::printf("FAIL: %s: word %zu is %08x, want %08x\n", what, i, got[i], want[i]);
+            ++failures;
+        }
+    return failures;
+}
+
+static int program() {
+    MacroAssembler masm;
+    Label loop, done, table;
+    masm.mov(x29, sp);                  // add x29, sp, xzr
+    masm.mov(x1, xzr);                  // mov x1, xzr
+    masm.mov(x2, x3);                   // mov x2, x3
+    masm.bind(loop);                    // loop:
+    masm.cmp(x1, x2);                   // cmp x1, x2
+    masm.b(cond::eq, done);             // b.eq done
+    masm.ldrLiteral(x4, 0x123456789);   // ldr x4, lit0
+    masm.add(x1, x1, x4);               // add x1, x1, x4
+    masm.tbz(x1, 3, loop);              // tbz x1, 3, loop
+    masm.cbnz(x1, loop);                // cbnz x1, loop
+    masm.ldr(x5, table);                // ldr x5, table
+    masm.emitLiteralPool();             // b after / lit0: .8byte 0x123456789 / after:
+    masm.bind(done);                    // done:
+    masm.align(16);                     // nop x 3
+    masm.ret();                         // br x30
+    masm.align(8, true);                // .4byte 0
+    masm.bind(table);                   // table:
+    masm.dc64(table);                   // .8byte table
+    masm.ldrLiteral(x6, 0x123456789);   // ldr x6, lit1
+    masm.finalize();                    // lit1: .8byte 0x123456789
+
+    const std::vector<uint32_t> want = {
+        0x8b3f63fd, 0xaa1f03e1, 0xaa0303e2, 0xeb22603f, 0x54000120, 0x580000c4,
+        0x8b246021, 0x361fff81, 0xb5ffff61, 0x58000125, 0x14000003, 0x23456789,
+        0x00000001, 0xd503201f, 0xd503201f, 0xd503201f, 0xd61f03c0, 0x00000000,
+        0x00000048, 0x00000000, 0x58000026, 0x23456789, 0x00000001,
+    };
+    return compare("program", masm.words(), want);
+}
+
+static int otherForms() {
+    MacroAssembler masm;
+    masm.cmp(x4, 4095);                 // cmp x4, 4095
+    masm.cmp(sp, 0);                    // cmp sp, 0
+    masm.neg(x21, x22);                 // neg x21, x22
+    masm.ldr(x1, x2);                   // ldr x1, [x2]
+    masm.ldr(x1, sp, 32760);            // ldr x1, [sp, 32760]
+    masm.str(x3, x4, -8);               // str x3, [x4, -8]
+    masm.str(xzr, x2, 4096);            // str xzr, [x2, 4096]
+    masm.ldrPre(x1, x2, 8);             // ldr x1, [x2, #8]!
+    masm.strPre(x1, sp, -16);           // str x1, [sp, #-16]!
+    masm.ldrPost(x1, x2, -16);          // ldr x1, [x2], #-16
+    masm.strPost(x1, sp, 16);           // str x1, [sp], 16
+    masm.ldr(x1, x2, x3);               // ldr x1, [x2, x3]
+    masm.str(x1, x2, x3, 3);            // str x1, [x2, x3, lsl 3]
+    masm.ldp(x29, x30, sp, 16);         // ldp x29, x30, [sp, 16]
+    masm.stp(x19, xzr, sp, 504);        // stp x19, xzr, [sp, 504]
+    masm.stpPre(x29, x30, sp, -16);     // stp x29, x30, [sp, #-16]!
+    masm.ldpPre(x1, x2, sp, -512);      // ldp x1, x2, [sp, -512]!
+    masm.ldpPost(x29, x30, sp, 16);     // ldp x29, x30, [sp], 16
+    masm.stpPost(x1, x2, x3, -8);       // stp x1, x2, [x3], -8
+    masm.add(v(0, vec::d2), v(1, vec::d2), v(2, vec::d2));      // add v0.2d, v1.2d, v2.2d
+    masm.sub(v(4, vec::h8), v(5, vec::h8), v(6, vec::h8));      // sub v4.8h, v5.8h, v6.8h
+    masm.mul(v(1, vec::b16), v(2, vec::b16), v(3, vec::b16));   // mul v1.16b, v2.16b, v3.16b
+    masm.ld1(v(0, vec::d2), x1);        // ld1 {v0.2d}, [x1]
+    masm.st1(v(31, vec::b8), sp);       // st1 {v31.8b}, [sp]
+    masm.ld1Post(v(2, vec::s4), x3);    // ld1 {v2.4s}, [x3], 16
+    masm.st1Post(v(6, vec::s2), x7);    // st1 {v6.2s}, [x7], #8
+    return compare("other forms", masm.words(),
+                   {0xf13ffc9f, 0xf10003ff, 0xcb1603f5, 0xf9400041, 0xf97fffe1, 0xf81f8083,
+                    0xf908005f, 0xf8408c41, 0xf81f0fe1, 0xf85f0441, 0xf80107e1, 0xf8636841,
+                    0xf8237841, 0xa9417bfd, 0xa91ffff3, 0xa9bf7bfd, 0xa9e00be1, 0xa8c17bfd,
+                    0xa8bf8861, 0x4ee28420, 0x6e6684a4, 0x4e239c41, 0x4c407c20, 0x0c0073ff,
+                    0x4cdf7862, 0x0c9f78e6});
+}
+
+// Register 31.  asm --raw has no syntax for the shifted-register forms,
+// so the comments give them as llvm-mc prints them.
+static int register31() {
+    MacroAssembler masm;
+    masm.add(xzr, x1, x2);              // add xzr, x1, x2
+    masm.add(x1, xzr, x2);              // add x1, xzr, x2
+    masm.sub(x3, xzr, x4);              // neg x3, x4
+    masm.cmp(xzr, x2);                  // cmp xzr, x2
+    masm.add(sp, x1, xzr);              // add sp, x1, xzr
+    masm.cmp(sp, x3);                   // cmp sp, x3
+    masm.mul(x1, xzr, x2);              // mul x1, xzr, x2
+    masm.ldur(xzr, sp, 8);              // ldur xzr, [sp, #8]
+    masm.csel(x1, xzr, x2, cond::eq);   // csel x1, xzr, x2, eq
+    masm.br(xzr);                       // br xzr
+    int failures = compare("register 31", masm.words(),
+                           {0x8b02003f, 0x8b0203e1, 0xcb0403e3, 0xeb0203ff, 0x8b3f603f,
+                            0xeb2363ff, 0x9b027fe1, 0xf84083ff, 0x9a8203e1, 0xd61f03e0});
+
+    const std::pair<const char *, std::function<void(MacroAssembler &)>> rejected[] = {
+        {"add(x1, x2, sp)",        [](MacroAssembler &m) { m.add(x1, x2, sp); }},
+        {"add(sp, xzr, x1)",       [](MacroAssembler &m) { m.add(sp, xzr, x1); }},
+        {"sub(xzr, sp, x1)",       [](MacroAssembler &m) { m.sub(xzr, sp, x1); }},
+        {"cmp(x1, sp)",            [](MacroAssembler &m) { m.cmp(x1, sp); }},
+        {"mov(sp, xzr)",           [](MacroAssembler &m) { m.mov(sp, xzr); }},
+        {"mul(x1, sp, x2)",        [](MacroAssembler &m) { m.mul(x1, sp, x2); }},
+        {"sdiv(sp, x1, x2)",       [](MacroAssembler &m) { m.sdiv(sp, x1, x2); }},
+        {"csel(x1, x2, sp, eq)",   [](MacroAssembler &m) { m.csel(x1, x2, sp, cond::eq); }},
+        {"cset(sp, eq)",           [](MacroAssembler &m) { m.cset(sp, cond::eq); }},
+        {"ldur(x1, xzr, 8)",       [](MacroAssembler &m) { m.ldur(x1, xzr, 8); }},
+        {"stur(sp, x1, 0)",        [](MacroAssembler &m) { m.stur(sp, x1, 0); }},
+        {"cbz(sp, l)",             [](MacroAssembler &m) { Label l; m.bind(l); m.cbz(sp, l); }},
+        {"tbnz(sp, 1, l)",         [](MacroAssembler &m) { Label l; m.bind(l); m.tbnz(sp, 1, l); }},
+        {"blr(sp)",                [](MacroAssembler &m) { m.blr(sp); }},
+        {"cmp(xzr, 5)",            [](MacroAssembler &m) { m.cmp(xzr, 5); }},
+        {"neg(sp, x1)",            [](MacroAssembler &m) { m.neg(sp, x1); }},
+        {"ldr(sp, x1, 8)",         [](MacroAssembler &m) { m.ldr(sp, x1, 8); }},
+        {"str(x1, xzr, x2)",       [](MacroAssembler &m) { m.str(x1, xzr, x2); }},
+        {"ldp(x1, x2, xzr)",       [](MacroAssembler &m) { m.ldp(x1, x2, xzr); }},
+        {"stpPre(sp, x1, x2, 16)", [](MacroAssembler &m) { m.stpPre(sp, x1, x2, 16); }},
+        {"ld1(v0.2d, xzr)",        [](MacroAssembler &m) { m.ld1(v(0, vec::d2), xzr); }},
+    };
+    for (const auto &[text, emit] : rejected) {
+        MacroAssembler m;
+        try {
+            emit(m);
+            std::printf("FAIL: %s was accepted\n", text);
+            ++failures;
+        } catch (const std::runtime_error &) {
+        }
+    }
+    return failures;
+}
+
+int main() {
+    return program() + otherForms() + register31() ? 1 : 0;
+}
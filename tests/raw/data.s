@@ -0,0 +1,24 @@
+// sections, data directives, alignment and zero fills
+    ldr x0, table
+    ldr x2, [x3, 16]
+    .p2align 4
+again:
+    b.ne again
+    br x30
+.data
+table:
+    .8byte 1, -2, 0x1122334455667788, table
+end:
+    .4byte -1, 0x10020
+    .byte 1, 255, -128, 7
+name:
+    .ascii "asm\0", "\t\"q\"\x41\n"
+    .balign 8, 0xee
+    .space 3, 0x5a
+    .zero 2
+.section .rodata.small
+    .p2align 3
+    .8byte end, buffer
+.bss
+buffer:
+    .zero 64
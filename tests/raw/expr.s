@@ -0,0 +1,13 @@
+// operand expressions: constant folding, label differences and label
+// plus offset, in instructions and data directives
+    ldr x0, table + 8
+    cmp x1, (end - table) >> 3
+    ldr x2, [x3, 2 * 8]
+    cmp x4, 4096 - (1 << 4) * 2 + -(8)
+    b.ne table - 4
+    br x30
+table:
+    .8byte 1, table + 16, end - table
+end:
+    .4byte -1, 0x10000 | 0x20
+    .byte 3 * 4 - 5, 0xff & 0x3c, -(2 + 2)
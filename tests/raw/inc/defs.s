@@ -0,0 +1,4 @@
+// Included by include.s; defines a macro the including file uses
+.macro bump reg
+    add \reg, \reg, \reg
+.endm
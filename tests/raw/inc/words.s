@@ -0,0 +1,2 @@
+// Included twice: the second include is served from the file cache
+    .4byte 0x11111111, here - start
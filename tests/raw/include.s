@@ -0,0 +1,11 @@
+// .include: paths relative to the including file, macros defined in an
+// included file, and a file included more than once
+.include "inc/defs.s"
+start:
+    bump x1
+    bump x2
+here:
+    br x30
+.data
+.include "inc/words.s"
+.include "inc/words.s"
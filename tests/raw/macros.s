@@ -0,0 +1,29 @@
+// .macro with defaults, \@ labels and \() joins, nested macros,
+// .rept and .irp
+.macro spin reg, step=x1
+loop\@:
+    sub \reg, \reg, \step
+    cmp \reg, 0
+    b.ne loop\@
+.endm
+.macro load3 base, first
+.irp n, 0, 1, 2
+    ldr x\first\()\n, [\base, \n * 8]
+.endr
+.endm
+.macro twice op, a, b
+    \op \a, \a, \b
+    \op \a, \a, \b
+.endm
+    spin x3
+    spin x4, x2
+    load3 sp, 1                 // x10, x11, x12
+    twice add, x5, x6
+    twice mul, x7, x7
+.rept 3
+    add x0, x0, x0
+.endr
+.irp r, x8, x9
+    spin \r
+.endr
+    br x30
@@ -0,0 +1,32 @@
+// flags: -O1
+// dead cmps: the scan passes instructions and labels and follows b;
+// readers, conditional branches and calls keep the cmp
+    cmp x1, x2                  // dead: overwritten after a label and a b
+    add x5, x5, x6
+join:
+    b next
+keep1:
+    cmp x1, x2                  // kept: b.eq reads it
+    b.eq keep1
+next:
+    cmp x3, x4                  // kept: cset reads it
+    mul x5, x5, x5
+    cset x9, eq
+    cmp x3, x4                  // kept: bl ends the scan
+    bl keep1
+    cmp x1, x1                  // kept: the scan does not follow a b twice
+loop:
+    b loop
+spin:
+    cmp x1, x2                  // dead: only this cmp follows it
+    sub x6, x6, x7
+    b spin
+    cmp x1, x2                  // dead: b chains to the cmp x7, x8
+    b hop
+hop:
+    b next2
+next2:
+    add x1, x1, xzr             // removed: no-op
+    cmp x7, x8
+    csel x1, x2, x3, lt
+    br x30
@@ -0,0 +1,15 @@
+// flags: --superopt
+// --superopt: runs of arithmetic with a shorter equivalent, found by
+// search; run.sh then reads them back from the cache
+    add x3, x1, x2
+    sub x3, x3, x2              // mov x3, x1
+    stur x3, [sp, 0]
+    neg x8, x9
+    neg x8, x8                  // mov x8, x9
+    stur x8, [sp, 8]
+    mul x10, x11, xzr
+    add x10, x10, x12           // mov x10, x12
+    stur x10, [sp, 16]
+    add x5, x6, x7
+    mul x5, x5, x5              // nothing shorter
+    br x30
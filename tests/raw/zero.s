@@ -0,0 +1,19 @@
+// large zero fills: a .zero of almost 1 MiB with labels after it, a page
+// aligned section leaving a hole after .data, and a trailing .bss
+    ldr x0, after
+    ldr x1, page
+    br x30
+.data
+before:
+    .4byte 7
+    .zero 1000000
+after:
+    .8byte after, before, page, tail
+.section .rodata.page
+    .p2align 12
+page:
+    .8byte -1
+.bss
+    .zero 8192
+tail:
+    .zero 8
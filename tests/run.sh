@@ -0,0 +1,151 @@
+#!/bin/sh
+# Checks run by `make check`, from the repository root:
+#
+#   tests/encoding/*.s   every line ending in `// xxxxxxxx` must assemble
+#                        (--raw) to the words listed, in order
+#   tests/raw/*.s        --raw output must match the bytes in NAME.hex
+#                        (od -Ax -tx1, so zero runs fold to `*`); covers
+#                        directives, macros, includes, zero fills and,
+#                        with a first line `// flags: -O1`, the peepholes
+#   superopt cache       tests/raw/superopt.s (run with --superopt above)
+#                        must come out the same from its cache under
+#                        -O1 --superopt-cache, and plain -O1 must ignore
+#                        the cache
+#   tests/high/*.hl      run through `asm --run` at -O0, which must print
+#                        NAME.expected, and built with --x86-64, which must
+#                        exit with x0's low 8 bits; then through every
+#                        configuration below, natively and on ARM64
+#                        (tests/a64sim), which must agree with --run on the
+#                        registers the program names.  A first line
+#                        `# set: x1=5 x2=7` gives the starting registers.
+#
+# Prints one line per failure and exits with status 1 if there were any.
+
+ASM=./asm
+SIM=tests/a64sim
+NATIVE_CONFIGS="-O1|--unroll=2|-O1 --unroll=3"
+ARM_CONFIGS="-O0|-O1|--unroll=2|-O1 --unroll=3|--outline|-O1 --outline|--align-loops=16"
+
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+# --superopt's default cache; keeps the tests away from the user's
+export XDG_CACHE_HOME="$tmp/cache"
+failures=0
+checks=0
+
+fail() {
+    echo "FAIL: $*"
+    failures=$((failures + 1))
+}
+
+# ---- encodings ----
+for src in tests/encoding/*.s; do
+    [ -e "$src" ] || continue
+    checks=$((checks + 1))
+    if ! $ASM --raw "$src" > "$tmp/enc.bin" 2> "$tmp/enc.err"; then
+        fail "$src: $(cat "$tmp/enc.err")"
+        continue
+    fi
+    sed -n 's|.*// *\(\([0-9a-f]\{8\} *\)\{1,\}\)$|\1|p' "$src" | tr -s ' ' '\n' | sed '/^$/d' > "$tmp/enc.want"
+    od -An -v -tx4 "$tmp/enc.bin" | tr -s ' ' '\n' | sed '/^$/d' > "$tmp/enc.got"
+    if ! cmp -s "$tmp/enc.want" "$tmp/enc.got"; then
+        fail "$src: encodings differ (want | got)"
+        paste "$tmp/enc.want" "$tmp/enc.got" | awk '$1 != $2' | head -5
+    fi
+done
+
+# ---- raw programs ----
+for src in tests/raw/*.s; do
+    [ -e "$src" ] || continue
+    checks=$((checks + 1))
+    flags=$(sed -n '1s|^// flags:||p' "$src")
+    if ! $ASM --raw $flags "$src" > "$tmp/raw.bin" 2> "$tmp/raw.err"; then
+        fail "$src: $(cat "$tmp/raw.err")"
+        continue
+    fi
+    od -Ax -tx1 "$tmp/raw.bin" > "$tmp/raw.got"
+    cmp -s "${src%.s}.hex" "$tmp/raw.got" || fail "$src: output differs from ${src%.s}.hex"
+done
+
+# ---- superoptimizer cache ----
+src=tests/raw/superopt.s
+cache="$XDG_CACHE_HOME/asm-superopt"
+checks=$((checks + 1))
+if ! grep -q '	= ' "$cache" 2> /dev/null; then
+    fail "$src: --superopt cached no rewrites"
+elif ! $ASM --raw -O1 --superopt-cache="$cache" "$src" > "$tmp/so.bin" 2> "$tmp/so.err"; then
+    fail "$src -O1 --superopt-cache: $(cat "$tmp/so.err")"
+elif ! od -Ax -tx1 "$tmp/so.bin" | cmp -s "${src%.s}.hex" -; then
+    fail "$src -O1 --superopt-cache: output differs from ${src%.s}.hex"
+fi
+checks=$((checks + 1))
+$ASM --raw "$src" > "$tmp/plain.bin" 2> /dev/null
+if ! $ASM --raw -O1 "$src" > "$tmp/so.bin" 2> "$tmp/so.err"; then
+    fail "$src -O1: $(cat "$tmp/so.err")"
+elif ! cmp -s "$tmp/plain.bin" "$tmp/so.bin"; then
+    fail "$src -O1: applied rewrites from the cache without --superopt or --superopt-cache"
+fi
+
+# ---- high-level programs ----
+
+# The registers a program names, outside comments, as a grep pattern.
+named() {
+    sed 's/#.*//' "$1" | grep -oE '\bx([0-9]|[12][0-9]|30)\b' | sort -u |
+        sed 's/.*/^& = /' | paste -sd'|' -
+}
+
+for src in tests/high/*.hl; do
+    [ -e "$src" ] || continue
+    set -- $(sed -n '1s/^# set://p' "$src")
+    args=""
+    for a in "$@"; do args="$args --set $a"; done
+    regs=$(named "$src")
+
+    checks=$((checks + 1))
+    if ! $ASM --high --run $args "$src" > "$tmp/ref" 2> "$tmp/err"; then
+        fail "$src --run: $(cat "$tmp/err")"
+        continue
+    fi
+    cmp -s "${src%.hl}.expected" "$tmp/ref" || fail "$src --run: output differs from ${src%.hl}.expected"
+    grep -E "$regs" "$tmp/ref" > "$tmp/want"
+
+    # the --x86-64 executable exits with the low 8 bits of x0
+    checks=$((checks + 1))
+    x0=$(sed -n 's/^x0 = //p' "$tmp/ref")
+    want=$(( ${x0:-0} & 255 ))
+    if ! $ASM --high --x86-64 $args "$src" -o "$tmp/prog" 2> "$tmp/err"; then
+        fail "$src --x86-64: $(grep ERROR "$tmp/err")"
+    else
+        "$tmp/prog"
+        status=$?
+        [ "$status" -eq "$want" ] || fail "$src --x86-64: exit status $status, want $want"
+    fi
+
+    IFS='|'
+    for config in $NATIVE_CONFIGS; do
+        unset IFS
+        checks=$((checks + 1))
+        if ! $ASM --high --run $config $args "$src" > "$tmp/got" 2> "$tmp/err"; then
+            fail "$src --run $config: $(cat "$tmp/err")"
+        elif ! grep -E "$regs" "$tmp/got" | cmp -s "$tmp/want" -; then
+            fail "$src --run $config: registers differ from -O0"
+        fi
+        IFS='|'
+    done
+    for config in $ARM_CONFIGS; do
+        unset IFS
+        checks=$((checks + 1))
+        if ! $ASM --high $config "$src" -o "$tmp/prog.bin" 2> "$tmp/err"; then
+            fail "$src $config: $(grep ERROR "$tmp/err")"
+        elif ! $SIM $args "$tmp/prog.bin" > "$tmp/got" 2> "$tmp/err"; then
+            fail "$src $config on ARM64: $(cat "$tmp/err")"
+        elif ! grep -E "$regs" "$tmp/got" | cmp -s "$tmp/want" -; then
+            fail "$src $config on ARM64: registers differ from --run -O0"
+        fi
+        IFS='|'
+    done
+    unset IFS
+done
+
+echo "$checks checks, $failures failed"
+[ "$failures" -eq 0 ]
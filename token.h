@@ -1,8 +1,10 @@
 #pragma once
 
 #include <iostream>
+#include <memory_resource>
 #include <string>
 #include <stdexcept>
+#include <vector>
 
 enum TokenType {
     NONE,
@@ -12,10 +14,22 @@ enum TokenType {
     HEXINT,
     REG,
     ZREG,
+    VREG,
     INT,
     COMMA,
     LBRACK,
     RBRACK,
+    EXCLAM,
+    STRING,
+    LPAREN,
+    RPAREN,
+    PLUS,
+    MINUS,
+    STAR,
+    LSHIFT,
+    RSHIFT,
+    AMP,
+    PIPE,
     NEWLINE
 };
 
@@ -24,13 +38,20 @@ struct Token {
     std::string lexeme;
 };
 
+/// Token containers allocate from a caller-supplied memory resource
+/// (see arena.h); the default is the global heap.
+using TokenList  = std::pmr::vector<Token>;
+using TokenLines = std::pmr::vector<TokenList>;
+
 // ---------- conversion helpers ----------
 
 inline TokenType stringToTokenType(const std::string &s) {
 #define TRY(t) if (s == #t) return t
     TRY(DOTID); TRY(LABEL); TRY(ID); TRY(HEXINT);
-    TRY(REG); TRY(ZREG); TRY(INT); TRY(COMMA);
-    TRY(LBRACK); TRY(RBRACK); TRY(NEWLINE);
+    TRY(REG); TRY(ZREG); TRY(VREG); TRY(INT); TRY(COMMA);
+    TRY(LBRACK); TRY(RBRACK); TRY(EXCLAM); TRY(STRING);
+    TRY(LPAREN); TRY(RPAREN); TRY(PLUS); TRY(MINUS); TRY(STAR);
+    TRY(LSHIFT); TRY(RSHIFT); TRY(AMP); TRY(PIPE); TRY(NEWLINE);
 #undef TRY
     return NONE;
 }
@@ -39,8 +60,10 @@ inline std::string tokenTypeToString(TokenType t) {
     switch (t) {
 #define CASE(t) case t: return #t
         CASE(DOTID); CASE(LABEL); CASE(ID); CASE(HEXINT);
-        CASE(REG); CASE(ZREG); CASE(INT); CASE(COMMA);
-        CASE(LBRACK); CASE(RBRACK); CASE(NEWLINE);
+        CASE(REG); CASE(ZREG); CASE(VREG); CASE(INT); CASE(COMMA);
+        CASE(LBRACK); CASE(RBRACK); CASE(EXCLAM); CASE(STRING);
+        CASE(LPAREN); CASE(RPAREN); CASE(PLUS); CASE(MINUS); CASE(STAR);
+        CASE(LSHIFT); CASE(RSHIFT); CASE(AMP); CASE(PIPE); CASE(NEWLINE);
 #undef CASE
         default: throw std::runtime_error("Unrecognized token type");
     }
@@ -57,6 +80,9 @@ inline std::istream &operator>>(std::istream &in, Token &tok) {
     std::string tt;
     in >> tt;
     tok.type = stringToTokenType(tt);
-    tok.lexeme = (tok.type != NEWLINE) ? (in >> tok.lexeme, tok.lexeme) : "";
+    if (tok.type == STRING)             // quoted, may hold spaces: rest of the line
+        std::getline(in >> std::ws, tok.lexeme);
+    else
+        tok.lexeme = (tok.type != NEWLINE) ? (in >> tok.lexeme, tok.lexeme) : "";
     return in;
 }
@@ -0,0 +1,659 @@
+#pragma once
+
+#include "ir.h"
+#include "ir_codegen.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <sys/mman.h>
+
+/// The ARM64 register state an X86Program runs on: x0-x30 and sp as
+/// 64-bit words, then v0-v31 as pairs of 64-bit lanes.
+struct X86Registers {
+    uint64_t x[32] = {};            // x0-x30, then sp
+    uint64_t v[32][2] = {};
+};
+
+/// x86-64 machine code lowered from IR.  Offset 0 is the entry point, a
+/// SysV function `void(X86Registers *)`.  `absolute` lists the 8-byte
+/// fields (`.8byte label`) that hold a code offset until relocate() adds
+/// the load address.
+struct X86Program {
+    std::vector<uint8_t> code;
+    std::vector<size_t> absolute;
+
+    void relocate(uint64_t base) {
+        for (size_t pos : absolute) {
+            uint64_t v;
+            std::memcpy(&v, &code[pos], 8);
+            v += base;
+            std::memcpy(&code[pos], &v, 8);
+        }
+        absolute.clear();
+    }
+};
+
+/// Lowers target-independent IR straight to x86-64 machine code, so --high
+/// programs can run natively on a Linux x86-64 host.
+///
+/// The ARM64 registers live in an X86Registers block addressed through rbx
+/// (biased by 128 so every x register is a disp8 away), except the eight
+/// the program names most often, which stay in r8-r15 from the entry point
+/// to the top-level return.  Each IR instruction moves its operands into
+/// rax/rcx/rdx, computes, and moves the result back.  xzr reads as zero
+/// and writes to it are dropped.  Control flow keeps ARM64 semantics
+/// rather than using the x86 stack: a call stores its return address in
+/// x30 and jumps, RET jumps to x30, and functions save and restore the
+/// same frame IRCodeGen gives them (IRCodeGen::Frame) at the same offsets
+/// from sp.  `sp` is the ARM64 stack pointer, a real address; the entry
+/// point sets it, if it is zero, to the top of 1 MiB it reserves on the
+/// host stack.
+///
+/// DIV and MOD follow the ARM64 lowering: DIV is sdiv, so a division by
+/// zero gives 0 and INT64_MIN / -1 gives INT64_MIN, and MOD is
+/// src1 - sdiv(src1, src2) * src2, which leaves src1 for a zero divisor.
+/// `.8byte label` holds the label's x86 address.
+///
+/// The entry point sets x30 to a return sequence, so the top-level RET
+/// returns to the caller with the final registers in the block.
+class X86CodeGen {
+public:
+    static X86Program lower(const IRProgram &ir) {
+        X86CodeGen g;
+        g.allocate(ir);
+        g.entry();
+        IRCodeGen::Frame frame;
+        for (size_t i = 0; i < ir.size(); ++i) {
+            if (ir[i].op == IRInstruction::FUNC) frame = IRCodeGen::computeFrame(ir, i);
+            if (IRCodeGen::isTailCall(ir, i)) g.tailCall(ir[i++], frame);
+            else g.lowerOne(ir[i], frame);
+            if (ir[i].op == IRInstruction::ENDFUNC) frame = IRCodeGen::Frame{};
+        }
+        return g.link();
+    }
+
+private:
+    enum Reg { RAX = 0, RCX = 1, RDX = 2, RBX = 3, RSP = 4, RBP = 5, RSI = 6, RDI = 7 };
+
+    static constexpr int kBias = 128;           // rbx = &regs.x[0] + kBias
+    static constexpr int kSp = 31;
+    static constexpr int32_t kStackBytes = 1 << 20;
+
+    enum class Fixup { REL32, ABS64 };
+    struct Use {
+        size_t pos;
+        std::string label;
+        Fixup kind;
+    };
+
+    std::vector<uint8_t> code_;
+    int home_[32];                              // x86 register (8-15) per x register, or -1
+    std::map<std::string, size_t> labels_;
+    std::vector<Use> uses_;
+
+    // ---------- byte emission ----------
+
+    void byte(uint8_t b) { code_.push_back(b); }
+    void bytes(std::initializer_list<uint8_t> bs) { code_.insert(code_.end(), bs); }
+
+    void imm32(int32_t v) {
+        for (int k = 0; k < 4; ++k) byte(static_cast<uint8_t>(static_cast<uint32_t>(v) >> (8 * k)));
+    }
+
+    void imm64(uint64_t v) {
+        for (int k = 0; k < 8; ++k) byte(static_cast<uint8_t>(v >> (8 * k)));
+    }
+
+    /// ModRM (and displacement) for [base + disp]; base is never rsp/r12.
+    void mem(int reg, Reg base, int32_t disp) {
+        if (disp >= -128 && disp <= 127) {
+            byte(static_cast<uint8_t>(0x40 | reg << 3 | base));
+            byte(static_cast<uint8_t>(disp));
+        } else {
+            byte(static_cast<uint8_t>(0x80 | reg << 3 | base));
+            imm32(disp);
+        }
+    }
+
+    /// REX.W <opcode> reg, [base + disp]
+    void opMem(std::initializer_list<uint8_t> opcode, int reg, Reg base, int32_t disp) {
+        byte(0x48);
+        bytes(opcode);
+        mem(reg, base, disp);
+    }
+
+    /// REX.W <opcode> with a register-direct ModRM.
+    void opReg(std::initializer_list<uint8_t> opcode, int reg, int rm) {
+        byte(0x48);
+        bytes(opcode);
+        byte(static_cast<uint8_t>(0xC0 | reg << 3 | rm));
+    }
+
+    void rel32(const std::string &label) {
+        uses_.push_back({code_.size(), label, Fixup::REL32});
+        imm32(0);
+    }
+
+    void bind(const std::string &label) {
+        if (!labels_.emplace(label, code_.size()).second)
+            throw std::runtime_error("X86CodeGen: duplicate label: " + label);
+    }
+
+    /// A short forward jump (opcode 0xEB or 0x7x); returns the rel8 to patch.
+    size_t jumpShort(uint8_t opcode) {
+        byte(opcode);
+        byte(0);
+        return code_.size() - 1;
+    }
+
+    void bindShort(size_t pos) { code_[pos] = static_cast<uint8_t>(code_.size() - pos - 1); }
+
+    // ---------- ARM64 register file ----------
+
+    /// Block index of an x register or sp, or -1.
+    static int index(const std::string &s) {
+        if (s == "sp") return kSp;
+        if (s.size() >= 2 && s[0] == 'x' && std::isdigit(static_cast<unsigned char>(s[1]))) {
+            int r = std::stoi(s.substr(1));
+            if (r <= 30) return r;
+        }
+        return -1;
+    }
+
+    static int slot(const std::string &s) {
+        int n = index(s);
+        if (n < 0) throw std::runtime_error("X86CodeGen: expected register, got: " + s);
+        return n;
+    }
+
+    static int32_t xDisp(int r) { return 8 * r - kBias; }
+
+    static int32_t vDisp(const std::string &s) {
+        if (s.size() < 2 || s[0] != 'v' || !std::isdigit(static_cast<unsigned char>(s[1])) ||
+            std::stoi(s.substr(1)) > 31)
+            throw std::runtime_error("X86CodeGen: expected vector register, got: " + s);
+        return static_cast<int32_t>(offsetof(X86Registers, v) + 16 * std::stoi(s.substr(1))) - kBias;
+    }
+
+    /// Give r8-r15 to the eight registers with the most static uses.
+    void allocate(const IRProgram &ir) {
+        std::pair<int, int> uses[32];
+        for (int r = 0; r < 32; ++r) uses[r] = {0, r};
+        for (auto &inst : ir)
+            for (const std::string *s : {&inst.dst, &inst.src1, &inst.src2, &inst.src3, &inst.src4})
+                if (int n = index(*s); n >= 0) ++uses[n].first;
+        std::stable_sort(std::begin(uses), std::end(uses),
+                         [](auto &a, auto &b) { return a.first > b.first; });
+        std::fill(std::begin(home_), std::end(home_), -1);
+        for (int k = 0; k < 8 && uses[k].first; ++k) home_[uses[k].second] = 8 + k;
+    }
+
+    /// r = <arm register>
+    void load(Reg r, const std::string &arm) {
+        if (arm == "xzr") {
+            bytes({0x31, static_cast<uint8_t>(0xC0 | r << 3 | r)});    // xor r32, r32
+            return;
+        }
+        int n = slot(arm);
+        if (home_[n] >= 0) bytes({0x4C, 0x89, static_cast<uint8_t>(0xC0 | (home_[n] - 8) << 3 | r)});
+        else opMem({0x8B}, r, RBX, xDisp(n));
+    }
+
+    /// <arm register> = r
+    void store(const std::string &arm, Reg r) {
+        if (arm == "xzr") return;
+        int n = slot(arm);
+        if (home_[n] >= 0) bytes({0x49, 0x89, static_cast<uint8_t>(0xC0 | r << 3 | (home_[n] - 8))});
+        else opMem({0x89}, r, RBX, xDisp(n));
+    }
+
+    /// Move the registers kept in r8-r15 in from (or out to) the block.
+    void homes(bool in) {
+        for (int n = 0; n < 32; ++n)
+            if (home_[n] >= 0) {
+                bytes({0x4C, static_cast<uint8_t>(in ? 0x8B : 0x89)});
+                mem(home_[n] - 8, RBX, xDisp(n));
+            }
+    }
+
+    static bool isInt(const std::string &s) {
+        size_t st = (!s.empty() && (s[0] == '-' || s[0] == '+')) ? 1 : 0;
+        if (st >= s.size()) return false;
+        if (s.size() > st + 2 && s[st] == '0' && (s[st + 1] == 'x' || s[st + 1] == 'X')) return true;
+        for (size_t i = st; i < s.size(); ++i)
+            if (!std::isdigit(static_cast<unsigned char>(s[i]))) return false;
+        return true;
+    }
+
+    /// Decimal or 0x-prefixed hex, as in IRCodeGen's immediates.
+    static long long parseInt(const std::string &s) {
+        size_t st = (s[0] == '-' || s[0] == '+') ? 1 : 0;
+        bool hex = s.size() > st + 2 && s[st] == '0' && (s[st + 1] == 'x' || s[st + 1] == 'X');
+        uint64_t mag = std::stoull(s.substr(st), nullptr, hex ? 16 : 10);
+        return static_cast<long long>(s[0] == '-' ? 0 - mag : mag);
+    }
+
+    static int32_t offset(const std::string &s) {
+        if (!isInt(s)) throw std::runtime_error("X86CodeGen: expected an integer offset, got: " + s);
+        long long v = parseInt(s);
+        if (v < INT32_MIN || v > INT32_MAX)
+            throw std::runtime_error("X86CodeGen: offset out of range: " + s);
+        return static_cast<int32_t>(v);
+    }
+
+    static std::string target(const std::string &label) {
+        if (label.empty() || isInt(label))
+            throw std::runtime_error("X86CodeGen: branch target must be a label, got: " + label);
+        return label;
+    }
+
+    /// Condition-code nibble of the jcc / cmovcc for a signed comparison.
+    static uint8_t cc(const std::string &cond) {
+        static const std::map<std::string, uint8_t> m = {
+            {"==", 0x4}, {"!=", 0x5}, {"<", 0xC}, {"<=", 0xE}, {">", 0xF}, {">=", 0xD},
+        };
+        auto it = m.find(cond);
+        if (it == m.end()) throw std::runtime_error("X86CodeGen: unknown condition: " + cond);
+        return it->second;
+    }
+
+    /// cmp src1, src2 (src2 may be an integer literal).
+    void compare(const IRInstruction &inst) {
+        load(RAX, inst.src1);
+        if (isInt(inst.src2)) {
+            opReg({0x81}, 7, RAX);                              // cmp rax, imm32
+            imm32(offset(inst.src2));
+        } else {
+            load(RCX, inst.src2);
+            opReg({0x39}, RCX, RAX);                            // cmp rax, rcx
+        }
+    }
+
+    /// rax = the base of a LOAD/STORE address and rcx = its index register,
+    /// if any; access() adds the offset or the scaled index.
+    void address(const std::string &base, const IRInstruction &inst) {
+        load(RAX, base);
+        if (!inst.src2.empty()) load(RCX, inst.src2);
+    }
+
+    /// <opcode> rdx, [rax + imm] / [rax + rcx * scale]
+    void access(uint8_t opcode, const IRInstruction &inst) {
+        if (inst.src2.empty()) {
+            byte(0x48);
+            byte(opcode);
+            byte(0x80 | RDX << 3 | RAX);                        // [rax + disp32]
+            imm32(offset(inst.imm));
+            return;
+        }
+        uint8_t ss;
+        if (inst.imm == "1") ss = 0;
+        else if (inst.imm == "8") ss = 3;
+        else throw std::runtime_error("X86CodeGen: unsupported index scale: " + inst.imm);
+        bytes({0x48, opcode, RDX << 3 | 0x04,                   // [SIB]
+               static_cast<uint8_t>(ss << 6 | RCX << 3 | RAX)});
+    }
+
+    // ---------- frames ----------
+
+    void prologue(const IRCodeGen::Frame &f) {
+        if (f.pairs.empty()) return;
+        const int32_t size = 16 * static_cast<int32_t>(f.pairs.size());
+        load(RDX, "sp");
+        opReg({0x81}, 5, RDX);                                  // sub rdx, size
+        imm32(size);
+        store("sp", RDX);
+        for (size_t k = 0; k < f.pairs.size(); ++k) {
+            const int32_t off = 16 * static_cast<int32_t>(k);
+            load(RAX, f.pairs[k].first);
+            opMem({0x89}, RAX, RDX, off);
+            load(RAX, f.pairs[k].second);
+            opMem({0x89}, RAX, RDX, off + 8);
+        }
+        if (f.record) store("x29", RDX);
+    }
+
+    void epilogue(const IRCodeGen::Frame &f) {
+        if (f.pairs.empty()) return;
+        const int32_t size = 16 * static_cast<int32_t>(f.pairs.size());
+        load(RDX, "sp");
+        for (size_t k = f.pairs.size(); k-- > 0;) {
+            const int32_t off = 16 * static_cast<int32_t>(k);
+            opMem({0x8B}, RAX, RDX, off);
+            store(f.pairs[k].first, RAX);
+            opMem({0x8B}, RAX, RDX, off + 8);
+            store(f.pairs[k].second, RAX);
+        }
+        opReg({0x81}, 0, RDX);                                  // add rdx, size
+        imm32(size);
+        store("sp", RDX);
+    }
+
+    /// x30 = the address after this sequence, which ends in a `tail`-byte jump.
+    void returnAddress(int tail) {
+        bytes({0x48, 0x8D, 0x05});                              // lea rax, [rip + rel32]
+        imm32((home_[30] >= 0 ? 3 : 4) + tail);                 // + the store below
+        store("x30", RAX);
+    }
+
+    // ---------- entry and lowering ----------
+
+    /// void entry(X86Registers *rdi): sets x30 to the return sequence and,
+    /// if it is zero, sp to the top of a reserved 1 MiB, then runs the
+    /// program.  The return sequence writes r8-r15 back to the block.
+    void entry() {
+        bytes({0x53, 0x55});                                    // push rbx; push rbp
+        bytes({0x41, 0x54, 0x41, 0x55, 0x41, 0x56, 0x41, 0x57});   // push r12-r15
+        bytes({0x48, 0x89, 0xE5});                              // mov rbp, rsp
+        bytes({0x48, 0x8D, 0x9F}); imm32(kBias);                // lea rbx, [rdi + kBias]
+        bytes({0x48, 0x8D, 0x05}); rel32("\x01" "exit");         // lea rax, [rip + exit]
+        opMem({0x89}, RAX, RBX, xDisp(30));
+        opMem({0x83}, 7, RBX, xDisp(kSp)); byte(0);             // cmp qword sp, 0
+        size_t set = jumpShort(0x75);                           // jne
+        bytes({0x48, 0x89, 0xE0});                              // mov rax, rsp
+        bytes({0x48, 0x83, 0xE0, 0xF0});                        // and rax, -16
+        opMem({0x89}, RAX, RBX, xDisp(kSp));
+        bindShort(set);
+        bytes({0x48, 0x81, 0xEC}); imm32(kStackBytes);          // sub rsp, kStackBytes
+        homes(true);
+        byte(0xE9); rel32("\x01" "start");                      // jmp start
+        bind("\x01" "exit");
+        homes(false);
+        bytes({0x48, 0x89, 0xEC});                              // mov rsp, rbp
+        bytes({0x41, 0x5F, 0x41, 0x5E, 0x41, 0x5D, 0x41, 0x5C});   // pop r15-r12
+        bytes({0x5D, 0x5B, 0xC3});                              // pop rbp; pop rbx; ret
+        bind("\x01" "start");
+    }
+
+    /// Epilogue, then jump to the callee.  As in IRCodeGen, an indirect
+    /// target in a register the epilogue restores is copied to x16.
+    void tailCall(const IRInstruction &call, const IRCodeGen::Frame &frame) {
+        if (call.op == IRInstruction::CALL_DIRECT) {
+            epilogue(frame);
+            byte(0xE9);
+            rel32(target(call.label));
+            return;
+        }
+        load(RCX, call.src1);
+        for (auto &[a, b] : frame.pairs)
+            if (a == call.src1 || b == call.src1) {
+                store("x16", RCX);
+                break;
+            }
+        epilogue(frame);
+        bytes({0xFF, 0xE1});                                    // jmp rcx
+    }
+
+    void arith(const IRInstruction &inst, std::initializer_list<uint8_t> opcode) {
+        load(RAX, inst.src1);
+        load(RCX, inst.src2);
+        opReg(opcode, RCX, RAX);
+        store(inst.dst, RAX);
+    }
+
+    /// sdiv semantics on top of idiv, which traps on both a zero divisor
+    /// and INT64_MIN / -1.
+    void divide(const IRInstruction &inst) {
+        const bool mod = inst.op == IRInstruction::MOD;
+        load(RAX, inst.src1);
+        load(RCX, inst.src2);
+        opReg({0x85}, RCX, RCX);                                // test rcx, rcx
+        size_t zero = jumpShort(0x74);                          // jz
+        opReg({0x83}, 7, RCX); byte(0xFF);                      // cmp rcx, -1
+        size_t minus = jumpShort(0x74);                         // je
+        bytes({0x48, 0x99});                                    // cqo
+        opReg({0xF7}, 7, RCX);                                  // idiv rcx
+        size_t done1 = jumpShort(0xEB);
+        bindShort(minus);
+        opReg({0xF7}, 3, RAX);                                  // neg rax
+        bytes({0x31, 0xD2});                                    // xor edx, edx
+        size_t done2 = jumpShort(0xEB);
+        bindShort(zero);
+        if (mod) opReg({0x89}, RAX, RDX);                       // mov rdx, rax
+        else bytes({0x31, 0xC0});                               // xor eax, eax
+        bindShort(done1);
+        bindShort(done2);
+        store(inst.dst, mod ? RDX : RAX);
+    }
+
+    void vector(const IRInstruction &inst) {
+        auto movdqu = [&](uint8_t op, int xmm, Reg base, int32_t disp) {
+            bytes({0xF3, 0x0F, op});
+            mem(xmm, base, disp);
+        };
+        switch (inst.op) {
+            case IRInstruction::VLOAD:
+                load(RAX, inst.src1);
+                movdqu(0x6F, 0, RAX, 0);                        // movdqu xmm0, [rax]
+                movdqu(0x7F, 0, RBX, vDisp(inst.dst));
+                break;
+            case IRInstruction::VSTORE:
+                load(RAX, inst.dst);
+                movdqu(0x6F, 0, RBX, vDisp(inst.src1));
+                movdqu(0x7F, 0, RAX, 0);                        // movdqu [rax], xmm0
+                break;
+            default:
+                movdqu(0x6F, 0, RBX, vDisp(inst.src1));
+                movdqu(0x6F, 1, RBX, vDisp(inst.src2));
+                bytes({0x66, 0x0F, inst.op == IRInstruction::VADD ? uint8_t(0xD4) : uint8_t(0xFB),
+                       0xC1});                                  // paddq / psubq xmm0, xmm1
+                movdqu(0x7F, 0, RBX, vDisp(inst.dst));
+                break;
+        }
+    }
+
+    void lowerOne(const IRInstruction &inst, const IRCodeGen::Frame &frame) {
+        switch (inst.op) {
+            case IRInstruction::LABEL:
+                bind(inst.dst);
+                break;
+
+            case IRInstruction::ADD: arith(inst, {0x01}); break;            // add rax, rcx
+            case IRInstruction::SUB: arith(inst, {0x29}); break;            // sub rax, rcx
+            case IRInstruction::MUL:
+                load(RAX, inst.src1);
+                load(RCX, inst.src2);
+                opReg({0x0F, 0xAF}, RAX, RCX);                              // imul rax, rcx
+                store(inst.dst, RAX);
+                break;
+
+            case IRInstruction::DIV:
+            case IRInstruction::MOD:
+                divide(inst);
+                break;
+
+            case IRInstruction::MOV:
+                load(RAX, inst.src1);
+                store(inst.dst, RAX);
+                break;
+
+            case IRInstruction::LOAD:
+                address(inst.src1, inst);
+                access(0x8B, inst);                                         // mov rdx, [...]
+                store(inst.dst, RDX);
+                break;
+
+            case IRInstruction::STORE:
+                address(inst.dst, inst);
+                load(RDX, inst.src1);
+                access(0x89, inst);                                         // mov [...], rdx
+                break;
+
+            case IRInstruction::CMP_BRANCH:
+                compare(inst);
+                bytes({0x0F, static_cast<uint8_t>(0x80 | cc(inst.cond))});  // jcc rel32
+                rel32(target(inst.label));
+                break;
+
+            case IRInstruction::SELECT:
+                // the arms first: xor (for xzr) clobbers the flags
+                load(RDX, inst.src4);
+                load(RSI, inst.src3);
+                compare(inst);
+                opReg({0x0F, static_cast<uint8_t>(0x40 | cc(inst.cond))}, RDX, RSI);   // cmovcc rdx, rsi
+                store(inst.dst, RDX);
+                break;
+
+            case IRInstruction::BRANCH:
+                byte(0xE9);
+                rel32(target(inst.label));
+                break;
+
+            case IRInstruction::CALL:
+                load(RCX, inst.src1);
+                returnAddress(2);
+                bytes({0xFF, 0xE1});                                        // jmp rcx
+                break;
+
+            case IRInstruction::CALL_DIRECT:
+                returnAddress(5);
+                byte(0xE9);
+                rel32(target(inst.label));
+                break;
+
+            case IRInstruction::FUNC:
+                bind(inst.dst);
+                prologue(frame);
+                break;
+
+            case IRInstruction::ENDFUNC:
+                break;
+
+            case IRInstruction::RET:
+                epilogue(frame);
+                load(RAX, "x30");
+                bytes({0xFF, 0xE0});                                        // jmp rax
+                break;
+
+            case IRInstruction::DATA8:
+                if (isInt(inst.imm)) {
+                    imm64(static_cast<uint64_t>(parseInt(inst.imm)));
+                } else {
+                    uses_.push_back({code_.size(), inst.imm, Fixup::ABS64});
+                    imm64(0);
+                }
+                break;
+
+            case IRInstruction::VLOAD:
+            case IRInstruction::VSTORE:
+            case IRInstruction::VADD:
+            case IRInstruction::VSUB:
+                vector(inst);
+                break;
+        }
+    }
+
+    X86Program link() {
+        X86Program p;
+        for (auto &u : uses_) {
+            auto it = labels_.find(u.label);
+            if (it == labels_.end())
+                throw std::runtime_error("X86CodeGen: undefined label: " + u.label);
+            if (u.kind == Fixup::REL32) {
+                int32_t rel = static_cast<int32_t>(it->second) - static_cast<int32_t>(u.pos + 4);
+                std::memcpy(&code_[u.pos], &rel, 4);
+            } else {
+                uint64_t off = it->second;
+                std::memcpy(&code_[u.pos], &off, 8);
+                p.absolute.push_back(u.pos);
+            }
+        }
+        p.code = std::move(code_);
+        return p;
+    }
+};
+
+/// An X86Program mapped into executable memory, for running in process.
+class X86Executable {
+public:
+    explicit X86Executable(X86Program program) : size_(program.code.size()) {
+        void *p = ::mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED) throw std::runtime_error("X86Executable: mmap failed");
+        program.relocate(reinterpret_cast<uint64_t>(p));
+        std::memcpy(p, program.code.data(), size_);
+        if (::mprotect(p, size_, PROT_READ | PROT_EXEC) != 0) {
+            ::munmap(p, size_);
+            throw std::runtime_error("X86Executable: mprotect failed");
+        }
+        code_ = p;
+    }
+    ~X86Executable() { ::munmap(code_, size_); }
+    X86Executable(const X86Executable &) = delete;
+    X86Executable &operator=(const X86Executable &) = delete;
+
+    /// Run the program from its first instruction until the top-level RET.
+    void run(X86Registers &regs) const {
+        reinterpret_cast<void (*)(X86Registers *)>(code_)(&regs);
+    }
+
+private:
+    void *code_ = nullptr;
+    size_t size_;
+};
+
+/// A static Linux x86-64 ELF executable that runs `program` on a register
+/// block initialised to `regs` and exits with x0 (its low 8 bits) as the
+/// status.  Code and header share one read/execute segment at 0x400000;
+/// the register block gets a read/write segment of its own.
+inline std::vector<uint8_t> x86Elf(X86Program program, const X86Registers &regs) {
+    constexpr uint64_t kBase = 0x400000, kPage = 0x1000;
+    constexpr size_t kHeaders = 64 + 2 * 56, kStart = kHeaders, kCode = kStart + 32;
+    const size_t data = (kCode + program.code.size() + 15) & ~size_t(15);
+    const uint64_t dataAddr = kBase + (data / kPage + 1) * kPage + data % kPage;
+
+    std::vector<uint8_t> out(data + sizeof(X86Registers));
+    auto put = [&](size_t pos, uint64_t v, int n) {
+        for (int k = 0; k < n; ++k) out[pos + k] = static_cast<uint8_t>(v >> (8 * k));
+    };
+
+    // ELF header
+    const uint8_t ident[] = {0x7F, 'E', 'L', 'F', 2, 1, 1, 0};
+    std::memcpy(out.data(), ident, sizeof ident);
+    put(16, 2, 2);                              // ET_EXEC
+    put(18, 62, 2);                             // EM_X86_64
+    put(20, 1, 4);
+    put(24, kBase + kStart, 8);                 // e_entry
+    put(32, 64, 8);                             // e_phoff
+    put(52, 64, 2);                             // e_ehsize
+    put(54, 56, 2);                             // e_phentsize
+    put(56, 2, 2);                              // e_phnum
+
+    auto segment = [&](size_t ph, uint32_t flags, uint64_t off, uint64_t addr, uint64_t size) {
+        put(ph, 1, 4);                          // PT_LOAD
+        put(ph + 4, flags, 4);
+        put(ph + 8, off, 8);
+        put(ph + 16, addr, 8);
+        put(ph + 24, addr, 8);
+        put(ph + 32, size, 8);
+        put(ph + 40, size, 8);
+        put(ph + 48, kPage, 8);
+    };
+    segment(64, 5, 0, kBase, kCode + program.code.size());          // R+X
+    segment(64 + 56, 6, data, dataAddr, sizeof(X86Registers));      // R+W
+
+    // _start: call the entry point on the register block, then exit(x0)
+    auto rip = [&](size_t end, uint64_t addr) { return addr - (kBase + end); };
+    const uint8_t start[] = {
+        0x48, 0x8D, 0x3D, 0, 0, 0, 0,           // lea rdi, [rip + regs]
+        0xE8, 0, 0, 0, 0,                       // call code
+        0x48, 0x8B, 0x3D, 0, 0, 0, 0,           // mov rdi, [rip + regs]  (x0)
+        0xB8, 60, 0, 0, 0,                      // mov eax, SYS_exit
+        0x0F, 0x05,                             // syscall
+    };
+    std::memcpy(&out[kStart], start, sizeof start);
+    put(kStart + 3, rip(kStart + 7, dataAddr), 4);
+    put(kStart + 8, rip(kStart + 12, kBase + kCode), 4);
+    put(kStart + 15, rip(kStart + 19, dataAddr), 4);
+
+    program.relocate(kBase + kCode);
+    std::memcpy(&out[kCode], program.code.data(), program.code.size());
+    std::memcpy(&out[data], &regs, sizeof regs);
+    return out;
+}